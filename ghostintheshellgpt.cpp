@@ -3,14 +3,60 @@
 #include <ctime>
 #include <fstream>
 #include <string>
+#include <sstream>
 #include <vector>
+#include <array>
 #include <thread>
 #include <chrono>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <mutex>
+#include <numeric>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <condition_variable>
+#include <csignal>
+#include <string_view>
+#include <list>
+#include <deque>
+#include <optional>
+#include <limits>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <random>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
+#ifdef GHOST_WITH_LLAMA
+#include <llama.h>
+#endif
+#ifdef GHOST_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 // Namespace imports
 using json = nlohmann::json;
@@ -18,19 +64,23 @@ using namespace std;
 
 // Function declarations
 void show_menu();
-void dynamic_spinner(const string& message, const string& color);
-void show_command_prompt();
-void save_session(const vector<json>& messages);
+void show_command_prompt(const string& status = "");
 void display_history(const vector<json>& messages);
-void load_session();
-void display_prompts(const map<string, string>& prompts);
-void edit_prompt(map<string, string>& prompts);
+void load_session(size_t count);
+void display_prompts(const string& prefix);
+void edit_prompt();
 void save_prompt(const string& name, const string& content);
 
 // Configuration files and constants
 const string CONFIG_FILE = "config.json";
 const string PROMPT_DIR = "prompts/";
-const string SESSION_FILE = "session_history.json";
+const string SESSION_FILE = "session_history.json";     // Legacy format, imported into the journal once
+const string SESSION_JOURNAL = "session_journal.jsonl";
+const string PROMPT_INDEX = "prompt_index.json";        // Manifest of PROMPT_DIR, see PromptLibrary
+const string SLOT_STATE = "slot_state.json";            // Server slot saved at exit, see SlotManager
+const string HISTORY_INDEX = "session_journal.idx";     // Full-text index of the journal, see HistoryIndex
+const string RAG_INDEX = "rag_index.bin";               // Embedded document chunks for rag:, see RagIndex
+const string DAEMON_SOCKET = "ghostintheshell.sock";    // Where --daemon listens and the REPL looks for it
 
 // ANSI color codes for enhanced UI
 const string COLOR_RESET = "\033[0m";
@@ -63,6 +113,53 @@ struct Config {
     SearchEngine search_engine = SearchEngine::DUCKDUCKGO;
     bool nsfw_mode = true;
     bool stream = true;  // Enable streaming by default
+    int context_tokens = 4096;     // Model context window shared by the prompt and the reply
+    int keep_recent_messages = 8;  // Always sent verbatim; older turns get summarized
+    int journal_fsync_every = 8;       // Session journal: fdatasync after this many records...
+    int journal_fsync_ms = 1000;       // ...or once the oldest unsynced record is this old
+    int journal_max_messages = 50000;  // Kept by journal compaction
+    bool cache_enabled = false;        // Response cache for repeated identical requests
+    string cache_dir = "cache/";
+    int cache_memory_mb = 64;
+    int cache_disk_mb = 512;
+    vector<string> search_engines;     // Queried concurrently; empty means just search_engine
+    map<string, string> search_endpoints; // Engine name -> base URL override; unknown names are DuckDuckGo-format mocks
+    string bing_api_key;
+    string google_api_key;
+    string google_cx;
+    int search_deadline_ms = 3000;     // Give up on engines that have not answered by then
+    int search_grace_ms = 150;         // After the first good result set, wait this long for the others
+    int search_cache_ttl = 600;        // Seconds a query's merged results are reused
+    int search_fetch_pages = 3;        // search: reads this many result pages into the prompt; 0 keeps just the snippet
+    int search_fetch_timeout_ms = 4000; // Per page, redirects included
+    int search_fetch_max_kb = 512;     // Bytes read from each page before it is cut off
+    int search_context_tokens = 1024;  // Budget for the passages taken from the pages
+    string backend = "http";           // "http" (server_url) or "llama.cpp" (in-process, needs GHOST_WITH_LLAMA)
+    string model_path;                 // GGUF model for the llama.cpp backend
+    int threads = 0;                   // llama.cpp CPU threads; 0 picks the hardware concurrency
+    int batch_concurrency = 4;         // Batch mode: requests in flight at once
+    int batch_retries = 3;             // Batch mode: retries for transport errors, 429 and 5xx
+    string metrics_file;               // Optional metrics export; empty disables it
+    string metrics_format = "prometheus"; // "prometheus" (text snapshot) or "jsonl" (one line per event)
+    string record_file;                // Outbound traffic recorded for --replay; a .zst name compresses it (GHOST_WITH_ZSTD)
+    int exec_timeout_ms = 30000;       // exec: commands are terminated after this long; 0 waits forever
+    int exec_max_running = 4;          // Commands running at once; the rest wait their turn
+    int exec_head_kb = 16;             // Output kept from the start of a command...
+    int exec_tail_kb = 48;             // ...and from its end; the middle is only counted
+    map<string, int> backends;         // Chat endpoint URL -> weight, replacing server_url when set; weight 0 drains one
+    string backend_routing = "least_outstanding"; // Or "latency": lowest recent time to first byte, scaled by queue
+    int backend_failover = 2;          // Other backends tried after a transport error, 429 or 5xx
+    int hedge_after_ms = 0;            // Race a second backend when the first has not answered by then; 0 disables
+    int health_check_ms = 5000;        // How often each backend's /health is probed; 0 disables
+    bool cache_prompt = true;          // Ask llama.cpp server to reuse the KV cache for the shared prompt prefix
+    int slot_id = -1;                  // Server slot for the conversation; -1 keeps the one the server reports
+    bool slot_save = false;            // Save the slot at exit and restore it on session:resume (needs --slot-save-path)
+    string tokenizer_path;             // tokenizer.json or GGUF for exact token counts; empty uses model_path or ~4 bytes/token
+    string embeddings_url;             // /v1/embeddings endpoint for rag:; empty derives it from server_url
+    int rag_chunk_tokens = 256;        // Documents are split into chunks of about this many tokens...
+    int rag_chunk_overlap = 32;        // ...each repeating up to this many from the end of the previous one
+    int rag_top_k = 4;                 // Chunks added to the prompt by rag:<question>
+    int rag_probe = 16;                // IVF lists scanned per query on large indexes; 0 scans every chunk
 
     // Default constructor
     Config() = default;
@@ -70,17 +167,155 @@ struct Config {
     // Move constructor
     Config(Config&&) = default;
 
-    // Delete copy constructor and assignment operator
-    Config(const Config&) = delete;
+    // Copies are explicit: snapshots are shared, so an edited copy is a deliberate step
+    Config clone() const { return Config(*this); }
     Config& operator=(const Config&) = delete;
+
+private:
+    Config(const Config&) = default;
 };
-// Thread-safe output
-mutex output_mutex;
+// Owns the live part of the terminal: streamed tokens, messages from background threads
+// and the spinner. Writers only append to a buffer; one persistent thread emits it at most
+// FRAMES_PER_SECOND times a second with a single write(2), so the cost of rendering stays
+// flat at any token rate and the spinner can never tear a line of text. Code that prints
+// with cout while something may be queued calls flush() first.
+class Renderer {
+public:
+    static constexpr int FRAMES_PER_SECOND = 30;
 
-void thread_safe_output(const string& message) {
-    lock_guard<mutex> guard(output_mutex);
-    cout << message << endl;
-}
+    static Renderer& instance() {
+        static Renderer renderer;
+        return renderer;
+    }
+
+    ~Renderer() { shutdown(); }
+
+    // Queues text for the next frame; it replaces the spinner until stop_spinner()
+    void write(string_view text) {
+        lock_guard<mutex> guard(mutex_);
+        start_thread_locked();
+        hide_spinner_locked();
+        if (spinner_active_) spinner_suspended_ = true;
+        bool was_empty = pending_.empty();
+        pending_.append(text);
+        if (was_empty) cv_.notify_one();
+    }
+
+    // Writes to stderr right away, after whatever is queued for stdout
+    void error(string_view text) {
+        lock_guard<mutex> guard(mutex_);
+        hide_spinner_locked();
+        emit_locked();
+        write_all(STDERR_FILENO, text);
+    }
+
+    void start_spinner(const string& message, const string& color) {
+        cout.flush(); // Keep earlier cout output ahead of the first frame
+        lock_guard<mutex> guard(mutex_);
+        start_thread_locked();
+        spinner_message_ = message;
+        spinner_color_ = color;
+        spinner_active_ = true;
+        spinner_suspended_ = false;
+        next_spinner_frame_ = chrono::steady_clock::now();
+        cv_.notify_one();
+    }
+
+    // Clears the spinner line and emits everything queued before returning
+    void stop_spinner() {
+        lock_guard<mutex> guard(mutex_);
+        spinner_active_ = false;
+        hide_spinner_locked();
+        emit_locked();
+    }
+
+    void flush() {
+        lock_guard<mutex> guard(mutex_);
+        emit_locked();
+    }
+
+    void shutdown() {
+        {
+            lock_guard<mutex> guard(mutex_);
+            stopping_ = true;
+            spinner_active_ = false;
+            hide_spinner_locked();
+            emit_locked();
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    Renderer() = default;
+
+    static void write_all(int fd, string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::write(fd, data.data(), data.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            data.remove_prefix(n);
+        }
+    }
+
+    void start_thread_locked() {
+        if (!thread_.joinable() && !stopping_) thread_ = thread(&Renderer::run, this);
+    }
+
+    void hide_spinner_locked() {
+        if (!spinner_visible_) return;
+        pending_ += "\r\033[K";
+        spinner_visible_ = false;
+    }
+
+    void emit_locked() {
+        if (pending_.empty()) return;
+        write_all(STDOUT_FILENO, pending_);
+        pending_.clear(); // Keeps the capacity for the next frame
+    }
+
+    void run() {
+        static const char* const frames[] = {"⠋", "⠙", "⠹", "⠸", "⠼", "⠴", "⠦", "⠧", "⠇", "⠏"};
+        const auto frame_interval = chrono::milliseconds(1000 / FRAMES_PER_SECOND);
+        unique_lock<mutex> lock(mutex_);
+        while (!stopping_) {
+            bool spinning = spinner_active_ && !spinner_suspended_;
+            if (pending_.empty() && !spinning) {
+                cv_.wait(lock);
+                continue;
+            }
+            auto due = pending_.empty() ? next_spinner_frame_ : last_frame_ + frame_interval;
+            if (chrono::steady_clock::now() < due) {
+                cv_.wait_until(lock, due);
+                continue;
+            }
+
+            auto now = chrono::steady_clock::now();
+            if (spinning && now >= next_spinner_frame_) {
+                pending_ += "\r" + spinner_color_ + " " + frames[spinner_frame_] + " " + spinner_message_ + "..." + COLOR_RESET;
+                spinner_frame_ = (spinner_frame_ + 1) % size(frames);
+                spinner_visible_ = true;
+                next_spinner_frame_ = now + chrono::milliseconds(80);
+            }
+            emit_locked();
+            last_frame_ = now;
+        }
+    }
+
+    mutex mutex_;
+    condition_variable cv_;
+    thread thread_;
+    bool stopping_ = false;
+    string pending_;
+    chrono::steady_clock::time_point last_frame_;
+    string spinner_message_;
+    string spinner_color_;
+    bool spinner_active_ = false;
+    bool spinner_suspended_ = false; // Text arrived; the spinner stays hidden
+    bool spinner_visible_ = false;   // A frame is on screen and must be erased before text
+    size_t spinner_frame_ = 0;
+    chrono::steady_clock::time_point next_spinner_frame_;
+};
 
 // Curl response helper
 size_t WriteCallback(void* contents, size_t size, size_t nmemb, string* output) {
@@ -89,521 +324,9704 @@ size_t WriteCallback(void* contents, size_t size, size_t nmemb, string* output)
     return total_size;
 }
 
-// Spinner helper for progress indication
-bool spinner_running = false;
-void spinner(const string& message) {
-    const vector<string> frames = {"|", "/", "-", "\\"};
-    int frame = 0;
-    while (spinner_running) {
-        cout << "\r" << COLOR_CYAN << message << " " << frames[frame] << COLOR_RESET << flush;
-        frame = (frame + 1) % frames.size();
-        this_thread::sleep_for(chrono::milliseconds(100));
+// Keep-alive connection layer shared by every HTTP call site.
+// Idle easy handles are kept per host so their live connections are reused, and a
+// share object lets all handles reuse one DNS cache, TLS session cache and connection cache.
+class ConnectionPool {
+public:
+    static ConnectionPool& instance() {
+        static ConnectionPool pool;
+        return pool;
+    }
+
+    // Returns a reset handle for `url` with the shared caches and keep-alive options applied
+    CURL* acquire(const string& url) {
+        CURL* curl = nullptr;
+        {
+            lock_guard<mutex> guard(pool_mutex_);
+            auto it = idle_.find(host_key(url));
+            if (it != idle_.end() && !it->second.empty()) {
+                curl = it->second.back();
+                it->second.pop_back();
+            }
+        }
+        if (curl) {
+            curl_easy_reset(curl); // Keeps the handle's live connections and caches
+        } else {
+            curl = curl_easy_init();
+            if (!curl) return nullptr;
+        }
+        apply_defaults(curl);
+        return curl;
+    }
+
+    void release(const string& url, CURL* curl) {
+        if (!curl) return;
+        {
+            lock_guard<mutex> guard(pool_mutex_);
+            vector<CURL*>& handles = idle_[host_key(url)];
+            if (!shut_down_ && handles.size() < MAX_IDLE_PER_HOST) {
+                handles.push_back(curl);
+                return;
+            }
+        }
+        curl_easy_cleanup(curl);
+    }
+
+    // Must run before curl_global_cleanup()
+    void shutdown() {
+        lock_guard<mutex> guard(pool_mutex_);
+        for (auto& entry : idle_) {
+            for (CURL* curl : entry.second) curl_easy_cleanup(curl);
+        }
+        idle_.clear();
+        if (share_) {
+            curl_share_cleanup(share_);
+            share_ = nullptr;
+        }
+        shut_down_ = true;
+    }
+
+    // "scheme://host:port" part of a URL
+    static string host_key(const string& url) {
+        size_t scheme_end = url.find("://");
+        size_t host_start = scheme_end == string::npos ? 0 : scheme_end + 3;
+        size_t host_end = url.find_first_of("/?#", host_start);
+        return url.substr(0, host_end);
+    }
+
+private:
+    static const size_t MAX_IDLE_PER_HOST = 4;
+
+    ConnectionPool() {
+        share_ = curl_share_init();
+        if (share_) {
+            curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock_callback);
+            curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock_callback);
+            curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        }
+    }
+
+    void apply_defaults(CURL* curl) {
+        if (share_) curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS); // h2 where TLS allows it
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L); // Prefer multiplexing over opening a new connection
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+    }
+
+    static void lock_callback(CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+        static_cast<ConnectionPool*>(userptr)->share_locks_[data].lock();
+    }
+
+    static void unlock_callback(CURL*, curl_lock_data data, void* userptr) {
+        static_cast<ConnectionPool*>(userptr)->share_locks_[data].unlock();
     }
-    cout << "\r" << string(message.size() + 3, ' ') << "\r"; // Clear the spinner line
+
+    CURLSH* share_ = nullptr;
+    mutex share_locks_[CURL_LOCK_DATA_LAST];
+    mutex pool_mutex_;
+    map<string, vector<CURL*>> idle_;
+    bool shut_down_ = false;
+};
+
+// RAII wrapper returning a pooled handle on scope exit
+class PooledHandle {
+public:
+    explicit PooledHandle(const string& url) : url_(url), curl_(ConnectionPool::instance().acquire(url)) {}
+    ~PooledHandle() { ConnectionPool::instance().release(url_, curl_); }
+    PooledHandle(const PooledHandle&) = delete;
+    PooledHandle& operator=(const PooledHandle&) = delete;
+
+    CURL* get() const { return curl_; }
+    explicit operator bool() const { return curl_ != nullptr; }
+
+private:
+    string url_;
+    CURL* curl_;
+};
+
+// Requests to this URL are served in-process by LlamaBackend instead of over HTTP
+const string LOCAL_BACKEND_URL = "llama://local";
+
+// Requests to this URL are routed by the BackendPool across config.backends
+const string BACKEND_POOL_URL = "pool://chat";
+
+// scheme://host[:port] of `url`
+string url_origin(const string& url) {
+    size_t scheme = url.find("://");
+    return url.substr(0, url.find('/', scheme == string::npos ? 0 : scheme + 3));
 }
 
-// JSON utilities
-json load_json_file(const string& file_path) {
-    ifstream file(file_path);
-    if (!file.is_open()) return {};
-    json data;
-    file >> data;
-    return data;
+// Whether a Content-Type value starts with one of the lowercase `accepted` types
+bool content_type_matches(string type, const vector<string>& accepted) {
+    transform(type.begin(), type.end(), type.begin(), [](unsigned char c) { return tolower(c); });
+    return any_of(accepted.begin(), accepted.end(), [&type](const string& prefix) { return type.compare(0, prefix.size(), prefix) == 0; });
 }
 
-void save_json_file(const string& file_path, const json& data) {
-    ofstream file(file_path);
-    if (!file.is_open()) {
-        cerr << COLOR_RED << "Error: Unable to save file " << file_path << COLOR_RESET << endl;
-        return;
+// Length of the longest prefix of `text` that does not end inside a UTF-8 sequence
+size_t utf8_complete_prefix(const string& text) {
+    size_t i = text.size();
+    size_t continuation = 0;
+    while (i > 0 && continuation < 3 && (static_cast<unsigned char>(text[i - 1]) & 0xC0) == 0x80) {
+        i--;
+        continuation++;
     }
-    file << data.dump(4);
-    file.close();
+    if (i == 0) return text.size();
+    unsigned char lead = static_cast<unsigned char>(text[i - 1]);
+    size_t expected = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : 0;
+    return continuation < expected ? i - 1 : text.size();
 }
 
-// Load and save configuration
-Config load_config() {
-    json config_data = load_json_file(CONFIG_FILE);
-    Config config;
-    if (!config_data.is_null()) {
-        config.server_url = config_data.value("server_url", config.server_url);
-        config.max_tokens = config_data.value("max_tokens", config.max_tokens);
-        config.temperature = config_data.value("temperature", config.temperature);
-        config.debug_mode = config_data.value("debug_mode", config.debug_mode);
-        config.search_engine = static_cast<SearchEngine>(config_data.value("search_engine", static_cast<int>(config.search_engine)));
-    } else {
-        // Create a JSON object from Config struct
-        json config_json = {
-            {"server_url", config.server_url},
-            {"max_tokens", config.max_tokens},
-            {"temperature", config.temperature},
-            {"debug_mode", config.debug_mode},
-            {"search_engine", static_cast<int>(config.search_engine)}
+// Parses all of `text` as a number; false (leaving `value` alone) if it is not one
+template <typename T>
+bool parse_number(string_view text, T& value) {
+    T parsed{};
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), parsed);
+    if (error != errc() || end != text.data() + text.size()) return false;
+    value = parsed;
+    return true;
+}
+
+// In-process inference through libllama (built with -DGHOST_WITH_LLAMA). The GGUF model
+// is mmap'd, and the KV cache survives between turns: each request only prefills the
+// tokens after the longest prefix shared with what is already evaluated. The cache holds
+// two sequences, so a summary or bg: job runs beside the conversation instead of evicting
+// its prefix.
+class LlamaBackend {
+public:
+    static LlamaBackend& instance() {
+        static LlamaBackend backend;
+        return backend;
+    }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+#ifdef GHOST_WITH_LLAMA
+        // A reloaded config with another model or context size loads afresh on the next request
+        if (config.model_path != model_path_ || config.context_tokens != n_ctx_) unload();
+#endif
+        model_path_ = config.model_path;
+        n_ctx_ = config.context_tokens;
+        n_threads_ = config.threads > 0 ? config.threads : static_cast<int>(max(1u, thread::hardware_concurrency()));
+    }
+
+    // Runs one chat completion request body, passing each piece of text to `emit`
+    // (returning false stops generation). Fills `usage` on success, `error` on failure.
+    bool complete(const json& request, const function<bool(const string&)>& emit, json& usage, string& error) {
+        lock_guard<mutex> guard(mutex_); // One request at a time
+#ifdef GHOST_WITH_LLAMA
+        if (!load(error)) return false;
+
+        vector<llama_token> tokens;
+        if (!tokenize_chat(request.value("messages", json::array()), tokens, error)) return false;
+        if (tokens.empty()) {
+            error = "The prompt is empty";
+            return false;
+        }
+        int max_tokens = request.value("max_tokens", 512);
+        if (static_cast<int>(tokens.size()) + max_tokens > n_ctx_) {
+            error = "Prompt of " + to_string(tokens.size()) + " tokens does not fit in the " + to_string(n_ctx_) + "-token context";
+            return false;
+        }
+
+        // Use the sequence already holding most of the prompt. A match under half the prompt
+        // (a shared template header, say) counts as none, and then the least recently used
+        // sequence is taken.
+        size_t sequence = 0;
+        size_t common = 0;
+        size_t best_match = 0;
+        for (size_t s = 0; s < SEQUENCES; s++) {
+            const vector<llama_token>& evaluated = sequences_[s].evaluated;
+            size_t shared = 0;
+            while (shared < evaluated.size() && shared < tokens.size() && evaluated[shared] == tokens[shared]) shared++;
+            size_t match = shared * 2 >= tokens.size() ? shared : 0;
+            if (s == 0 || match > best_match || (match == best_match && sequences_[s].used < sequences_[sequence].used)) {
+                sequence = s;
+                common = shared;
+                best_match = match;
+            }
+        }
+        sequences_[sequence].used = ++uses_;
+
+        // Keep the KV entries of the shared prefix; at least one token is decoded for fresh logits
+        if (common == tokens.size()) common--;
+        llama_memory_seq_rm(llama_get_memory(ctx_), static_cast<llama_seq_id>(sequence), static_cast<llama_pos>(common), -1);
+        sequences_[sequence].evaluated.resize(common);
+
+        for (size_t i = common; i < tokens.size(); i += BATCH_SIZE) {
+            int32_t count = static_cast<int32_t>(min(BATCH_SIZE, tokens.size() - i));
+            if (!decode(sequence, tokens.data() + i, count, error)) return false;
+        }
+
+        llama_sampler* sampler = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        double temperature = request.value("temperature", 0.7);
+        if (temperature <= 0) {
+            llama_sampler_chain_add(sampler, llama_sampler_init_greedy());
+        } else {
+            llama_sampler_chain_add(sampler, llama_sampler_init_min_p(0.05f, 1));
+            llama_sampler_chain_add(sampler, llama_sampler_init_temp(static_cast<float>(temperature)));
+            llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+        }
+
+        int completion_tokens = 0;
+        string pending; // Bytes of a UTF-8 character split across tokens
+        bool ok = true;
+        while (completion_tokens < max_tokens) {
+            llama_token token = llama_sampler_sample(sampler, ctx_, -1);
+            if (llama_vocab_is_eog(vocab_, token)) break;
+            completion_tokens++;
+
+            char piece[256];
+            int32_t length = llama_token_to_piece(vocab_, token, piece, sizeof(piece), 0, false);
+            if (length > 0) pending.append(piece, length);
+            size_t complete = utf8_complete_prefix(pending);
+            if (complete > 0) {
+                if (!emit(pending.substr(0, complete))) break;
+                pending.erase(0, complete);
+            }
+            if (!(ok = decode(sequence, &token, 1, error))) break;
+        }
+        llama_sampler_free(sampler);
+        if (!ok) return false;
+
+        usage = {
+            {"prompt_tokens", tokens.size()},
+            {"completion_tokens", completion_tokens},
+            {"total_tokens", tokens.size() + completion_tokens},
+            {"cached_tokens", common}
         };
-        save_json_file(CONFIG_FILE, config_json);
+        return true;
+#else
+        (void)request;
+        (void)emit;
+        (void)usage;
+        error = "The llama.cpp backend is not compiled in; rebuild with -DGHOST_WITH_LLAMA and link libllama";
+        return false;
+#endif
     }
-    return config;
-}
-// Enhanced AI query with llama, focusing on NSFW content
-string query_ai(const Config& config, const vector<json>& messages) {
-    CURL* curl = curl_easy_init();
-    CURLcode res;
-    string response_string;
 
-    if (!curl) {
-        cerr << COLOR_RED << "Error: CURL initialization failed" << COLOR_RESET << endl;
-        return {};
+    ~LlamaBackend() {
+#ifdef GHOST_WITH_LLAMA
+        bool loaded = model_ != nullptr;
+        unload();
+        if (loaded) llama_backend_free();
+#endif
     }
 
-    json payload = {
-        {"model", "llama"},
-        {"messages", messages},
-        {"max_tokens", config.max_tokens},
-        {"temperature", config.temperature},
-        {"nsfw_mode", true} // Ensuring NSFW mode is enabled
-    };
+private:
+    LlamaBackend() = default;
 
-    string payload_str = payload.dump();
+#ifdef GHOST_WITH_LLAMA
+    static constexpr size_t BATCH_SIZE = 512;
+    static constexpr size_t SEQUENCES = 2;
 
-    curl_easy_setopt(curl, CURLOPT_URL, config.server_url.c_str());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_string);
+    struct Sequence {
+        vector<llama_token> evaluated; // Tokens whose KV entries are in the sequence
+        uint64_t used = 0;             // Value of uses_ when last picked
+    };
 
-    // Improved spinner functionality with dynamic_spinner
-    thread spinner_thread(dynamic_spinner, "Processing your query...", COLOR_CYAN);
-    spinner_running = true;
-    res = curl_easy_perform(curl);
-    spinner_running = false;
-    spinner_thread.join();
+    bool load(string& error) {
+        if (ctx_) return true;
+        if (model_path_.empty()) {
+            error = "model_path is not set in " + CONFIG_FILE;
+            return false;
+        }
+        llama_backend_init();
+        llama_model_params model_params = llama_model_default_params();
+        model_params.use_mmap = true;
+        model_params.n_gpu_layers = 0; // Plain CPU
+        model_ = llama_model_load_from_file(model_path_.c_str(), model_params);
+        if (!model_) {
+            error = "Unable to load model " + model_path_;
+            return false;
+        }
+        llama_context_params context_params = llama_context_default_params();
+        context_params.n_ctx = static_cast<uint32_t>(n_ctx_ * SEQUENCES); // A full context for each sequence
+        context_params.n_seq_max = static_cast<uint32_t>(SEQUENCES);
+        context_params.n_batch = BATCH_SIZE;
+        context_params.n_threads = n_threads_;
+        context_params.n_threads_batch = n_threads_;
+        ctx_ = llama_init_from_model(model_, context_params);
+        if (!ctx_) {
+            error = "Unable to create a llama.cpp context";
+            return false;
+        }
+        vocab_ = llama_model_get_vocab(model_);
+        return true;
+    }
 
-    if (res != CURLE_OK) {
-        cerr << COLOR_RED << "Error: " << curl_easy_strerror(res) << COLOR_RESET << endl;
-    } else {
-        cout << COLOR_GREEN << "Query successful. Analyzing results..." << COLOR_RESET << endl;
+    void unload() {
+        if (ctx_) llama_free(ctx_);
+        if (model_) llama_model_free(model_);
+        ctx_ = nullptr;
+        model_ = nullptr;
+        vocab_ = nullptr;
+        for (Sequence& entry : sequences_) entry.evaluated.clear();
     }
 
-    curl_easy_cleanup(curl);
-    return response_string;
-}
+    // Renders `messages` with the model's chat template and tokenizes the result
+    bool tokenize_chat(const json& messages, vector<llama_token>& tokens, string& error) {
+        vector<string> roles, contents;
+        if (!messages.is_array()) {
+            error = "messages must be a list";
+            return false;
+        }
+        for (const auto& message : messages) {
+            json content = message.is_object() ? message.value("content", json()) : json();
+            json role = message.is_object() ? message.value("role", json("user")) : json();
+            if (content.is_null() || !role.is_string()) {
+                error = "Each message needs a role and content";
+                return false;
+            }
+            roles.push_back(role.get<string>());
+            contents.push_back(content.is_string() ? content.get<string>() : content.dump());
+        }
+        vector<llama_chat_message> chat;
+        size_t total = 0;
+        for (size_t i = 0; i < roles.size(); i++) {
+            chat.push_back({roles[i].c_str(), contents[i].c_str()});
+            total += roles[i].size() + contents[i].size();
+        }
 
-// URL encoding function
-string url_encode(const string& value) {
-    CURL *curl = curl_easy_init();
-    string encoded;
-    if (curl) {
-        char* output = curl_easy_escape(curl, value.c_str(), value.length());
-        if (output) {
-            encoded = output;
-            curl_free(output);
+        const char* chat_template = llama_model_chat_template(model_, nullptr);
+        vector<char> prompt(total * 2 + 256);
+        int32_t length = llama_chat_apply_template(chat_template, chat.data(), chat.size(), true, prompt.data(), prompt.size());
+        if (length > static_cast<int32_t>(prompt.size())) {
+            prompt.resize(length);
+            length = llama_chat_apply_template(chat_template, chat.data(), chat.size(), true, prompt.data(), prompt.size());
         }
-        curl_easy_cleanup(curl);
+        if (length < 0) {
+            error = "The model's chat template could not be applied";
+            return false;
+        }
+
+        int32_t count = llama_tokenize(vocab_, prompt.data(), length, nullptr, 0, true, true);
+        tokens.resize(count < 0 ? -count : count);
+        if (llama_tokenize(vocab_, prompt.data(), length, tokens.data(), tokens.size(), true, true) < 0) {
+            error = "Tokenization failed";
+            return false;
+        }
+        return true;
     }
-    return encoded;
-}
 
-// Enhanced status display with timestamp
-void display_status(const string& message, const string& color, const string& icon) {
-    auto now = chrono::system_clock::to_time_t(chrono::system_clock::now());
-    auto timestamp = put_time(localtime(&now), "%Y-%m-%d %H:%M:%S");
-    cout << color << "[" << timestamp << "] " << icon << " " << message << COLOR_RESET << endl;
+    // Appends `count` tokens to `sequence`; only the last one gets logits
+    bool decode(size_t sequence, const llama_token* tokens, int32_t count, string& error) {
+        vector<llama_token>& evaluated = sequences_[sequence].evaluated;
+        llama_batch batch = llama_batch_init(count, 0, 1);
+        for (int32_t i = 0; i < count; i++) {
+            batch.token[i] = tokens[i];
+            batch.pos[i] = static_cast<llama_pos>(evaluated.size() + i);
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = static_cast<llama_seq_id>(sequence);
+            batch.logits[i] = i == count - 1;
+        }
+        batch.n_tokens = count;
+        bool ok = llama_decode(ctx_, batch) == 0;
+        llama_batch_free(batch);
+        if (!ok) {
+            error = "llama_decode failed";
+            llama_memory_clear(llama_get_memory(ctx_), true);
+            for (Sequence& entry : sequences_) entry.evaluated.clear();
+            return false;
+        }
+        evaluated.insert(evaluated.end(), tokens, tokens + count);
+        return true;
+    }
+
+    llama_model* model_ = nullptr;
+    llama_context* ctx_ = nullptr;
+    const llama_vocab* vocab_ = nullptr;
+    Sequence sequences_[SEQUENCES];
+    uint64_t uses_ = 0;
+#endif
+
+    mutex mutex_;
+    string model_path_;
+    int n_ctx_ = 4096;
+    int n_threads_ = 1;
+};
+
+// Description of one HTTP request for the RequestEngine; a non-empty body makes it a POST
+struct RequestSpec {
+    string url;
+    string body;
+    vector<string> headers;
+    long timeout_ms = 0;
+    string metric = "http";  // Metrics series the request is recorded under, e.g. "chat" or "search:bing"
+    string affinity;         // BACKEND_POOL_URL requests: backend to prefer, e.g. the one holding the conversation's slot
+    bool follow_redirects = false; // For fetching arbitrary pages; API endpoints answer directly
+    vector<string> content_types;  // Lowercase Content-Type prefixes to accept; others are aborted before the body is read
+    function<bool(const char*, size_t)> on_data;  // Streaming sink; returning false aborts. Default: buffer into result.body
+    function<void(const struct HttpResult&)> on_complete; // Runs on the engine thread before waiters are woken
+};
+
+// Where the time of one transfer went, from CURLINFO. The phases are zero on a reused
+// connection; `network` is false for in-process requests, which only have a total.
+struct RequestTiming {
+    bool network = false;
+    double dns_ms = 0;
+    double connect_ms = 0;
+    double tls_ms = 0;
+    double ttfb_ms = 0;   // Request sent until the first response byte
+    double total_ms = 0;
+    curl_off_t bytes_in = 0;
+    curl_off_t bytes_out = 0;
+};
+
+struct HttpResult {
+    CURLcode curl_code = CURLE_OK;
+    long status = 0;
+    string body;
+    bool cancelled = false;
+    string message; // Error detail for failures that are not curl errors
+    string endpoint; // URL that produced the response; the chosen backend for routed requests
+    string content_type; // Of the response, if the server sent one
+    RequestTiming timing;
+
+    bool ok() const { return curl_code == CURLE_OK && !cancelled && status < 400; }
+    string error() const {
+        if (cancelled) return "Request cancelled";
+        if (!message.empty()) return message;
+        if (curl_code != CURLE_OK) return curl_easy_strerror(curl_code);
+        if (status >= 400) return "HTTP status " + to_string(status);
+        return {};
+    }
+};
+
+// Value at fraction `p` (0-1) of `samples`
+double percentile(vector<double> samples, double p) {
+    if (samples.empty()) return 0;
+    size_t rank = min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
 }
 
-// Function to generate a border
-string generate_border(int length, char border_char = '=', const string& color = COLOR_RESET) {
-    return color + string(length, border_char) + COLOR_RESET;
+// `value` with `precision` decimals, for tables and summaries; unlike fixed/setprecision it
+// leaves the stream's number format alone
+string fixed_number(double value, int precision) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", precision, value);
+    return buffer;
 }
 
+// The most recent `capacity` samples of one measurement plus lifetime count and sum
+class RollingHistogram {
+public:
+    explicit RollingHistogram(size_t capacity = 1024) : capacity_(capacity) {}
 
-// Di// Function to display search results with pagination
-void display_results(const vector<string>& results) {
-    cout << generate_border(30) << endl;
-    if (results.empty()) {
-        cout << COLOR_RED << "No results found." << COLOR_RESET << endl;
-    } else {
-        cout << COLOR_YELLOW << "Displaying top results:" << COLOR_RESET << endl;
-        for (size_t i = 0; i < results.size(); i++) {
-            cout << COLOR_GRADIENT_2 << " " << (i + 1) << ". " << COLOR_RESET;
-            cout << results[i] << endl;
+    void add(double value) {
+        if (window_.size() < capacity_) {
+            window_.push_back(value);
+        } else {
+            window_[next_] = value;
+            next_ = (next_ + 1) % capacity_;
         }
+        count_++;
+        sum_ += value;
     }
-    cout << generate_border(30) << endl;
-}
 
-// Function to show the welcome screen and available commands
-void show_welcome_screen() {
-    cout << "\033[2J\033[1;1H";  // Clear screen and move to top-left corner
-    cout << generate_border(50, '=', COLOR_GRADIENT_1) << endl;  // Top border
-    cout << COLOR_GRADIENT_1 << "    * Enhanced AI Terminal v2.0 *" << COLOR_RESET << endl;  // Version info
-    cout << COLOR_GRADIENT_2 << "        Ghostintheshell  " << COLOR_RESET << endl;  // Companion message
-    cout << COLOR_GRADIENT_3 << "    Build: " << __DATE__ << " " << __TIME__ << COLOR_RESET << endl;  // Build info
-    cout << generate_border(50, '=', COLOR_GRADIENT_1) << endl;  // Bottom border
-    show_menu();  // Show available commands
-}
+    double percentile(double p) const { return ::percentile(window_, p); }
+    uint64_t count() const { return count_; }
+    double sum() const { return sum_; }
 
-// Enhanced Interactive Menu Display
-void show_menu() {
-    std::cout << COLOR_HIGHLIGHT << "\nAvailable Commands:\n" << COLOR_RESET;
-    std::cout << COLOR_GRADIENT_2 << " ├─ search:<query>   " << COLOR_RESET << "Search the web for information\n";
-    std::cout << COLOR_GRADIENT_2 << " ├─ chat:<question>   " << COLOR_RESET << "Engage in conversation with the AI\n";
-    std::cout << COLOR_GRADIENT_2 << " ├─ nsfw:<on/off>    " << COLOR_RESET << "Toggle NSFW content filtering\n";
-    std::cout << COLOR_GRADIENT_2 << " ├─ help             " << COLOR_RESET << "Display detailed help information\n";
-    std::cout << COLOR_GRADIENT_2 << " ├─ clear            " << COLOR_RESET << "Clear the terminal screen\n";
-    std::cout << COLOR_GRADIENT_2 << " ├─ settings         " << COLOR_RESET << "Configure AI and search settings\n";
-    std::cout << COLOR_GRADIENT_2 << " └─ exit             " << COLOR_RESET << "Terminate the program\n";
-}
+private:
+    size_t capacity_;
+    size_t next_ = 0;
+    vector<double> window_;
+    uint64_t count_ = 0;
+    double sum_ = 0;
+};
 
-void handle_settings(Config& config) {
-    cout << COLOR_GRADIENT_1 << "\nSettings Menu" << COLOR_RESET << endl;
-    cout << generate_border(30) << endl;
-    cout << COLOR_GRADIENT_2 << "1. NSFW Mode: " << (config.nsfw_mode ? "ON" : "OFF") << COLOR_RESET << endl;
-    cout << COLOR_GRADIENT_2 << "2. Temperature: " << config.temperature << COLOR_RESET << endl;
-    cout << COLOR_GRADIENT_2 << "3. Max Tokens: " << config.max_tokens << COLOR_RESET << endl;
-    cout << COLOR_GRADIENT_2 << "4. Debug Mode: " << (config.debug_mode ? "ON" : "OFF") << COLOR_RESET << endl;
-    cout << generate_border(30) << endl;
-    
-    cout << "Enter setting number to change (or 'x' to exit): ";
-    string choice;
-    getline(cin, choice);
-    
-    // Start spinner while processing settings
-    thread spinner_thread(spinner, "Processing your settings...");
-    spinner_running = true;
+// Per-series request and generation metrics. Every RequestEngine transfer is recorded
+// under RequestSpec::metric; query_ai adds time to first token and token rates.
+// Optionally exported to config.metrics_file as a Prometheus text snapshot or as JSONL events.
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
 
-    if (choice == "1") {
-        config.nsfw_mode = !config.nsfw_mode;
-        cout << COLOR_SUCCESS << "NSFW Mode: " << (config.nsfw_mode ? "Enabled" : "Disabled") << COLOR_RESET << endl;
-    } else if (choice == "2") {
-        cout << "Enter new temperature (0.1-1.0): ";
-        cin >> config.temperature;
-        cin.ignore();
-    } else if (choice == "3") {
-        cout << "Enter new max tokens (100-2000): ";
-        cin >> config.max_tokens;
-        cin.ignore();
-    } else if (choice == "4") {
-        config.debug_mode = !config.debug_mode;
-        cout << COLOR_SUCCESS << "Debug Mode: " << (config.debug_mode ? "Enabled" : "Disabled") << COLOR_RESET << endl;
-    } else if (choice == "x") {
-        cout << "Exiting settings menu." << endl;
-        spinner_running = false; // Stop spinner before exiting
-        spinner_thread.join(); // Wait for spinner thread to finish
-        return; // Exit the settings menu
-    } else {
-        cout << COLOR_ALERT << "Invalid choice. Please try again." << COLOR_RESET << endl;
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        path_ = config.metrics_file;
+        jsonl_ = config.metrics_format == "jsonl";
+        if (events_.is_open()) events_.close();
+        if (jsonl_ && !path_.empty()) {
+            events_.open(path_, ios::app);
+            if (!events_.is_open()) cerr << COLOR_RED << "Error: Unable to write metrics to " << path_ << COLOR_RESET << endl;
+        }
     }
 
-    // Save the updated configuration
-    save_json_file(CONFIG_FILE, {
-        {"nsfw_mode", config.nsfw_mode},
-        {"temperature", config.temperature},
-        {"max_tokens", config.max_tokens},
-        {"debug_mode", config.debug_mode}
-    });
+    void record_request(const string& series, const HttpResult& result) {
+        const RequestTiming& timing = result.timing;
+        lock_guard<mutex> guard(mutex_);
+        Series& entry = series_[series];
+        entry.requests++;
+        if (!result.ok()) entry.errors++;
+        entry.bytes_in += timing.bytes_in;
+        entry.bytes_out += timing.bytes_out;
+        if (timing.network) {
+            entry.histograms["dns_ms"].add(timing.dns_ms);
+            entry.histograms["connect_ms"].add(timing.connect_ms);
+            entry.histograms["tls_ms"].add(timing.tls_ms);
+            if (result.ok()) entry.histograms["ttfb_ms"].add(timing.ttfb_ms);
+        }
+        if (result.ok()) entry.histograms["total_ms"].add(timing.total_ms);
+
+        if (events_.is_open()) {
+            json event = {
+                {"time", chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count()},
+                {"event", "request"},
+                {"series", series},
+                {"ok", result.ok()},
+                {"status", result.status},
+                {"total_ms", timing.total_ms},
+                {"bytes_in", timing.bytes_in},
+                {"bytes_out", timing.bytes_out}
+            };
+            if (timing.network) {
+                event["dns_ms"] = timing.dns_ms;
+                event["connect_ms"] = timing.connect_ms;
+                event["tls_ms"] = timing.tls_ms;
+                event["ttfb_ms"] = timing.ttfb_ms;
+            }
+            events_ << event.dump() << '\n';
+            events_.flush();
+        }
+        maybe_flush_locked();
+    }
+
+    // `ttft_ms` is negative when the reply was not streamed; token counts are negative when
+    // the server sent no usage block. Returns the decode rate in tokens/s, or -1 if unknown.
+    double record_generation(const string& series, double ttft_ms, double total_ms, long prompt_tokens, long completion_tokens,
+                             long cached_tokens = -1) {
+        lock_guard<mutex> guard(mutex_);
+        Series& entry = series_[series];
+        if (ttft_ms >= 0) entry.histograms["ttft_ms"].add(ttft_ms);
+        double tokens_per_second = -1;
+        if (prompt_tokens >= 0) entry.prompt_tokens += prompt_tokens;
+        if (cached_tokens >= 0) {
+            // Prefill work: prompt tokens the server had to evaluate rather than reuse
+            entry.cached_tokens += cached_tokens;
+            if (prompt_tokens >= 0) entry.histograms["prefill_tokens"].add(max(prompt_tokens - cached_tokens, 0L));
+        }
+        if (completion_tokens >= 0) {
+            entry.completion_tokens += completion_tokens;
+            // Decode rate: streamed replies exclude the wait for the first token
+            double generation_ms = ttft_ms >= 0 && completion_tokens > 1 ? total_ms - ttft_ms : total_ms;
+            double tokens = ttft_ms >= 0 && completion_tokens > 1 ? completion_tokens - 1 : completion_tokens;
+            if (generation_ms > 0 && tokens > 0) {
+                tokens_per_second = tokens * 1000.0 / generation_ms;
+                entry.histograms["tokens_per_second"].add(tokens_per_second);
+            }
+        }
+
+        if (events_.is_open()) {
+            json event = {
+                {"time", chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count()},
+                {"event", "generation"},
+                {"series", series},
+                {"total_ms", total_ms}
+            };
+            if (ttft_ms >= 0) event["ttft_ms"] = ttft_ms;
+            if (prompt_tokens >= 0) event["prompt_tokens"] = prompt_tokens;
+            if (cached_tokens >= 0) event["cached_tokens"] = cached_tokens;
+            if (completion_tokens >= 0) event["completion_tokens"] = completion_tokens;
+            if (tokens_per_second >= 0) event["tokens_per_second"] = tokens_per_second;
+            events_ << event.dump() << '\n';
+            events_.flush();
+        }
+        maybe_flush_locked();
+        return tokens_per_second;
+    }
+
+    void print() const {
+        lock_guard<mutex> guard(mutex_);
+        if (series_.empty()) {
+            cout << COLOR_YELLOW << "No requests recorded yet." << COLOR_RESET << endl;
+            return;
+        }
+        for (const auto& [name, entry] : series_) {
+            cout << COLOR_GRADIENT_1 << name << COLOR_RESET << ": " << entry.requests << " requests, " << entry.errors
+                 << " errors, " << (entry.bytes_out >> 10) << " KiB out, " << (entry.bytes_in >> 10) << " KiB in";
+            if (entry.prompt_tokens || entry.completion_tokens) {
+                cout << ", " << entry.prompt_tokens << " prompt";
+                if (entry.cached_tokens) cout << " (" << entry.cached_tokens << " cached)";
+                cout << " / " << entry.completion_tokens << " completion tokens";
+            }
+            cout << endl;
+            for (const auto& [metric, histogram] : entry.histograms) {
+                cout << COLOR_YELLOW << "  " << left << setw(18) << metric << right
+                     << " p50 " << setw(8) << fixed_number(histogram.percentile(0.50), 1)
+                     << "  p95 " << setw(8) << fixed_number(histogram.percentile(0.95), 1)
+                     << "  p99 " << setw(8) << fixed_number(histogram.percentile(0.99), 1)
+                     << "  (n=" << histogram.count() << ")" << COLOR_RESET << endl;
+            }
+        }
+    }
+
+    // Rewrites the Prometheus snapshot; record_* call this at most once a second
+    void flush() {
+        lock_guard<mutex> guard(mutex_);
+        write_prometheus_locked();
+    }
+
+private:
+    struct Series {
+        uint64_t requests = 0;
+        uint64_t errors = 0;
+        curl_off_t bytes_in = 0;
+        curl_off_t bytes_out = 0;
+        long prompt_tokens = 0;
+        long cached_tokens = 0;    // Prompt tokens served from the server's KV cache
+        long completion_tokens = 0;
+        map<string, RollingHistogram> histograms;
+    };
+
+    Metrics() = default;
+
+    void maybe_flush_locked() {
+        auto now = chrono::steady_clock::now();
+        if (now - last_flush_ < chrono::seconds(1)) return;
+        last_flush_ = now;
+        write_prometheus_locked();
+    }
+
+    void write_prometheus_locked() {
+        if (path_.empty() || jsonl_) return;
+        ostringstream out;
+        auto counter = [&](const string& name, auto value_of) {
+            out << "# TYPE ghost_" << name << " counter\n";
+            for (const auto& [series, entry] : series_) {
+                out << "ghost_" << name << "{series=\"" << series << "\"} " << value_of(entry) << "\n";
+            }
+        };
+        counter("requests_total", [](const Series& entry) { return entry.requests; });
+        counter("request_errors_total", [](const Series& entry) { return entry.errors; });
+        counter("bytes_received_total", [](const Series& entry) { return entry.bytes_in; });
+        counter("bytes_sent_total", [](const Series& entry) { return entry.bytes_out; });
+        counter("prompt_tokens_total", [](const Series& entry) { return entry.prompt_tokens; });
+        counter("cached_prompt_tokens_total", [](const Series& entry) { return entry.cached_tokens; });
+        counter("completion_tokens_total", [](const Series& entry) { return entry.completion_tokens; });
+
+        set<string> metric_names;
+        for (const auto& [series, entry] : series_) {
+            for (const auto& histogram : entry.histograms) metric_names.insert(histogram.first);
+        }
+        for (const string& metric : metric_names) {
+            out << "# TYPE ghost_" << metric << " summary\n";
+            for (const auto& [series, entry] : series_) {
+                auto it = entry.histograms.find(metric);
+                if (it == entry.histograms.end()) continue;
+                for (double quantile : {0.5, 0.95, 0.99}) {
+                    out << "ghost_" << metric << "{series=\"" << series << "\",quantile=\"" << quantile << "\"} "
+                        << it->second.percentile(quantile) << "\n";
+                }
+                out << "ghost_" << metric << "_sum{series=\"" << series << "\"} " << it->second.sum() << "\n";
+                out << "ghost_" << metric << "_count{series=\"" << series << "\"} " << it->second.count() << "\n";
+            }
+        }
+
+        // Replace atomically so scrapers never read a half-written file
+        string temp_path = path_ + ".tmp";
+        {
+            ofstream file(temp_path, ios::trunc);
+            if (!file.is_open()) return;
+            file << out.str();
+        }
+        error_code ec;
+        filesystem::rename(temp_path, path_, ec);
+    }
+
+    mutable mutex mutex_;
+    map<string, Series> series_;
+    string path_;
+    bool jsonl_ = false;
+    ofstream events_;
+    chrono::steady_clock::time_point last_flush_;
+};
+
+// Spreads chat requests over the servers in config.backends (URL -> weight). A request goes
+// to the healthy backend with the fewest outstanding requests per unit of weight
+// ("least_outstanding"), or with the lowest recent time to first byte scaled by its queue
+// ("latency"). Three failures in a row take a backend out of rotation; the RequestEngine
+// polls each server's /health and brings it back once that passes, and a backend without
+// a health endpoint gets one trial request after a cooldown instead.
+class BackendPool {
+public:
+    static BackendPool& instance() {
+        static BackendPool pool;
+        return pool;
+    }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        latency_routing_ = config.backend_routing == "latency";
+        failover_ = max(config.backend_failover, 0);
+        hedge_after_ms_ = max(config.hedge_after_ms, 0);
+        health_interval_ = chrono::milliseconds(max(config.health_check_ms, 0));
+        map<string, Backend> backends;
+        for (const auto& [url, weight] : config.backends) {
+            if (weight <= 0) continue; // Drained
+            auto it = backends_.find(url);
+            Backend& backend = backends[url] = it != backends_.end() ? it->second : Backend{};
+            backend.weight = weight;
+        }
+        backends_.swap(backends); // Outstanding counts of removed backends die with them
+    }
+
+    // Extra backends tried after a transport error, 429 or 5xx, and the hedging delay
+    size_t failover() const { return failover_.load(); }
+    int hedge_after_ms() const { return hedge_after_ms_.load(); }
+
+    // Backend for the next attempt of a request, skipping those it already `tried`; empty
+    // when none is left. `preferred` wins while it is up and carries at most twice the load
+    // of the best choice. The attempt counts as outstanding until release().
+    string acquire(const vector<string>& tried, const string& preferred = "") {
+        lock_guard<mutex> guard(mutex_);
+        auto now = chrono::steady_clock::now();
+        Backend* best = nullptr;
+        const string* best_url = nullptr;
+        bool best_available = false;
+        double best_score = 0;
+        for (auto& [url, backend] : backends_) {
+            if (find(tried.begin(), tried.end(), url) != tried.end()) continue;
+            // A backend that is down still beats failing outright
+            bool available = backend.healthy || now >= backend.retry_at;
+            double score = score_locked(backend);
+            if (!best || (available && !best_available) ||
+                (available == best_available && (score < best_score ||
+                 (score == best_score && backend.requests * best->weight < best->requests * backend.weight)))) {
+                best = &backend;
+                best_url = &url;
+                best_available = available;
+                best_score = score;
+            }
+        }
+        if (!best) return {};
+        auto it = backends_.find(preferred);
+        if (it != backends_.end() && it->second.healthy && best_available &&
+            find(tried.begin(), tried.end(), preferred) == tried.end() && score_locked(it->second) <= 2 * best_score) {
+            best = &it->second;
+            best_url = &it->first;
+        }
+        if (!best->healthy) best->retry_at = now + COOLDOWN; // One trial request per cooldown
+        best->outstanding++;
+        return *best_url;
+    }
+
+    // Ends an attempt. `healthy` is empty when the outcome says nothing about the backend
+    // (cancelled, or a hedged twin answered first); `ttfb_ms` is negative without a response.
+    void release(const string& url, optional<bool> healthy, double ttfb_ms) {
+        lock_guard<mutex> guard(mutex_);
+        auto it = backends_.find(url);
+        if (it == backends_.end()) return;
+        Backend& backend = it->second;
+        backend.outstanding = max(backend.outstanding - 1, 0);
+        if (!healthy) return;
+        backend.requests++;
+        if (*healthy) {
+            backend.healthy = true;
+            backend.consecutive_failures = 0;
+            if (ttfb_ms >= 0) backend.ttfb_ms = backend.ttfb_ms > 0 ? 0.8 * backend.ttfb_ms + 0.2 * ttfb_ms : ttfb_ms;
+        } else {
+            backend.failures++;
+            if (++backend.consecutive_failures >= FAILURES_TO_EJECT && backend.healthy) {
+                backend.healthy = false;
+                backend.retry_at = chrono::steady_clock::now() + COOLDOWN;
+            }
+        }
+    }
+
+    // Health URLs of the backends due for a probe; each gets one probe in flight at a time
+    vector<pair<string, string>> due_health_checks() {
+        lock_guard<mutex> guard(mutex_);
+        vector<pair<string, string>> due;
+        if (health_interval_.count() == 0) return due;
+        auto now = chrono::steady_clock::now();
+        for (auto& [url, backend] : backends_) {
+            if (backend.probing || now < backend.next_probe) continue;
+            backend.probing = true;
+            backend.next_probe = now + health_interval_;
+            due.emplace_back(url, health_url(url));
+        }
+        return due;
+    }
+
+    // llama.cpp answers /health with 200 once the model is loaded and 503 while loading;
+    // servers without the endpoint (404) are judged by their requests alone
+    void record_health(const string& url, const HttpResult& result) {
+        lock_guard<mutex> guard(mutex_);
+        auto it = backends_.find(url);
+        if (it == backends_.end()) return;
+        Backend& backend = it->second;
+        backend.probing = false;
+        if (result.status == 404) return;
+        backend.healthy = result.ok();
+        if (backend.healthy) {
+            backend.consecutive_failures = 0;
+        } else {
+            backend.retry_at = chrono::steady_clock::now() + health_interval_;
+        }
+    }
+
+    bool empty() const {
+        lock_guard<mutex> guard(mutex_);
+        return backends_.empty();
+    }
+
+    json stats() const {
+        lock_guard<mutex> guard(mutex_);
+        json backends = json::array();
+        for (const auto& [url, backend] : backends_) {
+            backends.push_back({
+                {"url", url},
+                {"weight", backend.weight},
+                {"healthy", backend.healthy},
+                {"outstanding", backend.outstanding},
+                {"requests", backend.requests},
+                {"failures", backend.failures},
+                {"ttfb_ms", backend.ttfb_ms}
+            });
+        }
+        return backends;
+    }
+
+    void print() const {
+        json backends = stats();
+        if (backends.empty()) return;
+        cout << COLOR_GRADIENT_1 << "backends" << COLOR_RESET << ":" << endl;
+        for (const auto& backend : backends) {
+            cout << (backend["healthy"].get<bool>() ? COLOR_GREEN : COLOR_RED) << "  " << backend["url"].get<string>()
+                 << COLOR_RESET << COLOR_YELLOW << "  weight " << backend["weight"] << ", " << backend["outstanding"]
+                 << " outstanding, " << backend["requests"] << " requests, " << backend["failures"] << " failures, first byte "
+                 << fixed_number(backend["ttfb_ms"].get<double>(), 1) << " ms" << COLOR_RESET << endl;
+        }
+    }
+
+    static string health_url(const string& url) { return url_origin(url) + "/health"; }
+
+private:
+    static constexpr int FAILURES_TO_EJECT = 3;
+    static constexpr chrono::seconds COOLDOWN{10};
+
+    struct Backend {
+        int weight = 1;
+        int outstanding = 0;
+        bool healthy = true;
+        int consecutive_failures = 0;
+        chrono::steady_clock::time_point retry_at;   // When a down backend may take a trial request
+        chrono::steady_clock::time_point next_probe;
+        bool probing = false;
+        double ttfb_ms = 0;                          // Moving average of time to first byte; 0 until measured
+        uint64_t requests = 0;
+        uint64_t failures = 0;
+    };
+
+    // Lower is better
+    double score_locked(const Backend& backend) const {
+        double queue = (backend.outstanding + 1.0) / backend.weight;
+        if (!latency_routing_) return queue;
+        // Unmeasured backends look as fast as the fastest, so they get sampled
+        double ttfb = backend.ttfb_ms;
+        if (ttfb <= 0) {
+            ttfb = numeric_limits<double>::max();
+            for (const auto& entry : backends_) {
+                if (entry.second.ttfb_ms > 0) ttfb = min(ttfb, entry.second.ttfb_ms);
+            }
+            if (ttfb == numeric_limits<double>::max()) ttfb = 1;
+        }
+        return ttfb * queue;
+    }
+
+    mutable mutex mutex_;
+    map<string, Backend> backends_;
+    bool latency_routing_ = false;
+    atomic<size_t> failover_{2};
+    atomic<int> hedge_after_ms_{0};
+    chrono::milliseconds health_interval_{5000};
+};
+
+// Handle to a request owned by the RequestEngine. The REPL can poll ready(), block in
+// wait_for() and cancel() at any time; result() is valid once ready() returns true.
+class PendingRequest {
+public:
+    bool ready() const { return done_.load(); }
+
+    bool wait_for(chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(mutex_);
+        return cv_.wait_for(lock, timeout, [this] { return done_.load(); });
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return done_.load(); });
+    }
+
+    void cancel();
+
+    const HttpResult& result() const { return result_; }
+
+private:
+    friend class RequestEngine;
+    friend class DaemonClient;
+
+    RequestSpec spec_;
+    HttpResult result_;
+    chrono::steady_clock::time_point submitted_;
+    vector<CURL*> transfers_;   // More than one while a hedged twin is racing
+    CURL* winner_ = nullptr;    // The transfer whose response is being delivered
+    vector<string> tried_;      // Backends used so far, for BACKEND_POOL_URL requests
+    bool hedged_ = false;
+    uint32_t remote_id_ = 0;    // Non-zero when the daemon runs the request, see DaemonClient
+    struct curl_slist* header_list_ = nullptr;
+    atomic<bool> cancel_requested_{false};
+    atomic<bool> done_{false};
+    mutex mutex_;
+    condition_variable cv_;
+};
+
+// Framing between the daemon and its clients: a 9-byte header (payload length, type,
+// request id) in host byte order, both ends being on the same machine, then the payload
+enum DaemonFrame : uint8_t {
+    FRAME_HELLO = 1, // Both ways, JSON: the protocol version; the daemon adds its pid
+    FRAME_REQUEST,   // Client: RequestSpec fields as one JSON line, then the raw body
+    FRAME_DATA,      // Daemon: response bytes of a request as they arrive
+    FRAME_DONE,      // Daemon: the request's HttpResult, without the body
+    FRAME_CANCEL,    // Client: cancel a request, or abandon a call
+    FRAME_CALL,      // Client: {"op": ...} for one of the daemon's shared services
+    FRAME_REPLY      // Daemon: the call's JSON answer
+};
+const uint32_t DAEMON_PROTOCOL = 1;
+const size_t DAEMON_MAX_FRAME = 256 << 20;
+
+string encode_frame(uint8_t type, uint32_t id, string_view payload) {
+    string frame(9 + payload.size(), '\0');
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    memcpy(&frame[0], &length, 4);
+    frame[4] = static_cast<char>(type);
+    memcpy(&frame[5], &id, 4);
+    memcpy(&frame[9], payload.data(), payload.size());
+    return frame;
+}
+
+bool send_frame_bytes(int fd, string_view data) {
+    while (!data.empty()) {
+        ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Blocks for one whole frame; false on EOF, error or an oversized length
+bool read_frame(int fd, uint8_t& type, uint32_t& id, string& payload) {
+    auto read_exact = [fd](char* data, size_t length) {
+        while (length > 0) {
+            ssize_t n = ::recv(fd, data, length, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            length -= n;
+        }
+        return true;
+    };
+    char header[9];
+    if (!read_exact(header, sizeof(header))) return false;
+    uint32_t length;
+    memcpy(&length, header, 4);
+    type = static_cast<uint8_t>(header[4]);
+    memcpy(&id, header + 5, 4);
+    if (length > DAEMON_MAX_FRAME) return false;
+    payload.resize(length);
+    return read_exact(payload.data(), length);
+}
+
+// Everything but the callbacks; the body follows the JSON line unescaped
+string encode_request_spec(const RequestSpec& spec) {
+    json meta = {{"url", spec.url}, {"headers", spec.headers}, {"timeout_ms", spec.timeout_ms},
+                 {"metric", spec.metric}, {"affinity", spec.affinity}, {"follow_redirects", spec.follow_redirects},
+                 {"content_types", spec.content_types}};
+    return meta.dump(-1, ' ', false, json::error_handler_t::replace) + "\n" + spec.body;
+}
+
+bool decode_request_spec(const string& payload, RequestSpec& spec) {
+    size_t newline = payload.find('\n');
+    if (newline == string::npos) return false;
+    json meta = json::parse(payload.begin(), payload.begin() + newline, nullptr, false);
+    if (!meta.is_object()) return false;
+    try {
+        spec.url = meta.value("url", "");
+        spec.headers = meta.value("headers", vector<string>());
+        spec.timeout_ms = meta.value("timeout_ms", 0L);
+        spec.metric = meta.value("metric", "http");
+        spec.affinity = meta.value("affinity", "");
+        spec.follow_redirects = meta.value("follow_redirects", false);
+        spec.content_types = meta.value("content_types", vector<string>());
+    } catch (const json::exception&) { // A field of the wrong type
+        return false;
+    }
+    spec.body = payload.substr(newline + 1);
+    return !spec.url.empty();
+}
+
+json http_result_to_json(const HttpResult& result) {
+    const RequestTiming& timing = result.timing;
+    return {{"curl_code", static_cast<int>(result.curl_code)}, {"status", result.status}, {"cancelled", result.cancelled},
+            {"message", result.message}, {"endpoint", result.endpoint}, {"content_type", result.content_type},
+            {"network", timing.network},
+            {"dns_ms", timing.dns_ms}, {"connect_ms", timing.connect_ms}, {"tls_ms", timing.tls_ms},
+            {"ttfb_ms", timing.ttfb_ms}, {"total_ms", timing.total_ms}, {"bytes_in", timing.bytes_in},
+            {"bytes_out", timing.bytes_out}};
+}
+
+// False if a field has the wrong type
+bool http_result_from_json(const json& meta, HttpResult& result) try {
+    RequestTiming& timing = result.timing;
+    result.curl_code = static_cast<CURLcode>(meta.value("curl_code", static_cast<int>(CURLE_RECV_ERROR)));
+    result.status = meta.value("status", 0L);
+    result.cancelled = meta.value("cancelled", false);
+    result.message = meta.value("message", "");
+    result.endpoint = meta.value("endpoint", "");
+    result.content_type = meta.value("content_type", "");
+    timing.network = meta.value("network", false);
+    timing.dns_ms = meta.value("dns_ms", 0.0);
+    timing.connect_ms = meta.value("connect_ms", 0.0);
+    timing.tls_ms = meta.value("tls_ms", 0.0);
+    timing.ttfb_ms = meta.value("ttfb_ms", 0.0);
+    timing.total_ms = meta.value("total_ms", 0.0);
+    timing.bytes_in = meta.value("bytes_in", curl_off_t{0});
+    timing.bytes_out = meta.value("bytes_out", curl_off_t{0});
+    return true;
+} catch (const json::exception&) {
+    return false;
+}
+
+// The REPL's side of the daemon (see DaemonServer). While connected, RequestEngine hands
+// every request to the daemon and replays its streamed reply into the same callbacks, so
+// callers cannot tell; the cache, search and prompt library forward their calls here too.
+// If the daemon goes away, pending work fails and everything falls back to running locally.
+class DaemonClient {
+public:
+    static DaemonClient& instance() {
+        static DaemonClient client;
+        return client;
+    }
+
+    ~DaemonClient() { close(); }
+
+    // Silent when nothing listens at `path`: no daemon simply means running standalone
+    bool connect(const string& path) {
+        close();
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) return false;
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return false;
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            ::close(fd);
+            return false;
+        }
+
+        // A listener that never answers (a stopped daemon, say) must not hold up the REPL
+        timeval timeout = {0, 500000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        uint8_t type = 0;
+        uint32_t id = 0;
+        string payload;
+        json hello = {{"protocol", DAEMON_PROTOCOL}};
+        if (!send_frame_bytes(fd, encode_frame(FRAME_HELLO, 0, hello.dump())) || !read_frame(fd, type, id, payload) ||
+            type != FRAME_HELLO) {
+            ::close(fd);
+            return false;
+        }
+        timeout = {0, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        json reply = json::parse(payload, nullptr, false);
+        const json* protocol = reply.is_object() ? &reply["protocol"] : nullptr;
+        if (!protocol || !protocol->is_number_unsigned() || protocol->get<uint32_t>() != DAEMON_PROTOCOL) {
+            cerr << COLOR_RED << "Error: The daemon on " << path << " speaks another protocol version; running without it"
+                 << COLOR_RESET << endl;
+            ::close(fd);
+            return false;
+        }
+        fd_ = fd;
+        path_ = path;
+        pid_ = reply["pid"].is_number_integer() ? reply["pid"].get<int>() : 0;
+        connected_ = true;
+        reader_ = thread(&DaemonClient::run, this);
+        return true;
+    }
+
+    bool connected() const { return connected_.load() && !serving; }
+    const string& path() const { return path_; }
+    int pid() const { return pid_; }
+
+    // Set on the daemon's own threads: what they run must not be forwarded, even when the
+    // process is also a client of itself (the daemon benchmark)
+    static inline thread_local bool serving = false;
+
+    // Sends `request` to the daemon; false when not connected, to run it locally instead
+    bool forward(const shared_ptr<PendingRequest>& request) {
+        uint32_t id;
+        {
+            lock_guard<mutex> guard(mutex_);
+            if (!connected_ || serving) return false;
+            id = next_id_++;
+            request->remote_id_ = id;
+            requests_[id] = request;
+        }
+        send(FRAME_REQUEST, id, encode_request_spec(request->spec_)); // A failed send surfaces as the lost connection
+        return true;
+    }
+
+    void cancel(uint32_t id) { send(FRAME_CANCEL, id, {}); }
+
+    // Runs one daemon service call and waits for its answer. False if the connection is
+    // lost, or, with `interrupt` set, once it is raised, abandoning the call.
+    bool call(const json& request, json& reply, const atomic<bool>* interrupt = nullptr) {
+        auto pending = make_shared<Call>();
+        uint32_t id;
+        {
+            lock_guard<mutex> guard(mutex_);
+            if (!connected_ || serving) return false;
+            id = next_id_++;
+            calls_[id] = pending;
+        }
+        send(FRAME_CALL, id, request.dump(-1, ' ', false, json::error_handler_t::replace));
+        unique_lock<mutex> lock(mutex_);
+        while (!pending->done) {
+            if (interrupt && interrupt->load()) {
+                calls_.erase(id);
+                lock.unlock();
+                cancel(id);
+                return false;
+            }
+            calls_cv_.wait_for(lock, chrono::milliseconds(10));
+        }
+        reply = move(pending->reply);
+        return !reply.is_null();
+    }
+
+    void close() {
+        if (fd_ < 0) return;
+        ::shutdown(fd_, SHUT_RDWR);
+        if (reader_.joinable()) reader_.join();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    struct Call {
+        bool done = false;
+        json reply;
+    };
+
+    DaemonClient() = default;
+
+    void send(uint8_t type, uint32_t id, string_view payload) {
+        lock_guard<mutex> guard(write_mutex_);
+        if (fd_ >= 0 && !send_frame_bytes(fd_, encode_frame(type, id, payload))) ::shutdown(fd_, SHUT_RDWR);
+    }
+
+    shared_ptr<PendingRequest> find(uint32_t id) {
+        lock_guard<mutex> guard(mutex_);
+        auto it = requests_.find(id);
+        return it == requests_.end() ? nullptr : it->second;
+    }
+
+    // Completes `request` like RequestEngine::finish does
+    static void complete(PendingRequest& request) {
+        Metrics::instance().record_request(request.spec_.metric, request.result_);
+        if (request.spec_.on_complete) request.spec_.on_complete(request.result_);
+        {
+            lock_guard<mutex> guard(request.mutex_);
+            request.done_ = true;
+        }
+        request.cv_.notify_all();
+    }
+
+    void run() {
+        set<uint32_t> aborted; // Requests whose on_data returned false; their remaining data is dropped
+        uint8_t type;
+        uint32_t id;
+        string payload;
+        while (read_frame(fd_, type, id, payload)) {
+            if (type == FRAME_DATA) {
+                shared_ptr<PendingRequest> request = find(id);
+                if (!request || request->cancel_requested_ || aborted.count(id)) continue;
+                if (!request->spec_.on_data) {
+                    request->result_.body += payload;
+                } else if (!request->spec_.on_data(payload.data(), payload.size())) {
+                    aborted.insert(id);
+                    cancel(id);
+                }
+            } else if (type == FRAME_DONE) {
+                shared_ptr<PendingRequest> request = find(id);
+                if (!request) continue;
+                json meta = json::parse(payload, nullptr, false);
+                if (!meta.is_object() || !http_result_from_json(meta, request->result_)) {
+                    request->result_.curl_code = CURLE_RECV_ERROR;
+                    request->result_.message = "Malformed reply frame from the daemon";
+                }
+                if (aborted.erase(id)) { // As a local transfer reports an aborting write callback
+                    request->result_.curl_code = CURLE_WRITE_ERROR;
+                    request->result_.cancelled = request->cancel_requested_;
+                }
+                complete(*request);
+                lock_guard<mutex> guard(mutex_);
+                requests_.erase(id);
+            } else if (type == FRAME_REPLY) {
+                lock_guard<mutex> guard(mutex_);
+                auto it = calls_.find(id);
+                if (it == calls_.end()) continue; // Abandoned
+                json reply = json::parse(payload, nullptr, false);
+                it->second->reply = reply.is_discarded() ? json() : move(reply);
+                it->second->done = true;
+                calls_.erase(it);
+                calls_cv_.notify_all();
+            }
+        }
+
+        // Connection gone: whatever is still pending fails
+        unordered_map<uint32_t, shared_ptr<PendingRequest>> requests;
+        {
+            lock_guard<mutex> guard(mutex_);
+            connected_ = false;
+            requests.swap(requests_);
+            for (auto& [call_id, call] : calls_) call->done = true;
+            calls_.clear();
+        }
+        calls_cv_.notify_all();
+        for (auto& [request_id, request] : requests) {
+            request->result_.curl_code = CURLE_RECV_ERROR;
+            request->result_.cancelled = request->cancel_requested_;
+            request->result_.message = "Lost the connection to the daemon";
+            complete(*request);
+        }
+    }
+
+    int fd_ = -1;
+    string path_;
+    int pid_ = 0;
+    atomic<bool> connected_{false};
+    thread reader_;
+    mutex write_mutex_;
+    mutex mutex_;
+    condition_variable calls_cv_;
+    uint32_t next_id_ = 1;
+    unordered_map<uint32_t, shared_ptr<PendingRequest>> requests_;
+    unordered_map<uint32_t, shared_ptr<Call>> calls_;
+};
+
+// A file of lines, zstd-compressed when its name ends in .zst. Compression needs a build
+// with -DGHOST_WITH_ZSTD and -lzstd; without it such names are refused.
+class LineWriter {
+public:
+    ~LineWriter() { close(); }
+
+    bool open(const string& path, string& error) {
+        close();
+        compressed_ = path.size() > 4 && path.compare(path.size() - 4, 4, ".zst") == 0;
+#ifndef GHOST_WITH_ZSTD
+        if (compressed_) {
+            error = "Writing " + path + " needs a build with -DGHOST_WITH_ZSTD";
+            return false;
+        }
+#endif
+        file_.open(path, ios::binary | ios::app);
+        if (!file_.is_open()) {
+            error = "Unable to write " + path;
+            return false;
+        }
+#ifdef GHOST_WITH_ZSTD
+        if (compressed_) {
+            context_ = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, 3);
+        }
+#endif
+        return true;
+    }
+
+    bool is_open() const { return file_.is_open(); }
+
+    void write_line(string_view line) {
+        if (!compressed_) {
+            file_ << line << '\n';
+            return;
+        }
+#ifdef GHOST_WITH_ZSTD
+        compress(line, ZSTD_e_continue);
+        compress("\n", ZSTD_e_continue);
+#endif
+    }
+
+    // Everything written so far reaches the file, decodable even if the process dies later
+    void flush() {
+#ifdef GHOST_WITH_ZSTD
+        if (compressed_) compress({}, ZSTD_e_flush);
+#endif
+        file_.flush();
+    }
+
+    void close() {
+        if (!file_.is_open()) return;
+#ifdef GHOST_WITH_ZSTD
+        if (compressed_) {
+            compress({}, ZSTD_e_end);
+            ZSTD_freeCCtx(context_);
+            context_ = nullptr;
+        }
+#endif
+        file_.close();
+    }
+
+private:
+#ifdef GHOST_WITH_ZSTD
+    void compress(string_view data, ZSTD_EndDirective mode) {
+        char output[1 << 16];
+        ZSTD_inBuffer input = {data.data(), data.size(), 0};
+        while (true) {
+            ZSTD_outBuffer out = {output, sizeof(output), 0};
+            size_t remaining = ZSTD_compressStream2(context_, &out, &input, mode);
+            file_.write(output, out.pos);
+            if (ZSTD_isError(remaining)) return;
+            if (mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0) return;
+        }
+    }
+
+    ZSTD_CCtx* context_ = nullptr;
+#endif
+    ofstream file_;
+    bool compressed_ = false;
+};
+
+// Reads what LineWriter wrote, a line at a time
+class LineReader {
+public:
+    ~LineReader() {
+#ifdef GHOST_WITH_ZSTD
+        if (context_) ZSTD_freeDCtx(context_);
+#endif
+    }
+
+    bool open(const string& path, string& error) {
+        compressed_ = path.size() > 4 && path.compare(path.size() - 4, 4, ".zst") == 0;
+#ifndef GHOST_WITH_ZSTD
+        if (compressed_) {
+            error = "Reading " + path + " needs a build with -DGHOST_WITH_ZSTD";
+            return false;
+        }
+#else
+        if (compressed_) context_ = ZSTD_createDCtx();
+#endif
+        file_.open(path, ios::binary);
+        if (!file_.is_open()) error = "Unable to open " + path;
+        return file_.is_open();
+    }
+
+    bool next(string& line) {
+        if (!compressed_) return static_cast<bool>(getline(file_, line));
+        size_t newline;
+        while ((newline = pending_.find('\n', scanned_)) == string::npos) {
+            scanned_ = pending_.size();
+            if (!fill()) {
+                if (pending_.empty()) return false;
+                line = move(pending_);
+                pending_.clear();
+                scanned_ = 0;
+                return true;
+            }
+        }
+        line.assign(pending_, 0, newline);
+        pending_.erase(0, newline + 1);
+        scanned_ = 0;
+        return true;
+    }
+
+private:
+    // Decompresses the next block of the file onto pending_; false at its end
+    bool fill() {
+#ifdef GHOST_WITH_ZSTD
+        char input[1 << 16];
+        char output[1 << 17];
+        file_.read(input, sizeof(input));
+        size_t length = static_cast<size_t>(file_.gcount());
+        if (length == 0) return false;
+        ZSTD_inBuffer in = {input, length, 0};
+        while (in.pos < in.size) {
+            ZSTD_outBuffer out = {output, sizeof(output), 0};
+            if (ZSTD_isError(ZSTD_decompressStream(context_, &out, &in))) return false;
+            pending_.append(output, out.pos);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#ifdef GHOST_WITH_ZSTD
+    ZSTD_DCtx* context_ = nullptr;
+#endif
+    ifstream file_;
+    bool compressed_ = false;
+    string pending_;
+    size_t scanned_ = 0;
+};
+
+// Records every request submitted to the RequestEngine to record_file, one JSON line each:
+// when it was sent (ms since recording began), what was sent, how long the reply took and
+// the reply itself, for --replay. Credentials in headers and `key=` URL parameters are
+// redacted; replies are kept up to MAX_REPLY bytes.
+class TrafficRecorder {
+public:
+    static TrafficRecorder& instance() {
+        static TrafficRecorder recorder;
+        return recorder;
+    }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        if (config.record_file == path_) return;
+        writer_.close();
+        path_ = config.record_file;
+        enabled_ = false;
+        if (path_.empty()) return;
+        string error;
+        if (!writer_.open(path_, error)) {
+            cerr << COLOR_RED << "Error: " << error << "; traffic is not recorded" << COLOR_RESET << endl;
+            return;
+        }
+        started_ = chrono::steady_clock::now();
+        unflushed_ = 0;
+        enabled_ = true;
+    }
+
+    bool enabled() const { return enabled_.load(); }
+
+    // Wraps `spec`'s callbacks so its reply is captured and the request logged when it ends
+    void attach(RequestSpec& spec) {
+        auto capture = make_shared<Capture>();
+        capture->submitted = chrono::steady_clock::now();
+        capture->record = {
+            {"t_ms", chrono::duration<double, milli>(capture->submitted - started_).count()},
+            {"metric", spec.metric},
+            {"url", redact_url(spec.url)},
+            {"headers", redact_headers(spec.headers)},
+            {"body", spec.body},
+            {"timeout_ms", spec.timeout_ms}
+        };
+        if (spec.on_data) {
+            capture->streamed = true;
+            spec.on_data = [capture, sink = move(spec.on_data)](const char* data, size_t length) {
+                if (capture->first_byte_ms < 0) {
+                    capture->first_byte_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - capture->submitted).count();
+                }
+                capture->reply.append(data, min(length, MAX_REPLY - capture->reply.size()));
+                capture->reply_bytes += length;
+                return sink(data, length);
+            };
+        }
+        spec.on_complete = [this, capture, done = move(spec.on_complete)](const HttpResult& result) {
+            if (done) done(result);
+            write(*capture, result);
+        };
+    }
+
+    void close() {
+        lock_guard<mutex> guard(mutex_);
+        writer_.close();
+        enabled_ = false;
+        path_.clear();
+    }
+
+private:
+    static constexpr size_t MAX_REPLY = 1 << 20;
+    static constexpr int FLUSH_EVERY = 64;
+
+    struct Capture {
+        chrono::steady_clock::time_point submitted;
+        json record;
+        bool streamed = false;
+        string reply;
+        size_t reply_bytes = 0;
+        double first_byte_ms = -1;
+    };
+
+    TrafficRecorder() = default;
+
+    static string redact_url(const string& url) {
+        string redacted = url;
+        for (size_t at = redacted.find("key="); at != string::npos; at = redacted.find("key=", at + 1)) {
+            if (at == 0 || (redacted[at - 1] != '?' && redacted[at - 1] != '&')) continue;
+            size_t end = redacted.find('&', at);
+            redacted.replace(at + 4, (end == string::npos ? redacted.size() : end) - at - 4, "REDACTED");
+        }
+        return redacted;
+    }
+
+    static vector<string> redact_headers(const vector<string>& headers) {
+        static const vector<string> SECRET = {"authorization", "ocp-apim-subscription-key", "x-api-key", "api-key"};
+        vector<string> redacted;
+        for (const string& header : headers) {
+            string name = header.substr(0, header.find(':'));
+            transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+            redacted.push_back(find(SECRET.begin(), SECRET.end(), name) == SECRET.end() ? header : header.substr(0, name.size()) + ": REDACTED");
+        }
+        return redacted;
+    }
+
+    void write(Capture& capture, const HttpResult& result) {
+        json& record = capture.record;
+        const string& reply = capture.streamed ? capture.reply : result.body;
+        record["endpoint"] = redact_url(result.endpoint);
+        record["status"] = result.status;
+        record["ok"] = result.ok();
+        record["error"] = result.error();
+        record["ms"] = chrono::duration<double, milli>(chrono::steady_clock::now() - capture.submitted).count();
+        record["ttfb_ms"] = capture.streamed ? capture.first_byte_ms : result.timing.network ? result.timing.ttfb_ms : -1.0;
+        size_t reply_bytes = capture.streamed ? capture.reply_bytes : result.body.size();
+        record["reply_bytes"] = reply_bytes;
+        record["reply"] = reply.substr(0, MAX_REPLY);
+        if (reply_bytes > MAX_REPLY) record["reply_truncated"] = true;
+        string line = record.dump(-1, ' ', false, json::error_handler_t::replace);
+        lock_guard<mutex> guard(mutex_);
+        if (!writer_.is_open()) return;
+        writer_.write_line(line);
+        if (++unflushed_ >= FLUSH_EVERY) {
+            writer_.flush();
+            unflushed_ = 0;
+        }
+    }
+
+    mutex mutex_;
+    string path_;
+    LineWriter writer_;
+    atomic<bool> enabled_{false};
+    chrono::steady_clock::time_point started_;
+    int unflushed_ = 0;
+};
+
+// Event-driven request engine: one background thread drives every transfer through
+// curl_multi, so queries never block the REPL and several can overlap.
+class RequestEngine {
+public:
+    static RequestEngine& instance() {
+        static RequestEngine engine;
+        return engine;
+    }
+
+    shared_ptr<PendingRequest> submit(RequestSpec spec) {
+        auto request = make_shared<PendingRequest>();
+        request->spec_ = move(spec);
+        // What the daemon runs for a client was recorded by that client, if at all
+        if (TrafficRecorder::instance().enabled() && !DaemonClient::serving) TrafficRecorder::instance().attach(request->spec_);
+        request->submitted_ = chrono::steady_clock::now();
+        if (DaemonClient::instance().forward(request)) return request;
+        if (request->spec_.url == LOCAL_BACKEND_URL) {
+            lock_guard<mutex> guard(local_mutex_);
+            if (!local_worker_.joinable() && !stopping_) {
+                local_worker_ = thread(&RequestEngine::run_local, this);
+            }
+            local_queue_.push_back(request);
+            local_cv_.notify_one();
+            return request;
+        }
+        {
+            lock_guard<mutex> guard(queue_mutex_);
+            if (!worker_.joinable() && !stopping_) {
+                worker_ = thread(&RequestEngine::run, this);
+            }
+            incoming_.push_back(request);
+        }
+        wakeup();
+        return request;
+    }
+
+    void wakeup() {
+        if (multi_) curl_multi_wakeup(multi_);
+    }
+
+    // Cancels everything still running; must run before ConnectionPool::shutdown()
+    void shutdown() {
+        {
+            lock_guard<mutex> guard(queue_mutex_);
+            stopping_ = true;
+        }
+        wakeup();
+        if (worker_.joinable()) worker_.join();
+        {
+            lock_guard<mutex> guard(local_mutex_);
+            for (auto& request : local_queue_) request->cancel_requested_ = true;
+        }
+        local_cv_.notify_all();
+        if (local_worker_.joinable()) local_worker_.join();
+        if (multi_) {
+            curl_multi_cleanup(multi_);
+            multi_ = nullptr;
+        }
+    }
+
+private:
+    RequestEngine() : multi_(curl_multi_init()) {}
+
+    // One HTTP exchange of a request; a routed request may have several over its life
+    struct Transfer {
+        shared_ptr<PendingRequest> request;
+        CURL* curl = nullptr;
+        string url;
+        bool routed = false;
+        string error_body; // Body of a retryable error response, kept back in case no other backend answers
+    };
+
+    // Worth another backend: overloaded or broken, as opposed to a bad request
+    static bool retryable_status(long status) { return status == 429 || status >= 500; }
+
+    static size_t write_callback(char* data, size_t size, size_t nmemb, void* userdata) {
+        auto* transfer = static_cast<Transfer*>(userdata);
+        PendingRequest* request = transfer->request.get();
+        size_t total_size = size * nmemb;
+        if (request->cancel_requested_) return 0; // Aborts the transfer
+        if (request->winner_ != transfer->curl) {
+            if (request->winner_) return 0; // A hedged twin answered first
+            long status = 0;
+            curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+            if (transfer->routed && retryable_status(status)) {
+                transfer->error_body.append(data, total_size);
+                return total_size;
+            }
+            request->winner_ = transfer->curl;
+            if (!accepts_content_type(request->spec_, transfer->curl)) return 0;
+        }
+        if (request->spec_.on_data) {
+            return request->spec_.on_data(data, total_size) ? total_size : 0;
+        }
+        request->result_.body.append(data, total_size);
+        return total_size;
+    }
+
+    // Whether the response's Content-Type is one `spec` accepts; a missing header passes
+    static bool accepts_content_type(const RequestSpec& spec, CURL* curl) {
+        if (spec.content_types.empty()) return true;
+        char* header = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &header);
+        return !header || content_type_matches(header, spec.content_types);
+    }
+
+    void start(const shared_ptr<PendingRequest>& request) {
+        if (request->spec_.url != BACKEND_POOL_URL) {
+            if (!launch(request, request->spec_.url, false)) finish(request, CURLE_FAILED_INIT);
+        } else if (!route(request)) {
+            request->result_.message = "No chat backend is available";
+            finish(request, CURLE_COULDNT_CONNECT);
+        }
+    }
+
+    // Starts an attempt on the next backend the pool picks for `request`
+    bool route(const shared_ptr<PendingRequest>& request) {
+        string url = BackendPool::instance().acquire(request->tried_, request->tried_.empty() ? request->spec_.affinity : "");
+        if (url.empty()) return false;
+        request->tried_.push_back(url);
+        if (launch(request, url, true)) return true;
+        BackendPool::instance().release(url, nullopt, -1);
+        return false;
+    }
+
+    bool launch(const shared_ptr<PendingRequest>& request, const string& url, bool routed) {
+        const RequestSpec& spec = request->spec_;
+        CURL* curl = ConnectionPool::instance().acquire(url);
+        if (!curl) return false;
+        if (!request->header_list_) {
+            for (const string& header : spec.headers) {
+                request->header_list_ = curl_slist_append(request->header_list_, header.c_str());
+            }
+        }
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        if (request->header_list_) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request->header_list_);
+        if (!spec.body.empty()) {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, spec.body.c_str());
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)spec.body.size());
+        }
+        if (spec.timeout_ms > 0) curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, spec.timeout_ms);
+        if (spec.follow_redirects) {
+            curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+            curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, ""); // Whatever compression curl can decode
+        }
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0");
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        Transfer& transfer = active_[curl]; // Map nodes are stable, so curl can keep a pointer
+        transfer.request = request;
+        transfer.curl = curl;
+        transfer.url = url;
+        transfer.routed = routed;
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer);
+        request->transfers_.push_back(curl);
+        curl_multi_add_handle(multi_, curl);
+        return true;
+    }
+
+    // Removes one transfer and tells the pool how its backend did
+    void detach(CURL* curl, optional<bool> healthy) {
+        auto it = active_.find(curl);
+        if (it == active_.end()) return;
+        Transfer& transfer = it->second;
+        if (transfer.routed) {
+            curl_off_t first_byte = 0;
+            curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+            BackendPool::instance().release(transfer.url, healthy, first_byte > 0 ? first_byte / 1000.0 : -1);
+        }
+        curl_multi_remove_handle(multi_, curl);
+        ConnectionPool::instance().release(transfer.url, curl);
+        vector<CURL*>& transfers = transfer.request->transfers_;
+        transfers.erase(remove(transfers.begin(), transfers.end(), curl), transfers.end());
+        active_.erase(it);
+    }
+
+    // A transfer ended. Failures before any byte was delivered move on to another backend
+    // while the failover budget lasts; everything else finishes the request.
+    void complete(CURL* curl, CURLcode code) {
+        auto it = active_.find(curl);
+        if (it == active_.end()) return;
+        Transfer& transfer = it->second;
+        shared_ptr<PendingRequest> request = transfer.request;
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        bool failed = code != CURLE_OK || (transfer.routed && retryable_status(status));
+
+        if (request->winner_ && request->winner_ != curl) return detach(curl, nullopt); // Lost a hedge race
+        if (!failed || request->winner_ == curl) return finish(request, code, curl, !failed);
+        if (request->transfers_.size() > 1) return detach(curl, false); // The hedged twin may still answer
+        if (transfer.routed && !request->cancel_requested_ &&
+            request->tried_.size() <= BackendPool::instance().failover() && route(request)) {
+            return detach(curl, false);
+        }
+        if (!request->spec_.on_data) request->result_.body = move(transfer.error_body);
+        finish(request, code, curl, false);
+    }
+
+    // Cumulative CURLINFO timestamps turned into per-phase durations
+    static void record_timing(CURL* curl, RequestTiming& timing) {
+        curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_off_t download = 0, upload = 0;
+        long header_size = 0, request_size = 0;
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &download);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &upload);
+        curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+        curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+        auto ms = [](curl_off_t us) { return max<curl_off_t>(us, 0) / 1000.0; };
+        timing.network = true;
+        timing.dns_ms = ms(namelookup);
+        timing.connect_ms = ms(connect - namelookup);
+        timing.tls_ms = appconnect > 0 ? ms(appconnect - connect) : 0;
+        timing.ttfb_ms = starttransfer > 0 ? ms(starttransfer - pretransfer) : 0;
+        if (total > 0) timing.total_ms = ms(total);
+        timing.bytes_in = download + header_size;
+        timing.bytes_out = upload + request_size;
+    }
+
+    // Completes `request`, taking status and timing from the `source` transfer and
+    // detaching whatever transfers are left
+    void finish(const shared_ptr<PendingRequest>& request, CURLcode code, CURL* source = nullptr,
+                optional<bool> healthy = nullopt) {
+        if (request->done_) return;
+        HttpResult& result = request->result_;
+        result.curl_code = code;
+        result.cancelled = request->cancel_requested_;
+        double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - request->submitted_).count();
+        result.timing.total_ms = elapsed_ms;
+        result.endpoint = request->spec_.url;
+        if (source) {
+            curl_easy_getinfo(source, CURLINFO_RESPONSE_CODE, &result.status);
+            char* content_type = nullptr;
+            curl_easy_getinfo(source, CURLINFO_CONTENT_TYPE, &content_type);
+            if (content_type) result.content_type = content_type;
+            record_timing(source, result.timing);
+            result.endpoint = active_[source].url;
+        }
+        if (request->tried_.size() > 1) result.timing.total_ms = elapsed_ms; // Failover or hedging: more than one transfer
+        for (CURL* curl : vector<CURL*>(request->transfers_)) detach(curl, curl == source ? healthy : nullopt);
+        curl_slist_free_all(request->header_list_);
+        request->header_list_ = nullptr;
+
+        Metrics::instance().record_request(request->spec_.metric, result);
+        if (request->spec_.on_complete) request->spec_.on_complete(result);
+        {
+            lock_guard<mutex> guard(request->mutex_);
+            request->done_ = true;
+        }
+        request->cv_.notify_all();
+    }
+
+    void run() {
+        while (true) {
+            vector<shared_ptr<PendingRequest>> incoming;
+            bool stopping;
+            {
+                lock_guard<mutex> guard(queue_mutex_);
+                incoming.swap(incoming_);
+                stopping = stopping_;
+            }
+            for (auto& request : incoming) {
+                if (request->cancel_requested_ || stopping) {
+                    request->cancel_requested_ = true;
+                    finish(request, CURLE_ABORTED_BY_CALLBACK);
+                } else {
+                    start(request);
+                }
+            }
+
+            // Cancelled transfers are dropped right away instead of waiting for their next write,
+            // and so are hedged twins that lost the race
+            vector<shared_ptr<PendingRequest>> cancelled;
+            vector<CURL*> losers;
+            vector<shared_ptr<PendingRequest>> hedges;
+            auto now = chrono::steady_clock::now();
+            auto hedge_after = chrono::milliseconds(BackendPool::instance().hedge_after_ms());
+            long wait_ms = 1000;
+            for (auto& [curl, transfer] : active_) {
+                PendingRequest& request = *transfer.request;
+                if (request.cancel_requested_ || stopping) {
+                    cancelled.push_back(transfer.request);
+                } else if (request.winner_ && request.winner_ != curl) {
+                    losers.push_back(curl);
+                } else if (transfer.routed && hedge_after.count() > 0 && !request.winner_ && !request.hedged_) {
+                    // Nothing received yet: past the deadline, race a second backend
+                    auto left = request.submitted_ + hedge_after - now;
+                    if (left <= chrono::milliseconds::zero()) {
+                        request.hedged_ = true;
+                        hedges.push_back(transfer.request);
+                    } else {
+                        wait_ms = min<long>(wait_ms, chrono::duration_cast<chrono::milliseconds>(left).count() + 1);
+                    }
+                }
+            }
+            for (auto& request : cancelled) {
+                request->cancel_requested_ = true;
+                CURL* source = request->winner_ ? request->winner_ : request->transfers_.empty() ? nullptr : request->transfers_.front();
+                finish(request, CURLE_ABORTED_BY_CALLBACK, source);
+            }
+            for (CURL* curl : losers) detach(curl, nullopt);
+            for (auto& request : hedges) route(request);
+            if (stopping) return;
+
+            // Health probes go through the engine like any request; on_complete reports back
+            for (auto& [url, health_url] : BackendPool::instance().due_health_checks()) {
+                auto probe = make_shared<PendingRequest>();
+                probe->spec_.url = health_url;
+                probe->spec_.timeout_ms = 2000;
+                probe->spec_.metric = "health";
+                probe->spec_.on_complete = [url = url](const HttpResult& result) { BackendPool::instance().record_health(url, result); };
+                probe->submitted_ = now;
+                start(probe);
+            }
+
+            int running = 0;
+            curl_multi_perform(multi_, &running);
+
+            CURLMsg* message;
+            int queued;
+            while ((message = curl_multi_info_read(multi_, &queued))) {
+                if (message->msg == CURLMSG_DONE) complete(message->easy_handle, message->data.result);
+            }
+
+            curl_multi_poll(multi_, nullptr, 0, static_cast<int>(wait_ms), nullptr);
+        }
+    }
+
+    // Serves LOCAL_BACKEND_URL requests one at a time, shaping the output exactly like an
+    // OpenAI-compatible server (SSE deltas when "stream" is set) so callers cannot tell.
+    void run_local() {
+        while (true) {
+            shared_ptr<PendingRequest> request;
+            {
+                unique_lock<mutex> lock(local_mutex_);
+                local_cv_.wait(lock, [this] { return stopping_ || !local_queue_.empty(); });
+                if (local_queue_.empty()) return;
+                request = local_queue_.front();
+                local_queue_.pop_front();
+            }
+
+            HttpResult& result = request->result_;
+            const RequestSpec& spec = request->spec_;
+            auto deliver = [&](const string& data) {
+                if (spec.on_data) return spec.on_data(data.data(), data.size());
+                result.body += data;
+                return true;
+            };
+
+            if (!request->cancel_requested_ && !stopping_) {
+                try {
+                    json body = json::parse(spec.body);
+                    bool stream = body.value("stream", false);
+                    string content;
+                    json usage;
+                    auto emit = [&](const string& piece) {
+                        if (request->cancel_requested_ || stopping_) return false;
+                        if (!stream) {
+                            content += piece;
+                            return true;
+                        }
+                        json event = {{"choices", {{{"delta", {{"content", piece}}}}}}};
+                        return deliver("data: " + event.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n");
+                    };
+                    if (LlamaBackend::instance().complete(body, emit, usage, result.message)) {
+                        result.status = 200;
+                        if (stream) {
+                            json last = {{"choices", {{{"delta", json::object()}, {"finish_reason", "stop"}}}}, {"usage", usage}};
+                            deliver("data: " + last.dump() + "\n\ndata: [DONE]\n\n");
+                        } else {
+                            json response = {
+                                {"choices", {{{"message", {{"role", "assistant"}, {"content", content}}}}}},
+                                {"usage", usage}
+                            };
+                            deliver(response.dump(-1, ' ', false, json::error_handler_t::replace));
+                        }
+                    } else {
+                        result.status = 500;
+                    }
+                } catch (const json::exception& e) {
+                    result.status = 400;
+                    result.message = string("Invalid request: ") + e.what();
+                }
+            }
+            finish(request, CURLE_OK);
+        }
+    }
+
+    CURLM* multi_ = nullptr;
+    thread worker_;
+    thread local_worker_;
+    mutex local_mutex_;
+    condition_variable local_cv_;
+    deque<shared_ptr<PendingRequest>> local_queue_;
+    mutex queue_mutex_;
+    vector<shared_ptr<PendingRequest>> incoming_;
+    map<CURL*, Transfer> active_;
+    bool stopping_ = false;
+};
+
+void PendingRequest::cancel() {
+    cancel_requested_ = true;
+    if (remote_id_) return DaemonClient::instance().cancel(remote_id_);
+    RequestEngine::instance().wakeup();
+}
+
+// Ctrl-C cancels the foreground request instead of killing the process
+atomic<bool> interrupt_requested{false};
+atomic<int> foreground_requests{0};
+
+void handle_sigint(int) {
+    if (foreground_requests.load() > 0) {
+        interrupt_requested = true;
+    } else {
+        signal(SIGINT, SIG_DFL);
+        raise(SIGINT);
+    }
+}
+
+// Read-only view of one value inside a JSON document, for pulling a few fields out of
+// replies without building an nlohmann DOM. parse() checks the document's structure once;
+// lookups then scan forward, skipping only the siblings in the way, and a value's end is
+// found only when it is read, so nested lookups never rescan what they descend into.
+// Strings are decoded on request (UTF-8 is passed through unchecked). A missing field, a
+// wrong type or malformed input gives an invalid view (or false) rather than an exception.
+class JsonView {
+public:
+    JsonView() = default;
+
+    // Whole document; invalid unless `text` is exactly one well-formed JSON value
+    static JsonView parse(string_view text) {
+        size_t begin = skip_space(text, 0);
+        size_t end = skip_value(text, begin, 0);
+        if (end == string_view::npos || skip_space(text, end) != text.size()) return {};
+        return JsonView(text.substr(begin, end - begin));
+    }
+
+    bool valid() const { return !text_.empty(); }
+    bool is_object() const { return valid() && text_[0] == '{'; }
+    bool is_array() const { return valid() && text_[0] == '['; }
+    bool is_string() const { return valid() && text_[0] == '"'; }
+    bool is_number() const { return valid() && (text_[0] == '-' || (text_[0] >= '0' && text_[0] <= '9')); }
+    bool is_null() const { return text_.substr(0, 4) == "null"; }
+
+    // The value's exact source text, e.g. to hand a small sub-object to nlohmann
+    string_view raw() const { return valid() ? text_.substr(0, skip_value(text_, 0, 0)) : string_view(); }
+
+    // The value as nlohmann json; null if invalid or if a string in it is malformed, since
+    // only the structure is checked here
+    json to_json() const {
+        json value = json::parse(raw(), nullptr, false);
+        return value.is_discarded() ? json() : value;
+    }
+
+    // Object member; invalid if this is not an object or has no such key
+    JsonView operator[](string_view key) const {
+        JsonView found;
+        if (!is_object()) return found;
+        for_each_member([&](string_view name, JsonView value) {
+            if (!key_equals(name, key)) return true;
+            found = value;
+            return false;
+        });
+        return found;
+    }
+
+    // Array element; invalid if this is not an array or is too short
+    JsonView operator[](size_t index) const {
+        JsonView found;
+        if (!is_array()) return found;
+        size_t i = 0;
+        for_each([&](JsonView value) {
+            if (i++ != index) return true;
+            found = value;
+            return false;
+        });
+        return found;
+    }
+
+    // Calls f(element) for each array element until it returns false
+    template <typename F>
+    void for_each(F f) const {
+        if (!is_array()) return;
+        size_t i = skip_space(text_, 1);
+        while (i < text_.size() && text_[i] != ']') {
+            if (!f(JsonView(text_.substr(i)))) return;
+            i = skip_space(text_, skip_value(text_, i, 0));
+            if (i < text_.size() && text_[i] == ',') i = skip_space(text_, i + 1);
+        }
+    }
+
+    // Calls f(raw_key, value) for each object member until it returns false; the key
+    // keeps its escapes, without the quotes
+    template <typename F>
+    void for_each_member(F f) const {
+        if (!is_object()) return;
+        size_t i = skip_space(text_, 1);
+        while (i < text_.size() && text_[i] == '"') {
+            size_t key_end = skip_string(text_, i);
+            string_view name = text_.substr(i + 1, key_end - i - 2);
+            size_t value = skip_space(text_, skip_space(text_, key_end) + 1); // Past the ':'
+            if (!f(name, JsonView(text_.substr(value)))) return;
+            i = skip_space(text_, skip_value(text_, value, 0));
+            if (i < text_.size() && text_[i] == ',') i = skip_space(text_, i + 1);
+        }
+    }
+
+    // Decodes a string value into `out`; false if this is not a string
+    bool get(string& out) const {
+        out.clear();
+        return is_string() && append_string(out);
+    }
+
+    // Appends a decoded string value to `out`, e.g. to assemble streamed deltas in place
+    bool append_string(string& out) const {
+        if (!is_string()) return false;
+        string_view body = text_.substr(1, skip_string(text_, 0) - 2);
+        size_t i = 0;
+        while (i < body.size()) {
+            size_t escape = body.find('\\', i);
+            if (escape == string_view::npos) escape = body.size();
+            out.append(body.data() + i, escape - i);
+            if (escape == body.size()) break;
+            if (escape + 1 >= body.size()) return false;
+            char c = body[escape + 1];
+            i = escape + 2;
+            switch (c) {
+                case '"': out += '"'; break;
+                case '\\': out += '\\'; break;
+                case '/': out += '/'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'u': {
+                    uint32_t code_point;
+                    if (!read_hex4(body, i, code_point)) return false;
+                    i += 4;
+                    if (code_point >= 0xD800 && code_point < 0xDC00) { // High surrogate; the low half follows
+                        uint32_t low;
+                        if (i + 6 > body.size() || body[i] != '\\' || body[i + 1] != 'u' || !read_hex4(body, i + 2, low) ||
+                            low < 0xDC00 || low >= 0xE000) {
+                            return false;
+                        }
+                        code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+                        i += 6;
+                    }
+                    append_utf8(out, code_point);
+                    break;
+                }
+                default: return false;
+            }
+        }
+        return true;
+    }
+
+    // String value, or `fallback` if missing or of another type
+    string string_or(const string& fallback) const {
+        string value;
+        return get(value) ? value : fallback;
+    }
+
+    // Integral value, or `fallback` if missing, not a number or out of range
+    long integer_or(long fallback) const {
+        if (!is_number()) return fallback;
+        string_view number = raw();
+        long value = 0;
+        auto [end, error] = from_chars(number.data(), number.data() + number.size(), value);
+        if (error != errc() || end != number.data() + number.size()) {
+            double real = strtod(string(number).c_str(), nullptr); // "12.0" or "1e3"
+            const double limit = -static_cast<double>(numeric_limits<long>::min()); // 2^63, exact
+            if (!(real >= -limit && real < limit)) return fallback; // Out of range, or NaN
+            if (real != static_cast<long>(real)) return fallback;
+            return static_cast<long>(real);
+        }
+        return value;
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 256; // Deeper documents are rejected rather than recursed into
+
+    // `text` starts at the value and may run on past its end
+    explicit JsonView(string_view text) : text_(text) {}
+
+    static size_t skip_space(string_view text, size_t i) {
+        while (i < text.size() && (text[i] == ' ' || text[i] == '\n' || text[i] == '\r' || text[i] == '\t')) i++;
+        return i;
+    }
+
+    // End of the string starting at the quote at `i`, or npos if unterminated
+    static size_t skip_string(string_view text, size_t i) {
+        for (i++;; i++) {
+            const void* quote = memchr(text.data() + i, '"', text.size() - i);
+            if (!quote) return string_view::npos;
+            i = static_cast<const char*>(quote) - text.data();
+            size_t backslashes = 0;
+            while (text[i - 1 - backslashes] == '\\') backslashes++;
+            if (backslashes % 2 == 0) return i + 1;
+        }
+    }
+
+    // End of the value starting at `i`, or npos if it is malformed or truncated
+    static size_t skip_value(string_view text, size_t i, int depth) {
+        if (i >= text.size()) return string_view::npos;
+        char c = text[i];
+        if (c == '"') return skip_string(text, i);
+        if (c == '{' || c == '[') {
+            if (depth >= MAX_DEPTH) return string_view::npos;
+            char close = c == '{' ? '}' : ']';
+            i = skip_space(text, i + 1);
+            if (i < text.size() && text[i] == close) return i + 1;
+            while (true) {
+                if (c == '{') {
+                    if (i >= text.size() || text[i] != '"') return string_view::npos;
+                    i = skip_string(text, i);
+                    if (i == string_view::npos) return i;
+                    i = skip_space(text, i);
+                    if (i >= text.size() || text[i] != ':') return string_view::npos;
+                    i = skip_space(text, i + 1);
+                }
+                i = skip_value(text, i, depth + 1);
+                if (i == string_view::npos) return i;
+                i = skip_space(text, i);
+                if (i >= text.size()) return string_view::npos;
+                if (text[i] == close) return i + 1;
+                if (text[i] != ',') return string_view::npos;
+                i = skip_space(text, i + 1);
+            }
+        }
+        string_view literal = c == 't' ? "true" : c == 'f' ? "false" : c == 'n' ? "null" : "";
+        if (!literal.empty()) return text.substr(i, literal.size()) == literal ? i + literal.size() : string_view::npos;
+        // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+        auto digits = [&](size_t& k) {
+            size_t first = k;
+            while (k < text.size() && text[k] >= '0' && text[k] <= '9') k++;
+            return k > first;
+        };
+        size_t end = i;
+        if (end < text.size() && text[end] == '-') end++;
+        if (end < text.size() && text[end] == '0') end++;
+        else if (!digits(end)) return string_view::npos;
+        if (end < text.size() && text[end] == '.' && !digits(++end)) return string_view::npos;
+        if (end < text.size() && (text[end] == 'e' || text[end] == 'E')) {
+            end++;
+            if (end < text.size() && (text[end] == '+' || text[end] == '-')) end++;
+            if (!digits(end)) return string_view::npos;
+        }
+        return end;
+    }
+
+    static bool key_equals(string_view raw_key, string_view key) {
+        if (raw_key.find('\\') == string_view::npos) return raw_key == key;
+        string decoded;
+        string quoted = "\"" + string(raw_key) + "\"";
+        return JsonView(quoted).get(decoded) && decoded == key;
+    }
+
+    static bool read_hex4(string_view text, size_t i, uint32_t& value) {
+        if (i + 4 > text.size()) return false;
+        auto [end, error] = from_chars(text.data() + i, text.data() + i + 4, value, 16);
+        return error == errc() && end == text.data() + i + 4;
+    }
+
+    static void append_utf8(string& out, uint32_t code_point) {
+        if (code_point < 0x80) {
+            out += static_cast<char>(code_point);
+        } else if (code_point < 0x800) {
+            out += static_cast<char>(0xC0 | (code_point >> 6));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            out += static_cast<char>(0xE0 | (code_point >> 12));
+            out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (code_point >> 18));
+            out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code_point & 0x3F));
+        }
+    }
+
+    string_view text_; // From the value's first byte to the end of the document
+};
+
+// Incremental parser state for OpenAI-style server-sent events ("data: {...}" / "data: [DONE]").
+// Fed from the request engine thread while the renderer animates the spinner.
+struct StreamState {
+    string label;                     // Printed once before the first token, e.g. "AI"
+    string line_buffer;               // Bytes received but not yet terminated by a newline
+    string raw;                       // Body kept verbatim until the first event, for non-SSE replies
+    string content;                   // Reply assembled from the delta chunks
+    json usage;                       // Usage block, if the server sends one with the last chunk
+    json timings;                     // llama.cpp server: prompt/cache token counts of the last chunk
+    long id_slot = -1;                // llama.cpp server: slot that served the request, when reported
+    bool saw_event = false;
+    bool done = false;
+    bool echo = true;                 // Print tokens; off for headless callers such as benchmarks
+    atomic<bool> started{false};      // Set with the first token
+    chrono::steady_clock::time_point first_token_at;
+};
+
+void stream_begin_output(StreamState& state) {
+    if (state.started) return;
+    state.started = true;
+    Renderer::instance().write(COLOR_CYAN + state.label + " >>> ");
+}
+
+void process_sse_line(StreamState& state, string_view line) {
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.compare(0, 5, "data:") != 0) return; // Comments, "event:" and blank separators
+    state.saw_event = true;
+    state.raw.clear();
+
+    size_t start = line.find_first_not_of(' ', 5);
+    if (start == string_view::npos) return;
+    string_view data = line.substr(start);
+    if (data == "[DONE]") {
+        state.done = true;
+        return;
+    }
+
+    // Most chunks carry one delta; only the rare usage/timings objects are turned into json
+    JsonView chunk = JsonView::parse(data);
+    if (!chunk.is_object()) {
+        Renderer::instance().error(COLOR_RED + "\nStream parse error: invalid JSON in event" + COLOR_RESET + "\n");
+        return;
+    }
+    JsonView content;
+    chunk.for_each_member([&](string_view key, JsonView value) {
+        if (key == "choices") content = value[0]["delta"]["content"];
+        else if (key == "usage" && value.is_object()) state.usage = value.to_json();
+        else if (key == "timings" && value.is_object()) state.timings = value.to_json();
+        else if (key == "id_slot") state.id_slot = value.integer_or(-1);
+        return true;
+    });
+    if (!content.is_string() || content.raw().size() == 2) return; // Role-only or empty delta
+    if (!state.started) state.first_token_at = chrono::steady_clock::now();
+    size_t piece_start = state.content.size();
+    content.append_string(state.content);
+    if (!state.echo) {
+        state.started = true;
+        return;
+    }
+    stream_begin_output(state);
+    Renderer::instance().write(string_view(state.content).substr(piece_start));
+}
+
+// Feeds received bytes to the SSE parser; complete lines are handled as they arrive
+void stream_feed(StreamState& state, const char* data, size_t length) {
+    if (!state.saw_event) state.raw.append(data, length);
+    state.line_buffer.append(data, length);
+
+    size_t line_start = 0;
+    size_t newline;
+    while ((newline = state.line_buffer.find('\n', line_start)) != string::npos) {
+        process_sse_line(state, string_view(state.line_buffer).substr(line_start, newline - line_start));
+        line_start = newline + 1;
+    }
+    state.line_buffer.erase(0, line_start);
+}
+
+// Blocks the REPL until `request` completes with a spinner on the renderer until the first
+// streamed text replaces it. Ctrl-C cancels the request; returns false then.
+bool wait_for_request(PendingRequest& request, const string& message, const string& color) {
+    Renderer::instance().start_spinner(message, color);
+    interrupt_requested = false;
+    foreground_requests++;
+    while (!request.wait_for(chrono::milliseconds(50))) {
+        if (interrupt_requested.exchange(false)) {
+            request.cancel();
+            request.wait();
+            break;
+        }
+    }
+    foreground_requests--;
+    Renderer::instance().stop_spinner();
+
+    if (request.result().cancelled) {
+        cout << COLOR_ALERT << "\nRequest cancelled." << COLOR_RESET << endl;
+        return false;
+    }
+    return true;
+}
+
+// JSON utilities
+json load_json_file(const string& file_path) {
+    ifstream file(file_path);
+    if (!file.is_open()) return {};
+    json data;
+    file >> data;
+    return data;
+}
+
+void save_json_file(const string& file_path, const json& data) {
+    ofstream file(file_path);
+    if (!file.is_open()) {
+        cerr << COLOR_RED << "Error: Unable to save file " << file_path << COLOR_RESET << endl;
+        return;
+    }
+    file << data.dump(4);
+    file.close();
+}
+
+// 64-bit FNV-1a hash
+uint64_t fnv1a64(string_view data, uint64_t seed = 14695981039346656037ULL) {
+    uint64_t hash = seed;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Config from its config.json form; missing keys keep their defaults
+Config config_from_json(const json& config_data) {
+    Config config;
+    if (!config_data.is_object()) return config;
+    config.server_url = config_data.value("server_url", config.server_url);
+    config.max_tokens = config_data.value("max_tokens", config.max_tokens);
+    config.temperature = config_data.value("temperature", config.temperature);
+    config.debug_mode = config_data.value("debug_mode", config.debug_mode);
+    config.search_engine = static_cast<SearchEngine>(config_data.value("search_engine", static_cast<int>(config.search_engine)));
+    config.stream = config_data.value("stream", config.stream);
+    config.context_tokens = config_data.value("context_tokens", config.context_tokens);
+    config.keep_recent_messages = config_data.value("keep_recent_messages", config.keep_recent_messages);
+    config.journal_fsync_every = config_data.value("journal_fsync_every", config.journal_fsync_every);
+    config.journal_fsync_ms = config_data.value("journal_fsync_ms", config.journal_fsync_ms);
+    config.journal_max_messages = config_data.value("journal_max_messages", config.journal_max_messages);
+    config.cache_enabled = config_data.value("cache_enabled", config.cache_enabled);
+    config.cache_dir = config_data.value("cache_dir", config.cache_dir);
+    config.cache_memory_mb = config_data.value("cache_memory_mb", config.cache_memory_mb);
+    config.cache_disk_mb = config_data.value("cache_disk_mb", config.cache_disk_mb);
+    config.nsfw_mode = config_data.value("nsfw_mode", config.nsfw_mode);
+    config.search_engines = config_data.value("search_engines", config.search_engines);
+    config.search_endpoints = config_data.value("search_endpoints", config.search_endpoints);
+    config.bing_api_key = config_data.value("bing_api_key", config.bing_api_key);
+    config.google_api_key = config_data.value("google_api_key", config.google_api_key);
+    config.google_cx = config_data.value("google_cx", config.google_cx);
+    config.search_deadline_ms = config_data.value("search_deadline_ms", config.search_deadline_ms);
+    config.search_grace_ms = config_data.value("search_grace_ms", config.search_grace_ms);
+    config.search_cache_ttl = config_data.value("search_cache_ttl", config.search_cache_ttl);
+    config.search_fetch_pages = config_data.value("search_fetch_pages", config.search_fetch_pages);
+    config.search_fetch_timeout_ms = config_data.value("search_fetch_timeout_ms", config.search_fetch_timeout_ms);
+    config.search_fetch_max_kb = config_data.value("search_fetch_max_kb", config.search_fetch_max_kb);
+    config.search_context_tokens = config_data.value("search_context_tokens", config.search_context_tokens);
+    config.backend = config_data.value("backend", config.backend);
+    config.model_path = config_data.value("model_path", config.model_path);
+    config.threads = config_data.value("threads", config.threads);
+    config.batch_concurrency = config_data.value("batch_concurrency", config.batch_concurrency);
+    config.batch_retries = config_data.value("batch_retries", config.batch_retries);
+    config.metrics_file = config_data.value("metrics_file", config.metrics_file);
+    config.metrics_format = config_data.value("metrics_format", config.metrics_format);
+    config.record_file = config_data.value("record_file", config.record_file);
+    config.exec_timeout_ms = config_data.value("exec_timeout_ms", config.exec_timeout_ms);
+    config.exec_max_running = config_data.value("exec_max_running", config.exec_max_running);
+    config.exec_head_kb = config_data.value("exec_head_kb", config.exec_head_kb);
+    config.exec_tail_kb = config_data.value("exec_tail_kb", config.exec_tail_kb);
+    config.backends = config_data.value("backends", config.backends);
+    config.backend_routing = config_data.value("backend_routing", config.backend_routing);
+    config.backend_failover = config_data.value("backend_failover", config.backend_failover);
+    config.hedge_after_ms = config_data.value("hedge_after_ms", config.hedge_after_ms);
+    config.health_check_ms = config_data.value("health_check_ms", config.health_check_ms);
+    config.cache_prompt = config_data.value("cache_prompt", config.cache_prompt);
+    config.slot_id = config_data.value("slot_id", config.slot_id);
+    config.slot_save = config_data.value("slot_save", config.slot_save);
+    config.tokenizer_path = config_data.value("tokenizer_path", config.tokenizer_path);
+    config.embeddings_url = config_data.value("embeddings_url", config.embeddings_url);
+    config.rag_chunk_tokens = config_data.value("rag_chunk_tokens", config.rag_chunk_tokens);
+    config.rag_chunk_overlap = config_data.value("rag_chunk_overlap", config.rag_chunk_overlap);
+    config.rag_top_k = config_data.value("rag_top_k", config.rag_top_k);
+    config.rag_probe = config_data.value("rag_probe", config.rag_probe);
+    return config;
+}
+
+// Every field, so saving never drops settings
+json config_to_json(const Config& config) {
+    return {
+        {"server_url", config.server_url},
+        {"max_tokens", config.max_tokens},
+        {"temperature", config.temperature},
+        {"debug_mode", config.debug_mode},
+        {"search_engine", static_cast<int>(config.search_engine)},
+        {"stream", config.stream},
+        {"context_tokens", config.context_tokens},
+        {"keep_recent_messages", config.keep_recent_messages},
+        {"journal_fsync_every", config.journal_fsync_every},
+        {"journal_fsync_ms", config.journal_fsync_ms},
+        {"journal_max_messages", config.journal_max_messages},
+        {"cache_enabled", config.cache_enabled},
+        {"cache_dir", config.cache_dir},
+        {"cache_memory_mb", config.cache_memory_mb},
+        {"cache_disk_mb", config.cache_disk_mb},
+        {"search_engines", config.search_engines},
+        {"search_endpoints", config.search_endpoints},
+        {"search_deadline_ms", config.search_deadline_ms},
+        {"search_grace_ms", config.search_grace_ms},
+        {"search_cache_ttl", config.search_cache_ttl},
+        {"search_fetch_pages", config.search_fetch_pages},
+        {"search_fetch_timeout_ms", config.search_fetch_timeout_ms},
+        {"search_fetch_max_kb", config.search_fetch_max_kb},
+        {"search_context_tokens", config.search_context_tokens},
+        {"backend", config.backend},
+        {"model_path", config.model_path},
+        {"threads", config.threads},
+        {"batch_concurrency", config.batch_concurrency},
+        {"batch_retries", config.batch_retries},
+        {"metrics_file", config.metrics_file},
+        {"metrics_format", config.metrics_format},
+        {"record_file", config.record_file},
+        {"exec_timeout_ms", config.exec_timeout_ms},
+        {"exec_max_running", config.exec_max_running},
+        {"exec_head_kb", config.exec_head_kb},
+        {"exec_tail_kb", config.exec_tail_kb},
+        {"backends", config.backends},
+        {"backend_routing", config.backend_routing},
+        {"backend_failover", config.backend_failover},
+        {"hedge_after_ms", config.hedge_after_ms},
+        {"health_check_ms", config.health_check_ms},
+        {"cache_prompt", config.cache_prompt},
+        {"slot_id", config.slot_id},
+        {"slot_save", config.slot_save},
+        {"tokenizer_path", config.tokenizer_path},
+        {"embeddings_url", config.embeddings_url},
+        {"rag_chunk_tokens", config.rag_chunk_tokens},
+        {"rag_chunk_overlap", config.rag_chunk_overlap},
+        {"rag_top_k", config.rag_top_k},
+        {"rag_probe", config.rag_probe},
+        {"nsfw_mode", config.nsfw_mode},
+        {"bing_api_key", config.bing_api_key},
+        {"google_api_key", config.google_api_key},
+        {"google_cx", config.google_cx}
+    };
+}
+
+// Load and save configuration
+Config load_config() {
+    json config_data = load_json_file(CONFIG_FILE);
+    if (config_data.is_null()) {
+        Config config;
+        save_json_file(CONFIG_FILE, config_to_json(config));
+        return config;
+    }
+    return config_from_json(config_data);
+}
+
+// Holds the live configuration as an immutable snapshot. Readers take a shared_ptr once
+// per command and keep using that snapshot, so a request or search never sees a half-
+// applied change; writers build a new Config and swap the pointer (read-copy-update).
+// A watcher thread reloads config.json when it changes on disk; update() persists the
+// complete config, replacing the file atomically so the watcher never reads it torn.
+class ConfigStore {
+public:
+    static ConfigStore& instance() {
+        static ConfigStore store;
+        return store;
+    }
+
+    ~ConfigStore() { stop_watching(); }
+
+    void load(const string& path) {
+        path_ = path;
+        publish(load_config());
+    }
+
+    shared_ptr<const Config> current() const { return atomic_load(&current_); }
+
+    // Bumped by every publish, so callers can tell when to re-apply settings
+    uint64_t version() const { return version_.load(); }
+
+    // Applies `change` to a copy of the current snapshot, publishes and saves it
+    void update(const function<void(Config&)>& change) {
+        lock_guard<mutex> guard(write_mutex_);
+        Config next = current()->clone();
+        change(next);
+        string text = config_to_json(next).dump(4);
+        publish(move(next));
+
+        string temp_path = path_ + ".tmp";
+        {
+            ofstream file(temp_path, ios::trunc);
+            if (!file.is_open()) {
+                Renderer::instance().error(COLOR_RED + "Error: Unable to save file " + path_ + COLOR_RESET + "\n");
+                return;
+            }
+            file << text;
+        }
+        error_code ec;
+        filesystem::rename(temp_path, path_, ec);
+        if (ec) {
+            Renderer::instance().error(COLOR_RED + "Error: Unable to save file " + path_ + ": " + ec.message() + COLOR_RESET + "\n");
+            return;
+        }
+        last_written_ = text;
+    }
+
+    // Reloads the file whenever it is written or replaced
+    void watch() {
+        if (watcher_.joinable()) return;
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) return;
+        filesystem::path file(path_);
+        string dir = file.has_parent_path() ? file.parent_path().string() : ".";
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            ::close(fd);
+            return;
+        }
+        stopping_ = false;
+        watcher_ = thread(&ConfigStore::run_watcher, this, fd, file.filename().string());
+    }
+
+    void stop_watching() {
+        stopping_ = true;
+        if (watcher_.joinable()) watcher_.join();
+    }
+
+private:
+    ConfigStore() : current_(make_shared<const Config>()) {}
+
+    void publish(Config config) {
+        atomic_store(&current_, shared_ptr<const Config>(make_shared<const Config>(move(config))));
+        version_++;
+    }
+
+    void reload() {
+        ifstream file(path_);
+        string text((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        lock_guard<mutex> guard(write_mutex_);
+        if (text == last_written_) return; // Our own update()
+        json config_data = json::parse(text, nullptr, false);
+        if (config_data.is_discarded() || !config_data.is_object()) {
+            // Editors save in steps; keep the current snapshot until the file parses
+            Renderer::instance().error(COLOR_ALERT + "\n" + path_ + " is not valid JSON; keeping the current settings" + COLOR_RESET + "\n");
+            return;
+        }
+        optional<Config> next;
+        try {
+            next.emplace(config_from_json(config_data));
+        } catch (const json::exception& e) {
+            // A wrongly typed value, say "max_tokens": "1000"
+            Renderer::instance().error(COLOR_ALERT + "\n" + path_ + ": " + e.what() + "; keeping the current settings" + COLOR_RESET + "\n");
+            return;
+        }
+        publish(move(*next));
+        last_written_ = text;
+    }
+
+    void run_watcher(int fd, string name) {
+        alignas(inotify_event) char buffer[4096];
+        while (!stopping_) {
+            pollfd descriptor = {fd, POLLIN, 0};
+            if (::poll(&descriptor, 1, 250) <= 0) continue;
+            bool changed = false;
+            ssize_t length;
+            while ((length = ::read(fd, buffer, sizeof(buffer))) > 0) {
+                for (ssize_t offset = 0; offset < length;) {
+                    const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                    offset += sizeof(inotify_event) + event->len;
+                    if (event->len > 0 && name == event->name) changed = true;
+                }
+            }
+            if (changed) reload();
+        }
+        ::close(fd);
+    }
+
+    string path_ = CONFIG_FILE;
+    shared_ptr<const Config> current_; // Only accessed through atomic_load/atomic_store
+    atomic<uint64_t> version_{0};
+    mutex write_mutex_;                // Serializes update() and reload()
+    string last_written_;
+    thread watcher_;
+    atomic<bool> stopping_{false};
+};
+// Read-only memory mapping of a whole file; pages are loaded lazily by the kernel
+class MappedFile {
+public:
+    explicit MappedFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                data_ = static_cast<const char*>(mapping);
+                size_ = st.st_size;
+            }
+        }
+        ::close(fd);
+    }
+    ~MappedFile() {
+        if (data_) munmap(const_cast<char*>(data_), size_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Token counts for sizing requests, from the model's own vocabulary: a Hugging Face
+// tokenizer.json or the tokenizer embedded in a GGUF file, byte-level BPE (GPT-2, Llama 3,
+// Qwen) or SentencePiece-style BPE (Llama 2). Text is split the way the model's
+// pre-tokenizer regex would, then every distinct piece is merged once and its count
+// cached by hash, so counting is a single pass of table lookups. The vocabulary loads on
+// a background thread; until then, and without one, counts fall back to ~4 bytes a token.
+class Tokenizer {
+public:
+    static constexpr int MESSAGE_OVERHEAD = 4; // Role and delimiter tokens of the chat template
+
+    static Tokenizer& instance() {
+        static Tokenizer tokenizer;
+        return tokenizer;
+    }
+
+    ~Tokenizer() {
+        if (loader_.joinable()) loader_.join();
+    }
+
+    // Loads tokenizer_path, or the GGUF model of the llama.cpp backend, when it changed
+    void configure(const Config& config) {
+        string path = config.tokenizer_path;
+        if (path.empty() && config.backend == "llama.cpp") path = config.model_path;
+        lock_guard<mutex> guard(load_mutex_);
+        if (path == path_) return;
+        path_ = path;
+        if (loader_.joinable()) loader_.join();
+        if (path.empty()) {
+            publish(nullptr);
+            return;
+        }
+        loader_ = thread([this, path, debug = config.debug_mode] {
+            string error;
+            auto started = chrono::steady_clock::now();
+            shared_ptr<Vocabulary> vocabulary = load(path, error);
+            if (!vocabulary) {
+                Renderer::instance().error(COLOR_RED + "Error: Tokenizer " + path + ": " + error + COLOR_RESET + "\n");
+            } else if (debug) {
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+                Renderer::instance().write(COLOR_YELLOW + "Tokenizer: " + to_string(vocabulary->size) + " tokens, " +
+                                           to_string(vocabulary->merges.size()) + " merges from " + path + " in " +
+                                           to_string(static_cast<int>(ms)) + " ms" + COLOR_RESET + "\n");
+            }
+            publish(vocabulary);
+        });
+    }
+
+    // True once a vocabulary is in use; counts are estimates until then
+    bool exact() const { return atomic_load(&vocabulary_) != nullptr; }
+
+    // Bumped whenever the vocabulary changes, so cached counts can be recomputed
+    uint64_t generation() const { return generation_.load(); }
+
+    // Blocks until a pending load has finished (for benchmarks)
+    void wait_loaded() {
+        lock_guard<mutex> guard(load_mutex_);
+        if (loader_.joinable()) loader_.join();
+    }
+
+    int count(string_view text) {
+        shared_ptr<const Vocabulary> vocabulary = atomic_load(&vocabulary_);
+        if (!vocabulary) return static_cast<int>((text.size() + 3) / 4);
+        lock_guard<mutex> guard(mutex_);
+        if (cache_generation_ != generation_) {
+            clear_cache();
+            cache_generation_ = generation_;
+        }
+        // Lines are counted and cached whole: a line break followed by a word (or, for
+        // SentencePiece, a word followed by a line break) is always a pre-token boundary
+        int total = 0;
+        for (size_t i = 0; i < text.size();) {
+            size_t end = i;
+            while (true) {
+                const void* newline = memchr(text.data() + end, '\n', text.size() - end);
+                if (!newline) {
+                    end = text.size();
+                    break;
+                }
+                end = static_cast<const char*>(newline) - text.data();
+                if (vocabulary->byte_level && end + 1 < text.size() && !is_space(text[end + 1])) {
+                    end++;
+                    break;
+                }
+                if (!vocabulary->byte_level && end > i && !is_space(text[end - 1])) break;
+                end++;
+            }
+            total += count_line(*vocabulary, text.substr(i, end - i), i == 0);
+            i = end;
+        }
+        return total;
+    }
+
+    int count_message(string_view content) { return count(content) + MESSAGE_OVERHEAD; }
+
+private:
+    struct Vocabulary {
+        bool byte_level = true;   // GPT-2 byte-to-unicode tokens; otherwise SentencePiece '▁' with <0xXX> fallback
+        bool llama3_split = false; // Llama 3 style pre-tokenizer: any one symbol may lead a word
+        int digit_group = 0;      // Most digits per pre-token; 0 for any number
+        size_t size = 0;
+        unordered_map<uint64_t, int> ids;                  // fnv1a64 of the token's bytes -> id
+        int byte_ids[256];                                 // Token of each single byte, -1 if none
+        int space_id = -1;                                 // SentencePiece '▁'
+        vector<int> unknown_lengths;                       // Bytes of ids size + k: characters outside the vocabulary that still merge
+        unordered_map<uint64_t, pair<int, int>> merges;    // (left << 32 | right) -> (rank, merged id)
+    };
+
+    Tokenizer() = default;
+
+    void publish(shared_ptr<const Vocabulary> vocabulary) {
+        atomic_store(&vocabulary_, move(vocabulary));
+        generation_++;
+    }
+
+    enum CharClass : uint8_t { LETTER = 1, DIGIT = 2, SPACE = 4, NEWLINE = 8 };
+
+    static constexpr array<uint8_t, 256> CHAR_CLASSES = [] {
+        array<uint8_t, 256> table{};
+        for (int b = 0; b < 256; b++) {
+            bool alpha = (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z');
+            if (alpha || b >= 0x80) table[b] = LETTER; // Non-ASCII counts as letters
+            else if (b >= '0' && b <= '9') table[b] = DIGIT;
+            else if (b == ' ' || (b >= '\t' && b <= '\r')) table[b] = SPACE | (b == '\n' || b == '\r' ? NEWLINE : 0);
+        }
+        return table;
+    }();
+
+    static uint8_t char_class(unsigned char c) { return CHAR_CLASSES[c]; }
+    static bool is_letter(unsigned char c) { return char_class(c) & LETTER; }
+    static bool is_digit(unsigned char c) { return char_class(c) & DIGIT; }
+    static bool is_space(unsigned char c) { return char_class(c) & SPACE; }
+    static bool is_newline(unsigned char c) { return char_class(c) & NEWLINE; }
+    static bool is_symbol(unsigned char c) { return char_class(c) == 0; }
+
+    // End of the pre-token starting at `i`, following the GPT-2 and Llama 3 split regexes
+    static size_t next_piece(const Vocabulary& vocabulary, string_view text, size_t i) {
+        size_t n = text.size();
+        auto at = [&](size_t k) { return static_cast<unsigned char>(text[k]); };
+        // 's 't 're 've 'm 'll 'd
+        if (at(i) == '\'' && i + 1 < n) {
+            auto lower = [&](size_t k) { return k < n ? (vocabulary.llama3_split ? tolower(at(k)) : at(k)) : 0; };
+            int c1 = lower(i + 1), c2 = lower(i + 2);
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') return i + 2;
+            if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) return i + 3;
+        }
+        size_t j = i;
+        if (vocabulary.llama3_split ? !is_letter(at(i)) && !is_digit(at(i)) && !is_newline(at(i))
+                                    : at(i) == ' ') {
+            if (i + 1 < n && is_letter(at(i + 1))) j = i + 1; // One leading symbol or space joins the word
+        }
+        if (is_letter(at(j))) {
+            while (j < n && is_letter(at(j))) j++;
+            return j;
+        }
+        j = i;
+        if (!vocabulary.llama3_split && at(i) == ' ' && i + 1 < n && is_digit(at(i + 1))) j = i + 1;
+        if (is_digit(at(j))) {
+            size_t limit = vocabulary.digit_group > 0 ? j + vocabulary.digit_group : n;
+            while (j < n && j < limit && is_digit(at(j))) j++;
+            return j;
+        }
+        j = i;
+        if (at(i) == ' ' && i + 1 < n && is_symbol(at(i + 1))) j = i + 1;
+        if (is_symbol(at(j))) {
+            while (j < n && is_symbol(at(j))) j++;
+            if (vocabulary.llama3_split) {
+                while (j < n && is_newline(at(j))) j++;
+            }
+            return j;
+        }
+        // Whitespace: up to the last newline (Llama 3), else all but the space that leads the next word
+        size_t end = i;
+        while (end < n && is_space(at(end))) end++;
+        if (vocabulary.llama3_split) {
+            size_t last_newline = end;
+            while (last_newline > i && !is_newline(at(last_newline - 1))) last_newline--;
+            if (last_newline > i) return last_newline;
+        }
+        if (end == n || end - i == 1) return end;
+        return end - 1;
+    }
+
+    int count_line(const Vocabulary& vocabulary, string_view line, bool first) {
+        uint64_t key = hash_line(line, first) | 1;
+        size_t slot = find_slot(key);
+        if (cache_[slot].first == key) return cache_[slot].second;
+        int count = vocabulary.byte_level ? count_byte_level(vocabulary, line) : count_sentencepiece(vocabulary, line, first);
+        insert(find_slot(key), key, count); // The slot may have moved if the cache grew
+        return count;
+    }
+
+    // Word-at-a-time hash for lines; pieces use fnv1a64 to match the vocabulary's keys
+    static uint64_t hash_line(string_view line, bool first) {
+        uint64_t hash = (first ? 0x2545F4914F6CDD1DULL : 0) ^ (line.size() * 0x9E3779B97F4A7C15ULL);
+        size_t i = 0;
+        for (; i + 8 <= line.size(); i += 8) {
+            uint64_t word;
+            memcpy(&word, line.data() + i, 8);
+            hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+            hash ^= hash >> 29;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, line.data() + i, line.size() - i);
+        hash = (hash ^ tail) * 0x94D049BB133111EBULL;
+        return hash ^ (hash >> 32);
+    }
+
+    int count_byte_level(const Vocabulary& vocabulary, string_view text) {
+        int total = 0;
+        for (size_t i = 0; i < text.size();) {
+            size_t end = next_piece(vocabulary, text, i);
+            total += count_piece(vocabulary, text.substr(i, end - i), false);
+            i = end;
+        }
+        return total;
+    }
+
+    // SentencePiece: spaces become '▁' and the text gets one leading '▁'. There is no
+    // pre-tokenizer, so pieces are cut only where merges do not reach across: a run of
+    // whitespace stays with the word after it, never with the one before.
+    int count_sentencepiece(const Vocabulary& vocabulary, string_view text, bool first) {
+        int total = 0;
+        for (size_t i = 0; i < text.size();) {
+            size_t end = i;
+            while (end < text.size() && is_space(text[end])) end++;
+            while (end < text.size() && !is_space(text[end])) end++;
+            total += count_piece(vocabulary, text.substr(i, end - i), first && i == 0);
+            i = end;
+        }
+        return total;
+    }
+
+    int count_piece(const Vocabulary& vocabulary, string_view piece, bool leading_space) {
+        uint64_t hash = fnv1a64(piece, leading_space ? 0x9E3779B97F4A7C15ULL : 14695981039346656037ULL);
+        uint64_t key = hash | 1;
+        size_t slot = find_slot(key);
+        if (cache_[slot].first == key) return cache_[slot].second;
+
+        int count;
+        auto token = vocabulary.ids.find(hash);
+        if (!leading_space && token != vocabulary.ids.end() && token->second < static_cast<int>(vocabulary.size)) {
+            count = 1; // Whole piece is a token, the common case for words
+        } else {
+            count = merge(vocabulary, piece, leading_space);
+        }
+        insert(slot, key, count);
+        return count;
+    }
+
+    // Applies BPE merges, lowest rank first, to the piece's characters
+    int merge(const Vocabulary& vocabulary, string_view piece, bool leading_space) {
+        vector<int>& symbols = symbols_;
+        symbols.clear();
+        if (vocabulary.byte_level) {
+            for (unsigned char c : piece) symbols.push_back(vocabulary.byte_ids[c]);
+        } else {
+            if (leading_space) symbols.push_back(vocabulary.space_id);
+            for (size_t i = 0; i < piece.size();) {
+                unsigned char lead = piece[i];
+                size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+                length = min(length, piece.size() - i);
+                if (lead == ' ') {
+                    symbols.push_back(vocabulary.space_id);
+                } else {
+                    auto it = vocabulary.ids.find(fnv1a64(piece.substr(i, length)));
+                    if (it != vocabulary.ids.end()) {
+                        symbols.push_back(it->second);
+                    } else {
+                        for (size_t k = 0; k < length; k++) symbols.push_back(vocabulary.byte_ids[static_cast<unsigned char>(piece[i + k])]);
+                    }
+                }
+                i += length;
+            }
+        }
+
+        while (symbols.size() > 1) {
+            int best_rank = INT32_MAX, best_id = -1;
+            size_t best_at = 0;
+            for (size_t k = 0; k + 1 < symbols.size(); k++) {
+                if (symbols[k] < 0 || symbols[k + 1] < 0) continue;
+                auto it = vocabulary.merges.find(static_cast<uint64_t>(symbols[k]) << 32 | static_cast<uint32_t>(symbols[k + 1]));
+                if (it != vocabulary.merges.end() && it->second.first < best_rank) {
+                    best_rank = it->second.first;
+                    best_id = it->second.second;
+                    best_at = k;
+                }
+            }
+            if (best_id < 0) break;
+            symbols[best_at] = best_id;
+            symbols.erase(symbols.begin() + best_at + 1);
+        }
+        int count = 0;
+        for (int id : symbols) {
+            count += id < static_cast<int>(vocabulary.size) ? 1 : vocabulary.unknown_lengths[id - vocabulary.size];
+        }
+        return count;
+    }
+
+    // GPT-2 maps every byte to a printable code point so tokens are valid text; this undoes it
+    static string decode_byte_level(const string& token) {
+        static const array<int, 512> byte_of = [] {
+            array<int, 512> table;
+            table.fill(-1);
+            int next = 256;
+            for (int b = 0; b < 256; b++) {
+                bool printable = (b >= 33 && b <= 126) || (b >= 161 && b <= 172) || (b >= 174 && b <= 255);
+                table[printable ? b : next++] = b;
+            }
+            return table;
+        }();
+        string bytes;
+        for (size_t i = 0; i < token.size();) {
+            unsigned char lead = token[i];
+            int code_point = lead;
+            size_t length = 1;
+            if (lead >= 0xC0 && lead < 0xE0 && i + 1 < token.size()) {
+                code_point = ((lead & 0x1F) << 6) | (token[i + 1] & 0x3F);
+                length = 2;
+            }
+            if (code_point >= 512 || byte_of[code_point] < 0) return token; // Not byte-level (e.g. a special token)
+            bytes += static_cast<char>(byte_of[code_point]);
+            i += length;
+        }
+        return bytes;
+    }
+
+    // Fills ids, byte_ids and merges from token strings and "left right" merge rules; with
+    // no merge rules (SentencePiece GGUF) they are derived from the token scores instead
+    static void index(Vocabulary& vocabulary, const vector<string>& tokens, const vector<string>& merges,
+                      const vector<float>& scores) {
+        vocabulary.size = tokens.size();
+        fill(begin(vocabulary.byte_ids), end(vocabulary.byte_ids), -1);
+        vector<string> bytes(tokens.size());
+        for (size_t id = 0; id < tokens.size(); id++) {
+            bytes[id] = vocabulary.byte_level ? decode_byte_level(tokens[id]) : tokens[id];
+            vocabulary.ids.emplace(fnv1a64(bytes[id]), static_cast<int>(id));
+            if (bytes[id].size() == 1) {
+                vocabulary.byte_ids[static_cast<unsigned char>(bytes[id][0])] = static_cast<int>(id);
+            }
+        }
+        auto id_of = [&](const string& token) {
+            auto it = vocabulary.ids.find(fnv1a64(token));
+            return it == vocabulary.ids.end() ? -1 : it->second;
+        };
+        if (!vocabulary.byte_level) {
+            const string space = "\xE2\x96\x81"; // ▁
+            vocabulary.space_id = id_of(space);
+            for (int b = 0; b < 256; b++) { // Byte fallback pieces
+                char name[8];
+                snprintf(name, sizeof(name), "<0x%02X>", b);
+                int id = id_of(name);
+                if (id >= 0) vocabulary.byte_ids[b] = id;
+            }
+        }
+
+        auto add_merge = [&](const string& left, const string& right, int rank) {
+            int left_id = id_of(left), right_id = id_of(right), merged_id = id_of(left + right);
+            if (left_id < 0 || right_id < 0 || merged_id < 0) return;
+            uint64_t key = static_cast<uint64_t>(left_id) << 32 | static_cast<uint32_t>(right_id);
+            vocabulary.merges.emplace(key, make_pair(rank, merged_id));
+        };
+        vocabulary.merges.reserve(merges.size());
+        for (size_t rank = 0; rank < merges.size(); rank++) {
+            size_t split = merges[rank].find(' ', 1);
+            if (split == string::npos) continue;
+            string left = merges[rank].substr(0, split), right = merges[rank].substr(split + 1);
+            if (vocabulary.byte_level) {
+                left = decode_byte_level(left);
+                right = decode_byte_level(right);
+            }
+            add_merge(left, right, static_cast<int>(rank));
+        }
+        if (merges.empty() && scores.size() == tokens.size()) {
+            // SentencePiece BPE merges the pair whose result scores highest. A character missing
+            // from the vocabulary still merges into a longer token, so it gets an id of its own.
+            auto add_unknown = [&](const string& piece) {
+                unsigned char lead = piece[0];
+                size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+                if (piece.size() != length || id_of(piece) >= 0) return;
+                vocabulary.ids.emplace(fnv1a64(piece), static_cast<int>(vocabulary.size + vocabulary.unknown_lengths.size()));
+                vocabulary.unknown_lengths.push_back(static_cast<int>(length));
+            };
+            vector<int> order(tokens.size());
+            iota(order.begin(), order.end(), 0);
+            sort(order.begin(), order.end(), [&](int a, int b) { return scores[a] > scores[b]; });
+            for (size_t rank = 0; rank < order.size(); rank++) {
+                const string& token = bytes[order[rank]];
+                for (size_t split = 1; split < token.size(); split++) {
+                    if ((static_cast<unsigned char>(token[split]) & 0xC0) == 0x80) continue; // Inside a character
+                    add_unknown(token.substr(0, split));
+                    add_unknown(token.substr(split));
+                    add_merge(token.substr(0, split), token.substr(split), static_cast<int>(rank));
+                }
+            }
+        }
+    }
+
+    static shared_ptr<Vocabulary> load(const string& path, string& error) {
+        MappedFile file(path);
+        if (!file.data()) {
+            error = "cannot read the file";
+            return nullptr;
+        }
+        if (file.size() >= 4 && memcmp(file.data(), "GGUF", 4) == 0) return load_gguf(file, error);
+        return load_tokenizer_json(file, error);
+    }
+
+    static shared_ptr<Vocabulary> load_tokenizer_json(const MappedFile& file, string& error) {
+        json document = json::parse(file.data(), file.data() + file.size(), nullptr, false);
+        if (!document.is_object() || !document.contains("model") || !document["model"].contains("vocab") ||
+            !document["model"]["vocab"].is_object()) {
+            error = "not a tokenizer.json with a model vocabulary";
+            return nullptr;
+        }
+        const json& model = document["model"];
+        if (model.contains("type") && model["type"] != "BPE") {
+            error = "only BPE tokenizers are supported";
+            return nullptr;
+        }
+        auto vocabulary = make_shared<Vocabulary>();
+        string pre_tokenizer = document.value("pre_tokenizer", json()).dump();
+        vocabulary->byte_level = pre_tokenizer.find("ByteLevel") != string::npos;
+        vocabulary->llama3_split = pre_tokenizer.find("[^\\\\r\\\\n\\\\p{L}\\\\p{N}]?\\\\p{L}+") != string::npos;
+        if (pre_tokenizer.find("\\\\p{N}{1,3}") != string::npos) vocabulary->digit_group = 3;
+        else if (vocabulary->llama3_split) vocabulary->digit_group = 1;
+
+        vector<string> tokens(model["vocab"].size());
+        for (const auto& [token, id] : model["vocab"].items()) {
+            // Ids past the vocabulary are added tokens, but never this far past it
+            if (!id.is_number_unsigned() || id.get<uint64_t>() > tokens.size() + (1u << 20)) {
+                error = "vocabulary entry \"" + token + "\" has an invalid id";
+                return nullptr;
+            }
+            size_t index = id.get<size_t>();
+            if (index >= tokens.size()) tokens.resize(index + 1);
+            tokens[index] = token;
+        }
+        vector<string> merges;
+        const json& rules = model.contains("merges") ? model["merges"] : json::array();
+        if (!rules.is_array()) {
+            error = "model merges are not a list";
+            return nullptr;
+        }
+        for (const auto& rule : rules) {
+            if (rule.is_string()) {
+                merges.push_back(rule.get<string>());
+            } else if (rule.is_array() && rule.size() == 2 && rule[0].is_string() && rule[1].is_string()) {
+                merges.push_back(rule[0].get<string>() + " " + rule[1].get<string>());
+            } else {
+                error = "malformed merge rule " + rule.dump();
+                return nullptr;
+            }
+        }
+        index(*vocabulary, tokens, merges, {});
+        return vocabulary;
+    }
+
+    // Reads the tokenizer.ggml.* metadata of a GGUF file; tensors are never touched
+    static shared_ptr<Vocabulary> load_gguf(const MappedFile& file, string& error) {
+        const char* cursor = file.data() + 4;
+        const char* end = file.data() + file.size();
+        bool ok = true;
+        auto read = [&](auto& value) {
+            if (static_cast<size_t>(end - cursor) < sizeof(value)) {
+                ok = false;
+                return;
+            }
+            memcpy(&value, cursor, sizeof(value));
+            cursor += sizeof(value);
+        };
+        auto read_string = [&]() {
+            uint64_t length = 0;
+            read(length);
+            if (!ok || length > static_cast<uint64_t>(end - cursor)) {
+                ok = false;
+                return string();
+            }
+            string value(cursor, length);
+            cursor += length;
+            return value;
+        };
+        static const size_t scalar_size[] = {1, 1, 2, 2, 4, 4, 4, 1, 0, 0, 8, 8, 8};
+        function<void(uint32_t)> skip = [&](uint32_t type) {
+            if (type == 8) {
+                read_string();
+            } else if (type == 9) {
+                uint32_t item_type = 0;
+                uint64_t count = 0;
+                read(item_type);
+                read(count);
+                if (item_type != 8 && item_type != 9 && item_type < 13) {
+                    if (count > static_cast<uint64_t>(end - cursor) / scalar_size[item_type]) ok = false;
+                    else cursor += count * scalar_size[item_type];
+                } else {
+                    for (uint64_t i = 0; ok && i < count; i++) skip(item_type);
+                }
+            } else if (type < 13) {
+                if (scalar_size[type] > static_cast<size_t>(end - cursor)) ok = false;
+                else cursor += scalar_size[type];
+            } else {
+                ok = false;
+            }
+        };
+
+        uint32_t version = 0;
+        uint64_t tensor_count = 0, kv_count = 0;
+        read(version);
+        read(tensor_count);
+        read(kv_count);
+        string model, pre;
+        vector<string> tokens, merges;
+        vector<float> scores;
+        for (uint64_t i = 0; ok && i < kv_count; i++) {
+            string key = read_string();
+            uint32_t type = 0;
+            read(type);
+            if (key == "tokenizer.ggml.model" && type == 8) {
+                model = read_string();
+            } else if (key == "tokenizer.ggml.pre" && type == 8) {
+                pre = read_string();
+            } else if ((key == "tokenizer.ggml.tokens" || key == "tokenizer.ggml.merges" || key == "tokenizer.ggml.scores") && type == 9) {
+                uint32_t item_type = 0;
+                uint64_t count = 0;
+                read(item_type);
+                read(count);
+                if (item_type == 8) {
+                    vector<string>& target = key == "tokenizer.ggml.tokens" ? tokens : merges;
+                    for (uint64_t k = 0; ok && k < count; k++) target.push_back(read_string());
+                } else if (item_type == 6 && count <= static_cast<uint64_t>(end - cursor) / 4) {
+                    scores.resize(count);
+                    memcpy(scores.data(), cursor, count * 4);
+                    cursor += count * 4;
+                } else {
+                    ok = false;
+                }
+            } else {
+                skip(type);
+            }
+        }
+        if (!ok || version < 2) {
+            error = "damaged or unsupported GGUF file";
+            return nullptr;
+        }
+        if (tokens.empty() || (model != "gpt2" && model != "llama")) {
+            error = model.empty() ? "no tokenizer in the GGUF metadata" : "unsupported tokenizer model \"" + model + "\"";
+            return nullptr;
+        }
+        auto vocabulary = make_shared<Vocabulary>();
+        vocabulary->byte_level = model == "gpt2";
+        vocabulary->llama3_split = pre.find("llama") != string::npos || pre == "qwen2" || pre == "smaug-bpe";
+        vocabulary->digit_group = pre == "qwen2" ? 1 : vocabulary->llama3_split ? 3 : 0;
+        index(*vocabulary, tokens, merges, scores);
+        return vocabulary;
+    }
+
+    // Cache slot holding `key`, or the free slot where it belongs (keys are never 0)
+    size_t find_slot(uint64_t key) const {
+        size_t slot = key & (cache_.size() - 1);
+        while (cache_[slot].first != 0 && cache_[slot].first != key) slot = (slot + 1) & (cache_.size() - 1);
+        return slot;
+    }
+
+    void insert(size_t slot, uint64_t key, int count) {
+        cache_[slot] = {key, count};
+        if (++cache_used_ * 2 > cache_.size()) {
+            if (cache_.size() >= CACHE_LIMIT) clear_cache();
+            else grow_cache();
+        }
+    }
+
+    void clear_cache() {
+        cache_.assign(CACHE_INITIAL, {0, 0});
+        cache_used_ = 0;
+    }
+
+    void grow_cache() {
+        vector<pair<uint64_t, int>> old(cache_.size() * 2, {0, 0});
+        old.swap(cache_);
+        for (const auto& entry : old) {
+            if (entry.first == 0) continue;
+            size_t slot = entry.first & (cache_.size() - 1);
+            while (cache_[slot].first != 0) slot = (slot + 1) & (cache_.size() - 1);
+            cache_[slot] = entry;
+        }
+    }
+
+    static constexpr size_t CACHE_INITIAL = 1 << 12;
+    static constexpr size_t CACHE_LIMIT = 1 << 20; // Slots; cleared rather than grown past this
+
+    mutex load_mutex_;
+    string path_;
+    thread loader_;
+    shared_ptr<const Vocabulary> vocabulary_; // Only accessed through atomic_load/atomic_store
+    atomic<uint64_t> generation_{0};
+    mutex mutex_;                             // Guards the cache and scratch space
+    vector<pair<uint64_t, int>> cache_ = vector<pair<uint64_t, int>>(CACHE_INITIAL, {0, 0}); // Open addressing: line or pre-token hash -> token count
+    size_t cache_used_ = 0;
+    uint64_t cache_generation_ = 0;
+    vector<int> symbols_;
+};
+
+// Serializes one chat message as a JSON object
+string serialize_message(string_view role, string_view content) {
+    json message = {{"role", role}, {"content", content}};
+    return message.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+// Compact conversation history. Roles are interned, contents live in one contiguous
+// buffer, and every message is serialized to JSON exactly once when appended, so any
+// contiguous range of the `messages` array is produced by copying already-serialized bytes.
+class MessageStore {
+public:
+    // Called after every append with the new message's index (e.g. to journal it)
+    void set_observer(function<void(const MessageStore&, size_t)> observer) {
+        observer_ = move(observer);
+    }
+
+    void append(string_view role, string_view content, bool notify = true) {
+        Entry entry;
+        entry.role = intern_role(role);
+        entry.content_offset = contents_.size();
+        entry.content_length = content.size();
+        entry.json_offset = serialized_.size();
+        contents_.append(content);
+        serialized_ += serialize_message(role, content);
+        entry.json_length = serialized_.size() - entry.json_offset;
+        serialized_ += ',';
+        entry.tokens = Tokenizer::instance().count_message(content);
+        entry.tokenizer_generation = Tokenizer::instance().generation();
+        entries_.push_back(entry);
+        if (notify && observer_) observer_(*this, entries_.size() - 1);
+    }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    // Views stay valid until the next append()
+    string_view role(size_t i) const { return roles_[entries_[i].role]; }
+    string_view content(size_t i) const {
+        return string_view(contents_).substr(entries_[i].content_offset, entries_[i].content_length);
+    }
+    string_view serialized(size_t i) const {
+        return string_view(serialized_).substr(entries_[i].json_offset, entries_[i].json_length);
+    }
+    // Recounted lazily when the tokenizer's vocabulary changed since the message was counted
+    int tokens(size_t i) const {
+        const Entry& entry = entries_[i];
+        uint64_t generation = Tokenizer::instance().generation();
+        if (entry.tokenizer_generation != generation) {
+            entry.tokens = Tokenizer::instance().count_message(content(i));
+            entry.tokenizer_generation = generation;
+        }
+        return entry.tokens;
+    }
+
+    // Appends messages [first, last) as comma-separated JSON objects with one copy
+    void append_serialized(string& out, size_t first, size_t last) const {
+        if (first >= last) return;
+        size_t begin = entries_[first].json_offset;
+        size_t end = entries_[last - 1].json_offset + entries_[last - 1].json_length;
+        out.append(serialized_, begin, end - begin);
+    }
+
+    json to_json(size_t i) const {
+        return {{"role", role(i)}, {"content", content(i)}};
+    }
+
+    vector<json> to_json() const {
+        vector<json> messages;
+        messages.reserve(entries_.size());
+        for (size_t i = 0; i < entries_.size(); i++) messages.push_back(to_json(i));
+        return messages;
+    }
+
+private:
+    struct Entry {
+        uint32_t role;
+        mutable int tokens;
+        mutable uint64_t tokenizer_generation;
+        size_t content_offset;
+        size_t content_length;
+        size_t json_offset;
+        size_t json_length;
+    };
+
+    uint32_t intern_role(string_view role) {
+        for (size_t i = 0; i < roles_.size(); i++) {
+            if (roles_[i] == role) return static_cast<uint32_t>(i);
+        }
+        roles_.emplace_back(role);
+        return static_cast<uint32_t>(roles_.size() - 1);
+    }
+
+    vector<string> roles_;
+    vector<Entry> entries_;
+    string contents_;
+    string serialized_;
+    function<void(const MessageStore&, size_t)> observer_;
+};
+
+// Where chat completions go: the in-process model, the backend pool or server_url
+string chat_endpoint(const Config& config) {
+    if (config.backend == "llama.cpp") return LOCAL_BACKEND_URL;
+    return config.backends.empty() ? config.server_url : BACKEND_POOL_URL;
+}
+
+// Builds the chat completion request around an already-serialized `messages` array
+// `max_tokens` overrides config.max_tokens when positive (e.g. clamped to the room left in the context).
+// A `slot` of 0 or more sends the request to that llama.cpp server slot (conversation turns).
+RequestSpec build_chat_request(const Config& config, const string& messages_json, bool stream, int max_tokens = 0, int slot = -1) {
+    json payload = {
+        {"model", "llama"},
+        {"max_tokens", max_tokens > 0 ? max_tokens : config.max_tokens},
+        {"temperature", config.temperature},
+        {"stream", stream},
+        {"cache_prompt", config.cache_prompt}, // llama.cpp server: reuse the KV cache of a shared prompt prefix
+        {"nsfw_mode", true} // Ensuring NSFW mode is enabled
+    };
+    if (slot >= 0) payload["id_slot"] = slot; // llama.cpp server: the slot holding the conversation
+    string fields = payload.dump();
+
+    RequestSpec spec;
+    spec.url = chat_endpoint(config);
+    spec.body.reserve(messages_json.size() + fields.size() + 16);
+    spec.body = "{\"messages\":";
+    spec.body += messages_json;
+    spec.body += ',';
+    spec.body.append(fields, 1, string::npos);
+    spec.headers = {"Content-Type: application/json"};
+    spec.metric = "chat";
+    return spec;
+}
+
+// Prompt size of a serialized `messages` array, counting each message's template overhead
+int count_prompt_tokens(const string& messages_json) {
+    JsonView messages = JsonView::parse(messages_json);
+    if (!messages.is_array()) return -1;
+    int tokens = 0;
+    string content;
+    messages.for_each([&](JsonView message) {
+        JsonView value = message["content"];
+        if (!value.get(content)) content = value.raw(); // Content parts are counted as their JSON
+        tokens += Tokenizer::instance().count_message(content);
+        return true;
+    });
+    return tokens;
+}
+
+struct CachedResponse {
+    string content;
+    json usage;
+    double latency_ms = 0; // What the original request cost, reported as saved time on hits
+};
+
+// Content-addressed response cache: an in-memory LRU tier in front of one file per
+// response under cache_dir, both size-limited. Keys hash the canonical request. With a
+// daemon running, its instance serves every terminal.
+class ResponseCache {
+public:
+    static ResponseCache& instance() {
+        static ResponseCache cache;
+        return cache;
+    }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        dir_ = config.cache_dir;
+        max_memory_bytes_ = static_cast<size_t>(config.cache_memory_mb) << 20;
+        max_disk_bytes_ = static_cast<size_t>(config.cache_disk_mb) << 20;
+        if (!config.cache_enabled) return;
+
+        error_code ec;
+        filesystem::create_directories(dir_, ec);
+        disk_entries_.clear();
+        disk_bytes_ = 0;
+        for (const auto& entry : filesystem::directory_iterator(dir_, ec)) {
+            if (entry.path().extension() != ".json") continue;
+            size_t size = entry.file_size(ec);
+            disk_entries_[entry.path().stem().string()] = {size, entry.last_write_time(ec)};
+            disk_bytes_ += size;
+        }
+    }
+
+    // Messages are already canonical: MessageStore serializes each one deterministically
+    static string key(const Config& config, const string& messages_json) {
+        string canonical = "llama\n" + to_string(config.max_tokens) + "\n" + to_string(config.temperature) + "\n" + messages_json;
+        char hex[33];
+        snprintf(hex, sizeof(hex), "%016llx%016llx",
+                 static_cast<unsigned long long>(fnv1a64(canonical)),
+                 static_cast<unsigned long long>(fnv1a64(canonical, 0x9E3779B97F4A7C15ULL)));
+        return hex;
+    }
+
+    bool get(const string& key, CachedResponse& response) {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "cache.get"}, {"key", key}}, reply)) {
+            if (!reply.value("hit", false)) return false;
+            response.content = reply.value("content", "");
+            response.usage = reply.value("usage", json());
+            response.latency_ms = reply.value("latency_ms", 0.0);
+            return true;
+        }
+        lock_guard<mutex> guard(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            response = it->second->second;
+            memory_hits_++;
+            saved_ms_ += response.latency_ms;
+            return true;
+        }
+
+        auto disk = disk_entries_.find(key);
+        if (disk != disk_entries_.end()) {
+            json entry = load_json_file(path_for(key));
+            if (entry.is_object() && entry.contains("content")) {
+                response.content = entry.value("content", "");
+                response.usage = entry.value("usage", json());
+                response.latency_ms = entry.value("latency_ms", 0.0);
+                error_code ec;
+                disk->second.mtime = filesystem::file_time_type::clock::now();
+                filesystem::last_write_time(path_for(key), disk->second.mtime, ec); // Recently used
+                insert_memory(key, response);
+                disk_hits_++;
+                saved_ms_ += response.latency_ms;
+                return true;
+            }
+        }
+        misses_++;
+        return false;
+    }
+
+    void put(const string& key, const CachedResponse& response) {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "cache.put"}, {"key", key}, {"content", response.content},
+                                           {"usage", response.usage}, {"latency_ms", response.latency_ms}}, reply)) {
+            return;
+        }
+        lock_guard<mutex> guard(mutex_);
+        insert_memory(key, response);
+
+        json entry = {{"content", response.content}, {"latency_ms", response.latency_ms}};
+        if (!response.usage.is_null()) entry["usage"] = response.usage;
+        string data = entry.dump(-1, ' ', false, json::error_handler_t::replace);
+        string path = path_for(key);
+        string temp_path = path + ".tmp";
+        {
+            ofstream file(temp_path, ios::binary | ios::trunc);
+            if (!file.is_open()) return;
+            file << data;
+        }
+        error_code ec;
+        filesystem::rename(temp_path, path, ec);
+        if (ec) return;
+
+        auto existing = disk_entries_.find(key);
+        if (existing != disk_entries_.end()) disk_bytes_ -= existing->second.size;
+        disk_entries_[key] = {data.size(), filesystem::file_time_type::clock::now()};
+        disk_bytes_ += data.size();
+        evict_disk();
+    }
+
+    json stats() const {
+        lock_guard<mutex> guard(mutex_);
+        return {{"memory_hits", memory_hits_}, {"disk_hits", disk_hits_}, {"misses", misses_}, {"saved_ms", saved_ms_},
+                {"memory_bytes", memory_bytes_}, {"disk_bytes", disk_bytes_}};
+    }
+
+    void print_stats() const {
+        json counts;
+        if (!DaemonClient::instance().call({{"op", "cache.stats"}}, counts)) counts = stats();
+        cout << COLOR_YELLOW << "Cache: " << counts.value("memory_hits", 0) << " memory hits, " << counts.value("disk_hits", 0)
+             << " disk hits, " << counts.value("misses", 0) << " misses, " << static_cast<long>(counts.value("saved_ms", 0.0))
+             << " ms of inference saved (" << (counts.value("memory_bytes", size_t{0}) >> 10) << " KiB in memory, "
+             << (counts.value("disk_bytes", size_t{0}) >> 10) << " KiB on disk)" << COLOR_RESET << endl;
+    }
+
+private:
+    struct DiskEntry {
+        size_t size;
+        filesystem::file_time_type mtime;
+    };
+
+    ResponseCache() = default;
+
+    string path_for(const string& key) const {
+        return (filesystem::path(dir_) / (key + ".json")).string();
+    }
+
+    static size_t footprint(const string& key, const CachedResponse& response) {
+        return key.size() + response.content.size() + 128;
+    }
+
+    void insert_memory(const string& key, const CachedResponse& response) {
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            memory_bytes_ -= footprint(key, it->second->second);
+            lru_.erase(it->second);
+        }
+        lru_.emplace_front(key, response);
+        index_[key] = lru_.begin();
+        memory_bytes_ += footprint(key, response);
+        while (memory_bytes_ > max_memory_bytes_ && lru_.size() > 1) {
+            memory_bytes_ -= footprint(lru_.back().first, lru_.back().second);
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+    }
+
+    // Least recently used files go first
+    void evict_disk() {
+        if (disk_bytes_ <= max_disk_bytes_) return;
+        vector<pair<filesystem::file_time_type, string>> by_age;
+        for (const auto& entry : disk_entries_) by_age.emplace_back(entry.second.mtime, entry.first);
+        sort(by_age.begin(), by_age.end());
+        for (const auto& entry : by_age) {
+            if (disk_bytes_ <= max_disk_bytes_ * 9 / 10) break;
+            error_code ec;
+            filesystem::remove(path_for(entry.second), ec);
+            disk_bytes_ -= disk_entries_[entry.second].size;
+            disk_entries_.erase(entry.second);
+        }
+    }
+
+    mutable mutex mutex_;
+    string dir_ = "cache/";
+    list<pair<string, CachedResponse>> lru_;
+    unordered_map<string, list<pair<string, CachedResponse>>::iterator> index_;
+    size_t memory_bytes_ = 0;
+    size_t max_memory_bytes_ = 64 << 20;
+    unordered_map<string, DiskEntry> disk_entries_;
+    size_t disk_bytes_ = 0;
+    size_t max_disk_bytes_ = 512 << 20;
+    size_t memory_hits_ = 0;
+    size_t disk_hits_ = 0;
+    size_t misses_ = 0;
+    double saved_ms_ = 0;
+};
+
+// Replays a cached reply through the same render path as a live one: in streaming mode
+// it is fed to the SSE parser as a sequence of delta events.
+string replay_cached_response(const Config& config, const CachedResponse& cached, const string& label) {
+    json response = {
+        {"choices", {{{"message", {{"role", "assistant"}, {"content", cached.content}}}}}}
+    };
+    if (!cached.usage.is_null()) response["usage"] = cached.usage;
+    if (!config.stream) return response.dump();
+
+    StreamState stream_state;
+    stream_state.label = label;
+    size_t start = 0;
+    while (start < cached.content.size()) {
+        size_t end = cached.content.find(' ', start + 1);
+        end = end == string::npos ? cached.content.size() : end;
+        json event = {{"choices", {{{"delta", {{"content", cached.content.substr(start, end - start)}}}}}}};
+        string line = "data: " + event.dump(-1, ' ', false, json::error_handler_t::replace) + "\n\n";
+        stream_feed(stream_state, line.data(), line.size());
+        start = end;
+    }
+    if (stream_state.started) Renderer::instance().write(COLOR_RESET + "\n");
+    Renderer::instance().flush();
+    return response.dump();
+}
+
+// Prompt tokens the server answered from its KV cache: llama.cpp server reports them as
+// timings.cache_n, OpenAI-style servers as usage.prompt_tokens_details.cached_tokens and
+// the in-process backend as usage.cached_tokens. -1 when the response does not say.
+long cached_prompt_tokens(JsonView response) {
+    long cached = response["timings"]["cache_n"].integer_or(-1);
+    if (cached >= 0) return cached;
+    JsonView usage = response["usage"];
+    JsonView details = usage["prompt_tokens_details"];
+    return details.is_object() ? details["cached_tokens"].integer_or(-1) : usage["cached_tokens"].integer_or(-1);
+}
+
+// Assistant text of a chat completion response. On failure `reply` holds the reason: the
+// server's own error message when it sent one, otherwise what was wrong with the reply.
+bool extract_reply(string_view body, string& reply) {
+    JsonView response = JsonView::parse(body);
+    if (!response.is_object()) {
+        reply = "Invalid response: not a JSON object";
+        return false;
+    }
+    if (response["choices"][0]["message"]["content"].get(reply)) return true;
+    JsonView error = response["error"];
+    reply = error.is_object() ? error["message"].string_or("Server error") : error.string_or("Invalid response: no message content");
+    return false;
+}
+
+// Keeps the conversation on one llama.cpp server slot, so the slot's KV cache still holds
+// the conversation prefix next turn and only the new messages are prefilled. Chat turns
+// carry the slot id and prefer the backend that served the previous turn. With slot_save
+// the slot is written to the server's --slot-save-path at exit and restored by
+// session:resume, so a resumed conversation does not start with a full prefill either.
+class SlotManager {
+public:
+    static SlotManager& instance() {
+        static SlotManager manager;
+        return manager;
+    }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        if (config.slot_id >= 0) slot_ = config.slot_id;
+        else if (pinned_) slot_ = -1; // Unpinned: learn the slot from the server again
+        pinned_ = config.slot_id >= 0;
+    }
+
+    // Slot for the next conversation turn's id_slot, or -1 to let the server choose
+    int slot() const {
+        lock_guard<mutex> guard(mutex_);
+        return slot_;
+    }
+
+    // Points a conversation turn at the backend of the previous one
+    void pin(RequestSpec& spec) const {
+        lock_guard<mutex> guard(mutex_);
+        spec.affinity = endpoint_;
+    }
+
+    // Learns the backend and, unless pinned, the slot from a finished turn
+    void observe(const HttpResult& result, const string& response_string) {
+        JsonView response = JsonView::parse(response_string);
+        lock_guard<mutex> guard(mutex_);
+        if (!result.endpoint.empty()) endpoint_ = result.endpoint;
+        if (!response.is_object()) return;
+        if (!pinned_ && response["id_slot"].is_number()) slot_ = static_cast<int>(response["id_slot"].integer_or(slot_));
+        long prompt_tokens = response["usage"]["prompt_tokens"].integer_or(-1);
+        last_cached_ = cached_prompt_tokens(response);
+        last_evaluated_ = prompt_tokens >= 0 && last_cached_ >= 0 ? prompt_tokens - last_cached_ : -1;
+    }
+
+    // Writes the slot's KV cache on the server and remembers where, for restore()
+    bool save(const Config& config) {
+        string endpoint;
+        int slot;
+        {
+            lock_guard<mutex> guard(mutex_);
+            endpoint = endpoint_;
+            slot = slot_;
+        }
+        if (!config.slot_save || slot < 0 || endpoint.compare(0, 4, "http") != 0) return false;
+        string filename = "ghostintheshell-slot" + to_string(slot) + ".bin";
+        if (!slot_action(endpoint, slot, "save", filename)) return false;
+        save_json_file(SLOT_STATE, {{"endpoint", endpoint}, {"slot", slot}, {"filename", filename}});
+        return true;
+    }
+
+    // Loads the slot saved by the last save() back into the server and pins the conversation to it
+    bool restore(const Config& config) {
+        if (!config.slot_save) return false;
+        json state = load_json_file(SLOT_STATE);
+        if (!state.is_object() || !state.contains("slot")) return false;
+        string endpoint = state.value("endpoint", "");
+        int slot = state.value("slot", -1);
+        if (!slot_action(endpoint, slot, "restore", state.value("filename", ""))) return false;
+        lock_guard<mutex> guard(mutex_);
+        endpoint_ = endpoint;
+        if (!pinned_) slot_ = slot;
+        return true;
+    }
+
+    void print() const {
+        lock_guard<mutex> guard(mutex_);
+        if (endpoint_.empty()) return;
+        cout << COLOR_GRADIENT_1 << "slot" << COLOR_RESET << ": " << (slot_ >= 0 ? to_string(slot_) : "chosen by the server")
+             << " on " << endpoint_;
+        if (last_cached_ >= 0) cout << ", last turn " << last_cached_ << " prompt tokens cached / " << last_evaluated_ << " evaluated";
+        cout << endl;
+    }
+
+private:
+    SlotManager() = default;
+
+    // POST <origin>/slots/<id>?action=save|restore {"filename": ...}
+    static bool slot_action(const string& endpoint, int slot, const string& action, const string& filename) {
+        RequestSpec spec;
+        spec.url = url_origin(endpoint) + "/slots/" + to_string(slot) + "?action=" + action;
+        spec.body = json{{"filename", filename}}.dump();
+        spec.headers = {"Content-Type: application/json"};
+        spec.timeout_ms = 30000;
+        spec.metric = "slot_" + action;
+        shared_ptr<PendingRequest> request = RequestEngine::instance().submit(move(spec));
+        request->wait();
+        const HttpResult& result = request->result();
+        if (result.ok()) return true;
+        cerr << COLOR_RED << "Error: Slot " << action << " failed: " << result.error();
+        json error = json::parse(result.body, nullptr, false);
+        if (error.is_object() && error.contains("error") && error["error"].is_object()) {
+            cerr << " (" << error["error"].value("message", "") << ")";
+        }
+        cerr << COLOR_RESET << endl;
+        return false;
+    }
+
+    mutable mutex mutex_;
+    string endpoint_;   // Backend that served the last turn
+    int slot_ = -1;
+    bool pinned_ = false;
+    long last_cached_ = -1;
+    long last_evaluated_ = -1;
+};
+
+// Records time to first token and token counts for a finished chat request; in debug mode
+// also prints where the time went, to tell a slow server from client overhead
+void record_generation_metrics(const Config& config, const HttpResult& result, const string& response_string,
+                               const StreamState& stream_state, chrono::steady_clock::time_point request_start) {
+    double total_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - request_start).count();
+    double ttft_ms = stream_state.started ? chrono::duration<double, milli>(stream_state.first_token_at - request_start).count() : -1;
+    JsonView response = JsonView::parse(response_string); // Invalid replies are counted without tokens
+    long prompt_tokens = response["usage"]["prompt_tokens"].integer_or(-1);
+    long completion_tokens = response["usage"]["completion_tokens"].integer_or(-1);
+    long cached_tokens = cached_prompt_tokens(response);
+    double tokens_per_second = Metrics::instance().record_generation("chat", ttft_ms, total_ms, prompt_tokens, completion_tokens,
+                                                                     cached_tokens);
+
+    if (config.debug_mode) {
+        const RequestTiming& timing = result.timing;
+        ostringstream line;
+        line << fixed << setprecision(1);
+        if (timing.network) {
+            line << "dns " << timing.dns_ms << " ms, connect " << timing.connect_ms << " ms, tls " << timing.tls_ms
+                 << " ms, first byte " << timing.ttfb_ms << " ms, ";
+        }
+        if (ttft_ms >= 0) line << "first token " << ttft_ms << " ms, ";
+        line << "total " << total_ms << " ms, " << timing.bytes_out << " B out, " << timing.bytes_in << " B in";
+        if (tokens_per_second >= 0) line << ", " << tokens_per_second << " tokens/s";
+        if (cached_tokens >= 0 && prompt_tokens >= 0) {
+            line << ", prompt " << prompt_tokens << " tokens (" << cached_tokens << " cached, "
+                 << max(prompt_tokens - cached_tokens, 0L) << " evaluated)";
+        }
+        cout << COLOR_YELLOW << "Timing: " << line.str() << COLOR_RESET << endl;
+    }
+}
+
+// Enhanced AI query with llama, focusing on NSFW content.
+// The request runs on the RequestEngine; Ctrl-C cancels it and returns an empty string.
+// With config.stream the reply is printed token by token under `label` and a
+// non-streaming shaped response is returned, so callers can parse either mode alike.
+// Identical requests are answered from the ResponseCache when config.cache_enabled.
+string query_ai(const Config& config, const string& messages_json, const string& label = "AI") {
+    ResponseCache& cache = ResponseCache::instance();
+    string cache_key;
+    if (config.cache_enabled) {
+        cache_key = ResponseCache::key(config, messages_json);
+        CachedResponse cached;
+        if (cache.get(cache_key, cached)) {
+            string response_string = replay_cached_response(config, cached, label);
+            if (config.debug_mode) cache.print_stats();
+            return response_string;
+        }
+    }
+
+    // Sized before sending: with the model's tokenizer an overflowing prompt is refused
+    // here instead of by the server, and the reply is limited to the room left.
+    int max_tokens = config.max_tokens;
+    if (Tokenizer::instance().exact()) {
+        int prompt_tokens = count_prompt_tokens(messages_json);
+        if (config.debug_mode) {
+            cout << COLOR_YELLOW << "Prompt: " << prompt_tokens << " of " << config.context_tokens << " context tokens" << COLOR_RESET << endl;
+        }
+        if (prompt_tokens >= config.context_tokens) {
+            cerr << COLOR_RED << "Error: Prompt of " << prompt_tokens << " tokens does not fit in the "
+                 << config.context_tokens << "-token context" << COLOR_RESET << endl;
+            return {};
+        }
+        max_tokens = min(max_tokens, config.context_tokens - prompt_tokens);
+    }
+
+    auto request_start = chrono::steady_clock::now();
+    RequestSpec spec = build_chat_request(config, messages_json, config.stream, max_tokens, SlotManager::instance().slot());
+    SlotManager::instance().pin(spec);
+
+    StreamState stream_state;
+    stream_state.label = label;
+    if (config.stream) {
+        spec.on_data = [&stream_state](const char* data, size_t length) {
+            stream_feed(stream_state, data, length);
+            return true;
+        };
+    }
+
+    shared_ptr<PendingRequest> request = RequestEngine::instance().submit(move(spec));
+    bool completed = wait_for_request(*request, "Processing your query", COLOR_CYAN);
+    const HttpResult& result = request->result();
+
+    if (!completed) return {};
+    if (config.stream) {
+        // Flush a final event that was not newline-terminated
+        if (!stream_state.line_buffer.empty()) process_sse_line(stream_state, stream_state.line_buffer);
+        if (stream_state.started) Renderer::instance().write(COLOR_RESET + "\n");
+        Renderer::instance().flush();
+    }
+
+    string response_string;
+    if (!result.ok()) {
+        cerr << COLOR_RED << "Error: " << result.error() << COLOR_RESET << endl;
+    } else if (config.stream && stream_state.saw_event) {
+        json response = {
+            {"choices", {{{"message", {{"role", "assistant"}, {"content", stream_state.content}}}}}}
+        };
+        if (!stream_state.usage.is_null()) response["usage"] = stream_state.usage;
+        if (!stream_state.timings.is_null()) response["timings"] = stream_state.timings;
+        if (stream_state.id_slot >= 0) response["id_slot"] = stream_state.id_slot;
+        response_string = response.dump();
+    } else if (config.stream) {
+        // Server ignored "stream": print the buffered reply so callers see the same output
+        response_string = stream_state.raw;
+        string reply;
+        if (extract_reply(response_string, reply)) { // Otherwise left to the caller, same as the non-streaming path
+            cout << COLOR_CYAN << label << " >>> " << reply << COLOR_RESET << endl;
+        }
+    } else {
+        response_string = result.body;
+        cout << COLOR_GREEN << "Query successful. Analyzing results..." << COLOR_RESET << endl;
+    }
+
+    if (!response_string.empty()) {
+        record_generation_metrics(config, result, response_string, stream_state, request_start);
+        SlotManager::instance().observe(result, response_string);
+    }
+
+    if (!cache_key.empty() && !response_string.empty()) {
+        CachedResponse entry;
+        if (extract_reply(response_string, entry.content)) { // Malformed replies are not cached
+            JsonView usage = JsonView::parse(response_string)["usage"];
+            if (usage.is_object()) entry.usage = usage.to_json();
+            entry.latency_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - request_start).count();
+            cache.put(cache_key, entry);
+        }
+        if (config.debug_mode) cache.print_stats();
+    }
+    return response_string;
+}
+
+// Keeps requests inside the token budget. The system prompt and the most recent turns
+// are sent verbatim; older turns are folded into a running summary that is produced on
+// the RequestEngine while the user is typing the next command.
+class ContextManager {
+public:
+    ~ContextManager() {
+        if (pending_) {
+            pending_->cancel();
+            pending_->wait();
+        }
+    }
+
+    // JSON `messages` array to send for the history, trimmed to the prompt budget.
+    // `extra_message` (already serialized) is appended as the newest message.
+    string build(const Config& config, const MessageStore& messages, const string& extra_message = "") {
+        string context = "[";
+        if (messages.empty()) return context + extra_message + "]";
+        Tokenizer& tokenizer = Tokenizer::instance();
+        int budget = prompt_budget(config);
+        if (!extra_message.empty()) budget -= tokenizer.count_message(extra_message); // Serialized, so a slight overcount
+
+        string summary, system_prompt;
+        int system_prompt_tokens;
+        size_t start;
+        {
+            lock_guard<mutex> guard(mutex_);
+            summary = summary_;
+            system_prompt = system_prompt_;
+            system_prompt_tokens = system_prompt_tokens_;
+            start = min(summarized_upto_, messages.size());
+        }
+
+        if (system_prompt.empty()) {
+            context += messages.serialized(0);
+            budget -= messages.tokens(0);
+        } else {
+            context += system_prompt;
+            budget -= system_prompt_tokens;
+        }
+        if (!summary.empty()) {
+            string summary_message = "Summary of the earlier conversation: " + summary;
+            budget -= tokenizer.count_message(summary_message);
+            context += ',';
+            context += serialize_message("system", summary_message);
+        }
+
+        // Newest first until the budget is spent. Turns that are neither summarized yet
+        // nor within budget are left out rather than overflowing the server's context.
+        size_t first = messages.size();
+        while (first > max<size_t>(start, 1)) {
+            int cost = messages.tokens(first - 1);
+            if (cost > budget && (first != messages.size() || !extra_message.empty())) break;
+            budget -= cost;
+            first--;
+        }
+        if (first < messages.size()) {
+            context += ',';
+            messages.append_serialized(context, first, messages.size());
+        }
+        if (!extra_message.empty()) context += "," + extra_message;
+        last_prompt_tokens_ = prompt_budget(config) - budget;
+        return context + "]";
+    }
+
+    // Prompt size of the last build(), in tokens (estimated until a tokenizer is loaded)
+    int last_prompt_tokens() const { return last_prompt_tokens_; }
+
+    // Starts a background summary once the unsummarized history passes 3/4 of the budget
+    void maybe_summarize(const Config& config, const MessageStore& messages) {
+        lock_guard<mutex> guard(mutex_);
+        if (pending_ && !pending_->ready()) return;
+        pending_.reset();
+
+        size_t keep = static_cast<size_t>(max(config.keep_recent_messages, 1));
+        if (messages.size() <= summarized_upto_ + keep) return;
+        int tokens = 0;
+        for (size_t i = summarized_upto_; i < messages.size(); i++) tokens += messages.tokens(i);
+        if (tokens * 4 < prompt_budget(config) * 3) return;
+
+        size_t fold_end = messages.size() - keep;
+        string transcript;
+        if (!summary_.empty()) transcript += "Previous summary: " + summary_ + "\n\n";
+        for (size_t i = summarized_upto_; i < fold_end; i++) {
+            transcript.append(messages.role(i)).append(": ").append(messages.content(i)).append("\n");
+        }
+
+        json payload = {
+            {"model", "llama"},
+            {"messages", {
+                {{"role", "system"}, {"content", "Summarize the conversation below in a few sentences. "
+                                                 "Keep facts, names, decisions and open questions."}},
+                {{"role", "user"}, {"content", transcript}}
+            }},
+            {"max_tokens", min(config.max_tokens, 256)},
+            {"temperature", 0.2},
+            {"stream", false}
+        };
+
+        RequestSpec spec;
+        spec.url = chat_endpoint(config);
+        spec.body = payload.dump();
+        spec.headers = {"Content-Type: application/json"};
+        spec.metric = "summary";
+        spec.on_complete = [this, fold_end](const HttpResult& result) {
+            string summary;
+            if (!result.ok() || !extract_reply(result.body, summary)) return; // The fold is retried after the next turn
+            lock_guard<mutex> guard(mutex_);
+            summary_ = summary;
+            summarized_upto_ = fold_end;
+        };
+        pending_ = RequestEngine::instance().submit(move(spec));
+    }
+
+    string summary() const {
+        lock_guard<mutex> guard(mutex_);
+        return summary_;
+    }
+
+    // Sent in place of the session's first (system) message from now on
+    void set_system_prompt(const string& content) {
+        lock_guard<mutex> guard(mutex_);
+        system_prompt_ = serialize_message("system", content);
+        system_prompt_tokens_ = Tokenizer::instance().count_message(content);
+    }
+
+private:
+    static int prompt_budget(const Config& config) {
+        return max(config.context_tokens - config.max_tokens, 256);
+    }
+
+    mutable mutex mutex_;
+    string summary_;
+    size_t summarized_upto_ = 1; // messages[1, summarized_upto_) are covered by summary_
+    string system_prompt_;       // Serialized override for messages[0], if any
+    int system_prompt_tokens_ = 0;
+    atomic<int> last_prompt_tokens_{0};
+    shared_ptr<PendingRequest> pending_;
+};
+
+// URL encoding function (RFC 3986 unreserved characters pass through)
+string url_encode(const string& value) {
+    static const char hex[] = "0123456789ABCDEF";
+    string encoded;
+    encoded.reserve(value.size() * 3);
+    for (unsigned char c : value) {
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            encoded += static_cast<char>(c);
+        } else {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 0x0F];
+        }
+    }
+    return encoded;
+}
+
+// Enhanced status display with timestamp
+void display_status(const string& message, const string& color, const string& icon) {
+    auto now = chrono::system_clock::to_time_t(chrono::system_clock::now());
+    auto timestamp = put_time(localtime(&now), "%Y-%m-%d %H:%M:%S");
+    cout << color << "[" << timestamp << "] " << icon << " " << message << COLOR_RESET << endl;
+}
+
+// Function to generate a border
+string generate_border(int length, char border_char = '=', const string& color = COLOR_RESET) {
+    return color + string(length, border_char) + COLOR_RESET;
+}
+
+
+// Di// Function to display search results with pagination
+void display_results(const vector<string>& results) {
+    cout << generate_border(30) << endl;
+    if (results.empty()) {
+        cout << COLOR_RED << "No results found." << COLOR_RESET << endl;
+    } else {
+        cout << COLOR_YELLOW << "Displaying top results:" << COLOR_RESET << endl;
+        for (size_t i = 0; i < results.size(); i++) {
+            cout << COLOR_GRADIENT_2 << " " << (i + 1) << ". " << COLOR_RESET;
+            cout << results[i] << endl;
+        }
+    }
+    cout << generate_border(30) << endl;
+}
+
+// Function to show the welcome screen and available commands
+void show_welcome_screen() {
+    cout << "\033[2J\033[1;1H";  // Clear screen and move to top-left corner
+    cout << generate_border(50, '=', COLOR_GRADIENT_1) << endl;  // Top border
+    cout << COLOR_GRADIENT_1 << "    * Enhanced AI Terminal v2.0 *" << COLOR_RESET << endl;  // Version info
+    cout << COLOR_GRADIENT_2 << "        Ghostintheshell  " << COLOR_RESET << endl;  // Companion message
+    cout << COLOR_GRADIENT_3 << "    Build: " << __DATE__ << " " << __TIME__ << COLOR_RESET << endl;  // Build info
+    cout << generate_border(50, '=', COLOR_GRADIENT_1) << endl;  // Bottom border
+    show_menu();  // Show available commands
+}
+
+// Enhanced Interactive Menu Display
+void show_menu() {
+    std::cout << COLOR_HIGHLIGHT << "\nAvailable Commands:\n" << COLOR_RESET;
+    std::cout << COLOR_GRADIENT_2 << " ├─ search:<query>   " << COLOR_RESET << "Search the web for information\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ rag:<question>   " << COLOR_RESET << "Answer from local documents (rag:add:<path> to index them)\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ chat:<question>   " << COLOR_RESET << "Engage in conversation with the AI\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ bg:<question>    " << COLOR_RESET << "Ask the AI in the background\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ exec:<command>   " << COLOR_RESET << "Run a shell command (bgexec:<command> in the background)\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ jobs             " << COLOR_RESET << "List background jobs (cancel:<id> to stop one)\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ history          " << COLOR_RESET << "Show this session's messages\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ history:search <terms> " << COLOR_RESET << "Search all saved sessions (history:use:<n> to add a match)\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ session:resume   " << COLOR_RESET << "Continue from the saved session journal\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ stats            " << COLOR_RESET << "Show request latency and token metrics\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ prompts[:<prefix>] " << COLOR_RESET << "List prompts (prompt:load:<name> to use one)\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ nsfw:<on/off>    " << COLOR_RESET << "Toggle NSFW content filtering\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ help             " << COLOR_RESET << "Display detailed help information\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ clear            " << COLOR_RESET << "Clear the terminal screen\n";
+    std::cout << COLOR_GRADIENT_2 << " ├─ settings         " << COLOR_RESET << "Configure AI and search settings\n";
+    std::cout << COLOR_GRADIENT_2 << " └─ exit             " << COLOR_RESET << "Terminate the program\n";
+}
+
+void handle_settings() {
+    ConfigStore& store = ConfigStore::instance();
+    shared_ptr<const Config> config = store.current();
+    cout << COLOR_GRADIENT_1 << "\nSettings Menu" << COLOR_RESET << endl;
+    cout << generate_border(30) << endl;
+    cout << COLOR_GRADIENT_2 << "1. NSFW Mode: " << (config->nsfw_mode ? "ON" : "OFF") << COLOR_RESET << endl;
+    cout << COLOR_GRADIENT_2 << "2. Temperature: " << config->temperature << COLOR_RESET << endl;
+    cout << COLOR_GRADIENT_2 << "3. Max Tokens: " << config->max_tokens << COLOR_RESET << endl;
+    cout << COLOR_GRADIENT_2 << "4. Debug Mode: " << (config->debug_mode ? "ON" : "OFF") << COLOR_RESET << endl;
+    cout << generate_border(30) << endl;
+    
+    cout << "Enter setting number to change (or 'x' to exit): ";
+    string choice;
+    getline(cin, choice);
+
+    function<void(Config&)> change;
+    if (choice == "1") {
+        bool nsfw_mode = !config->nsfw_mode;
+        change = [nsfw_mode](Config& next) { next.nsfw_mode = nsfw_mode; };
+        cout << COLOR_SUCCESS << "NSFW Mode: " << (nsfw_mode ? "Enabled" : "Disabled") << COLOR_RESET << endl;
+    } else if (choice == "2") {
+        cout << "Enter new temperature (0.1-1.0): ";
+        double temperature = config->temperature;
+        cin >> temperature;
+        cin.ignore();
+        change = [temperature](Config& next) { next.temperature = temperature; };
+    } else if (choice == "3") {
+        cout << "Enter new max tokens (100-2000): ";
+        int max_tokens = config->max_tokens;
+        cin >> max_tokens;
+        cin.ignore();
+        change = [max_tokens](Config& next) { next.max_tokens = max_tokens; };
+    } else if (choice == "4") {
+        bool debug_mode = !config->debug_mode;
+        change = [debug_mode](Config& next) { next.debug_mode = debug_mode; };
+        cout << COLOR_SUCCESS << "Debug Mode: " << (debug_mode ? "Enabled" : "Disabled") << COLOR_RESET << endl;
+    } else if (choice == "x") {
+        cout << "Exiting settings menu." << endl;
+        return; // Exit the settings menu
+    } else {
+        cout << COLOR_ALERT << "Invalid choice. Please try again." << COLOR_RESET << endl;
+        return;
+    }
+
+    // Publish and save the complete updated configuration
+    Renderer::instance().start_spinner("Processing your settings", COLOR_CYAN);
+    store.update(change);
+    Renderer::instance().stop_spinner();
+}
+
+// Help command logic
+void handle_help() {
+    cout << COLOR_GRADIENT_1 << "\nHelp Menu" << COLOR_RESET << endl;
+    cout << generate_border(30) << endl;
+    cout << COLOR_GRADIENT_2 << "1. search:<query>   " << COLOR_RESET << "Search the web for information.\n";
+    cout << COLOR_GRADIENT_2 << "2. chat:<question>   " << COLOR_RESET << "Engage in conversation with the AI.\n";
+    cout << COLOR_GRADIENT_2 << "3. rag:<question>    " << COLOR_RESET << "Ask the AI with the most relevant chunks of your indexed documents in the prompt.\n";
+    cout << COLOR_GRADIENT_2 << "4. rag:add:<path>    " << COLOR_RESET << "Index a text file or a directory for rag:; changed files are indexed again. rag:status shows the index.\n";
+    cout << COLOR_GRADIENT_2 << "5. bg:<question>    " << COLOR_RESET << "Ask the AI in the background; the reply is shown when ready.\n";
+    cout << COLOR_GRADIENT_2 << "6. exec:<command>   " << COLOR_RESET << "Run a shell command; its output is added to the conversation. Ctrl-C stops it.\n";
+    cout << COLOR_GRADIENT_2 << "7. bgexec:<command> " << COLOR_RESET << "Run a shell command in the background; long output keeps only its start and end.\n";
+    cout << COLOR_GRADIENT_2 << "8. jobs             " << COLOR_RESET << "List background jobs. Use cancel:<id> to stop one.\n";
+    cout << COLOR_GRADIENT_2 << "9. history          " << COLOR_RESET << "Show this session's messages.\n";
+    cout << COLOR_GRADIENT_2 << "10. history:search <terms>  " << COLOR_RESET << "Rank messages of all saved sessions. Filters: role:user|assistant, since:7d|YYYY-MM-DD, until:YYYY-MM-DD.\n";
+    cout << COLOR_GRADIENT_2 << "11. history:use:<n|all>     " << COLOR_RESET << "Add search match n (or all of them) to the conversation as context.\n";
+    cout << COLOR_GRADIENT_2 << "12. session:resume[:<n>]  " << COLOR_RESET << "Load the last n (default 50) messages of earlier sessions.\n";
+    cout << COLOR_GRADIENT_2 << "13. session:show[:<n>]    " << COLOR_RESET << "Print the last n (default 20) journaled messages.\n";
+    cout << COLOR_GRADIENT_2 << "14. session:compact " << COLOR_RESET << "Rewrite the session journal, dropping damaged and old records.\n";
+    cout << COLOR_GRADIENT_2 << "15. stats           " << COLOR_RESET << "Show p50/p95/p99 of DNS, connect, TLS, first byte, first token and total time per request type.\n";
+    cout << COLOR_GRADIENT_2 << "16. prompts[:<prefix>]     " << COLOR_RESET << "List the prompt library, or the names starting with prefix.\n";
+    cout << COLOR_GRADIENT_2 << "17. prompt:load:<name>     " << COLOR_RESET << "Use a prompt as the system prompt; a unique prefix is enough.\n";
+    cout << COLOR_GRADIENT_2 << "18. prompt:save:<name>:<text>  " << COLOR_RESET << "Save a prompt. prompt:edit changes an existing one.\n";
+    cout << COLOR_GRADIENT_2 << "19. nsfw:<on/off>   " << COLOR_RESET << "Toggle NSFW content filtering.\n";
+    cout << COLOR_GRADIENT_2 << "20. help            " << COLOR_RESET << "Display this help information.\n";
+    cout << COLOR_GRADIENT_2 << "21. clear           " << COLOR_RESET << "Clear the terminal screen.\n";
+    cout << COLOR_GRADIENT_2 << "22. settings        " << COLOR_RESET << "Configure AI and search settings.\n";
+    cout << COLOR_GRADIENT_2 << "23. exit            " << COLOR_RESET << "Terminate the program.\n";
+    cout << COLOR_YELLOW << "Press Ctrl-C while the AI is answering to cancel the request.\n" << COLOR_RESET;
+    cout << generate_border(30) << endl;
+}
+
+struct SearchResult {
+    string text;
+    string url;
+    string engine;
+};
+
+// One pluggable search backend: how to ask it and how to read its answer
+class SearchProvider {
+public:
+    explicit SearchProvider(string name) : name_(move(name)) {}
+    virtual ~SearchProvider() = default;
+    const string& name() const { return name_; }
+    virtual RequestSpec request(const string& query, bool safe_search) const = 0;
+    // Appends the results in `body`; false if it is not a JSON object
+    virtual bool parse(string_view body, vector<SearchResult>& results) const = 0;
+
+protected:
+    string name_;
+};
+
+// DuckDuckGo Instant Answer API; also the format expected from local mock endpoints
+class DuckDuckGoProvider : public SearchProvider {
+public:
+    DuckDuckGoProvider(string name, string endpoint) : SearchProvider(move(name)), endpoint_(move(endpoint)) {}
+
+    RequestSpec request(const string& query, bool safe_search) const override {
+        RequestSpec spec;
+        spec.url = endpoint_ + "?q=" + url_encode(query) + "&format=json&no_html=1&safesearch=" + (safe_search ? "on" : "off");
+        spec.headers = {"Accept: application/json"};
+        return spec;
+    }
+
+    bool parse(string_view body, vector<SearchResult>& results) const override {
+        JsonView data = JsonView::parse(body);
+        if (!data.is_object()) return false;
+        string abstract = data["AbstractText"].string_or("");
+        if (!abstract.empty()) results.push_back({abstract, data["AbstractURL"].string_or(""), name_});
+        auto add_entry = [&](JsonView entry) {
+            string text;
+            if (entry["Text"].get(text)) results.push_back({move(text), entry["FirstURL"].string_or(""), name_});
+            return true;
+        };
+        data["RelatedTopics"].for_each([&](JsonView topic) {
+            // Disambiguation groups nest their entries under "Topics"
+            JsonView group = topic["Topics"];
+            if (group.valid()) group.for_each(add_entry);
+            else add_entry(topic);
+            return true;
+        });
+        return true;
+    }
+
+private:
+    string endpoint_;
+};
+
+// Bing Web Search API v7 (needs bing_api_key)
+class BingProvider : public SearchProvider {
+public:
+    BingProvider(string endpoint, string api_key) : SearchProvider("bing"), endpoint_(move(endpoint)), api_key_(move(api_key)) {}
+
+    RequestSpec request(const string& query, bool safe_search) const override {
+        RequestSpec spec;
+        spec.url = endpoint_ + "?q=" + url_encode(query) + "&count=10&safeSearch=" + (safe_search ? "Strict" : "Off");
+        spec.headers = {"Accept: application/json", "Ocp-Apim-Subscription-Key: " + api_key_};
+        return spec;
+    }
+
+    bool parse(string_view body, vector<SearchResult>& results) const override {
+        JsonView data = JsonView::parse(body);
+        if (!data.is_object()) return false;
+        data["webPages"]["value"].for_each([&](JsonView page) {
+            results.push_back({page["name"].string_or("") + ": " + page["snippet"].string_or(""), page["url"].string_or(""), name_});
+            return true;
+        });
+        return true;
+    }
+
+private:
+    string endpoint_;
+    string api_key_;
+};
+
+// Google Custom Search JSON API (needs google_api_key and google_cx)
+class GoogleProvider : public SearchProvider {
+public:
+    GoogleProvider(string endpoint, string api_key, string cx)
+        : SearchProvider("google"), endpoint_(move(endpoint)), api_key_(move(api_key)), cx_(move(cx)) {}
+
+    RequestSpec request(const string& query, bool safe_search) const override {
+        RequestSpec spec;
+        spec.url = endpoint_ + "?key=" + url_encode(api_key_) + "&cx=" + url_encode(cx_) + "&q=" + url_encode(query) +
+                   "&safe=" + (safe_search ? "active" : "off");
+        spec.headers = {"Accept: application/json"};
+        return spec;
+    }
+
+    bool parse(string_view body, vector<SearchResult>& results) const override {
+        JsonView data = JsonView::parse(body);
+        if (!data.is_object()) return false;
+        data["items"].for_each([&](JsonView item) {
+            results.push_back({item["title"].string_or("") + ": " + item["snippet"].string_or(""), item["link"].string_or(""), name_});
+            return true;
+        });
+        return true;
+    }
+
+private:
+    string endpoint_;
+    string api_key_;
+    string cx_;
+};
+
+// Providers for the configured engines, primary first. Engines missing credentials are skipped.
+vector<unique_ptr<SearchProvider>> make_search_providers(const Config& config) {
+    static const char* ENGINE_NAMES[] = {"google", "bing", "duckduckgo"};
+    vector<string> names = config.search_engines;
+    if (names.empty()) names.push_back(ENGINE_NAMES[static_cast<int>(config.search_engine)]);
+
+    auto endpoint = [&](const string& name, const string& fallback) {
+        auto it = config.search_endpoints.find(name);
+        return it != config.search_endpoints.end() ? it->second : fallback;
+    };
+
+    vector<unique_ptr<SearchProvider>> providers;
+    for (const string& name : names) {
+        if (name == "google") {
+            if (config.google_api_key.empty() || config.google_cx.empty()) continue;
+            providers.push_back(make_unique<GoogleProvider>(endpoint(name, "https://www.googleapis.com/customsearch/v1"),
+                                                            config.google_api_key, config.google_cx));
+        } else if (name == "bing") {
+            if (config.bing_api_key.empty()) continue;
+            providers.push_back(make_unique<BingProvider>(endpoint(name, "https://api.bing.microsoft.com/v7.0/search"),
+                                                          config.bing_api_key));
+        } else if (name == "duckduckgo" || config.search_endpoints.count(name)) {
+            providers.push_back(make_unique<DuckDuckGoProvider>(name, endpoint(name, "https://api.duckduckgo.com/")));
+        }
+    }
+    if (providers.empty()) {
+        providers.push_back(make_unique<DuckDuckGoProvider>("duckduckgo", endpoint("duckduckgo", "https://api.duckduckgo.com/")));
+    }
+    return providers;
+}
+
+// Queries every configured engine concurrently on the RequestEngine and merges their
+// results. Returns once the first good result set has had search_grace_ms for the others
+// to catch up, or at search_deadline_ms. Merged results are reused for search_cache_ttl.
+class SearchService {
+public:
+    static SearchService& instance() {
+        static SearchService service;
+        return service;
+    }
+
+    vector<SearchResult> search(const Config& config, const string& query) {
+        if (DaemonClient::instance().connected()) {
+            // The daemon's cache is shared by every terminal; Ctrl-C abandons the wait
+            json reply;
+            interrupt_requested = false;
+            foreground_requests++;
+            bool answered = DaemonClient::instance().call({{"op", "search"}, {"query", query}, {"nsfw", config.nsfw_mode}},
+                                                          reply, &interrupt_requested);
+            foreground_requests--;
+            if (answered) {
+                vector<SearchResult> results;
+                for (const auto& item : reply.value("results", json::array())) {
+                    results.push_back({item.value("text", ""), item.value("url", ""), item.value("engine", "")});
+                }
+                return results;
+            }
+            if (interrupt_requested) return {};
+        }
+
+        bool safe_search = !config.nsfw_mode;
+        auto providers = make_search_providers(config);
+        string cache_key = (safe_search ? "safe\n" : "open\n") + query;
+        for (const auto& provider : providers) cache_key += "\n" + provider->name();
+
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> guard(mutex_);
+            auto it = cache_.find(cache_key);
+            if (it != cache_.end() && it->second.expires > now) return it->second.results;
+        }
+
+        struct FanOut {
+            mutex lock;
+            vector<vector<SearchResult>> results;
+            vector<bool> finished;
+            bool have_results = false;
+            chrono::steady_clock::time_point first_results;
+        };
+        auto fan_out = make_shared<FanOut>();
+        fan_out->results.resize(providers.size());
+        fan_out->finished.resize(providers.size(), false);
+
+        vector<shared_ptr<PendingRequest>> requests;
+        for (size_t i = 0; i < providers.size(); i++) {
+            RequestSpec spec = providers[i]->request(query, safe_search);
+            spec.timeout_ms = config.search_deadline_ms;
+            spec.metric = "search:" + providers[i]->name();
+            const SearchProvider* provider = providers[i].get();
+            spec.on_complete = [fan_out, provider, i](const HttpResult& result) {
+                vector<SearchResult> parsed;
+                if (result.ok() && !provider->parse(result.body, parsed)) {
+                    parsed.clear();
+                    Renderer::instance().error(COLOR_RED + "\n" + provider->name() + " returned invalid JSON" + COLOR_RESET + "\n");
+                }
+                lock_guard<mutex> guard(fan_out->lock);
+                fan_out->finished[i] = true;
+                if (!parsed.empty() && !fan_out->have_results) {
+                    fan_out->have_results = true;
+                    fan_out->first_results = chrono::steady_clock::now();
+                }
+                fan_out->results[i] = move(parsed);
+            };
+            requests.push_back(RequestEngine::instance().submit(move(spec)));
+        }
+
+        auto deadline = now + chrono::milliseconds(config.search_deadline_ms);
+        auto grace = chrono::milliseconds(config.search_grace_ms);
+        interrupt_requested = false;
+        foreground_requests++;
+        while (chrono::steady_clock::now() < deadline && !interrupt_requested) {
+            {
+                lock_guard<mutex> guard(fan_out->lock);
+                bool all_finished = all_of(fan_out->finished.begin(), fan_out->finished.end(), [](bool done) { return done; });
+                if (all_finished) break;
+                if (fan_out->have_results && chrono::steady_clock::now() - fan_out->first_results >= grace) break;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        foreground_requests--;
+        for (auto& request : requests) request->cancel();
+        for (auto& request : requests) request->wait(); // Callbacks reference the providers
+
+        vector<SearchResult> merged = merge(fan_out->results);
+        if (!merged.empty()) {
+            lock_guard<mutex> guard(mutex_);
+            auto expires = chrono::steady_clock::now() + chrono::seconds(config.search_cache_ttl);
+            for (auto it = cache_.begin(); it != cache_.end();) {
+                it = it->second.expires <= now ? cache_.erase(it) : next(it);
+            }
+            cache_[cache_key] = {expires, merged};
+        }
+        return merged;
+    }
+
+private:
+    struct CacheEntry {
+        chrono::steady_clock::time_point expires;
+        vector<SearchResult> results;
+    };
+
+    SearchService() = default;
+
+    // "https://www.Example.com/a/" and "http://example.com/a" are the same result
+    static string normalize_url(const string& url) {
+        string key = url.substr(url.find("://") == string::npos ? 0 : url.find("://") + 3);
+        transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return tolower(c); });
+        if (key.compare(0, 4, "www.") == 0) key.erase(0, 4);
+        while (!key.empty() && key.back() == '/') key.pop_back();
+        return key;
+    }
+
+    // Round-robin across engines in priority order, dropping duplicates
+    static vector<SearchResult> merge(const vector<vector<SearchResult>>& per_engine) {
+        vector<SearchResult> merged;
+        set<string> seen;
+        for (size_t rank = 0;; rank++) {
+            bool any = false;
+            for (const auto& results : per_engine) {
+                if (rank >= results.size()) continue;
+                any = true;
+                const SearchResult& result = results[rank];
+                if (seen.insert(result.url.empty() ? result.text : normalize_url(result.url)).second) {
+                    merged.push_back(result);
+                }
+            }
+            if (!any) break;
+        }
+        return merged;
+    }
+
+    mutex mutex_;
+    map<string, CacheEntry> cache_;
+};
+
+// Streaming HTML to text: fed a page as its bytes arrive, so the text is ready as soon as
+// the transfer ends. Markup and comments are dropped along with the contents of script,
+// style and similar elements and of nav, aside and footer; entities are decoded, white
+// space collapsed, and block elements end the paragraph in progress. Stops keeping text
+// after `max_text` bytes.
+class HtmlTextExtractor {
+public:
+    explicit HtmlTextExtractor(size_t max_text = SIZE_MAX) : max_text_(max_text) {}
+
+    void feed(const char* data, size_t length) {
+        for (size_t i = 0; i < length; i++) consume(data[i]);
+    }
+
+    // Ends the last paragraph; a tag or entity cut off by the end of the input is dropped
+    void finish() {
+        if (state_ == ENTITY) {
+            state_ = TEXT;
+            emit_literal_entity();
+        }
+        end_paragraph();
+    }
+
+    const vector<string>& paragraphs() const { return paragraphs_; }
+    const string& title() const { return title_; }
+    size_t text_bytes() const { return text_bytes_; }
+
+private:
+    enum State { TEXT, TAG, COMMENT, ENTITY, RAW };
+    static constexpr size_t MAX_TAG = 256;    // Kept of each tag; only its name matters
+    static constexpr size_t MAX_ENTITY = 10;
+
+    void consume(char c) {
+        switch (state_) {
+        case TEXT:
+            if (c == '<') {
+                state_ = TAG;
+                tag_.clear();
+                quote_ = 0;
+            } else if (c == '&') {
+                state_ = ENTITY;
+                entity_.clear();
+            } else {
+                text(c);
+            }
+            break;
+        case TAG:
+            if (tag_.empty() && !isalpha(static_cast<unsigned char>(c)) && c != '/' && c != '!' && c != '?') {
+                state_ = TEXT; // "a < b" is text
+                text('<');
+                consume(c);
+                break;
+            }
+            if (quote_) {
+                if (c == quote_) quote_ = 0;
+            } else if (c == '"' || c == '\'') {
+                if (!tag_.empty() && tag_[0] != '!') quote_ = c;
+            } else if (c == '>') {
+                state_ = TEXT;
+                tag(tag_);
+                break;
+            }
+            if (tag_.size() < MAX_TAG) tag_ += c;
+            if (tag_ == "!--") {
+                state_ = COMMENT;
+                dashes_ = 0;
+            }
+            break;
+        case COMMENT:
+            if (c == '>' && dashes_ >= 2) state_ = TEXT;
+            dashes_ = c == '-' ? dashes_ + 1 : 0;
+            break;
+        case ENTITY:
+            if (c == ';') {
+                state_ = TEXT;
+                decode_entity();
+            } else if ((isalnum(static_cast<unsigned char>(c)) || (c == '#' && entity_.empty())) && entity_.size() < MAX_ENTITY) {
+                entity_ += c;
+            } else {
+                state_ = TEXT;
+                emit_literal_entity();
+                consume(c);
+            }
+            break;
+        case RAW:
+            // Only the matching end tag leaves; "a<b" in a script is not markup
+            if (tolower(static_cast<unsigned char>(c)) == raw_end_[raw_matched_]) {
+                if (++raw_matched_ == raw_end_.size()) {
+                    state_ = TAG;
+                    tag_ = raw_end_.substr(1);
+                    quote_ = 0;
+                }
+            } else {
+                raw_matched_ = c == '<' ? 1 : 0;
+            }
+            break;
+        }
+    }
+
+    void tag(const string& content) {
+        bool closing = !content.empty() && content[0] == '/';
+        string name;
+        for (size_t i = closing ? 1 : 0; i < content.size() && isalnum(static_cast<unsigned char>(content[i])); i++) {
+            name += static_cast<char>(tolower(static_cast<unsigned char>(content[i])));
+        }
+        if (name.empty()) return; // <!DOCTYPE>, <?xml?> and stray '<'
+        static const set<string> RAW_ELEMENTS = {"script", "style", "noscript", "template", "svg", "textarea"};
+        static const set<string> HIDDEN_ELEMENTS = {"nav", "aside", "footer"};
+        static const set<string> BLOCK_ELEMENTS = {
+            "p", "div", "br", "hr", "li", "ul", "ol", "dl", "dt", "dd", "tr", "td", "th", "table", "section", "article",
+            "header", "main", "blockquote", "pre", "figure", "figcaption", "h1", "h2", "h3", "h4", "h5", "h6", "title"};
+        if (!closing && content.back() != '/' && RAW_ELEMENTS.count(name)) {
+            state_ = RAW;
+            raw_end_ = "</" + name;
+            raw_matched_ = 0;
+            return;
+        }
+        if (BLOCK_ELEMENTS.count(name)) end_paragraph();
+        if (name == "title") in_title_ = !closing;
+        if (HIDDEN_ELEMENTS.count(name)) hidden_depth_ = closing ? max(hidden_depth_ - 1, 0) : hidden_depth_ + 1;
+    }
+
+    void decode_entity() {
+        static const map<string, const char*> NAMED = {
+            {"amp", "&"}, {"lt", "<"}, {"gt", ">"}, {"quot", "\""}, {"apos", "'"}, {"nbsp", " "}, {"mdash", "—"},
+            {"ndash", "–"}, {"hellip", "…"}, {"lsquo", "‘"}, {"rsquo", "’"}, {"ldquo", "“"},
+            {"rdquo", "”"}, {"copy", "©"}, {"middot", "·"}, {"bull", "•"}};
+        if (!entity_.empty() && entity_[0] == '#') {
+            bool hex = entity_.size() > 1 && (entity_[1] == 'x' || entity_[1] == 'X');
+            uint32_t code = 0;
+            const char* begin = entity_.data() + (hex ? 2 : 1);
+            if (from_chars(begin, entity_.data() + entity_.size(), code, hex ? 16 : 10).ec != errc() || code == 0 || code > 0x10FFFF) {
+                return emit_literal_entity();
+            }
+            if (code == 0xA0) return text(' ');
+            string utf8;
+            if (code < 0x80) {
+                utf8 += static_cast<char>(code);
+            } else if (code < 0x800) {
+                utf8 += static_cast<char>(0xC0 | (code >> 6));
+                utf8 += static_cast<char>(0x80 | (code & 0x3F));
+            } else if (code < 0x10000) {
+                utf8 += static_cast<char>(0xE0 | (code >> 12));
+                utf8 += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                utf8 += static_cast<char>(0x80 | (code & 0x3F));
+            } else {
+                utf8 += static_cast<char>(0xF0 | (code >> 18));
+                utf8 += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                utf8 += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                utf8 += static_cast<char>(0x80 | (code & 0x3F));
+            }
+            for (char c : utf8) text(c);
+            return;
+        }
+        auto it = NAMED.find(entity_);
+        if (it == NAMED.end()) return emit_literal_entity();
+        for (const char* c = it->second; *c; c++) text(*c);
+    }
+
+    void emit_literal_entity() {
+        text('&');
+        for (char c : entity_) text(c);
+    }
+
+    void text(char c) {
+        bool space = c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f';
+        string& target = in_title_ ? title_ : current_;
+        if (!in_title_ && (hidden_depth_ > 0 || text_bytes_ >= max_text_)) return;
+        if (space) {
+            pending_space_ = !target.empty();
+            return;
+        }
+        if (pending_space_) target += ' ';
+        pending_space_ = false;
+        target += c;
+        if (!in_title_) text_bytes_++;
+    }
+
+    void end_paragraph() {
+        pending_space_ = false;
+        if (current_.empty()) return;
+        paragraphs_.push_back(move(current_));
+        current_.clear();
+    }
+
+    size_t max_text_;
+    State state_ = TEXT;
+    string tag_;
+    char quote_ = 0;
+    int dashes_ = 0;
+    string entity_;
+    string raw_end_;      // "</script" while inside one
+    size_t raw_matched_ = 0;
+    bool in_title_ = false;
+    int hidden_depth_ = 0;
+    bool pending_space_ = false;
+    string current_;
+    string title_;
+    vector<string> paragraphs_;
+    size_t text_bytes_ = 0;
+};
+
+struct FetchedPage {
+    string url;
+    string title;
+    vector<string> paragraphs;
+    size_t bytes = 0;
+    bool truncated = false; // Cut off at search_fetch_max_kb or by the timeout; the text so far is kept
+    string error;           // Set when nothing usable came back
+    double ms = 0;
+};
+
+// Fetches `urls` concurrently on the RequestEngine, extracting text while each body streams
+// in. Every page has search_fetch_timeout_ms and search_fetch_max_kb; Ctrl-C stops waiting.
+vector<FetchedPage> fetch_pages(const Config& config, const vector<string>& urls) {
+    struct PageState {
+        HtmlTextExtractor extractor;
+        size_t bytes = 0;
+        bool capped = false;
+        bool binary = false;
+    };
+    static const vector<string> TEXT_TYPES = {"text/html", "application/xhtml+xml", "text/plain"};
+    const size_t MAX_TITLE_BYTES = 200; // The title goes into the prompt beside the passages
+    size_t max_bytes = static_cast<size_t>(max(config.search_fetch_max_kb, 1)) << 10;
+    auto start = chrono::steady_clock::now();
+    vector<shared_ptr<PageState>> states;
+    vector<shared_ptr<PendingRequest>> requests;
+    for (const string& url : urls) {
+        auto state = make_shared<PageState>();
+        RequestSpec spec;
+        spec.url = url;
+        spec.headers = {"Accept: text/html,application/xhtml+xml,text/plain;q=0.9"};
+        spec.content_types = TEXT_TYPES;
+        spec.timeout_ms = config.search_fetch_timeout_ms;
+        spec.metric = "fetch";
+        spec.follow_redirects = true;
+        spec.on_data = [state, max_bytes](const char* data, size_t length) {
+            if (state->bytes == 0 && memchr(data, '\0', min<size_t>(length, 512))) { // A PDF or an image
+                state->binary = true;
+                return false;
+            }
+            size_t keep = min(length, max_bytes - state->bytes);
+            state->extractor.feed(data, keep);
+            state->bytes += keep;
+            if (keep == length) return true;
+            state->capped = true;
+            return false;
+        };
+        states.push_back(state);
+        requests.push_back(RequestEngine::instance().submit(move(spec)));
+    }
+
+    interrupt_requested = false;
+    foreground_requests++;
+    for (auto& request : requests) {
+        while (!request->wait_for(chrono::milliseconds(50))) {
+            if (!interrupt_requested) continue;
+            for (auto& pending : requests) pending->cancel();
+            break;
+        }
+    }
+    foreground_requests--;
+    for (auto& request : requests) request->wait();
+
+    vector<FetchedPage> pages(urls.size());
+    for (size_t i = 0; i < urls.size(); i++) {
+        PageState& state = *states[i];
+        const HttpResult& result = requests[i]->result();
+        FetchedPage& page = pages[i];
+        page.url = urls[i];
+        page.bytes = state.bytes;
+        page.ms = result.timing.total_ms > 0 ? result.timing.total_ms
+                                             : chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (state.binary || (!result.content_type.empty() && !content_type_matches(result.content_type, TEXT_TYPES))) {
+            page.error = "Not a text page";
+            continue;
+        }
+        if (result.status >= 400) {
+            page.error = "HTTP status " + to_string(result.status);
+            continue;
+        }
+        state.extractor.finish();
+        const string& title = state.extractor.title();
+        page.title = title.substr(0, utf8_complete_prefix(title.substr(0, MAX_TITLE_BYTES)));
+        page.paragraphs = state.extractor.paragraphs();
+        page.truncated = state.capped || (!result.ok() && !page.paragraphs.empty());
+        if (page.paragraphs.empty()) page.error = result.ok() ? "No text" : result.error();
+    }
+    return pages;
+}
+
+// Cuts the pages into passages of about PASSAGE_WORDS words, ranks them by BM25 against
+// `query` and returns the best that fit `token_budget`, grouped by page in reading order.
+// Paragraphs under MIN_WORDS words (menus, buttons, captions) are left out.
+string select_passages(const vector<FetchedPage>& pages, const string& query, int token_budget) {
+    const size_t PASSAGE_WORDS = 120;
+    const size_t MIN_WORDS = 6;
+    const double BM25_K1 = 1.2;
+    const double BM25_B = 0.75;
+    struct Passage {
+        size_t page;
+        size_t position;
+        string text;
+        unordered_map<string, int> terms;
+        size_t length = 0;
+        double score = 0;
+    };
+    auto for_each_term = [](const string& text, auto emit) {
+        string term;
+        for (size_t i = 0; i <= text.size(); i++) {
+            unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+            if (isalnum(c) || c >= 0x80) {
+                term += static_cast<char>(tolower(c));
+            } else {
+                if (term.size() > 1) emit(term);
+                term.clear();
+            }
+        }
+    };
+    auto word_count = [](const string& text) {
+        return static_cast<size_t>(count_if(text.begin(), text.end(), [](char c) { return c == ' ' || c == '\n'; })) + 1;
+    };
+
+    vector<Passage> passages;
+    set<uint64_t> seen; // Boilerplate repeated across pages is kept once
+    for (size_t p = 0; p < pages.size(); p++) {
+        string current;
+        size_t position = 0;
+        auto flush = [&]() {
+            if (current.empty()) return;
+            if (seen.insert(fnv1a64(current)).second) passages.push_back({p, position++, move(current), {}, 0, 0});
+            current.clear();
+        };
+        for (const string& paragraph : pages[p].paragraphs) {
+            if (word_count(paragraph) < MIN_WORDS) continue;
+            // Long paragraphs are cut at the sentence end nearest each PASSAGE_WORDS words
+            size_t begin = 0;
+            while (begin < paragraph.size()) {
+                size_t end = begin, words = 0;
+                while (end < paragraph.size() && words < PASSAGE_WORDS) {
+                    end = paragraph.find(' ', end + 1);
+                    if (end == string::npos) end = paragraph.size();
+                    words++;
+                }
+                if (end < paragraph.size()) {
+                    size_t sentence = paragraph.rfind(". ", end);
+                    if (sentence != string::npos && sentence > begin && word_count(paragraph.substr(begin, sentence - begin)) >= PASSAGE_WORDS / 2) {
+                        end = sentence + 1;
+                    }
+                }
+                string piece = paragraph.substr(begin, end - begin);
+                if (!current.empty() && word_count(current) + word_count(piece) > PASSAGE_WORDS) flush();
+                current += (current.empty() ? "" : "\n") + piece;
+                begin = paragraph.find_first_not_of(' ', end);
+                if (begin == string::npos) break;
+            }
+        }
+        flush();
+    }
+    if (passages.empty()) return {};
+
+    unordered_map<string, int> document_frequency;
+    double total_length = 0;
+    for (Passage& passage : passages) {
+        for_each_term(passage.text, [&](const string& term) {
+            if (passage.terms[term]++ == 0) document_frequency[term]++;
+            passage.length++;
+        });
+        total_length += passage.length;
+    }
+    double average_length = max(total_length / passages.size(), 1.0);
+    set<string> query_terms;
+    for_each_term(query, [&](const string& term) { query_terms.insert(term); });
+    for (Passage& passage : passages) {
+        for (const string& term : query_terms) {
+            auto it = passage.terms.find(term);
+            if (it == passage.terms.end()) continue;
+            double df = document_frequency[term];
+            double idf = log(1 + (passages.size() - df + 0.5) / (df + 0.5));
+            double tf = it->second;
+            passage.score += idf * tf * (BM25_K1 + 1) / (tf + BM25_K1 * (1 - BM25_B + BM25_B * passage.length / average_length));
+        }
+    }
+
+    // Best first; passages nothing matches fall back to the start of each page in turn
+    vector<size_t> order(passages.size());
+    iota(order.begin(), order.end(), 0);
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (passages[a].score != passages[b].score) return passages[a].score > passages[b].score;
+        if (passages[a].position != passages[b].position) return passages[a].position < passages[b].position;
+        return passages[a].page < passages[b].page;
+    });
+    vector<size_t> chosen;
+    int used = 0;
+    for (size_t index : order) {
+        int tokens = Tokenizer::instance().count(passages[index].text) + 8; // Plus its reference line
+        if (used + tokens > token_budget) continue;
+        used += tokens;
+        chosen.push_back(index);
+    }
+    sort(chosen.begin(), chosen.end(), [&](size_t a, size_t b) {
+        return make_pair(passages[a].page, passages[a].position) < make_pair(passages[b].page, passages[b].position);
+    });
+
+    string context = "Passages from the result pages. Use them to answer when they are relevant and name the pages you use.\n";
+    size_t last_page = SIZE_MAX;
+    for (size_t index : chosen) {
+        const Passage& passage = passages[index];
+        if (passage.page != last_page) {
+            const FetchedPage& page = pages[passage.page];
+            context += "\n[" + to_string(passage.page + 1) + "] " + page.url + (page.title.empty() ? "" : " (" + page.title + ")") + "\n";
+            last_page = passage.page;
+        }
+        context += passage.text + "\n";
+    }
+    return chosen.empty() ? string() : context;
+}
+
+string web_search_with_selection(const Config& config, const string& query) {
+    display_status("Starting Web Search: " + query, COLOR_HIGHLIGHT, "ℹ");
+
+    Renderer::instance().start_spinner("Searching web resources", COLOR_GRADIENT_1);
+    vector<SearchResult> results = SearchService::instance().search(config, query);
+    Renderer::instance().stop_spinner();
+
+    if (results.empty()) {
+        cout << COLOR_RED << "No related topics found for your search." << COLOR_RESET << endl;
+        return "No results."; // Return early if no results
+    }
+
+    cout << COLOR_SUCCESS << "\n📚 NSFW Search Results" << COLOR_RESET << endl;
+    cout << generate_border(30) << endl;
+
+    vector<string> search_results;
+    for (size_t i = 0; i < min<size_t>(10, results.size()); i++) {
+        search_results.push_back(results[i].text);
+    }
+
+    display_results(search_results);
+
+    int count = static_cast<int>(search_results.size());
+    cout << COLOR_HIGHLIGHT << "Select result (1-" << count << "): " << COLOR_RESET;
+
+    int selection;
+    while (!(cin >> selection) || selection < 1 || selection > count) {
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        cout << COLOR_ALERT << "Please enter a number between 1 and " << count << ": " << COLOR_RESET;
+    }
+    cin.ignore();
+
+    display_status("NSFW Search completed successfully", COLOR_SUCCESS, "✓");
+    string selected = search_results[selection - 1];
+    if (config.search_fetch_pages <= 0) return selected;
+
+    // The chosen result's page first, then the next best, so the analysis reads more than a snippet
+    vector<string> urls;
+    auto add_url = [&urls](const string& url) {
+        if ((url.compare(0, 7, "http://") == 0 || url.compare(0, 8, "https://") == 0) && find(urls.begin(), urls.end(), url) == urls.end()) {
+            urls.push_back(url);
+        }
+    };
+    add_url(results[selection - 1].url);
+    for (size_t i = 0; i < results.size() && urls.size() < static_cast<size_t>(config.search_fetch_pages); i++) add_url(results[i].url);
+    if (urls.empty()) return selected;
+
+    Renderer::instance().start_spinner("Reading " + to_string(urls.size()) + (urls.size() == 1 ? " page" : " pages"), COLOR_GRADIENT_1);
+    vector<FetchedPage> pages = fetch_pages(config, urls);
+    Renderer::instance().stop_spinner();
+    for (size_t i = 0; i < pages.size(); i++) {
+        const FetchedPage& page = pages[i];
+        cout << COLOR_GRADIENT_2 << "[" << i + 1 << "] " << page.url << COLOR_RESET;
+        if (!page.error.empty()) {
+            cout << COLOR_YELLOW << " (" << page.error << ")" << COLOR_RESET;
+        } else if (config.debug_mode) {
+            cout << COLOR_YELLOW << " (" << (page.bytes >> 10) << " KiB" << (page.truncated ? ", cut off" : "") << ", "
+                 << static_cast<long>(page.ms) << " ms)" << COLOR_RESET;
+        }
+        cout << endl;
+    }
+    string passages = select_passages(pages, query, config.search_context_tokens);
+    return passages.empty() ? selected : selected + "\n\n" + passages;
+}
+
+// Append-only JSONL session journal replacing the old save-on-exit session file.
+// Each message is written as it is produced ({"role":..,"content":..,"ts":..}) and each
+// program run starts with a {"session":ts} marker. fdatasync is batched by record count
+// and age, a torn last line left by a crash is cut off on open, and reads go through mmap
+// from the end of the file so resuming only parses the records it needs. Several REPLs
+// may share one journal: appends hold a shared flock, compaction an exclusive one, and a
+// writer whose file was compacted away by another process reopens the new one.
+class SessionJournal {
+public:
+    ~SessionJournal() {
+        if (fd_ >= 0) {
+            sync();
+            ::close(fd_);
+        }
+    }
+
+    bool open(const string& path, const Config& config) {
+        path_ = path;
+        fsync_every_ = max(config.journal_fsync_every, 1);
+        fsync_interval_ = chrono::milliseconds(config.journal_fsync_ms);
+        max_messages_ = static_cast<size_t>(max(config.journal_max_messages, 1));
+
+        bool fresh = !filesystem::exists(path_);
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd_ < 0) {
+            cerr << COLOR_RED << "Error: Unable to open session journal " << path_ << COLOR_RESET << endl;
+            return false;
+        }
+        lock_current(LOCK_EX);
+        recover_torn_tail();
+        if (fresh && filesystem::exists(SESSION_FILE)) import_legacy_session();
+        flock(fd_, LOCK_UN);
+
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && st.st_size > JOURNAL_COMPACT_BYTES) compact();
+        if (fd_ < 0) return false;
+        if (fstat(fd_, &st) == 0) session_start_ = st.st_size;
+        last_sync_ = chrono::steady_clock::now();
+        return true;
+    }
+
+    // Journals message `i` of `messages`, reusing its cached serialization
+    void append(const MessageStore& messages, size_t i) {
+        if (fd_ < 0) return;
+        string record;
+        if (!session_marked_) {
+            record = "{\"session\":" + to_string(time(nullptr)) + "}\n";
+            session_marked_ = true;
+        }
+        string_view message = messages.serialized(i);
+        record.append(message.substr(0, message.size() - 1));
+        record += ",\"ts\":" + to_string(time(nullptr)) + "}\n";
+        if (!lock_current(LOCK_SH)) return;
+        write_all(record);
+        flock(fd_, LOCK_UN);
+
+        if (++unsynced_ >= fsync_every_ || chrono::steady_clock::now() - last_sync_ >= fsync_interval_) sync();
+    }
+
+    void sync() {
+        if (fd_ < 0 || unsynced_ == 0) return;
+        fdatasync(fd_);
+        unsynced_ = 0;
+        last_sync_ = chrono::steady_clock::now();
+    }
+
+    // Last `count` messages, oldest first. With `before_session` only earlier runs are read.
+    vector<json> tail(size_t count, bool before_session) const {
+        return read_tail(path_, count, before_session ? static_cast<size_t>(session_start_) : SIZE_MAX);
+    }
+
+    // Last `count` messages of the journal at `path` that end before byte `limit`
+    static vector<json> read_tail(const string& path, size_t count, size_t limit = SIZE_MAX) {
+        vector<json> records;
+        MappedFile file(path);
+        if (!file.data()) return records;
+        size_t end = min(limit, file.size());
+        while (end > 0 && records.size() < count) {
+            const char* data = file.data();
+            size_t line_end = end;
+            if (data[line_end - 1] == '\n') line_end--;
+            const void* newline = line_end ? memrchr(data, '\n', line_end) : nullptr;
+            size_t line_start = newline ? static_cast<const char*>(newline) - data + 1 : 0;
+            try {
+                json record = json::parse(data + line_start, data + line_end);
+                if (record.contains("role")) records.push_back(move(record));
+            } catch (const json::parse_error&) {
+                // Skip damaged lines; compaction removes them
+            }
+            end = line_start;
+        }
+        reverse(records.begin(), records.end());
+        return records;
+    }
+
+    // Rewrites the journal without damaged lines, keeping the newest journal_max_messages
+    // messages. The new file is written beside the old one and renamed over it.
+    bool compact() {
+        sync();
+        if (!lock_current(LOCK_EX)) return false;
+        MappedFile file(path_);
+        if (!file.data()) {
+            flock(fd_, LOCK_UN);
+            return true;
+        }
+
+        vector<pair<size_t, size_t>> lines; // [start, end) of every valid line
+        size_t message_count = 0;
+        for (size_t pos = 0; pos < file.size();) {
+            const void* newline = memchr(file.data() + pos, '\n', file.size() - pos);
+            size_t end = newline ? static_cast<const char*>(newline) - file.data() : file.size();
+            if (json::accept(file.data() + pos, file.data() + end)) {
+                lines.emplace_back(pos, end);
+                if (string_view(file.data() + pos, end - pos).find("\"role\"") != string_view::npos) message_count++;
+            }
+            pos = end + 1;
+        }
+
+        string temp_path = path_ + ".tmp";
+        int out = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) {
+            flock(fd_, LOCK_UN);
+            return false;
+        }
+        bool ok = true;
+        size_t skip = message_count > max_messages_ ? message_count - max_messages_ : 0;
+        string buffer;
+        size_t written = 0;
+        off_t new_session_start = -1;
+        for (const auto& line : lines) {
+            string_view text(file.data() + line.first, line.second - line.first);
+            bool is_message = text.find("\"role\"") != string_view::npos;
+            if (skip > 0) {
+                if (is_message) skip--;
+                continue;
+            }
+            if (new_session_start < 0 && static_cast<off_t>(line.first) >= session_start_ && session_start_ > 0) {
+                new_session_start = written + buffer.size();
+            }
+            buffer.append(text).push_back('\n');
+            if (buffer.size() >= (1 << 20)) {
+                written += buffer.size();
+                ok = ok && write_fd(out, buffer);
+                buffer.clear();
+            }
+        }
+        written += buffer.size();
+        ok = ok && write_fd(out, buffer) && fsync(out) == 0;
+        ok = ::close(out) == 0 && ok;
+
+        // A short copy (ENOSPC, EIO) must never replace the journal
+        if (!ok || rename(temp_path.c_str(), path_.c_str()) != 0) {
+            unlink(temp_path.c_str());
+            flock(fd_, LOCK_UN);
+            return false;
+        }
+        ::close(fd_); // Also releases the lock; waiting writers see the new inode and reopen
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        session_start_ = new_session_start >= 0 ? new_session_start : static_cast<off_t>(written);
+        return fd_ >= 0;
+    }
+
+private:
+    static const off_t JOURNAL_COMPACT_BYTES = 64 << 20;
+
+    static bool write_fd(int fd, const string& data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            offset += n;
+        }
+        return true;
+    }
+
+    void write_all(const string& data) {
+        write_fd(fd_, data);
+    }
+
+    // Locks fd_ with `operation` (LOCK_SH or LOCK_EX). If another process compacted the
+    // journal meanwhile, fd_ refers to the unlinked old file: flush, reopen the path and lock
+    // again. Our earlier records were moved, so this run's messages then count as earlier runs.
+    bool lock_current(int operation) {
+        while (fd_ >= 0) {
+            flock(fd_, operation);
+            struct stat open_st, path_st;
+            if (fstat(fd_, &open_st) != 0 || stat(path_.c_str(), &path_st) != 0 ||
+                (open_st.st_ino == path_st.st_ino && open_st.st_dev == path_st.st_dev)) {
+                return true;
+            }
+            sync();
+            ::close(fd_);
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+            if (fd_ >= 0 && fstat(fd_, &open_st) == 0) session_start_ = open_st.st_size;
+        }
+        return false;
+    }
+
+    // A crash mid-write can leave a partial last line; cut the file back to the last newline
+    void recover_torn_tail() {
+        MappedFile file(path_);
+        if (!file.data() || file.data()[file.size() - 1] == '\n') return;
+        const void* newline = memrchr(file.data(), '\n', file.size());
+        off_t keep = newline ? static_cast<const char*>(newline) - file.data() + 1 : 0;
+        if (ftruncate(fd_, keep) == 0) {
+            cerr << COLOR_ALERT << "Recovered session journal: dropped a partial record" << COLOR_RESET << endl;
+        }
+    }
+
+    void import_legacy_session() {
+        json legacy = load_json_file(SESSION_FILE);
+        if (!legacy.is_array()) return;
+        string records = "{\"session\":0}\n";
+        for (const auto& message : legacy) {
+            if (message.contains("role") && message.contains("content")) {
+                records += message.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+            }
+        }
+        write_all(records);
+        sync();
+    }
+
+    string path_;
+    int fd_ = -1;
+    off_t session_start_ = 0; // Journal size when this run started
+    bool session_marked_ = false;
+    int unsynced_ = 0;
+    int fsync_every_ = 8;
+    chrono::milliseconds fsync_interval_{1000};
+    size_t max_messages_ = 50000;
+    chrono::steady_clock::time_point last_sync_;
+};
+
+// Full-text index over the session journal for history:search. Messages are split into
+// lowercase terms; each term's postings list holds (document delta, term frequency) pairs
+// as varints, and documents are journal records (byte offset, timestamp, role, length),
+// so hits are ranked with BM25 and read back from the journal itself. The saved index is
+// one file, mapped read-only: a header, the document table, the postings, the sorted term
+// table and the term text. It covers a prefix of the journal, identified by inode, length
+// and a hash of its last bytes; records journaled after that are indexed in memory when
+// update() runs, and folded into the file once there are enough of them. A rewritten
+// journal (session:compact) is detected and indexed again from scratch.
+class HistoryIndex {
+public:
+    enum Role : uint32_t { ROLE_USER = 1, ROLE_ASSISTANT = 2, ROLE_SYSTEM = 4, ROLE_OTHER = 8 };
+
+    struct Filter {
+        uint32_t roles = 0;            // Role bits to keep; 0 keeps every role
+        int64_t since = 0;             // Unix time bounds, inclusive
+        int64_t until = INT64_MAX;
+    };
+
+    struct Hit {
+        double score;
+        int64_t ts;
+        string role;
+        string content;
+    };
+
+    void open(const string& index_path, const string& journal_path) {
+        index_path_ = index_path;
+        journal_path_ = journal_path;
+        map_index();
+    }
+
+    // Indexes the journal records written since the last call
+    void update() {
+        struct stat st;
+        if (::stat(journal_path_.c_str(), &st) != 0) return;
+        MappedFile journal(journal_path_);
+        uint64_t inode = st.st_ino;
+        if (inode != journal_inode_ || static_cast<uint64_t>(st.st_size) < indexed_bytes_ ||
+            (base_ && pending_docs_.empty() && indexed_bytes_ == header().journal_bytes &&
+             prefix_check(journal, indexed_bytes_) != header().journal_check)) {
+            reset(inode); // Compacted, truncated or replaced
+        }
+        if (!journal.data()) return;
+
+        string_view text(journal.data(), journal.size());
+        size_t end = text.rfind('\n');
+        if (end == string_view::npos || end + 1 <= indexed_bytes_) return;
+        for (size_t pos = indexed_bytes_; pos <= end;) {
+            size_t line_end = text.find('\n', pos);
+            add_record(text.substr(pos, line_end - pos), pos);
+            pos = line_end + 1;
+        }
+        indexed_bytes_ = end + 1;
+        if (pending_docs_.size() >= max<size_t>(MERGE_MIN_DOCS, base_docs() / 16)) save(journal);
+    }
+
+    // Best `limit` messages for the query's terms, highest BM25 score first
+    vector<Hit> search(string_view query, const Filter& filter, size_t limit) {
+        vector<Hit> hits;
+        size_t doc_count = base_docs() + pending_docs_.size();
+        if (doc_count == 0) return hits;
+        vector<string> query_terms;
+        string text(query);
+        for_each_term(text, [&](string_view term) { query_terms.emplace_back(term); });
+        sort(query_terms.begin(), query_terms.end());
+        query_terms.erase(unique(query_terms.begin(), query_terms.end()), query_terms.end());
+
+        uint64_t total_length = (base_ ? header().total_length : 0) + pending_length_;
+        double average_length = max(1.0, static_cast<double>(total_length) / doc_count);
+        scores_.resize(doc_count);
+        touched_.clear();
+        for (const string& term : query_terms) {
+            vector<pair<string_view, uint32_t>> lists; // Encoded postings and the id they count from
+            uint32_t doc_freq = 0;
+            if (const TermEntry* entry = find_term(term)) {
+                lists.emplace_back(string_view(base_->data() + header().postings_offset + entry->postings_offset, entry->postings_bytes), 0);
+                doc_freq += entry->doc_freq;
+            }
+            size_t slot = term_slots_.empty() ? 0 : find_slot(term, fnv1a64(term));
+            if (!term_slots_.empty() && term_slots_[slot] != 0) {
+                const Pending& postings = pending_terms_[term_slots_[slot] - 1];
+                lists.emplace_back(string_view(reinterpret_cast<const char*>(postings.bytes.data()), postings.bytes.size()), 0);
+                doc_freq += postings.doc_freq;
+            }
+            if (doc_freq == 0) continue;
+            double idf = log(1 + (doc_count - doc_freq + 0.5) / (doc_freq + 0.5));
+            for (auto [bytes, doc] : lists) {
+                const uint8_t* cursor = reinterpret_cast<const uint8_t*>(bytes.data());
+                const uint8_t* stop = cursor + bytes.size();
+                while (cursor < stop) {
+                    doc += static_cast<uint32_t>(read_varint(cursor, stop));
+                    uint32_t tf = static_cast<uint32_t>(read_varint(cursor, stop));
+                    if (doc >= doc_count) break; // Damaged postings
+                    const DocEntry& meta = document(doc);
+                    if ((filter.roles && !(filter.roles & meta.role)) || meta.ts < filter.since || meta.ts > filter.until) continue;
+                    double norm = tf + BM25_K1 * (1 - BM25_B + BM25_B * meta.length / average_length);
+                    if (scores_[doc] == 0) touched_.push_back(doc);
+                    scores_[doc] += static_cast<float>(idf * tf * (BM25_K1 + 1) / norm);
+                }
+            }
+        }
+
+        size_t count = min(limit, touched_.size());
+        partial_sort(touched_.begin(), touched_.begin() + count, touched_.end(),
+                     [this](uint32_t a, uint32_t b) { return scores_[a] != scores_[b] ? scores_[a] > scores_[b] : a > b; });
+        MappedFile journal(journal_path_);
+        for (size_t i = 0; i < count && journal.data(); i++) {
+            const DocEntry& meta = document(touched_[i]);
+            string_view text(journal.data(), journal.size());
+            if (meta.offset >= text.size()) continue;
+            string_view line = text.substr(meta.offset, text.find('\n', meta.offset) - meta.offset);
+            JsonView record = JsonView::parse(line);
+            hits.push_back({scores_[touched_[i]], meta.ts, record["role"].string_or(""), record["content"].string_or("")});
+        }
+        for (uint32_t doc : touched_) scores_[doc] = 0;
+        return hits;
+    }
+
+    size_t size() const { return base_docs() + pending_docs_.size(); }
+
+    // Lowercases `text` and calls emit(term) for each word in it: runs of ASCII letters and
+    // digits, with any non-ASCII bytes kept as part of the word, cut to MAX_TERM bytes.
+    // Single letters are skipped.
+    template <typename F>
+    static void for_each_term(string& text, F emit) {
+        size_t start = 0;
+        for (size_t i = 0; i <= text.size(); i++) {
+            char folded = i < text.size() ? TERM_BYTES[static_cast<unsigned char>(text[i])] : 0;
+            if (folded) {
+                text[i] = folded;
+                continue;
+            }
+            size_t length = i - start;
+            if (length > 1 || (length == 1 && text[start] >= '0' && text[start] <= '9')) {
+                emit(string_view(text.data() + start, min(length, MAX_TERM)));
+            }
+            start = i + 1;
+        }
+    }
+
+private:
+    static constexpr size_t MAX_TERM = 32;
+    static constexpr size_t MERGE_MIN_DOCS = 2000; // Pending records folded into the file at once, at least
+    static constexpr size_t TERM_SLOTS_INITIAL = 1 << 10;
+    static constexpr double BM25_K1 = 1.2;
+    static constexpr double BM25_B = 0.75;
+    // Each byte lowercased, or 0 for the bytes that separate words
+    static constexpr array<char, 256> TERM_BYTES = [] {
+        array<char, 256> table{};
+        for (int b = 0; b < 256; b++) {
+            if ((b >= 'a' && b <= 'z') || (b >= '0' && b <= '9') || b >= 0x80) table[b] = static_cast<char>(b);
+            else if (b >= 'A' && b <= 'Z') table[b] = static_cast<char>(b + 32);
+        }
+        return table;
+    }();
+    static constexpr char MAGIC[8] = {'G', 'H', 'I', 'D', 'X', '0', '0', '1'};
+
+    // On-disk layout, host byte order (the index is a local cache beside the journal)
+    struct Header {
+        char magic[8];
+        uint64_t journal_inode;
+        uint64_t journal_bytes;   // Journal prefix the file covers...
+        uint64_t journal_check;   // ...and fnv1a64 of its last 256 bytes
+        uint64_t doc_count;
+        uint64_t term_count;
+        uint64_t total_length;    // Terms in all documents, for BM25's average length
+        uint64_t postings_offset;
+        uint64_t terms_offset;
+        uint64_t text_offset;
+    };
+    struct DocEntry {
+        uint64_t offset;          // Of the record in the journal
+        int64_t ts;
+        uint32_t length;          // In terms
+        uint32_t role;
+    };
+    struct TermEntry {
+        uint64_t postings_offset; // Relative to Header::postings_offset
+        uint32_t postings_bytes;
+        uint32_t doc_freq;
+        uint32_t last_doc;        // So appended postings can continue the delta coding
+        uint32_t text_offset;     // Relative to Header::text_offset
+        uint32_t text_length;
+        uint32_t reserved;
+    };
+    // Postings of records not yet in the file, with absolute ids delta coded like the file's
+    struct Pending {
+        string term;
+        uint64_t hash;
+        vector<uint8_t> bytes;
+        uint32_t doc_freq = 0;
+        uint32_t last_doc = 0;
+    };
+
+    const Header& header() const { return *reinterpret_cast<const Header*>(base_->data()); }
+    size_t base_docs() const { return base_ ? header().doc_count : 0; }
+
+    const DocEntry& document(uint32_t doc) const {
+        if (doc < base_docs()) return reinterpret_cast<const DocEntry*>(base_->data() + sizeof(Header))[doc];
+        return pending_docs_[doc - base_docs()];
+    }
+
+    const TermEntry* find_term(string_view term) const {
+        if (!base_) return nullptr;
+        const TermEntry* terms = reinterpret_cast<const TermEntry*>(base_->data() + header().terms_offset);
+        const char* text = base_->data() + header().text_offset;
+        const TermEntry* end = terms + header().term_count;
+        const TermEntry* it = lower_bound(terms, end, term, [text](const TermEntry& entry, string_view value) {
+            return string_view(text + entry.text_offset, entry.text_length) < value;
+        });
+        return it != end && string_view(text + it->text_offset, it->text_length) == term ? it : nullptr;
+    }
+
+    // Maps the saved index if every section and term lies inside the file. A damaged file
+    // is left unmapped, so update() rebuilds the index from the journal.
+    void map_index() {
+        base_.reset(new MappedFile(index_path_));
+        if (!base_->data() || !valid_layout(*base_)) {
+            base_.reset();
+            return;
+        }
+        journal_inode_ = header().journal_inode;
+        indexed_bytes_ = header().journal_bytes;
+    }
+
+    static bool valid_layout(const MappedFile& file) {
+        uint64_t size = file.size();
+        if (size < sizeof(Header)) return false;
+        const Header& saved = *reinterpret_cast<const Header*>(file.data());
+        if (memcmp(saved.magic, MAGIC, sizeof(MAGIC)) != 0 || saved.doc_count > (size - sizeof(Header)) / sizeof(DocEntry) ||
+            saved.postings_offset != sizeof(Header) + saved.doc_count * sizeof(DocEntry) ||
+            saved.terms_offset < saved.postings_offset || saved.terms_offset > size || saved.terms_offset % 8 != 0 ||
+            saved.term_count > (size - saved.terms_offset) / sizeof(TermEntry) ||
+            saved.text_offset != saved.terms_offset + saved.term_count * sizeof(TermEntry)) {
+            return false;
+        }
+        uint64_t postings_size = saved.terms_offset - saved.postings_offset;
+        uint64_t text_size = size - saved.text_offset;
+        const TermEntry* terms = reinterpret_cast<const TermEntry*>(file.data() + saved.terms_offset);
+        for (uint64_t i = 0; i < saved.term_count; i++) {
+            const TermEntry& entry = terms[i];
+            if (entry.postings_offset > postings_size || entry.postings_bytes > postings_size - entry.postings_offset ||
+                entry.text_offset > text_size || entry.text_length > text_size - entry.text_offset) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void reset(uint64_t inode) {
+        base_.reset();
+        pending_docs_.clear();
+        pending_terms_.clear();
+        term_slots_.clear();
+        pending_length_ = 0;
+        journal_inode_ = inode;
+        indexed_bytes_ = 0;
+    }
+
+    static uint64_t prefix_check(const MappedFile& journal, uint64_t bytes) {
+        if (!journal.data() || bytes > journal.size()) return 0;
+        size_t start = bytes > 256 ? bytes - 256 : 0;
+        return fnv1a64(string_view(journal.data() + start, bytes - start));
+    }
+
+    void add_record(string_view line, uint64_t offset) {
+        JsonView record = JsonView::parse(line);
+        string content;
+        if (!record["content"].get(content)) return; // Session markers and damaged lines
+        string role = record["role"].string_or("");
+        DocEntry meta{offset, record["ts"].integer_or(0), 0,
+                      role == "user" ? ROLE_USER : role == "assistant" ? ROLE_ASSISTANT : role == "system" ? ROLE_SYSTEM : ROLE_OTHER};
+        uint32_t doc = static_cast<uint32_t>(size());
+
+        terms_.clear();
+        for_each_term(content, [this](string_view term) { terms_.push_back(pending_postings(term)); });
+        sort(terms_.begin(), terms_.end());
+        for (size_t i = 0; i < terms_.size();) {
+            size_t j = i + 1;
+            while (j < terms_.size() && terms_[j] == terms_[i]) j++;
+            Pending& postings = pending_terms_[terms_[i]];
+            write_varint(postings.bytes, doc - postings.last_doc);
+            write_varint(postings.bytes, j - i);
+            postings.last_doc = doc;
+            postings.doc_freq++;
+            i = j;
+        }
+        meta.length = static_cast<uint32_t>(terms_.size());
+        pending_length_ += meta.length;
+        pending_docs_.push_back(meta);
+    }
+
+    // Slot of `term` in term_slots_: the one holding it, or the empty one it would go in
+    size_t find_slot(string_view term, uint64_t hash) const {
+        size_t slot = hash & (term_slots_.size() - 1);
+        while (term_slots_[slot] != 0) {
+            const Pending& entry = pending_terms_[term_slots_[slot] - 1];
+            if (entry.hash == hash && entry.term == term) break;
+            slot = (slot + 1) & (term_slots_.size() - 1);
+        }
+        return slot;
+    }
+
+    // Index of `term` in pending_terms_, added if new
+    uint32_t pending_postings(string_view term) {
+        if (term_slots_.empty()) term_slots_.assign(TERM_SLOTS_INITIAL, 0);
+        uint64_t hash = fnv1a64(term);
+        size_t slot = find_slot(term, hash);
+        if (term_slots_[slot] != 0) return term_slots_[slot] - 1;
+        pending_terms_.push_back({string(term), hash, {}, 0, 0});
+        term_slots_[slot] = static_cast<uint32_t>(pending_terms_.size());
+        if (pending_terms_.size() * 2 > term_slots_.size()) {
+            term_slots_.assign(term_slots_.size() * 2, 0);
+            for (size_t i = 0; i < pending_terms_.size(); i++) {
+                term_slots_[find_slot(pending_terms_[i].term, pending_terms_[i].hash)] = static_cast<uint32_t>(i + 1);
+            }
+        }
+        return static_cast<uint32_t>(pending_terms_.size() - 1);
+    }
+
+    // Writes the file's documents and terms merged with the pending ones, then maps the result
+    bool save(const MappedFile& journal) {
+        string temp_path = index_path_ + ".tmp";
+        ofstream out(temp_path, ios::binary | ios::trunc);
+        if (!out) return false;
+        Header saved{};
+        memcpy(saved.magic, MAGIC, sizeof(MAGIC));
+        saved.journal_inode = journal_inode_;
+        saved.journal_bytes = indexed_bytes_;
+        saved.journal_check = prefix_check(journal, indexed_bytes_);
+        saved.doc_count = size();
+        saved.total_length = (base_ ? header().total_length : 0) + pending_length_;
+        out.write(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        if (base_) out.write(base_->data() + sizeof(Header), base_docs() * sizeof(DocEntry));
+        out.write(reinterpret_cast<const char*>(pending_docs_.data()), pending_docs_.size() * sizeof(DocEntry));
+        saved.postings_offset = sizeof(Header) + saved.doc_count * sizeof(DocEntry);
+
+        vector<pair<string_view, const Pending*>> added;
+        added.reserve(pending_terms_.size());
+        for (const Pending& postings : pending_terms_) added.emplace_back(postings.term, &postings);
+        sort(added.begin(), added.end());
+
+        vector<TermEntry> terms;
+        string text;
+        uint64_t postings_bytes = 0;
+        const TermEntry* base_terms = base_ ? reinterpret_cast<const TermEntry*>(base_->data() + header().terms_offset) : nullptr;
+        size_t base_count = base_ ? header().term_count : 0;
+        const char* base_text = base_ ? base_->data() + header().text_offset : nullptr;
+        const char* base_postings = base_ ? base_->data() + header().postings_offset : nullptr;
+        vector<uint8_t> head;
+        for (size_t b = 0, a = 0; b < base_count || a < added.size();) {
+            string_view base_term = b < base_count ? string_view(base_text + base_terms[b].text_offset, base_terms[b].text_length) : string_view();
+            bool take_base = b < base_count && (a == added.size() || base_term <= added[a].first);
+            bool take_added = a < added.size() && (b == base_count || added[a].first <= base_term);
+            TermEntry entry{postings_bytes, 0, 0, 0, static_cast<uint32_t>(text.size()), 0, 0};
+            text.append(take_base ? base_term : added[a].first);
+            entry.text_length = static_cast<uint32_t>(text.size() - entry.text_offset);
+            if (take_base) {
+                const TermEntry& old = base_terms[b++];
+                out.write(base_postings + old.postings_offset, old.postings_bytes);
+                entry.postings_bytes = old.postings_bytes;
+                entry.doc_freq = old.doc_freq;
+                entry.last_doc = old.last_doc;
+            }
+            if (take_added) {
+                const Pending& postings = *added[a++].second;
+                // The first delta counts from 0; re-encode it from the file's last document
+                const uint8_t* cursor = postings.bytes.data();
+                uint32_t first = static_cast<uint32_t>(read_varint(cursor, postings.bytes.data() + postings.bytes.size()));
+                head.clear();
+                write_varint(head, first - entry.last_doc);
+                out.write(reinterpret_cast<const char*>(head.data()), head.size());
+                size_t rest = postings.bytes.size() - (cursor - postings.bytes.data());
+                out.write(reinterpret_cast<const char*>(cursor), rest);
+                entry.postings_bytes += static_cast<uint32_t>(head.size() + rest);
+                entry.doc_freq += postings.doc_freq;
+                entry.last_doc = postings.last_doc;
+            }
+            postings_bytes += entry.postings_bytes;
+            terms.push_back(entry);
+        }
+        saved.term_count = terms.size();
+        saved.terms_offset = saved.postings_offset + postings_bytes;
+        saved.terms_offset += (8 - saved.terms_offset % 8) % 8; // TermEntry is read in place
+        out.write("\0\0\0\0\0\0\0", saved.terms_offset - saved.postings_offset - postings_bytes);
+        out.write(reinterpret_cast<const char*>(terms.data()), terms.size() * sizeof(TermEntry));
+        saved.text_offset = saved.terms_offset + terms.size() * sizeof(TermEntry);
+        out.write(text.data(), text.size());
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        out.close();
+        if (!out || rename(temp_path.c_str(), index_path_.c_str()) != 0) return false;
+
+        pending_docs_.clear();
+        pending_terms_.clear();
+        term_slots_.clear();
+        pending_length_ = 0;
+        map_index();
+        return true;
+    }
+
+    static void write_varint(vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Stops at `stop`, or after ten bytes, if the value is damaged
+    static uint64_t read_varint(const uint8_t*& cursor, const uint8_t* stop) {
+        uint64_t value = 0;
+        for (int shift = 0; cursor < stop && shift < 64; shift += 7) {
+            uint8_t byte = *cursor++;
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        return value;
+    }
+
+    string index_path_;
+    string journal_path_;
+    unique_ptr<MappedFile> base_;       // Saved index, if any
+    uint64_t journal_inode_ = 0;
+    uint64_t indexed_bytes_ = 0;        // Journal bytes covered by the file and the pending records
+    vector<DocEntry> pending_docs_;
+    vector<Pending> pending_terms_;
+    vector<uint32_t> term_slots_;       // Open addressing over pending_terms_ by hash; 0 is empty, else index + 1
+    uint64_t pending_length_ = 0;
+    vector<uint32_t> terms_;            // Scratch space of add_record()
+    vector<float> scores_;              // Per document, zero outside search()
+    vector<uint32_t> touched_;
+};
+
+// Splits history:search input into search terms and role:, since: and until: filters.
+// Times are a date (YYYY-MM-DD, local time) or an age such as 12h, 7d or 2w.
+bool parse_history_query(const string& input, string& terms, HistoryIndex::Filter& filter, string& error) {
+    auto parse_time = [&](const string& value, bool end_of_day, int64_t& out) {
+        int year, month, day;
+        char unit = 0;
+        long amount = 0;
+        if (sscanf(value.c_str(), "%d-%d-%d", &year, &month, &day) == 3) {
+            tm date{};
+            date.tm_year = year - 1900;
+            date.tm_mon = month - 1;
+            date.tm_mday = day;
+            date.tm_isdst = -1;
+            out = mktime(&date) + (end_of_day ? 86399 : 0);
+            return true;
+        }
+        if (sscanf(value.c_str(), "%ld%c", &amount, &unit) == 2 && amount >= 0) {
+            long seconds = unit == 'h' ? 3600 : unit == 'd' ? 86400 : unit == 'w' ? 7 * 86400 : 0;
+            if (seconds) {
+                out = time(nullptr) - amount * seconds;
+                return true;
+            }
+        }
+        error = "Invalid time: " + value + " (use YYYY-MM-DD or an age like 7d)";
+        return false;
+    };
+
+    istringstream words(input);
+    string word;
+    while (words >> word) {
+        if (word.find("role:") == 0) {
+            string role = word.substr(5);
+            if (role == "user") filter.roles |= HistoryIndex::ROLE_USER;
+            else if (role == "assistant") filter.roles |= HistoryIndex::ROLE_ASSISTANT;
+            else if (role == "system") filter.roles |= HistoryIndex::ROLE_SYSTEM;
+            else {
+                error = "Unknown role: " + role;
+                return false;
+            }
+        } else if (word.find("since:") == 0) {
+            if (!parse_time(word.substr(6), false, filter.since)) return false;
+        } else if (word.find("until:") == 0) {
+            if (!parse_time(word.substr(6), true, filter.until)) return false;
+        } else {
+            terms += (terms.empty() ? "" : " ") + word;
+        }
+    }
+    if (terms.empty()) error = "Usage: history:search <terms> [role:user|assistant] [since:7d] [until:YYYY-MM-DD]";
+    return !terms.empty();
+}
+
+// Lists search hits numbered for history:use, each with an excerpt around its first matching term
+void display_history_hits(const vector<HistoryIndex::Hit>& hits, const string& terms, double elapsed_ms) {
+    cout << COLOR_GRADIENT_1 << "\nHistory matches for \"" << terms << "\"" << COLOR_RESET
+         << COLOR_GRADIENT_2 << " (" << fixed_number(elapsed_ms, 1) << " ms)" << COLOR_RESET << endl;
+    cout << generate_border(30) << endl;
+    vector<string> query_terms;
+    string text = terms;
+    HistoryIndex::for_each_term(text, [&](string_view term) { query_terms.emplace_back(term); });
+    for (size_t i = 0; i < hits.size(); i++) {
+        const HistoryIndex::Hit& hit = hits[i];
+        string lower = hit.content;
+        transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return tolower(c); });
+        size_t match = string::npos;
+        for (const string& term : query_terms) match = min(match, lower.find(term));
+        size_t start = match != string::npos && match > 60 ? match - 60 : 0;
+        size_t length = 200;
+        while (start > 0 && (static_cast<unsigned char>(hit.content[start]) & 0xC0) == 0x80) start--;
+        while (start + length < hit.content.size() && (static_cast<unsigned char>(hit.content[start + length]) & 0xC0) == 0x80) length--;
+        string excerpt = hit.content.substr(start, length);
+        replace(excerpt.begin(), excerpt.end(), '\n', ' ');
+
+        char date[32] = "unknown date";
+        time_t ts = hit.ts;
+        if (ts > 0) strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&ts));
+        cout << COLOR_HIGHLIGHT << i + 1 << ". " << COLOR_RESET << COLOR_GRADIENT_2 << date << "  " << hit.role
+             << "  score " << fixed_number(hit.score, 2) << COLOR_RESET << "\n   "
+             << (start > 0 ? "…" : "") << excerpt << (start + length < hit.content.size() ? "…" : "") << endl;
+    }
+    if (hits.empty()) cout << COLOR_YELLOW << "No matching messages." << COLOR_RESET << endl;
+    else cout << COLOR_YELLOW << "Use history:use:<n> (or history:use:all) to add matches to the conversation." << COLOR_RESET << endl;
+}
+
+// Dot product of two float vectors; AVX2 with FMA when the CPU has it
+float dot_product_scalar(const float* a, const float* b, size_t n) {
+    float lanes[8] = {};
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        for (int lane = 0; lane < 8; lane++) lanes[lane] += a[i + lane] * b[i + lane];
+    }
+    float sum = 0;
+    for (; i < n; i++) sum += a[i] * b[i];
+    for (float lane : lanes) sum += lane;
+    return sum;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma"))) float dot_product_avx2(const float* a, const float* b, size_t n) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    if (i + 8 <= n) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        i += 8;
+    }
+    sum0 = _mm256_add_ps(sum0, sum1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    float sum = _mm_cvtss_f32(half);
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+#endif
+
+float dot_product(const float* a, const float* b, size_t n) {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (avx2) return dot_product_avx2(a, b, n);
+#endif
+    return dot_product_scalar(a, b, n);
+}
+
+void normalize_vector(float* vector, size_t n) {
+    float norm = sqrt(dot_product(vector, vector, n));
+    if (norm > 0) {
+        for (size_t i = 0; i < n; i++) vector[i] /= norm;
+    }
+}
+
+// Splits a document into chunks of about `chunk_tokens` tokens, cutting between paragraphs
+// where possible, then between lines, then between words. Every chunk after the first
+// starts with up to `overlap_tokens` tokens from the end of the previous one.
+vector<string> chunk_document(string_view text, int chunk_tokens, int overlap_tokens) {
+    Tokenizer& tokenizer = Tokenizer::instance();
+    vector<pair<string_view, int>> units; // Consecutive pieces of `text` with their token counts
+    function<void(string_view, int)> split = [&](string_view piece, int level) {
+        static const char* separators[] = {"\n\n", "\n", " "};
+        int tokens = tokenizer.count(piece);
+        if (tokens <= chunk_tokens || piece.size() <= 1) {
+            units.emplace_back(piece, tokens);
+            return;
+        }
+        if (level == 3) { // One long word: cut by bytes at about four a token
+            size_t step = static_cast<size_t>(chunk_tokens) * 4;
+            for (size_t start = 0; start < piece.size(); start += step) split(piece.substr(start, step), 4);
+            return;
+        }
+        if (level == 4) { // Denser than four bytes a token (base64, CJK): halve until it fits
+            size_t middle = piece.size() / 2;
+            while (middle > 1 && (static_cast<unsigned char>(piece[middle]) & 0xC0) == 0x80) middle--; // Not inside a character
+            split(piece.substr(0, middle), 4);
+            split(piece.substr(middle), 4);
+            return;
+        }
+        string_view separator = separators[level];
+        size_t start = 0;
+        while (start < piece.size()) {
+            size_t end = piece.find(separator, start);
+            end = end == string_view::npos ? piece.size() : end + separator.size();
+            split(piece.substr(start, end - start), level + 1);
+            start = end;
+        }
+    };
+    split(text, 0);
+
+    vector<string> chunks;
+    size_t first = 0;
+    while (first < units.size()) {
+        size_t last = first;
+        int tokens = 0;
+        while (last < units.size() && (last == first || tokens + units[last].second <= chunk_tokens)) tokens += units[last++].second;
+        const char* begin = units[first].first.data();
+        const char* end = units[last - 1].first.data() + units[last - 1].first.size();
+        size_t trimmed = string_view(begin, end - begin).find_first_not_of(" \t\r\n");
+        if (trimmed != string_view::npos) chunks.emplace_back(begin + trimmed, end - begin - trimmed);
+        if (last == units.size()) break;
+        size_t next = last;
+        for (int overlap = 0; next > first + 1 && overlap + units[next - 1].second <= overlap_tokens;) overlap += units[--next].second;
+        first = next;
+    }
+    return chunks;
+}
+
+// The embeddings endpoint next to the chat one, unless embeddings_url names another
+string embeddings_endpoint(const Config& config) {
+    if (!config.embeddings_url.empty()) return config.embeddings_url;
+    string url = config.backends.empty() ? config.server_url : config.backends.begin()->first;
+    size_t chat = url.rfind("/chat/completions");
+    return chat == string::npos ? url_origin(url) + "/v1/embeddings" : url.substr(0, chat) + "/embeddings";
+}
+
+// Embeds `inputs` through an OpenAI-style /v1/embeddings endpoint, EMBEDDING_BATCH inputs a
+// request with EMBEDDING_IN_FLIGHT requests at once. `vectors` receives them L2-normalized and
+// in input order, `dim` floats each. Ctrl-C cancels.
+bool request_embeddings(const Config& config, const vector<string>& inputs, vector<float>& vectors, size_t& dim, string& error) {
+    const size_t EMBEDDING_BATCH = 32;
+    const size_t EMBEDDING_IN_FLIGHT = 4;
+    if (config.backend == "llama.cpp" && config.embeddings_url.empty()) {
+        error = "Embeddings need an HTTP server; set embeddings_url";
+        return false;
+    }
+    string endpoint = embeddings_endpoint(config);
+    vectors.clear();
+    dim = 0;
+    struct Batch {
+        size_t first;  // Index of the batch's first input
+        size_t count;
+        shared_ptr<PendingRequest> request;
+    };
+    deque<Batch> in_flight;
+    size_t next = 0;
+    bool spinner = isatty(STDOUT_FILENO); // Keeps piped output, such as --bench records, clean
+    if (spinner) {
+        Renderer::instance().start_spinner("Embedding " + to_string(inputs.size()) + (inputs.size() == 1 ? " text" : " texts"),
+                                           COLOR_GRADIENT_1);
+    }
+    interrupt_requested = false;
+    foreground_requests++;
+    while (error.empty() && (next < inputs.size() || !in_flight.empty())) {
+        while (next < inputs.size() && in_flight.size() < EMBEDDING_IN_FLIGHT) {
+            size_t count = min(EMBEDDING_BATCH, inputs.size() - next);
+            RequestSpec spec;
+            spec.url = endpoint;
+            spec.body = json{{"model", "llama"}, {"input", vector<string>(inputs.begin() + next, inputs.begin() + next + count)}}
+                            .dump(-1, ' ', false, json::error_handler_t::replace);
+            spec.headers = {"Content-Type: application/json"};
+            spec.timeout_ms = 120000;
+            spec.metric = "embeddings";
+            in_flight.push_back({next, count, RequestEngine::instance().submit(move(spec))});
+            next += count;
+        }
+        auto [first, count, request] = in_flight.front();
+        if (!request->wait_for(chrono::milliseconds(50))) {
+            if (interrupt_requested.exchange(false)) error = "Cancelled";
+            continue;
+        }
+        in_flight.pop_front();
+        const HttpResult& result = request->result();
+        JsonView data = JsonView::parse(result.body)["data"];
+        if (!result.ok() || !data.is_array()) {
+            extract_reply(result.body, error); // The server's error message, if it sent one
+            error = "Embeddings request to " + endpoint + " failed: " + (result.ok() ? error : result.error());
+            break;
+        }
+        long position = 0;
+        vector<bool> received(count);
+        data.for_each([&](JsonView item) {
+            long offset = item["index"].integer_or(position++);
+            if (offset < 0 || offset >= static_cast<long>(count) || received[offset]) {
+                error = "Embeddings response has a wrong or repeated index";
+                return false;
+            }
+            received[offset] = true;
+            size_t index = first + static_cast<size_t>(offset);
+            vector<float> values;
+            item["embedding"].for_each([&](JsonView number) {
+                string_view raw = number.raw();
+                float value = 0;
+                from_chars(raw.data(), raw.data() + raw.size(), value);
+                values.push_back(value);
+                return true;
+            });
+            if (dim == 0) dim = values.size();
+            if (values.empty() || values.size() != dim) {
+                error = "Embeddings response has inconsistent vectors";
+                return false;
+            }
+            if (vectors.size() < inputs.size() * dim) vectors.resize(inputs.size() * dim);
+            normalize_vector(values.data(), dim);
+            copy(values.begin(), values.end(), vectors.begin() + index * dim);
+            return true;
+        });
+        if (error.empty() && position != static_cast<long>(count)) error = "Embeddings response is missing vectors";
+    }
+    for (auto& pending : in_flight) pending.request->cancel();
+    foreground_requests--;
+    if (spinner) Renderer::instance().stop_spinner();
+    return error.empty();
+}
+
+// Local document retrieval for rag:. Files are split into chunks, embedded, and kept in
+// one mapped file (RAG_INDEX): the chunks' unit vectors, their text and their source files.
+// Large indexes are partitioned IVF-style: spherical k-means centroids, with the vectors
+// stored grouped by nearest centroid, so a query scores the centroids and then scans only
+// the `probe` closest lists; small ones are scanned in full. Re-adding a file replaces its
+// chunks when its size or mtime changed. Every add rewrites the file, reusing the
+// centroids until the index has doubled since they were trained.
+class RagIndex {
+public:
+    struct Hit {
+        float score;
+        string source;
+        string text;
+    };
+
+    struct AddResult {
+        size_t files = 0;      // Files embedded
+        size_t unchanged = 0;  // Files already indexed as they are
+        size_t chunks = 0;     // Chunks embedded
+    };
+
+    void open(const string& path) {
+        path_ = path;
+        map_index();
+    }
+
+    size_t size() const { return index_ ? header().chunk_count : 0; }
+    size_t dimensions() const { return index_ ? header().dim : 0; }
+    size_t lists() const { return index_ ? header().list_count : 0; }
+    size_t sources() const { return index_ ? header().source_count : 0; }
+
+    // Indexes the text files under `path`, a file or a directory
+    bool add(const Config& config, const string& path, AddResult& added, string& error) {
+        vector<filesystem::path> files;
+        error_code status;
+        if (filesystem::is_directory(path, status)) {
+            for (auto it = filesystem::recursive_directory_iterator(path, filesystem::directory_options::skip_permission_denied, status);
+                 it != filesystem::recursive_directory_iterator(); it.increment(status)) {
+                if (status) break;
+                if (it->path().filename().string()[0] == '.') {
+                    if (it->is_directory()) it.disable_recursion_pending();
+                    continue;
+                }
+                if (it->is_regular_file()) files.push_back(it->path());
+            }
+        } else if (filesystem::is_regular_file(path, status)) {
+            files.push_back(path);
+        } else {
+            error = "No such file or directory: " + path;
+            return false;
+        }
+        sort(files.begin(), files.end());
+
+        map<string, uint32_t> existing; // Path -> source id in the current file
+        for (uint32_t i = 0; i < sources(); i++) existing[string(source_path(i))] = i;
+        vector<bool> replaced(sources(), false);
+        vector<NewSource> new_sources;
+        vector<string> texts;
+        vector<uint32_t> text_sources; // Index into new_sources per text
+        for (const filesystem::path& file : files) {
+            struct stat st;
+            filesystem::path full_path = filesystem::absolute(file, status);
+            if (status) continue;
+            string absolute = full_path.lexically_normal().string();
+            if (::stat(absolute.c_str(), &st) != 0 || st.st_size == 0 || st.st_size > MAX_FILE_BYTES) continue;
+            auto old = existing.find(absolute);
+            if (old != existing.end()) {
+                const SourceEntry& entry = source(old->second);
+                if (entry.mtime == st.st_mtime && entry.size == static_cast<uint64_t>(st.st_size)) {
+                    added.unchanged++;
+                    continue;
+                }
+                replaced[old->second] = true;
+            }
+            MappedFile content(absolute);
+            if (!content.data()) continue;
+            string_view text(content.data(), content.size());
+            if (text.substr(0, 4096).find('\0') != string_view::npos) continue; // Binary
+            size_t first_text = texts.size();
+            for (string& chunk : chunk_document(text, max(config.rag_chunk_tokens, 16), max(config.rag_chunk_overlap, 0))) {
+                texts.push_back(move(chunk));
+                text_sources.push_back(static_cast<uint32_t>(new_sources.size()));
+            }
+            new_sources.push_back({absolute, st.st_mtime, static_cast<uint64_t>(st.st_size), static_cast<uint32_t>(texts.size() - first_text)});
+            added.files++;
+        }
+        if (new_sources.empty() || (texts.empty() && !index_)) return true;
+
+        vector<float> vectors;
+        size_t dim = 0;
+        if (!texts.empty() && !request_embeddings(config, texts, vectors, dim, error)) return false;
+        if (index_ && dim && dim != dimensions()) {
+            error = "The embedding model changed from " + to_string(dimensions()) + " to " + to_string(dim) +
+                    " dimensions; remove " + path_ + " to rebuild the index";
+            return false;
+        }
+        added.chunks = texts.size();
+        if (!write(replaced, new_sources, texts, text_sources, vectors, dim ? dim : dimensions())) {
+            error = "Unable to write " + path_;
+            return false;
+        }
+        return true;
+    }
+
+    // The `k` chunks closest to `query` (a unit vector), best first. With `probe` > 0 only
+    // that many IVF lists are scanned.
+    vector<Hit> search(const float* query, size_t k, int probe) const {
+        vector<Hit> hits;
+        if (!index_ || size() == 0 || k == 0) return hits;
+        size_t dim = dimensions();
+        size_t list_count = lists();
+        const uint64_t* list_starts = reinterpret_cast<const uint64_t*>(index_->data() + header().lists_offset);
+        vector<uint32_t> scanned;
+        if (list_count <= 1 || probe <= 0 || static_cast<size_t>(probe) >= list_count) {
+            for (uint32_t list = 0; list < list_count; list++) scanned.push_back(list);
+        } else {
+            const float* centroids = reinterpret_cast<const float*>(index_->data() + header().centroids_offset);
+            vector<pair<float, uint32_t>> closest(list_count);
+            for (uint32_t list = 0; list < list_count; list++) closest[list] = {dot_product(query, centroids + list * dim, dim), list};
+            partial_sort(closest.begin(), closest.begin() + probe, closest.end(), greater<pair<float, uint32_t>>());
+            for (int i = 0; i < probe; i++) scanned.push_back(closest[i].second);
+        }
+
+        vector<pair<float, uint64_t>> best; // Min-heap of the top k
+        best.reserve(k + 1);
+        const float* vectors = reinterpret_cast<const float*>(index_->data() + header().vectors_offset);
+        for (uint32_t list : scanned) {
+            for (uint64_t chunk = list_starts[list]; chunk < list_starts[list + 1]; chunk++) {
+                float score = dot_product(query, vectors + chunk * dim, dim);
+                if (best.size() == k && score <= best.front().first) continue;
+                best.emplace_back(score, chunk);
+                push_heap(best.begin(), best.end(), greater<pair<float, uint64_t>>());
+                if (best.size() > k) {
+                    pop_heap(best.begin(), best.end(), greater<pair<float, uint64_t>>());
+                    best.pop_back();
+                }
+            }
+        }
+        sort_heap(best.begin(), best.end(), greater<pair<float, uint64_t>>());
+        const char* text = index_->data() + header().text_offset;
+        for (const auto& [score, chunk] : best) {
+            const ChunkEntry& entry = this->chunk(chunk);
+            hits.push_back({score, string(source_path(entry.source)), string(text + entry.text_offset, entry.text_length)});
+        }
+        return hits;
+    }
+
+    // Replaces the index with unnamed chunks holding `vectors` (unit length, `dim` floats each), for --bench
+    bool build(const vector<float>& vectors, size_t dim) {
+        size_t count = vectors.size() / dim;
+        vector<string> texts(count);
+        vector<uint32_t> text_sources(count, 0);
+        return write(vector<bool>(sources(), true), {{"synthetic", 0, 0, static_cast<uint32_t>(count)}}, texts, text_sources, vectors, dim);
+    }
+
+private:
+    static constexpr off_t MAX_FILE_BYTES = 8 << 20;     // Larger files are skipped
+    static constexpr size_t IVF_MIN_CHUNKS = 16384;      // Below this every query scans all vectors
+    static constexpr size_t KMEANS_SAMPLES_PER_LIST = 32;
+    static constexpr int KMEANS_ITERATIONS = 8;
+    static constexpr uint32_t MAX_DIMENSIONS = 1 << 16;  // Far above any embedding model, so sizes cannot overflow
+    static constexpr char MAGIC[8] = {'G', 'R', 'A', 'G', 'I', 'X', '0', '1'};
+
+    // On-disk layout, host byte order: header, centroids, list starts, vectors, chunks,
+    // sources, text. Vectors are 64-byte aligned and stored in list order.
+    struct Header {
+        char magic[8];
+        uint32_t dim;
+        uint32_t list_count;
+        uint64_t chunk_count;
+        uint64_t source_count;
+        uint64_t trained_count;   // Chunks when the centroids were trained
+        uint64_t centroids_offset;
+        uint64_t lists_offset;    // list_count + 1 chunk numbers
+        uint64_t vectors_offset;
+        uint64_t chunks_offset;
+        uint64_t sources_offset;
+        uint64_t text_offset;
+    };
+    struct ChunkEntry {
+        uint64_t text_offset;
+        uint32_t text_length;
+        uint32_t source;
+    };
+    struct SourceEntry {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t chunks;
+        int64_t mtime;
+        uint64_t size;
+    };
+    struct NewSource {
+        string path;
+        int64_t mtime;
+        uint64_t size;
+        uint32_t chunks;
+    };
+
+    const Header& header() const { return *reinterpret_cast<const Header*>(index_->data()); }
+    const ChunkEntry& chunk(uint64_t i) const { return reinterpret_cast<const ChunkEntry*>(index_->data() + header().chunks_offset)[i]; }
+    const SourceEntry& source(uint32_t i) const { return reinterpret_cast<const SourceEntry*>(index_->data() + header().sources_offset)[i]; }
+    string_view source_path(uint32_t i) const {
+        const SourceEntry& entry = source(i);
+        return string_view(index_->data() + header().text_offset + entry.path_offset, entry.path_length);
+    }
+
+    // Maps the saved index if its sections, lists, chunks and sources all lie inside the
+    // file; a damaged file is left unmapped and replaced by the next rag:add
+    void map_index() {
+        index_.reset(new MappedFile(path_));
+        if (!index_->data() || !valid_layout(*index_)) index_.reset();
+    }
+
+    static bool valid_layout(const MappedFile& file) {
+        uint64_t size = file.size();
+        if (size < sizeof(Header)) return false;
+        const Header& saved = *reinterpret_cast<const Header*>(file.data());
+        // Bound the counts first so the offsets below cannot overflow
+        if (memcmp(saved.magic, MAGIC, sizeof(MAGIC)) != 0 || saved.dim > MAX_DIMENSIONS || saved.list_count == 0 ||
+            (saved.dim == 0 && saved.chunk_count > 0) || saved.list_count > size / sizeof(uint64_t) ||
+            saved.chunk_count > size / (saved.dim * sizeof(float) + sizeof(ChunkEntry)) ||
+            saved.source_count > size / sizeof(SourceEntry)) {
+            return false;
+        }
+        auto align = [](uint64_t offset, uint64_t alignment) { return (offset + alignment - 1) / alignment * alignment; };
+        uint64_t centroids = saved.list_count > 1 ? uint64_t{saved.list_count} * saved.dim : 0;
+        if (saved.centroids_offset != align(sizeof(Header), 64) ||
+            saved.lists_offset != saved.centroids_offset + centroids * sizeof(float) ||
+            saved.vectors_offset != align(saved.lists_offset + (saved.list_count + 1) * sizeof(uint64_t), 64) ||
+            saved.chunks_offset != saved.vectors_offset + saved.chunk_count * saved.dim * sizeof(float) ||
+            saved.sources_offset != saved.chunks_offset + saved.chunk_count * sizeof(ChunkEntry) ||
+            saved.text_offset != saved.sources_offset + saved.source_count * sizeof(SourceEntry) || saved.text_offset > size) {
+            return false;
+        }
+        const uint64_t* list_starts = reinterpret_cast<const uint64_t*>(file.data() + saved.lists_offset);
+        if (list_starts[0] != 0 || list_starts[saved.list_count] != saved.chunk_count) return false;
+        for (uint32_t list = 0; list < saved.list_count; list++) {
+            if (list_starts[list] > list_starts[list + 1]) return false;
+        }
+        uint64_t text_size = size - saved.text_offset;
+        const ChunkEntry* chunks = reinterpret_cast<const ChunkEntry*>(file.data() + saved.chunks_offset);
+        for (uint64_t i = 0; i < saved.chunk_count; i++) {
+            if (chunks[i].source >= saved.source_count || chunks[i].text_offset > text_size ||
+                chunks[i].text_length > text_size - chunks[i].text_offset) {
+                return false;
+            }
+        }
+        const SourceEntry* sources = reinterpret_cast<const SourceEntry*>(file.data() + saved.sources_offset);
+        for (uint64_t i = 0; i < saved.source_count; i++) {
+            if (sources[i].path_offset > text_size || sources[i].path_length > text_size - sources[i].path_offset) return false;
+        }
+        return true;
+    }
+
+    // Runs f(begin, end) over [0, count) split across the hardware threads
+    template <typename F>
+    static void parallel_ranges(size_t count, F f) {
+        size_t workers = min<size_t>(max(thread::hardware_concurrency(), 1u), max<size_t>(count / 1024, 1));
+        vector<thread> threads;
+        for (size_t w = 1; w < workers; w++) threads.emplace_back(f, count * w / workers, count * (w + 1) / workers);
+        f(0, count / workers);
+        for (thread& worker : threads) worker.join();
+    }
+
+    static uint32_t nearest(const float* vector, const float* centroids, size_t list_count, size_t dim) {
+        uint32_t best = 0;
+        float best_score = -2;
+        for (uint32_t list = 0; list < list_count; list++) {
+            float score = dot_product(vector, centroids + list * dim, dim);
+            if (score > best_score) {
+                best_score = score;
+                best = list;
+            }
+        }
+        return best;
+    }
+
+    // Spherical k-means over an even sample of the vectors
+    static vector<float> train(const function<const float*(size_t)>& vector_at, size_t count, size_t dim, size_t list_count) {
+        size_t samples = min(count, list_count * KMEANS_SAMPLES_PER_LIST);
+        vector<float> sample(samples * dim);
+        for (size_t i = 0; i < samples; i++) copy_n(vector_at(i * count / samples), dim, &sample[i * dim]);
+        vector<float> centroids(list_count * dim);
+        for (size_t list = 0; list < list_count; list++) copy_n(&sample[list * samples / list_count * dim], dim, &centroids[list * dim]);
+
+        vector<uint32_t> assignment(samples);
+        for (int iteration = 0; iteration < KMEANS_ITERATIONS; iteration++) {
+            parallel_ranges(samples, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) assignment[i] = nearest(&sample[i * dim], centroids.data(), list_count, dim);
+            });
+            vector<float> sums(list_count * dim, 0);
+            vector<size_t> sizes(list_count, 0);
+            for (size_t i = 0; i < samples; i++) {
+                float* sum = &sums[assignment[i] * dim];
+                for (size_t d = 0; d < dim; d++) sum[d] += sample[i * dim + d];
+                sizes[assignment[i]]++;
+            }
+            for (size_t list = 0; list < list_count; list++) {
+                if (sizes[list] == 0) { // Reseed an empty list from the sample
+                    copy_n(&sample[(list * 7919 % samples) * dim], dim, &sums[list * dim]);
+                }
+                normalize_vector(&sums[list * dim], dim);
+            }
+            centroids.swap(sums);
+        }
+        return centroids;
+    }
+
+    // Writes the current chunks, minus those of `replaced` sources, plus the new ones, then maps the result
+    bool write(const vector<bool>& replaced, const vector<NewSource>& new_sources, const vector<string>& texts,
+               const vector<uint32_t>& text_sources, const vector<float>& new_vectors, size_t dim) {
+        // Sources: the kept old ones, then the new ones
+        vector<int64_t> source_ids(sources(), -1);
+        uint32_t source_count = 0;
+        for (uint32_t i = 0; i < sources(); i++) {
+            if (!replaced[i]) source_ids[i] = source_count++;
+        }
+        uint32_t first_new_source = source_count;
+        source_count += static_cast<uint32_t>(new_sources.size());
+
+        // Items: the kept old chunks, then the new ones
+        vector<uint64_t> kept;
+        for (uint64_t i = 0; i < size(); i++) {
+            if (source_ids[chunk(i).source] >= 0) kept.push_back(i);
+        }
+        size_t count = kept.size() + texts.size();
+        const float* old_vectors = index_ ? reinterpret_cast<const float*>(index_->data() + header().vectors_offset) : nullptr;
+        auto vector_at = [&](size_t item) -> const float* {
+            return item < kept.size() ? old_vectors + kept[item] * dim : &new_vectors[(item - kept.size()) * dim];
+        };
+
+        size_t list_count = 1;
+        uint64_t trained_count = count;
+        vector<float> centroids;
+        if (count >= IVF_MIN_CHUNKS) {
+            if (index_ && lists() > 1 && count < 2 * header().trained_count) {
+                list_count = lists();
+                trained_count = header().trained_count;
+                const float* old = reinterpret_cast<const float*>(index_->data() + header().centroids_offset);
+                centroids.assign(old, old + list_count * dim);
+            } else {
+                list_count = static_cast<size_t>(sqrt(static_cast<double>(count)));
+                centroids = train(vector_at, count, dim, list_count);
+            }
+        }
+        vector<uint32_t> assignment(count, 0);
+        if (list_count > 1) {
+            parallel_ranges(count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) assignment[i] = nearest(vector_at(i), centroids.data(), list_count, dim);
+            });
+        }
+        vector<uint64_t> list_starts(list_count + 1, 0);
+        for (uint32_t list : assignment) list_starts[list + 1]++;
+        for (size_t list = 0; list < list_count; list++) list_starts[list + 1] += list_starts[list];
+        vector<uint64_t> order(count); // Items in list order
+        vector<uint64_t> fill(list_starts.begin(), list_starts.end() - 1);
+        for (size_t item = 0; item < count; item++) order[fill[assignment[item]]++] = item;
+
+        auto align = [](uint64_t offset, uint64_t alignment) { return (offset + alignment - 1) / alignment * alignment; };
+        Header saved{};
+        memcpy(saved.magic, MAGIC, sizeof(MAGIC));
+        saved.dim = static_cast<uint32_t>(dim);
+        saved.list_count = static_cast<uint32_t>(list_count);
+        saved.chunk_count = count;
+        saved.source_count = source_count;
+        saved.trained_count = trained_count;
+        saved.centroids_offset = align(sizeof(Header), 64);
+        saved.lists_offset = saved.centroids_offset + centroids.size() * sizeof(float);
+        saved.vectors_offset = align(saved.lists_offset + list_starts.size() * sizeof(uint64_t), 64);
+        saved.chunks_offset = saved.vectors_offset + count * dim * sizeof(float);
+        saved.sources_offset = saved.chunks_offset + count * sizeof(ChunkEntry);
+        saved.text_offset = saved.sources_offset + source_count * sizeof(SourceEntry);
+
+        string temp_path = path_ + ".tmp";
+        ofstream out(temp_path, ios::binary | ios::trunc);
+        if (!out) return false;
+        auto pad = [&](uint64_t offset) {
+            static const char zeros[64] = {};
+            out.write(zeros, offset - static_cast<uint64_t>(out.tellp()));
+        };
+        out.write(reinterpret_cast<const char*>(&saved), sizeof(saved));
+        pad(saved.centroids_offset);
+        out.write(reinterpret_cast<const char*>(centroids.data()), centroids.size() * sizeof(float));
+        out.write(reinterpret_cast<const char*>(list_starts.data()), list_starts.size() * sizeof(uint64_t));
+        pad(saved.vectors_offset);
+        for (uint64_t item : order) out.write(reinterpret_cast<const char*>(vector_at(item)), dim * sizeof(float));
+
+        // Text: chunk texts in list order, then source paths
+        const char* old_text = index_ ? index_->data() + header().text_offset : nullptr;
+        auto text_of = [&](uint64_t item) {
+            if (item < kept.size()) {
+                const ChunkEntry& entry = chunk(kept[item]);
+                return string_view(old_text + entry.text_offset, entry.text_length);
+            }
+            return string_view(texts[item - kept.size()]);
+        };
+        uint64_t text_bytes = 0;
+        for (uint64_t item : order) {
+            string_view text = text_of(item);
+            uint32_t owner = item < kept.size() ? static_cast<uint32_t>(source_ids[chunk(kept[item]).source])
+                                                : first_new_source + text_sources[item - kept.size()];
+            ChunkEntry entry{text_bytes, static_cast<uint32_t>(text.size()), owner};
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            text_bytes += text.size();
+        }
+        vector<string_view> paths;
+        for (uint32_t i = 0; i < sources(); i++) {
+            if (source_ids[i] < 0) continue;
+            const SourceEntry& old = source(i);
+            SourceEntry entry{text_bytes, old.path_length, old.chunks, old.mtime, old.size};
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            paths.push_back(source_path(i));
+            text_bytes += old.path_length;
+        }
+        for (const NewSource& added : new_sources) {
+            SourceEntry entry{text_bytes, static_cast<uint32_t>(added.path.size()), added.chunks, added.mtime, added.size};
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            paths.push_back(added.path);
+            text_bytes += added.path.size();
+        }
+        for (uint64_t item : order) {
+            string_view text = text_of(item);
+            out.write(text.data(), text.size());
+        }
+        for (string_view path : paths) out.write(path.data(), path.size());
+        out.close();
+        if (!out || rename(temp_path.c_str(), path_.c_str()) != 0) return false;
+        map_index();
+        return true;
+    }
+
+    string path_;
+    unique_ptr<MappedFile> index_;
+};
+
+// Index over the prompt library in PROMPT_DIR. A manifest (PROMPT_INDEX) records each
+// prompt's size, mtime and content hash, so startup does not open thousands of files:
+// when the directory's mtime still matches the manifest it is trusted as is, otherwise
+// only stat() is rescanned. Content is read on first use, revalidated against the file's
+// size and mtime, and cached. While running, inotify reports changes and poll() applies
+// them file by file. Names stay sorted for prefix completion. A REPL connected to the
+// daemon never opens its own: lookups and saves go to the daemon's library.
+class PromptLibrary {
+public:
+    static PromptLibrary& instance() {
+        static PromptLibrary library;
+        return library;
+    }
+
+    ~PromptLibrary() { close(); }
+
+    void open(const string& dir, const string& manifest_path) {
+        close();
+        dir_ = dir;
+        manifest_path_ = manifest_path;
+        entries_.clear();
+        entries_[DEFAULT_NAME] = builtin_default();
+
+        // Watch first so nothing changing during the scan is missed
+        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd_ >= 0 && filesystem::is_directory(dir_)) {
+            inotify_add_watch(inotify_fd_, dir_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+        }
+
+        json manifest = load_json_file(manifest_path_);
+        map<string, Entry> known;
+        bool damaged = false; // Rescan the directory rather than trust the manifest
+        int64_t saved_dir_mtime = 0;
+        try {
+            if (manifest.is_object() && manifest.value("dir", "") == dir_) {
+                for (const auto& [name, item] : manifest.value("prompts", json::object()).items()) {
+                    Entry entry;
+                    entry.size = item.value("size", uintmax_t{0});
+                    entry.mtime_ns = item.value("mtime_ns", int64_t{0});
+                    string hash = item.value("hash", "");
+                    if (!hash.empty()) {
+                        // A hash that does not parse leaves the entry unhashed, to be hashed on load
+                        auto [end, error] = from_chars(hash.data(), hash.data() + hash.size(), entry.hash, 16);
+                        entry.hashed = error == errc() && end == hash.data() + hash.size();
+                        if (!entry.hashed) damaged = true;
+                    }
+                    known[name] = move(entry);
+                }
+                saved_dir_mtime = manifest.value("dir_mtime_ns", int64_t{0});
+            }
+        } catch (const json::exception&) { // Wrongly typed fields
+            known.clear();
+            damaged = true;
+        }
+
+        int64_t dir_mtime = mtime_of(dir_);
+        if (!known.empty() && !damaged && dir_mtime != 0 && saved_dir_mtime == dir_mtime) {
+            for (auto& [name, entry] : known) entries_[name] = move(entry);
+            return;
+        }
+
+        if (filesystem::is_directory(dir_)) {
+            for (const auto& file : filesystem::directory_iterator(dir_)) {
+                if (file.path().extension() != ".json") continue;
+                string name = file.path().stem().string();
+                Entry entry;
+                if (!stat_entry(name, entry)) continue;
+                auto it = known.find(name);
+                if (it != known.end() && it->second.size == entry.size && it->second.mtime_ns == entry.mtime_ns) {
+                    entry.hash = it->second.hash;
+                    entry.hashed = it->second.hashed;
+                }
+                entries_[name] = move(entry);
+            }
+        }
+        dirty_ = true;
+    }
+
+    // Applies pending inotify events; cheap when there are none
+    void poll() {
+        if (inotify_fd_ < 0) return;
+        alignas(inotify_event) char buffer[16384];
+        ssize_t length;
+        while ((length = ::read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+            for (ssize_t offset = 0; offset < length;) {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->len == 0) continue;
+                filesystem::path file(event->name);
+                if (file.extension() != ".json") continue;
+                string name = file.stem().string();
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    if (entries_.erase(name)) dirty_ = true;
+                    if (name == DEFAULT_NAME) entries_[DEFAULT_NAME] = builtin_default();
+                } else {
+                    refresh(name);
+                }
+            }
+        }
+    }
+
+    // Up to `limit` names starting with `prefix`, in order
+    vector<string> complete(const string& prefix, size_t limit = SIZE_MAX) const {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "prompts.complete"}, {"prefix", prefix}, {"limit", limit}}, reply)) {
+            return reply.value("names", vector<string>());
+        }
+        vector<string> names;
+        for (auto it = entries_.lower_bound(prefix);
+             it != entries_.end() && names.size() < limit && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            names.push_back(it->first);
+        }
+        return names;
+    }
+
+    // Exact name, or the only name with that prefix
+    bool resolve(const string& name, string& resolved) const {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "prompts.resolve"}, {"name", name}}, reply)) {
+            resolved = reply.value("name", "");
+            return reply.value("found", false);
+        }
+        if (entries_.count(name)) {
+            resolved = name;
+            return true;
+        }
+        vector<string> names = complete(name, 2);
+        if (names.size() != 1) return false;
+        resolved = names[0];
+        return true;
+    }
+
+    bool load(const string& name, string& content) {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "prompts.load"}, {"name", name}}, reply)) {
+            content = reply.value("content", "");
+            return reply.value("found", false);
+        }
+        auto it = entries_.find(name);
+        if (it == entries_.end()) return false;
+        Entry& entry = it->second;
+        if (!entry.builtin) {
+            Entry current;
+            if (!stat_entry(name, current)) return false;
+            if (current.size != entry.size || current.mtime_ns != entry.mtime_ns) {
+                entry = move(current); // Edited in place while we were not watching
+                dirty_ = true;
+            }
+        }
+        if (!entry.loaded) {
+            ifstream file(path_for(name), ios::binary);
+            string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            json prompt_data = json::parse(data, nullptr, false);
+            if (prompt_data.is_discarded() || !prompt_data.is_object()) return false;
+            entry.content = prompt_data.value("content", "");
+            entry.loaded = true;
+            uint64_t hash = fnv1a64(data);
+            if (!entry.hashed || entry.hash != hash) dirty_ = true;
+            entry.hash = hash;
+            entry.hashed = true;
+        }
+        content = entry.content;
+        return true;
+    }
+
+    bool save(const string& name, const string& content) {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "prompts.save"}, {"name", name}, {"content", content}}, reply)) {
+            return reply.value("saved", false);
+        }
+        json prompt_data = {
+            {"role", "system"},
+            {"content", content}
+        };
+        filesystem::create_directories(dir_);
+        save_json_file(path_for(name), prompt_data);
+        refresh(name);
+        return entries_.count(name) > 0;
+    }
+
+    size_t size() const {
+        json reply;
+        if (DaemonClient::instance().call({{"op", "prompts.size"}}, reply)) return reply.value("size", size_t{0});
+        return entries_.size();
+    }
+
+    // Writes the manifest if anything changed since it was read
+    void save_manifest() {
+        if (!dirty_ || manifest_path_.empty()) return;
+        json prompts = json::object();
+        for (const auto& [name, entry] : entries_) {
+            if (entry.builtin) continue;
+            json item = {{"size", entry.size}, {"mtime_ns", entry.mtime_ns}};
+            if (entry.hashed) {
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(entry.hash));
+                item["hash"] = hash;
+            }
+            prompts[name] = item;
+        }
+        json manifest = {{"version", 1}, {"dir", dir_}, {"dir_mtime_ns", mtime_of(dir_)}, {"prompts", prompts}};
+        string temp_path = manifest_path_ + ".tmp";
+        {
+            ofstream file(temp_path, ios::trunc);
+            if (!file.is_open()) return;
+            file << manifest.dump();
+        }
+        error_code ec;
+        filesystem::rename(temp_path, manifest_path_, ec);
+        if (ec) return; // Still dirty; tried again on the next save
+        dirty_ = false;
+    }
+
+    void close() {
+        save_manifest();
+        if (inotify_fd_ >= 0) ::close(inotify_fd_);
+        inotify_fd_ = -1;
+    }
+
+private:
+    struct Entry {
+        uintmax_t size = 0;
+        int64_t mtime_ns = 0;
+        uint64_t hash = 0;     // FNV-1a of the file, known once it has been read
+        bool hashed = false;
+        bool builtin = false;
+        bool loaded = false;
+        string content;
+    };
+
+    static constexpr const char* DEFAULT_NAME = "default";
+
+    PromptLibrary() = default;
+
+    static Entry builtin_default() {
+        Entry entry;
+        entry.builtin = true;
+        entry.loaded = true;
+        entry.content = "You are a helpful AI assistant.";
+        return entry;
+    }
+
+    static int64_t mtime_of(const string& path) {
+        struct stat info;
+        if (::stat(path.c_str(), &info) != 0) return 0;
+        return static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+    }
+
+    string path_for(const string& name) const {
+        return (filesystem::path(dir_) / (name + ".json")).string();
+    }
+
+    bool stat_entry(const string& name, Entry& entry) const {
+        struct stat info;
+        if (::stat(path_for(name).c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+        entry.size = static_cast<uintmax_t>(info.st_size);
+        entry.mtime_ns = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+        return true;
+    }
+
+    void refresh(const string& name) {
+        Entry entry;
+        if (!stat_entry(name, entry)) return;
+        auto it = entries_.find(name);
+        if (it != entries_.end() && !it->second.builtin && it->second.size == entry.size && it->second.mtime_ns == entry.mtime_ns) {
+            return;
+        }
+        entries_[name] = move(entry);
+        dirty_ = true;
+    }
+
+    string dir_;
+    string manifest_path_;
+    map<string, Entry> entries_;
+    int inotify_fd_ = -1;
+    bool dirty_ = false;
+};
+
+// Keeps the first `head_limit` and the last `tail_limit` bytes of a stream in fixed memory;
+// everything in between is only counted
+class BoundedCapture {
+public:
+    BoundedCapture(size_t head_limit, size_t tail_limit) : head_limit_(head_limit), ring_(tail_limit) {}
+
+    void append(const char* data, size_t length) {
+        total_ += length;
+        size_t to_head = min(length, head_limit_ - head_.size());
+        head_.append(data, to_head);
+        data += to_head;
+        length -= to_head;
+        size_t capacity = ring_.size();
+        if (length == 0 || capacity == 0) return;
+        if (length > capacity) { // Only the newest `capacity` bytes can survive
+            data += length - capacity;
+            length = capacity;
+        }
+        while (length > 0) {
+            size_t end = (start_ + size_) % capacity;
+            size_t chunk = min(length, capacity - end);
+            memcpy(ring_.data() + end, data, chunk);
+            data += chunk;
+            length -= chunk;
+            size_ += chunk;
+            if (size_ > capacity) {
+                start_ = (start_ + size_ - capacity) % capacity;
+                size_ = capacity;
+            }
+        }
+    }
+
+    size_t total() const { return total_; }
+    size_t omitted() const { return total_ - head_.size() - size_; }
+
+    string tail() const {
+        string out;
+        out.reserve(size_);
+        size_t first = min(size_, ring_.size() - start_);
+        out.append(ring_.data() + start_, first);
+        out.append(ring_.data(), size_ - first);
+        return out;
+    }
+
+    string text() const {
+        string out = head_;
+        if (omitted() > 0) out += "\n[... " + to_string(omitted()) + " bytes omitted ...]\n";
+        return out + tail();
+    }
+
+private:
+    size_t head_limit_;
+    string head_;
+    vector<char> ring_;
+    size_t start_ = 0;
+    size_t size_ = 0;
+    size_t total_ = 0;
+};
+
+struct ProcessOptions {
+    long timeout_ms = 30000;   // 0 waits forever
+    size_t head_bytes = 16 << 10;
+    size_t tail_bytes = 48 << 10;
+    function<void(const char*, size_t, bool is_stderr)> on_output; // Runs on the runner thread
+};
+
+struct ProcessResult {
+    int exit_code = -1;
+    int signal = 0;           // Set when the command was killed by a signal
+    bool timed_out = false;
+    bool cancelled = false;
+    string error;             // Spawn failures
+    string output;            // stdout and stderr interleaved, head and tail only
+    size_t output_bytes = 0;  // Everything the command wrote
+    double elapsed_ms = 0;
+
+    bool ok() const { return error.empty() && exit_code == 0; }
+    string status() const {
+        if (!error.empty()) return error;
+        if (timed_out) return "timed out";
+        if (cancelled) return "cancelled";
+        if (signal) return string("killed by ") + strsignal(signal);
+        return "exit " + to_string(exit_code);
+    }
+};
+
+// A command owned by the ProcessRunner; the waiting side mirrors PendingRequest
+class ProcessHandle {
+public:
+    ProcessHandle(string command, ProcessOptions options)
+        : command_(move(command)), options_(move(options)), capture_(options_.head_bytes, options_.tail_bytes) {}
+
+    const string& command() const { return command_; }
+    bool ready() const { return done_.load(); }
+
+    bool wait_for(chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(mutex_);
+        return cv_.wait_for(lock, timeout, [this] { return done_.load(); });
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return done_.load(); });
+    }
+
+    void cancel();
+
+    const ProcessResult& result() const { return result_; }
+
+private:
+    friend class ProcessRunner;
+
+    string command_;
+    ProcessOptions options_;
+    BoundedCapture capture_;
+    ProcessResult result_;
+    pid_t pid_ = -1;          // Also the process group id
+    int stdout_fd_ = -1;
+    int stderr_fd_ = -1;
+    bool exited_ = false;
+    chrono::steady_clock::time_point started_;
+    optional<chrono::steady_clock::time_point> terminated_at_; // SIGTERM sent
+    atomic<bool> cancel_requested_{false};
+    atomic<bool> done_{false};
+    mutex mutex_;
+    condition_variable cv_;
+};
+
+// Runs shell commands through posix_spawn. One thread polls the stdout and stderr pipes
+// of every running command and streams what arrives into each command's BoundedCapture
+// (and its on_output callback), so a command printing gigabytes costs constant memory and
+// never blocks the REPL. Timeouts send SIGTERM to the command's process group and SIGKILL
+// two seconds later. At most `max_running` commands run at once; the rest wait in a queue.
+class ProcessRunner {
+public:
+    static ProcessRunner& instance() {
+        static ProcessRunner runner;
+        return runner;
+    }
+
+    ~ProcessRunner() { shutdown(); }
+
+    void configure(const Config& config) {
+        lock_guard<mutex> guard(mutex_);
+        max_running_ = static_cast<size_t>(max(config.exec_max_running, 1));
+    }
+
+    shared_ptr<ProcessHandle> run(string command, ProcessOptions options) {
+        auto handle = make_shared<ProcessHandle>(move(command), move(options));
+        {
+            lock_guard<mutex> guard(mutex_);
+            if (wake_pipe_[0] < 0 && pipe2(wake_pipe_, O_CLOEXEC | O_NONBLOCK) != 0) {
+                handle->result_.error = string("pipe: ") + strerror(errno);
+                finish(*handle);
+                return handle;
+            }
+            if (!thread_.joinable() && !stopping_) thread_ = thread(&ProcessRunner::loop, this);
+            queued_.push_back(handle);
+        }
+        wakeup();
+        return handle;
+    }
+
+    void wakeup() {
+        if (wake_pipe_[1] < 0) return;
+        char byte = 1;
+        ssize_t ignored = ::write(wake_pipe_[1], &byte, 1); // A full pipe already means "wake up"
+        (void)ignored;
+    }
+
+    // Terminates everything still running or queued
+    void shutdown() {
+        {
+            lock_guard<mutex> guard(mutex_);
+            stopping_ = true;
+        }
+        wakeup();
+        if (thread_.joinable()) thread_.join();
+        for (int& fd : wake_pipe_) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    ProcessRunner() = default;
+
+    static bool spawn(ProcessHandle& handle) {
+        int out[2], err[2];
+        if (pipe2(out, O_CLOEXEC) != 0) {
+            handle.result_.error = string("pipe: ") + strerror(errno);
+            return false;
+        }
+        if (pipe2(err, O_CLOEXEC) != 0) {
+            handle.result_.error = string("pipe: ") + strerror(errno);
+            ::close(out[0]);
+            ::close(out[1]);
+            return false;
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0); // The REPL owns the terminal
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+
+        // A process group of its own: timeouts kill the whole pipeline, and Ctrl-C at the
+        // terminal reaches the REPL, which cancels the command itself
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        sigset_t defaults, unblocked;
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGPIPE);
+        sigemptyset(&unblocked);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setpgroup(&attributes, 0);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+        posix_spawnattr_setsigmask(&attributes, &unblocked);
+
+        string command = handle.command_;
+        char* argv[] = {const_cast<char*>("sh"), const_cast<char*>("-c"), command.data(), nullptr};
+        int status = posix_spawn(&handle.pid_, "/bin/sh", &actions, &attributes, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attributes);
+        ::close(out[1]);
+        ::close(err[1]);
+        if (status != 0) {
+            handle.result_.error = string("posix_spawn: ") + strerror(status);
+            handle.pid_ = -1;
+            ::close(out[0]);
+            ::close(err[0]);
+            return false;
+        }
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        fcntl(err[0], F_SETFL, O_NONBLOCK);
+        handle.stdout_fd_ = out[0];
+        handle.stderr_fd_ = err[0];
+        handle.started_ = chrono::steady_clock::now();
+        return true;
+    }
+
+    static void finish(ProcessHandle& handle) {
+        ProcessResult& result = handle.result_;
+        result.output = handle.capture_.text();
+        result.output_bytes = handle.capture_.total();
+        if (handle.pid_ > 0) {
+            result.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - handle.started_).count();
+        }
+        {
+            lock_guard<mutex> guard(handle.mutex_);
+            handle.done_ = true;
+        }
+        handle.cv_.notify_all();
+    }
+
+    static void close_fd(int& fd) {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    // Reads what is available without blocking and closes the pipe at EOF
+    void drain(ProcessHandle& handle, int& fd, bool is_stderr) {
+        for (int reads = 0; fd >= 0 && reads < 16; reads++) { // Bounded, so one chatty command cannot starve the rest
+            ssize_t n = ::read(fd, buffer_.data(), buffer_.size());
+            if (n > 0) {
+                handle.capture_.append(buffer_.data(), n);
+                if (handle.options_.on_output) handle.options_.on_output(buffer_.data(), n, is_stderr);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                if (n < 0 && errno == EAGAIN) return;
+                close_fd(fd);
+            }
+        }
+    }
+
+    // Drains, enforces the deadline and reaps one command; true once it is finished
+    bool advance(ProcessHandle& handle, chrono::steady_clock::time_point now, bool stopping) {
+        drain(handle, handle.stdout_fd_, false);
+        drain(handle, handle.stderr_fd_, true);
+
+        int status;
+        if (!handle.exited_ && waitpid(handle.pid_, &status, WNOHANG) == handle.pid_) {
+            handle.exited_ = true;
+            handle.result_.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            handle.result_.signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        }
+
+        bool expired = handle.options_.timeout_ms > 0 &&
+                       now - handle.started_ >= chrono::milliseconds(handle.options_.timeout_ms);
+        if (!handle.terminated_at_ && (expired || handle.cancel_requested_ || stopping)) {
+            handle.result_.timed_out = expired && !handle.cancel_requested_ && !stopping;
+            handle.result_.cancelled = !handle.result_.timed_out;
+            kill(-handle.pid_, SIGTERM);
+            handle.terminated_at_ = now;
+        } else if (handle.terminated_at_ && now - *handle.terminated_at_ >= chrono::seconds(2)) {
+            kill(-handle.pid_, SIGKILL);
+            if (handle.exited_) {
+                // Whatever still holds the pipes open has had its chance
+                close_fd(handle.stdout_fd_);
+                close_fd(handle.stderr_fd_);
+            }
+        }
+        return handle.exited_ && handle.stdout_fd_ < 0 && handle.stderr_fd_ < 0;
+    }
+
+    void loop() {
+        vector<shared_ptr<ProcessHandle>> running;
+        buffer_.resize(65536);
+        while (true) {
+            bool stopping;
+            {
+                lock_guard<mutex> guard(mutex_);
+                stopping = stopping_;
+                while (running.size() < max_running_ && !queued_.empty()) {
+                    shared_ptr<ProcessHandle> handle = queued_.front();
+                    queued_.pop_front();
+                    if (stopping || handle->cancel_requested_) {
+                        handle->result_.cancelled = true;
+                        finish(*handle);
+                    } else if (spawn(*handle)) {
+                        running.push_back(handle);
+                    } else {
+                        finish(*handle);
+                    }
+                }
+            }
+            if (stopping && running.empty()) return;
+
+            // Sleep until output, a wakeup, the nearest deadline or the next reap check
+            auto now = chrono::steady_clock::now();
+            long timeout_ms = 100;
+            vector<pollfd> descriptors = {{wake_pipe_[0], POLLIN, 0}};
+            for (auto& handle : running) {
+                if (handle->stdout_fd_ >= 0) descriptors.push_back({handle->stdout_fd_, POLLIN, 0});
+                if (handle->stderr_fd_ >= 0) descriptors.push_back({handle->stderr_fd_, POLLIN, 0});
+                if (handle->stdout_fd_ < 0 && handle->stderr_fd_ < 0) timeout_ms = min(timeout_ms, 5L);
+                if (handle->options_.timeout_ms > 0 && !handle->terminated_at_) {
+                    auto left = handle->started_ + chrono::milliseconds(handle->options_.timeout_ms) - now;
+                    timeout_ms = min<long>(timeout_ms, max<long>(0, chrono::duration_cast<chrono::milliseconds>(left).count() + 1));
+                }
+            }
+            ::poll(descriptors.data(), descriptors.size(), static_cast<int>(timeout_ms));
+            char wake_bytes[64];
+            while (::read(wake_pipe_[0], wake_bytes, sizeof(wake_bytes)) > 0) {}
+
+            now = chrono::steady_clock::now();
+            for (auto it = running.begin(); it != running.end();) {
+                if (advance(**it, now, stopping)) {
+                    finish(**it);
+                    it = running.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+    mutex mutex_;
+    deque<shared_ptr<ProcessHandle>> queued_;
+    size_t max_running_ = 4;
+    bool stopping_ = false;
+    int wake_pipe_[2] = {-1, -1};
+    vector<char> buffer_; // Read buffer of the runner thread
+    thread thread_;
+};
+
+void ProcessHandle::cancel() {
+    cancel_requested_ = true;
+    ProcessRunner::instance().wakeup();
+}
+
+ProcessOptions process_options(const Config& config) {
+    ProcessOptions options;
+    options.timeout_ms = config.exec_timeout_ms;
+    options.head_bytes = static_cast<size_t>(max(config.exec_head_kb, 0)) << 10;
+    options.tail_bytes = static_cast<size_t>(max(config.exec_tail_kb, 0)) << 10;
+    return options;
+}
+
+// Runs `command` in the foreground, echoing its output live (stderr in red) up to the
+// head limit; the retained tail is shown when it finishes. Ctrl-C cancels it.
+ProcessResult execute_command(const Config& config, const string& command) {
+    cout << "\n⚡ Executing Command ⚡" << endl;
+    cout << "╔════════════════════╗" << endl;
+    cout << "│ " << command << endl;
+    cout << "╟────────────────────╢" << endl;
+
+    ProcessOptions options = process_options(config);
+    auto echoed = make_shared<size_t>(0);
+    size_t echo_limit = options.head_bytes;
+    options.on_output = [echoed, echo_limit](const char* data, size_t length, bool is_stderr) {
+        if (*echoed >= echo_limit) return;
+        size_t shown = min(length, echo_limit - *echoed);
+        *echoed += shown;
+        string text(data, shown);
+        Renderer::instance().write(is_stderr ? COLOR_RED + text + COLOR_RESET : text);
+        if (*echoed >= echo_limit) {
+            Renderer::instance().write(COLOR_YELLOW + "\n[... output continues; the end is shown when the command finishes ...]\n" + COLOR_RESET);
+        }
+    };
+
+    cout.flush();
+    shared_ptr<ProcessHandle> process = ProcessRunner::instance().run(command, move(options));
+    interrupt_requested = false;
+    foreground_requests++;
+    while (!process->wait_for(chrono::milliseconds(50))) {
+        if (interrupt_requested.exchange(false)) process->cancel();
+    }
+    foreground_requests--;
+    Renderer::instance().flush();
+
+    const ProcessResult& result = process->result();
+    // The head was echoed live; the rest of the capture is the omission marker and the tail
+    if (result.output_bytes > echo_limit) cout << result.output.substr(min(result.output.size(), echo_limit));
+    if (!result.output.empty() && result.output.back() != '\n') cout << endl;
+    cout << "╚═ " << result.status() << " · " << fixed_number(result.elapsed_ms, 1) << " ms · "
+         << result.output_bytes << " bytes ═╝" << endl;
+    return result;
+}
+
+// Conversation entry that lets the model see what a command printed
+string command_message(const string& command, const ProcessResult& result) {
+    return "Command `" + command + "` (" + result.status() + ") output:\n" + result.output;
+}
+
+// Chat query or shell command running in the background while the REPL stays usable
+struct BackgroundJob {
+    int id;
+    string question;                    // The question, or the command for process jobs
+    shared_ptr<PendingRequest> request;
+    shared_ptr<ProcessHandle> process;  // Set instead of `request` for bgexec: jobs
+
+    bool ready() const { return process ? process->ready() : request->ready(); }
+    void cancel() const {
+        if (process) process->cancel();
+        else request->cancel();
+    }
+};
+
+// Prints finished background jobs and appends their exchange to the conversation
+void collect_background_jobs(vector<BackgroundJob>& jobs, MessageStore& messages) {
+    for (auto it = jobs.begin(); it != jobs.end();) {
+        if (!it->ready()) {
+            ++it;
+            continue;
+        }
+        if (it->process) {
+            const ProcessResult& process = it->process->result();
+            cout << (process.ok() ? COLOR_SUCCESS : COLOR_ALERT) << "[job " << it->id << "] " << it->question
+                 << " (" << process.status() << ")" << COLOR_RESET << endl;
+            cout << process.output;
+            if (!process.output.empty() && process.output.back() != '\n') cout << endl;
+            messages.append("system", command_message(it->question, process));
+            it = jobs.erase(it);
+            continue;
+        }
+        const HttpResult& result = it->request->result();
+        if (!result.ok()) {
+            cout << COLOR_ALERT << "[job " << it->id << "] " << result.error() << COLOR_RESET << endl;
+        } else {
+            string reply;
+            if (extract_reply(result.body, reply)) {
+                messages.append("user", it->question);
+                messages.append("assistant", reply);
+                cout << COLOR_CYAN << "[job " << it->id << "] AI >>> " << reply << COLOR_RESET << endl;
+            } else {
+                cerr << COLOR_RED << "[job " << it->id << "] " << reply << COLOR_RESET << endl;
+            }
+        }
+        it = jobs.erase(it);
+    }
+}
+
+// Long-running owner of what every terminal on the machine can share: the request engine
+// with its pooled connections and backend routing, the in-process model, the response and
+// search caches and the prompt library. REPLs find it on a Unix socket (DAEMON_SOCKET) and
+// keep only their conversation. Each connection has a reader thread and a writer thread
+// with an outbox, so a terminal that stops reading (Ctrl-Z) never holds up the engine.
+class DaemonServer {
+public:
+    ~DaemonServer() { stop(); }
+
+    // Refuses a socket another daemon still answers on; a stale file is replaced
+    bool start(const string& path, string& error) {
+        sockaddr_un address{};
+        if (path.size() >= sizeof(address.sun_path)) {
+            error = "Socket path is too long: " + path;
+            return false;
+        }
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size());
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool taken = probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        if (probe >= 0) ::close(probe);
+        if (taken) {
+            error = "Another daemon is listening on " + path;
+            return false;
+        }
+        ::unlink(path.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        mode_t mask = umask(0177); // Only the owner may connect
+        bool bound = listen_fd_ >= 0 && bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        umask(mask);
+        if (!bound || listen(listen_fd_, 64) != 0) {
+            error = "Unable to listen on " + path + ": " + strerror(errno);
+            if (listen_fd_ >= 0) ::close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+        path_ = path;
+        started_ = chrono::steady_clock::now();
+        stopping_ = false;
+        acceptor_ = thread(&DaemonServer::accept_loop, this);
+        return true;
+    }
+
+    // Disconnects every client, cancelling what they still have running
+    void stop() {
+        if (listen_fd_ < 0) return;
+        stopping_ = true;
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        if (acceptor_.joinable()) acceptor_.join();
+        ::unlink(path_.c_str());
+        vector<shared_ptr<Connection>> connections;
+        {
+            lock_guard<mutex> guard(mutex_);
+            connections.swap(connections_);
+        }
+        for (auto& connection : connections) ::shutdown(connection->fd, SHUT_RDWR);
+        for (auto& connection : connections) close_connection(*connection);
+    }
+
+private:
+    struct Connection {
+        int fd = -1;
+        mutex lock;
+        condition_variable cv;
+        deque<string> outbox;   // Encoded frames for the writer thread
+        bool closing = false;
+        unordered_map<uint32_t, shared_ptr<PendingRequest>> requests;
+        int running_calls = 0;  // Calls answered off the reader thread
+        thread reader;
+        thread writer;
+        atomic<bool> finished{false};
+
+        void send(uint8_t type, uint32_t id, string_view payload) {
+            {
+                lock_guard<mutex> guard(lock);
+                outbox.push_back(encode_frame(type, id, payload));
+            }
+            cv.notify_one();
+        }
+    };
+
+    void accept_loop() {
+        while (!stopping_) {
+            int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (stopping_) return;
+                this_thread::sleep_for(chrono::milliseconds(10)); // Out of descriptors, say
+                continue;
+            }
+            auto connection = make_shared<Connection>();
+            connection->fd = fd;
+            lock_guard<mutex> guard(mutex_);
+            for (auto it = connections_.begin(); it != connections_.end();) { // Reap clients that left
+                if (!(*it)->finished) {
+                    ++it;
+                    continue;
+                }
+                close_connection(**it);
+                it = connections_.erase(it);
+            }
+            connection->reader = thread(&DaemonServer::serve, this, connection);
+            connection->writer = thread(&DaemonServer::write_loop, connection);
+            connections_.push_back(connection);
+        }
+    }
+
+    static void close_connection(Connection& connection) {
+        if (connection.reader.joinable()) connection.reader.join();
+        if (connection.writer.joinable()) connection.writer.join();
+        ::close(connection.fd);
+    }
+
+    void serve(shared_ptr<Connection> connection) {
+        DaemonClient::serving = true;
+        uint8_t type;
+        uint32_t id;
+        string payload;
+        while (read_frame(connection->fd, type, id, payload)) {
+            if (type == FRAME_HELLO) {
+                json hello = {{"protocol", DAEMON_PROTOCOL}, {"pid", getpid()}};
+                connection->send(FRAME_HELLO, 0, hello.dump());
+            } else if (type == FRAME_REQUEST) {
+                RequestSpec spec;
+                if (!decode_request_spec(payload, spec)) {
+                    HttpResult failed;
+                    failed.curl_code = CURLE_URL_MALFORMAT;
+                    failed.message = "Malformed request frame";
+                    connection->send(FRAME_DONE, id, http_result_to_json(failed).dump());
+                    continue;
+                }
+                spec.on_data = [connection, id](const char* data, size_t length) {
+                    connection->send(FRAME_DATA, id, string_view(data, length));
+                    return true;
+                };
+                spec.on_complete = [connection, id](const HttpResult& result) {
+                    connection->send(FRAME_DONE, id, http_result_to_json(result).dump(-1, ' ', false, json::error_handler_t::replace));
+                    lock_guard<mutex> guard(connection->lock);
+                    connection->requests.erase(id);
+                };
+                lock_guard<mutex> guard(connection->lock); // Held so on_complete cannot run before the insert
+                connection->requests[id] = RequestEngine::instance().submit(move(spec));
+                requests_served_++;
+            } else if (type == FRAME_CANCEL) {
+                shared_ptr<PendingRequest> request;
+                {
+                    lock_guard<mutex> guard(connection->lock);
+                    auto it = connection->requests.find(id);
+                    if (it != connection->requests.end()) request = it->second;
+                }
+                if (request) request->cancel();
+            } else if (type == FRAME_CALL) {
+                json request = json::parse(payload, nullptr, false);
+                if (!request.is_object() || request.value("op", "") != "search") {
+                    connection->send(FRAME_REPLY, id, handle_call(request).dump(-1, ' ', false, json::error_handler_t::replace));
+                    continue;
+                }
+                // Searches wait on the network, so they must not stall this client's other frames
+                {
+                    lock_guard<mutex> guard(connection->lock);
+                    connection->running_calls++;
+                }
+                thread([this, connection, id, request = move(request)] {
+                    DaemonClient::serving = true;
+                    json reply = handle_call(request);
+                    connection->send(FRAME_REPLY, id, reply.dump(-1, ' ', false, json::error_handler_t::replace));
+                    lock_guard<mutex> guard(connection->lock);
+                    connection->running_calls--;
+                    connection->cv.notify_all();
+                }).detach();
+            }
+        }
+
+        // The client left: cancel what it started, then let the writer drain and stop
+        vector<shared_ptr<PendingRequest>> pending;
+        {
+            lock_guard<mutex> guard(connection->lock);
+            for (auto& [request_id, request] : connection->requests) pending.push_back(request);
+        }
+        for (auto& request : pending) request->cancel();
+        for (auto& request : pending) request->wait();
+        {
+            unique_lock<mutex> lock(connection->lock);
+            connection->cv.wait(lock, [&] { return connection->running_calls == 0; });
+            connection->closing = true;
+        }
+        connection->cv.notify_all();
+        connection->finished = true;
+    }
+
+    // Sends whatever has queued up in one write, so a burst of small deltas costs one syscall
+    static void write_loop(shared_ptr<Connection> connection) {
+        bool broken = false;
+        unique_lock<mutex> lock(connection->lock);
+        while (true) {
+            connection->cv.wait(lock, [&] { return connection->closing || !connection->outbox.empty(); });
+            if (connection->outbox.empty()) return;
+            string batch;
+            for (const string& frame : connection->outbox) batch += frame;
+            connection->outbox.clear();
+            lock.unlock();
+            if (!broken && !send_frame_bytes(connection->fd, batch)) {
+                broken = true; // Gone; the reader sees EOF and tears down
+                ::shutdown(connection->fd, SHUT_RDWR);
+            }
+            lock.lock();
+        }
+    }
+
+    // Unknown operations and malformed calls answer null, which makes the client fall back
+    // to doing it locally
+    json handle_call(const json& request) {
+        try {
+            return dispatch_call(request);
+        } catch (const json::exception&) { // A field of the wrong type
+            return nullptr;
+        }
+    }
+
+    json dispatch_call(const json& request) {
+        string op = request.is_object() ? request.value("op", "") : "";
+        if (op == "search") {
+            shared_ptr<const Config> snapshot = ConfigStore::instance().current();
+            Config config = snapshot ? snapshot->clone() : Config();
+            config.nsfw_mode = request.value("nsfw", config.nsfw_mode);
+            json results = json::array();
+            for (const SearchResult& result : SearchService::instance().search(config, request.value("query", ""))) {
+                results.push_back({{"text", result.text}, {"url", result.url}, {"engine", result.engine}});
+            }
+            return {{"results", results}};
+        }
+        if (op == "cache.get") {
+            CachedResponse cached;
+            if (!ResponseCache::instance().get(request.value("key", ""), cached)) return {{"hit", false}};
+            return {{"hit", true}, {"content", cached.content}, {"usage", cached.usage}, {"latency_ms", cached.latency_ms}};
+        }
+        if (op == "cache.put") {
+            CachedResponse cached;
+            cached.content = request.value("content", "");
+            cached.usage = request.value("usage", json());
+            cached.latency_ms = request.value("latency_ms", 0.0);
+            ResponseCache::instance().put(request.value("key", ""), cached);
+            return {{"stored", true}};
+        }
+        if (op == "cache.stats") return ResponseCache::instance().stats();
+        if (op == "status") {
+            size_t clients = 0;
+            {
+                lock_guard<mutex> guard(mutex_);
+                for (const auto& connection : connections_) clients += !connection->finished;
+            }
+            return {{"pid", getpid()}, {"clients", clients}, {"requests", requests_served_.load()},
+                    {"uptime_s", chrono::duration<double>(chrono::steady_clock::now() - started_).count()}};
+        }
+        if (op.compare(0, 8, "prompts.") != 0) return nullptr;
+
+        lock_guard<mutex> guard(prompts_mutex_);
+        PromptLibrary& prompts = PromptLibrary::instance();
+        prompts.poll();
+        string name = request.value("name", "");
+        if (op == "prompts.complete") return {{"names", prompts.complete(request.value("prefix", ""), request.value("limit", SIZE_MAX))}};
+        if (op == "prompts.size") return {{"size", prompts.size()}};
+        if (op == "prompts.resolve") {
+            string resolved;
+            bool found = prompts.resolve(name, resolved);
+            return {{"found", found}, {"name", resolved}};
+        }
+        if (op == "prompts.load") {
+            string content;
+            bool found = prompts.load(name, content);
+            return {{"found", found}, {"content", content}};
+        }
+        if (op == "prompts.save") {
+            bool saved = prompts.save(name, request.value("content", ""));
+            prompts.save_manifest();
+            return {{"saved", saved}};
+        }
+        return nullptr;
+    }
+
+    string path_;
+    int listen_fd_ = -1;
+    atomic<bool> stopping_{false};
+    thread acceptor_;
+    mutex mutex_;
+    vector<shared_ptr<Connection>> connections_;
+    mutex prompts_mutex_; // PromptLibrary is not thread-safe and every client shares it
+    atomic<uint64_t> requests_served_{0};
+    chrono::steady_clock::time_point started_;
+};
+
+atomic<bool> daemon_stop_requested{false};
+
+void handle_daemon_signal(int) {
+    daemon_stop_requested = true;
+}
+
+// ghostintheshellgpt --daemon [--socket path]: serves REPLs until SIGINT or SIGTERM,
+// applying config.json changes as they land
+int run_daemon(const string& socket_path) {
+    ConfigStore& config_store = ConfigStore::instance();
+    config_store.load(CONFIG_FILE);
+    config_store.watch();
+    uint64_t applied_version = 0;
+    auto refresh_config = [&]() {
+        if (config_store.version() == applied_version) return;
+        applied_version = config_store.version();
+        shared_ptr<const Config> snapshot = config_store.current();
+        ResponseCache::instance().configure(*snapshot);
+        LlamaBackend::instance().configure(*snapshot); // Metrics are the clients' to keep, per terminal
+        BackendPool::instance().configure(*snapshot);
+    };
+    refresh_config();
+    PromptLibrary::instance().open(PROMPT_DIR, PROMPT_INDEX);
+
+    DaemonServer server;
+    string error;
+    if (!server.start(socket_path, error)) {
+        cerr << COLOR_RED << "Error: " << error << COLOR_RESET << endl;
+        return 1;
+    }
+    signal(SIGINT, handle_daemon_signal);
+    signal(SIGTERM, handle_daemon_signal);
+    display_status("Daemon listening on " + socket_path + " (pid " + to_string(getpid()) + ")", COLOR_SUCCESS, "✓");
+    while (!daemon_stop_requested) {
+        refresh_config();
+        this_thread::sleep_for(chrono::milliseconds(200));
+    }
+    server.stop();
+    PromptLibrary::instance().close();
+    display_status("Daemon stopped", COLOR_SUCCESS, "✓");
+    return 0;
+}
+
+// Main interactive agent function
+void interactive_agent_enhanced() {
+    ConfigStore& config_store = ConfigStore::instance();
+    config_store.load(CONFIG_FILE);
+    config_store.watch();
+    shared_ptr<const Config> snapshot = config_store.current();
+    uint64_t applied_version = config_store.version();
+    DaemonClient& daemon = DaemonClient::instance();
+    bool remote = daemon.connected(); // The cache, the backends, the model and the prompts are then the daemon's
+    // Singletons keep their own copies of a few settings; refreshed when a new snapshot lands
+    auto apply_config = [&remote](const Config& config) {
+        if (!remote) {
+            ResponseCache::instance().configure(config);
+            LlamaBackend::instance().configure(config);
+            BackendPool::instance().configure(config);
+        }
+        Metrics::instance().configure(config);
+        TrafficRecorder::instance().configure(config);
+        ProcessRunner::instance().configure(config);
+        SlotManager::instance().configure(config);
+        Tokenizer::instance().configure(config);
+    };
+    auto refresh_config = [&]() {
+        if (remote && !daemon.connected()) { // From now on everything runs here
+            remote = false;
+            cerr << COLOR_RED << "Error: Lost the daemon; continuing without it" << COLOR_RESET << endl;
+            apply_config(*config_store.current());
+            PromptLibrary::instance().open(PROMPT_DIR, PROMPT_INDEX);
+        }
+        if (config_store.version() == applied_version) return;
+        applied_version = config_store.version();
+        snapshot = config_store.current();
+        apply_config(*snapshot);
+    };
+    apply_config(*snapshot);
+    PromptLibrary& prompts = PromptLibrary::instance();
+    if (!remote) prompts.open(PROMPT_DIR, PROMPT_INDEX);
+    SessionJournal journal;
+    journal.open(SESSION_JOURNAL, *snapshot);
+    HistoryIndex history_index;
+    history_index.open(HISTORY_INDEX, SESSION_JOURNAL);
+    vector<HistoryIndex::Hit> history_hits; // Of the last history:search, for history:use
+    RagIndex rag_index;
+    rag_index.open(RAG_INDEX);
+    MessageStore messages;
+    messages.set_observer([&journal](const MessageStore& store, size_t i) { journal.append(store, i); });
+    messages.append("system", "You are a powerful AI assistant with advanced capabilities.");
+    ContextManager context;
+    // Sends `input` with the conversation and records the turn once a reply arrives
+    auto chat_turn = [&messages, &context](const Config& config, const string& input) {
+        string response = query_ai(config, context.build(config, messages, serialize_message("user", input)));
+        if (response.empty()) return; // Cancelled or failed; the turn is not recorded
+        string reply;
+        if (!extract_reply(response, reply)) {
+            cerr << COLOR_RED << "Error: " << reply << COLOR_RESET << endl;
+            return;
+        }
+
+        long total_tokens = JsonView::parse(response)["usage"]["total_tokens"].integer_or(-1);
+        if (config.debug_mode && total_tokens >= 0) {
+            cout << COLOR_YELLOW << "Token count: " << total_tokens << COLOR_RESET << endl;
+        }
+
+        messages.append("user", input);
+        messages.append("assistant", reply);
+        if (!config.stream) {
+            cout << COLOR_CYAN << "AI >>> " << reply << COLOR_RESET << endl;
+        }
+    };
+    vector<BackgroundJob> jobs;
+    int next_job_id = 1;
+    signal(SIGINT, handle_sigint);
+    show_welcome_screen();  // Show welcome screen only once
+    if (remote) display_status("Using the daemon on " + daemon.path() + " (pid " + to_string(daemon.pid()) + ")", COLOR_SUCCESS, "✓");
+    
+    while (true) {
+        collect_background_jobs(jobs, messages);
+        refresh_config();
+        context.maybe_summarize(*snapshot, messages); // Runs while the user types
+        context.build(*snapshot, messages);            // Sizes the history the next question is sent with
+        show_command_prompt((Tokenizer::instance().exact() ? "" : "~") + to_string(context.last_prompt_tokens()) + "/" +
+                            to_string(snapshot->context_tokens) + " tokens");
+        string input;
+        getline(cin, input);
+        prompts.poll(); // Library changes made while the user was typing
+        refresh_config();
+        shared_ptr<const Config> command_snapshot = snapshot; // Kept for the whole command
+        const Config& config = *command_snapshot;
+        
+        // Enhanced command processing
+        if (input == "clear") {
+            cout << "\033[2J\033[1;1H";
+            show_welcome_screen();  // Show welcome screen again after clearing
+            continue;
+        }
+        
+        if (input == "settings") {
+            handle_settings(); // Call the settings handler
+            continue;
+        }
+        
+        if (input == "help") {
+            handle_help(); // Call the help handler
+            continue;
+        }
+        
+        if (input.find("search:") == 0) {
+            string query = input.substr(7);
+            string result = web_search_with_selection(config, query);
+            messages.append("system", "Search result: " + result);
+            // Auto-analyze search results
+            messages.append("user", "Please analyze this search result and provide insights.");
+            string response = query_ai(config, context.build(config, messages), "Analysis");
+            // Ensure response is valid; streamed replies were already printed
+            string reply;
+            if (!response.empty() && !config.stream) {
+                if (extract_reply(response, reply)) {
+                    cout << COLOR_CYAN << "Analysis >>> " << reply << COLOR_RESET << endl;
+                } else {
+                    cerr << COLOR_RED << "Error: " << reply << COLOR_RESET << endl;
+                }
+            }
+            continue;
+        }
+        
+        if (input.find("rag:add:") == 0) {
+            RagIndex::AddResult added;
+            string error;
+            if (!rag_index.add(config, input.substr(8), added, error)) {
+                cerr << COLOR_RED << "Error: " << error << COLOR_RESET << endl;
+            } else {
+                display_status("Indexed " + to_string(added.chunks) + " chunks from " + to_string(added.files) + " files (" +
+                               to_string(added.unchanged) + " unchanged); " + to_string(rag_index.size()) + " chunks in total",
+                               COLOR_SUCCESS, "✓");
+            }
+            continue;
+        }
+
+        if (input == "rag:status") {
+            cout << COLOR_GRADIENT_1 << "rag" << COLOR_RESET << ": " << rag_index.size() << " chunks from " << rag_index.sources()
+                 << " files, " << rag_index.dimensions() << " dimensions, "
+                 << (rag_index.lists() > 1 ? to_string(rag_index.lists()) + " IVF lists" : string("exact search")) << ", embeddings from "
+                 << embeddings_endpoint(config) << endl;
+            continue;
+        }
+
+        if (input.find("rag:") == 0) {
+            string question = input.substr(4);
+            if (rag_index.size() == 0) {
+                cout << COLOR_ALERT << "No documents indexed yet. Add some with rag:add:<path>" << COLOR_RESET << endl;
+                continue;
+            }
+            vector<float> query;
+            size_t dim = 0;
+            string error;
+            if (!request_embeddings(config, {question}, query, dim, error)) {
+                cerr << COLOR_RED << "Error: " << error << COLOR_RESET << endl;
+                continue;
+            }
+            if (dim != rag_index.dimensions()) {
+                cerr << COLOR_RED << "Error: The embedding model returns " << dim << " dimensions but the index has "
+                     << rag_index.dimensions() << "; remove " << RAG_INDEX << " and add the documents again" << COLOR_RESET << endl;
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            vector<RagIndex::Hit> hits = rag_index.search(query.data(), static_cast<size_t>(max(config.rag_top_k, 1)), config.rag_probe);
+            double search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            string excerpts = "Excerpts from local documents. Use them to answer when they are relevant and name the files you use.\n";
+            for (size_t i = 0; i < hits.size(); i++) {
+                excerpts += "\n[" + to_string(i + 1) + "] " + hits[i].source + "\n" + hits[i].text + "\n";
+                cout << COLOR_GRADIENT_2 << "[" << i + 1 << "] " << hits[i].source << COLOR_RESET;
+                if (config.debug_mode) cout << COLOR_YELLOW << " (" << fixed_number(hits[i].score, 3) << ")" << COLOR_RESET;
+                cout << endl;
+            }
+            if (config.debug_mode) {
+                cout << COLOR_YELLOW << "Retrieved " << hits.size() << " of " << rag_index.size() << " chunks in "
+                     << fixed_number(search_ms, 2) << " ms" << COLOR_RESET << endl;
+            }
+            messages.append("system", excerpts);
+            chat_turn(config, question);
+            continue;
+        }
+
+        if (input.find("bg:") == 0) {
+            string job_messages = context.build(config, messages, serialize_message("user", input.substr(3)));
+            BackgroundJob job{next_job_id++, input.substr(3),
+                              RequestEngine::instance().submit(build_chat_request(config, job_messages, false)), nullptr};
+            cout << COLOR_SUCCESS << "[job " << job.id << "] Running in background." << COLOR_RESET << endl;
+            jobs.push_back(move(job));
+            continue;
+        }
+
+        if (input.find("exec:") == 0) {
+            string command = input.substr(5);
+            ProcessResult result = execute_command(config, command);
+            messages.append("system", command_message(command, result));
+            continue;
+        }
+
+        if (input.find("bgexec:") == 0) {
+            BackgroundJob job{next_job_id++, input.substr(7), nullptr,
+                              ProcessRunner::instance().run(input.substr(7), process_options(config))};
+            cout << COLOR_SUCCESS << "[job " << job.id << "] Running in background." << COLOR_RESET << endl;
+            jobs.push_back(move(job));
+            continue;
+        }
+
+        if (input == "jobs") {
+            if (jobs.empty()) cout << COLOR_YELLOW << "No background jobs." << COLOR_RESET << endl;
+            for (const auto& job : jobs) {
+                cout << COLOR_GREEN << "  [job " << job.id << "] " << (job.ready() ? "done" : "running")
+                     << ": " << (job.process ? "$ " : "") << job.question << COLOR_RESET << endl;
+            }
+            continue;
+        }
+
+        if (input.find("cancel:") == 0) {
+            string id = input.substr(7);
+            auto it = find_if(jobs.begin(), jobs.end(), [&](const BackgroundJob& job) { return to_string(job.id) == id; });
+            if (it != jobs.end()) {
+                it->cancel();
+            } else {
+                cout << COLOR_ALERT << "No such job: " << id << COLOR_RESET << endl;
+            }
+            continue;
+        }
+
+        if (input == "history") {
+            display_history(messages.to_json());
+            continue;
+        }
+
+        if (input.find("history:search") == 0) {
+            string terms, error;
+            HistoryIndex::Filter filter;
+            if (!parse_history_query(input.substr(min<size_t>(15, input.size())), terms, filter, error)) {
+                cout << COLOR_ALERT << error << COLOR_RESET << endl;
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            journal.sync();
+            history_index.update();
+            history_hits = history_index.search(terms, filter, 10);
+            display_history_hits(history_hits, terms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            continue;
+        }
+
+        if (input.find("history:use:") == 0) {
+            string which = input.substr(12);
+            size_t first = 0, last = history_hits.size();
+            if (which != "all") {
+                size_t n = strtoul(which.c_str(), nullptr, 10);
+                if (n < 1 || n > history_hits.size()) {
+                    cout << COLOR_ALERT << "No such match: " << which << " (run history:search first)" << COLOR_RESET << endl;
+                    continue;
+                }
+                first = n - 1;
+                last = n;
+            }
+            for (size_t i = first; i < last; i++) {
+                const HistoryIndex::Hit& hit = history_hits[i];
+                char date[32] = "an unknown date";
+                time_t ts = hit.ts;
+                if (ts > 0) strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&ts));
+                messages.append("system", "From an earlier conversation (" + hit.role + ", " + date + "):\n" + hit.content, false); // Already journaled
+            }
+            display_status("Added " + to_string(last - first) + " earlier messages to the conversation", COLOR_SUCCESS, "✓");
+            continue;
+        }
+
+        if (input == "stats") {
+            json status;
+            if (remote && daemon.call({{"op", "status"}}, status)) {
+                cout << COLOR_GRADIENT_1 << "daemon" << COLOR_RESET << ": pid " << status.value("pid", 0) << ", "
+                     << status.value("clients", 0) << " clients, " << status.value("requests", 0) << " requests served, up "
+                     << static_cast<long>(status.value("uptime_s", 0.0)) << " s" << endl;
+            }
+            Metrics::instance().print();
+            BackendPool::instance().print();
+            SlotManager::instance().print();
+            Metrics::instance().flush();
+            continue;
+        }
+
+        if (input == "prompts" || input.find("prompts:") == 0) {
+            display_prompts(input.size() > 8 ? input.substr(8) : "");
+            continue;
+        }
+
+        if (input.find("prompt:load:") == 0) {
+            string name = input.substr(12), resolved, content;
+            if (!prompts.resolve(name, resolved)) {
+                vector<string> candidates = prompts.complete(name, 10);
+                if (candidates.empty()) {
+                    cout << COLOR_RED << "Prompt not found: " << name << COLOR_RESET << endl;
+                } else {
+                    cout << COLOR_YELLOW << "Ambiguous prompt name. Matches:" << COLOR_RESET << endl;
+                    for (const string& candidate : candidates) cout << COLOR_GREEN << "  " << candidate << COLOR_RESET << endl;
+                }
+            } else if (!prompts.load(resolved, content)) {
+                cout << COLOR_RED << "Error: Unable to read prompt " << resolved << COLOR_RESET << endl;
+            } else {
+                context.set_system_prompt(content);
+                display_status("Loaded prompt: " + resolved, COLOR_SUCCESS, "✓");
+            }
+            continue;
+        }
+
+        if (input.find("prompt:save:") == 0) {
+            string rest = input.substr(12);
+            size_t colon = rest.find(':');
+            if (colon == string::npos || colon == 0) {
+                cout << COLOR_ALERT << "Usage: prompt:save:<name>:<content>" << COLOR_RESET << endl;
+            } else {
+                save_prompt(rest.substr(0, colon), rest.substr(colon + 1));
+            }
+            continue;
+        }
+
+        if (input == "prompt:edit") {
+            edit_prompt();
+            continue;
+        }
+
+        if (input.find("session:show") == 0) {
+            size_t count = 20;
+            if (input.size() > 13 && !parse_number(string_view(input).substr(13), count)) {
+                cout << COLOR_ALERT << "Usage: session:show[:<n>]" << COLOR_RESET << endl;
+                continue;
+            }
+            load_session(count);
+            continue;
+        }
+
+        if (input.find("session:resume") == 0) {
+            size_t count = 50;
+            if (input.size() > 15 && !parse_number(string_view(input).substr(15), count)) {
+                cout << COLOR_ALERT << "Usage: session:resume[:<n>]" << COLOR_RESET << endl;
+                continue;
+            }
+            size_t resumed = 0;
+            for (const auto& message : journal.tail(count, true)) {
+                if (message["role"] == "system") continue;
+                messages.append(message.value("role", "user"), message.value("content", ""), false); // Already journaled
+                resumed++;
+            }
+            display_status("Resumed " + to_string(resumed) + " messages from the session journal", COLOR_SUCCESS, "✓");
+            if (SlotManager::instance().restore(config)) {
+                display_status("Restored the conversation's server slot; its prompt cache is warm", COLOR_SUCCESS, "✓");
+            }
+            continue;
+        }
+
+        if (input == "session:compact") {
+            if (journal.compact()) {
+                display_status("Session journal compacted", COLOR_SUCCESS, "✓");
+            } else {
+                cerr << COLOR_RED << "Error: Session journal compaction failed" << COLOR_RESET << endl;
+            }
+            continue;
+        }
+
+        if (input == "exit") {
+            journal.sync(); // Messages are journaled as they are produced
+            prompts.save_manifest();
+            config_store.stop_watching();
+            if (SlotManager::instance().save(config)) {
+                display_status("Saved the server slot for session:resume", COLOR_SUCCESS, "✓");
+            }
+            display_status("Session saved. Goodbye!", COLOR_GRADIENT_1, "👋");
+            break;
+        }
+        
+        // Enhanced NSFW command processing
+        if (input.find("nsfw:") == 0) {
+            string mode = input.substr(5);
+            if (mode == "on") {
+                config_store.update([](Config& next) { next.nsfw_mode = true; });
+                cout << COLOR_SUCCESS << "NSFW Mode: Enabled" << COLOR_RESET << endl;
+            } else if (mode == "off") {
+                config_store.update([](Config& next) { next.nsfw_mode = false; });
+                cout << COLOR_SUCCESS << "NSFW Mode: Disabled" << COLOR_RESET << endl;
+            } else {
+                cout << COLOR_ALERT << "Invalid NSFW command. Use 'nsfw:on' or 'nsfw:off'." << COLOR_RESET << endl;
+            }
+            continue;
+        }
+        
+        // Enhanced chat processing
+        if (!input.empty() && input != "help") {
+            chat_turn(config, input);
+        } else {
+            cout << COLOR_ALERT << "Invalid command. Type 'help' for a list of available commands." << COLOR_RESET << endl;
+        }
+    }
+}
+
+// Lists the prompt library, optionally only names starting with `prefix`
+void display_prompts(const string& prefix) {
+    PromptLibrary& library = PromptLibrary::instance();
+    const size_t limit = 50;
+    vector<string> names = library.complete(prefix, limit + 1);
+    cout << COLOR_YELLOW << "Available Prompts (" << library.size() << " total):" << COLOR_RESET << endl;
+    for (size_t i = 0; i < min(names.size(), limit); i++) {
+        cout << COLOR_GREEN << "  " << names[i] << COLOR_RESET << endl;
+    }
+    if (names.size() > limit) cout << COLOR_GREEN << "  ..." << COLOR_RESET << endl;
+    cout << COLOR_BLUE << "Use 'prompt:load:<name>' to switch prompts." << COLOR_RESET << endl;
+}
+// Replaces the content of an existing prompt
+void edit_prompt() {
+    cout << "Enter the name of the prompt you want to edit: ";
+    string name;
+    getline(cin, name);
+
+    string resolved, content;
+    if (PromptLibrary::instance().resolve(name, resolved) && PromptLibrary::instance().load(resolved, content)) {
+        cout << COLOR_YELLOW << "Current content: " << content << COLOR_RESET << endl;
+        cout << "Enter the new content for the prompt: ";
+        string new_content;
+        getline(cin, new_content);
+        save_prompt(resolved, new_content);
+    } else {
+        cout << COLOR_RED << "Prompt not found." << COLOR_RESET << endl;
+    }
+}
+
+void save_prompt(const string& name, const string& content) {
+    if (PromptLibrary::instance().save(name, content)) {
+        cout << COLOR_GREEN << "Prompt saved successfully." << COLOR_RESET << endl;
+    } else {
+        cout << COLOR_RED << "Error: Unable to save prompt " << name << COLOR_RESET << endl;
+    }
+}
+
+// Headless batch mode: reads prompts from a JSONL file (or "-" for stdin), keeps up to
+// batch_concurrency requests in flight with retry and exponential backoff, and writes one
+// JSONL result per item as it completes. Input lines are a plain prompt, a JSON string,
+// or an object with "prompt" or "messages" and an optional "id".
+int run_batch(const Config& config, const string& input_path, const string& output_path) {
+    ResponseCache::instance().configure(config);
+    LlamaBackend::instance().configure(config);
+    Metrics::instance().configure(config);
+    TrafficRecorder::instance().configure(config);
+    BackendPool::instance().configure(config);
+
+    ifstream input_file;
+    if (input_path != "-") {
+        input_file.open(input_path);
+        if (!input_file.is_open()) {
+            cerr << COLOR_RED << "Error: Unable to open " << input_path << COLOR_RESET << endl;
+            return 1;
+        }
+    }
+    istream& input = input_path == "-" ? cin : input_file;
+    ofstream output_file;
+    if (!output_path.empty() && output_path != "-") {
+        output_file.open(output_path, ios::trunc);
+        if (!output_file.is_open()) {
+            cerr << COLOR_RED << "Error: Unable to write " << output_path << COLOR_RESET << endl;
+            return 1;
+        }
+    }
+    ostream& output = output_file.is_open() ? output_file : cout;
+
+    struct BatchItem {
+        size_t index;
+        json id;
+        string messages_json;
+        string cache_key;
+        int attempts = 0;
+        chrono::steady_clock::time_point started;
+        chrono::steady_clock::time_point attempt_started;
+        chrono::steady_clock::time_point retry_at;
+        shared_ptr<PendingRequest> request;
+    };
+
+    mutex wake_mutex;
+    condition_variable wake;
+    auto submit = [&](BatchItem& item) {
+        RequestSpec spec = build_chat_request(config, item.messages_json, false);
+        spec.metric = "batch";
+        spec.on_complete = [&](const HttpResult&) {
+            lock_guard<mutex> guard(wake_mutex);
+            wake.notify_one();
+        };
+        item.attempts++;
+        item.attempt_started = chrono::steady_clock::now();
+        item.request = RequestEngine::instance().submit(move(spec));
+    };
+
+    auto write_result = [&](const BatchItem& item, json result) {
+        auto now = chrono::steady_clock::now();
+        result["index"] = item.index;
+        if (!item.id.is_null()) result["id"] = item.id;
+        result["attempts"] = item.attempts;
+        result["total_ms"] = chrono::duration<double, milli>(now - item.started).count();
+        output << result.dump(-1, ' ', false, json::error_handler_t::replace) << '\n';
+        output.flush();
+    };
+
+    size_t concurrency = static_cast<size_t>(max(config.batch_concurrency, 1));
+    size_t next_index = 0, succeeded = 0, failed = 0;
+    list<BatchItem> in_flight;
+    bool input_done = false;
+    auto batch_start = chrono::steady_clock::now();
+
+    while (!input_done || !in_flight.empty()) {
+        // Top up the window from the input
+        while (!input_done && in_flight.size() < concurrency) {
+            string line;
+            if (!getline(input, line)) {
+                input_done = true;
+                break;
+            }
+            if (line.find_first_not_of(" \t\r") == string::npos) continue;
+
+            BatchItem item;
+            item.index = next_index++;
+            item.started = chrono::steady_clock::now();
+            json entry = json::parse(line, nullptr, false);
+            string error;
+            if (entry.is_discarded()) {
+                item.messages_json = "[" + serialize_message("user", line) + "]"; // Plain-text prompt
+            } else if (entry.is_string()) {
+                item.messages_json = "[" + serialize_message("user", entry.get<string>()) + "]";
+            } else if (entry.is_object() && entry.contains("messages")) {
+                const json& messages = entry["messages"];
+                item.id = entry.value("id", json());
+                if (!messages.is_array() || messages.empty() ||
+                    !all_of(messages.begin(), messages.end(), [](const json& message) { return message.is_object(); })) {
+                    error = "\"messages\" must be a list of message objects";
+                } else {
+                    item.messages_json = messages.dump(-1, ' ', false, json::error_handler_t::replace);
+                }
+            } else if (entry.is_object() && entry.contains("prompt")) {
+                item.id = entry.value("id", json());
+                if (!entry["prompt"].is_string()) error = "\"prompt\" must be a string";
+                else item.messages_json = "[" + serialize_message("user", entry["prompt"].get<string>()) + "]";
+            } else {
+                error = "expected a prompt, \"prompt\" or \"messages\"";
+            }
+            if (!error.empty()) {
+                write_result(item, {{"error", error}});
+                failed++;
+                continue;
+            }
+
+            if (config.cache_enabled) {
+                item.cache_key = ResponseCache::key(config, item.messages_json);
+                CachedResponse cached;
+                if (ResponseCache::instance().get(item.cache_key, cached)) {
+                    json result = {{"reply", cached.content}, {"latency_ms", 0}, {"cached", true}};
+                    if (cached.usage.is_object()) {
+                        result["prompt_tokens"] = cached.usage.value("prompt_tokens", 0);
+                        result["completion_tokens"] = cached.usage.value("completion_tokens", 0);
+                    }
+                    write_result(item, result);
+                    succeeded++;
+                    continue;
+                }
+            }
+            submit(item);
+            in_flight.push_back(move(item));
+        }
+
+        // Collect finished items; transient failures go back in with backoff
+        auto now = chrono::steady_clock::now();
+        for (auto it = in_flight.begin(); it != in_flight.end();) {
+            BatchItem& item = *it;
+            if (!item.request) {
+                if (now >= item.retry_at) submit(item);
+                ++it;
+                continue;
+            }
+            if (!item.request->ready()) {
+                ++it;
+                continue;
+            }
+
+            const HttpResult& result = item.request->result();
+            double latency_ms = chrono::duration<double, milli>(now - item.attempt_started).count();
+            bool transient = result.curl_code != CURLE_OK || result.status == 429 || result.status >= 500;
+            if (result.ok()) {
+                string reply;
+                if (extract_reply(result.body, reply)) {
+                    JsonView usage = JsonView::parse(result.body)["usage"];
+                    long prompt_tokens = usage["prompt_tokens"].integer_or(-1);
+                    long completion_tokens = usage["completion_tokens"].integer_or(-1);
+                    Metrics::instance().record_generation("batch", -1, latency_ms, prompt_tokens, completion_tokens);
+                    write_result(item, {
+                        {"reply", reply},
+                        {"latency_ms", latency_ms},
+                        {"prompt_tokens", max(prompt_tokens, 0L)},
+                        {"completion_tokens", max(completion_tokens, 0L)}
+                    });
+                    if (!item.cache_key.empty()) {
+                        json usage_json = usage.is_object() ? usage.to_json() : json();
+                        ResponseCache::instance().put(item.cache_key, {reply, usage_json, latency_ms});
+                    }
+                    succeeded++;
+                } else {
+                    write_result(item, {{"error", reply}, {"latency_ms", latency_ms}});
+                    failed++;
+                }
+            } else if (transient && item.attempts <= config.batch_retries) {
+                // 250 ms, 500 ms, 1 s, ... plus up to 25% jitter
+                long backoff_ms = 250L << min(item.attempts - 1, 6);
+                backoff_ms += static_cast<long>(fnv1a64(to_string(item.index) + ":" + to_string(item.attempts)) % (backoff_ms / 4 + 1));
+                item.retry_at = now + chrono::milliseconds(backoff_ms);
+                item.request.reset();
+                ++it;
+                continue;
+            } else {
+                write_result(item, {{"error", result.error()}, {"latency_ms", latency_ms}});
+                failed++;
+            }
+            it = in_flight.erase(it);
+        }
+
+        if (!in_flight.empty()) {
+            unique_lock<mutex> lock(wake_mutex);
+            wake.wait_for(lock, chrono::milliseconds(20));
+        }
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - batch_start).count();
+    cerr << COLOR_SUCCESS << "Batch finished: " << succeeded << " ok, " << failed << " failed in " << seconds << " s ("
+         << (seconds > 0 ? (succeeded + failed) / seconds : 0) << " items/s)" << COLOR_RESET << endl;
+    return failed == 0 ? 0 : 2;
+}
+
+struct ReplayOptions {
+    string target;             // Origin that model requests are sent to instead of the recorded one
+    double rate = 1;           // 2 replays the traffic twice as fast
+    bool include_web = false;  // Also re-issue search and page requests, which go to third parties;
+                               // those that needed an API key fail, as the key was redacted
+};
+
+struct ReplayRecord {
+    double t_ms = 0;
+    string metric;
+    string url;
+    vector<string> headers;
+    string body;
+    long timeout_ms = 0;
+    long status = 0;
+    bool ok = false;
+    double ms = 0;
+    double ttfb_ms = -1;
+    optional<uint64_t> reply_hash; // Unset when the recorded reply was cut off
+};
+
+// What a replayed reply is compared by: the text of a chat completion, streamed or not, as
+// ids and timestamps differ on every run, or the whole body for other requests
+string comparable_reply(string_view body) {
+    StreamState stream;
+    stream.echo = false;
+    stream_feed(stream, body.data(), body.size());
+    if (!stream.line_buffer.empty()) process_sse_line(stream, stream.line_buffer);
+    if (stream.saw_event) return stream.content;
+    string reply;
+    return extract_reply(body, reply) ? reply : string(body);
+}
+
+// The requests of a recording (see TrafficRecorder) to send again, in order. Search and page
+// requests are skipped unless include_web is set, and so are in-process (llama://) ones
+// when there is no target to send them to.
+bool load_recording(const string& path, const ReplayOptions& options, vector<ReplayRecord>& records, size_t& skipped, string& error) {
+    LineReader reader;
+    if (!reader.open(path, error)) return false;
+    string target = options.target.empty() ? string() : url_origin(options.target);
+    string line;
+    skipped = 0;
+    while (reader.next(line)) {
+        if (line.empty()) continue;
+        json entry = json::parse(line, nullptr, false);
+        if (!entry.is_object()) {
+            skipped++;
+            continue;
+        }
+        ReplayRecord record;
+        try {
+            record.metric = entry.value("metric", "http");
+            bool web = record.metric.compare(0, 7, "search:") == 0 || record.metric == "fetch";
+            if (web && !options.include_web) {
+                skipped++;
+                continue;
+            }
+            // Routed requests were recorded as pool://chat; the backend that answered is the endpoint
+            record.url = entry.value("url", "");
+            if (record.url.compare(0, 4, "http") != 0) record.url = entry.value("endpoint", "");
+            bool http = record.url.compare(0, 4, "http") == 0;
+            if (!web && !target.empty()) {
+                record.url = target + (http ? record.url.substr(url_origin(record.url).size()) : "/v1/chat/completions");
+            } else if (!http) {
+                skipped++;
+                continue;
+            }
+            record.t_ms = entry.value("t_ms", 0.0);
+            record.headers = entry.value("headers", vector<string>());
+            record.body = entry.value("body", "");
+            record.timeout_ms = entry.value("timeout_ms", 0L);
+            record.status = entry.value("status", 0L);
+            record.ok = entry.value("ok", false);
+            record.ms = entry.value("ms", 0.0);
+            record.ttfb_ms = entry.value("ttfb_ms", -1.0);
+            if (!entry.value("reply_truncated", false)) record.reply_hash = fnv1a64(comparable_reply(entry.value("reply", "")));
+        } catch (const json::exception&) { // A field of the wrong type
+            skipped++;
+            continue;
+        }
+        records.push_back(move(record));
+    }
+    stable_sort(records.begin(), records.end(), [](const ReplayRecord& a, const ReplayRecord& b) { return a.t_ms < b.t_ms; });
+    return true;
+}
+
+// Re-issues `records` open-loop: each one is sent at its recorded offset divided by `rate`,
+// whether or not earlier ones have answered, so a slow server builds up a queue as it would
+// under the real load. Latencies count from the scheduled send time. Returns one report per
+// metrics series comparing the replay with the recording, then one for the whole run.
+vector<json> replay_traffic(const vector<ReplayRecord>& records, double rate) {
+    struct Outcome {
+        chrono::steady_clock::time_point scheduled;
+        double lag_ms = 0;
+        double ttfb_ms = -1;
+        double ms = 0;
+        string reply;
+        HttpResult result;
+    };
+    vector<Outcome> outcomes(records.size());
+    vector<shared_ptr<PendingRequest>> requests;
+    double first_ms = records.empty() ? 0 : records.front().t_ms;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records.size(); i++) {
+        const ReplayRecord& record = records[i];
+        Outcome& outcome = outcomes[i];
+        outcome.scheduled = start + chrono::microseconds(static_cast<long long>((record.t_ms - first_ms) * 1000 / max(rate, 1e-6)));
+        this_thread::sleep_until(outcome.scheduled);
+        outcome.lag_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - outcome.scheduled).count();
+        RequestSpec spec;
+        spec.url = record.url;
+        spec.headers = record.headers;
+        spec.body = record.body;
+        spec.timeout_ms = record.timeout_ms;
+        spec.metric = "replay:" + record.metric;
+        spec.follow_redirects = record.metric == "fetch";
+        spec.on_data = [&outcome](const char* data, size_t length) {
+            if (outcome.ttfb_ms < 0) outcome.ttfb_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - outcome.scheduled).count();
+            outcome.reply.append(data, length);
+            return true;
+        };
+        spec.on_complete = [&outcome](const HttpResult& result) {
+            outcome.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - outcome.scheduled).count();
+            outcome.result = result;
+        };
+        requests.push_back(RequestEngine::instance().submit(move(spec)));
+    }
+    for (auto& request : requests) request->wait();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    struct Series {
+        size_t requests = 0;
+        size_t errors = 0;
+        size_t recorded_errors = 0;
+        size_t status_changed = 0;
+        size_t replies_changed = 0;
+        vector<double> ms, recorded_ms, ttfb_ms, recorded_ttfb_ms, lag_ms;
+    };
+    map<string, Series> series;
+    for (size_t i = 0; i < records.size(); i++) {
+        const ReplayRecord& record = records[i];
+        const Outcome& outcome = outcomes[i];
+        uint64_t reply_hash = fnv1a64(comparable_reply(outcome.reply));
+        for (Series* entry : {&series[record.metric], &series["all"]}) {
+            entry->requests++;
+            entry->lag_ms.push_back(outcome.lag_ms);
+            if (!outcome.result.ok()) entry->errors++;
+            if (!record.ok) entry->recorded_errors++;
+            if (outcome.result.status != record.status) entry->status_changed++;
+            if (outcome.result.ok()) {
+                if (record.reply_hash && *record.reply_hash != reply_hash) entry->replies_changed++;
+                entry->ms.push_back(outcome.ms);
+                if (outcome.ttfb_ms >= 0) entry->ttfb_ms.push_back(outcome.ttfb_ms);
+            }
+            if (record.ok) {
+                entry->recorded_ms.push_back(record.ms);
+                if (record.ttfb_ms >= 0) entry->recorded_ttfb_ms.push_back(record.ttfb_ms);
+            }
+        }
+    }
+
+    vector<json> report;
+    for (const auto& [name, entry] : series) {
+        json line = {
+            {"series", name},
+            {"requests", entry.requests},
+            {"errors", entry.errors},
+            {"recorded_errors", entry.recorded_errors},
+            {"status_changed", entry.status_changed},
+            {"replies_changed", entry.replies_changed}
+        };
+        for (auto [label, quantile] : {pair<const char*, double>{"p50", 0.50}, {"p95", 0.95}, {"p99", 0.99}}) {
+            line[string(label) + "_ms"] = percentile(entry.ms, quantile);
+            line["recorded_" + string(label) + "_ms"] = percentile(entry.recorded_ms, quantile);
+            if (!entry.ms.empty() && !entry.recorded_ms.empty()) {
+                line[string(label) + "_delta_ms"] = percentile(entry.ms, quantile) - percentile(entry.recorded_ms, quantile);
+            }
+        }
+        line["ttfb_p50_ms"] = percentile(entry.ttfb_ms, 0.50);
+        line["recorded_ttfb_p50_ms"] = percentile(entry.recorded_ttfb_ms, 0.50);
+        line["lag_p95_ms"] = percentile(entry.lag_ms, 0.95);
+        if (name == "all") {
+            double span_s = records.empty() ? 0 : (records.back().t_ms - first_ms) / 1000 / max(rate, 1e-6);
+            line["rate"] = rate;
+            line["duration_s"] = seconds;
+            line["offered_rps"] = span_s > 0 ? records.size() / span_s : 0.0;
+            line["completed_rps"] = seconds > 0 ? records.size() / seconds : 0.0;
+            line["lag_max_ms"] = entry.lag_ms.empty() ? 0.0 : *max_element(entry.lag_ms.begin(), entry.lag_ms.end());
+        }
+        report.push_back(move(line));
+    }
+    auto all = find_if(report.begin(), report.end(), [](const json& line) { return line["series"] == "all"; });
+    if (all != report.end()) rotate(all, all + 1, report.end()); // Last
+    return report;
+}
+
+// ghostintheshellgpt --replay <recording> [--target http://host:port] [--rate 2] [--include-web]
+// [--out report.jsonl]: sends recorded traffic again and reports how it fared against the recording.
+// Recordings hold redacted API keys, so with --include-web the keyed search requests fail.
+int run_replay(const string& path, const ReplayOptions& options, const string& output_path) {
+    vector<ReplayRecord> records;
+    size_t skipped = 0;
+    string error;
+    if (!load_recording(path, options, records, skipped, error)) {
+        cerr << COLOR_RED << "Error: " << error << COLOR_RESET << endl;
+        return 1;
+    }
+    if (records.empty()) {
+        cerr << COLOR_RED << "Error: Nothing to replay in " << path << " (" << skipped << " requests skipped)" << COLOR_RESET << endl;
+        return 1;
+    }
+    ofstream output_file;
+    if (!output_path.empty() && output_path != "-") {
+        output_file.open(output_path, ios::trunc);
+        if (!output_file.is_open()) {
+            cerr << COLOR_RED << "Error: Unable to write " << output_path << COLOR_RESET << endl;
+            return 1;
+        }
+    }
+    ostream& output = output_file.is_open() ? output_file : cout;
+    double span_s = (records.back().t_ms - records.front().t_ms) / 1000 / options.rate;
+    cerr << COLOR_YELLOW << "Replaying " << records.size() << " requests over " << fixed_number(span_s, 1) << " s at "
+         << fixed_number(options.rate, 1) << "x" << (skipped ? " (" + to_string(skipped) + " skipped)" : "") << COLOR_RESET << endl;
+    for (const json& line : replay_traffic(records, options.rate)) output << line.dump() << endl;
+    return 0;
+}
+
+// Heap allocations made through operator new, for the benchmark suite. Counting replaces
+// the global operators, so it is only built with -DGHOST_BENCH_ALLOCATIONS. Threads that
+// should not be attributed to the client (the mock server) switch tracking off.
+// The operators stay out of line so GCC does not pair inlined free() with new.
+atomic<size_t> allocation_count{0};
+thread_local bool allocation_tracking = true;
+
+#ifndef GHOST_BENCH_ALLOCATIONS
+const bool ALLOCATIONS_COUNTED = false;
+#else
+const bool ALLOCATIONS_COUNTED = true;
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    if (allocation_tracking) allocation_count.fetch_add(1, memory_order_relaxed);
+    if (void* pointer = malloc(size ? size : 1)) return pointer;
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void* pointer, size_t) noexcept {
+    free(pointer);
+}
+#endif
+
+// An allocation count for a benchmark record, or "unavailable" when counting is not built in
+json allocation_figure(double allocations) {
+    return ALLOCATIONS_COUNTED ? json(allocations) : json("unavailable");
+}
+
+// Minimal HTTP/1.1 server on 127.0.0.1 standing in for the model server and search
+// engines in benchmarks: keep-alive, Content-Length bodies, chunked streaming replies.
+class MockServer {
+public:
+    struct Request {
+        string method;
+        string path;
+        map<string, string> headers; // Lower-case names
+        string body;
+    };
+    using Handler = function<void(const Request&, int fd)>;
+
+    ~MockServer() { stop(); }
+
+    // Requests go to the handler with the longest matching path prefix
+    void route(const string& prefix, Handler handler) { routes_[prefix] = move(handler); }
+
+    bool start() {
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) return false;
+        int enable = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0; // Ephemeral
+        socklen_t length = sizeof(address);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(listen_fd_, 128) != 0 ||
+            getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            ::close(listen_fd_);
+            listen_fd_ = -1;
+            return false;
+        }
+        port_ = ntohs(address.sin_port);
+        acceptor_ = thread(&MockServer::accept_loop, this);
+        return true;
+    }
+
+    void stop() {
+        if (listen_fd_ < 0) return;
+        stopping_ = true;
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        ::close(listen_fd_);
+        listen_fd_ = -1;
+        if (acceptor_.joinable()) acceptor_.join();
+        {
+            lock_guard<mutex> guard(mutex_);
+            for (int fd : open_fds_) ::shutdown(fd, SHUT_RDWR);
+        }
+        for (auto& connection : connections_) connection.join();
+        connections_.clear();
+    }
+
+    string url(const string& path) const { return "http://127.0.0.1:" + to_string(port_) + path; }
+
+    static void send_all(int fd, string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+            if (n <= 0) return;
+            data.remove_prefix(n);
+        }
+    }
+
+    static void send_response(int fd, int status, const string& content_type, const string& body) {
+        send_all(fd, "HTTP/1.1 " + to_string(status) + (status < 400 ? " OK" : " Error") + "\r\nContent-Type: " + content_type +
+                     "\r\nContent-Length: " + to_string(body.size()) + "\r\n\r\n" + body);
+    }
+
+    static void send_chunked_header(int fd, const string& content_type) {
+        send_all(fd, "HTTP/1.1 200 OK\r\nContent-Type: " + content_type + "\r\nTransfer-Encoding: chunked\r\n\r\n");
+    }
+
+    // An empty chunk ends the body
+    static void send_chunk(int fd, string_view data) {
+        char size[32];
+        snprintf(size, sizeof(size), "%zx\r\n", data.size());
+        send_all(fd, string(size) + string(data) + "\r\n");
+    }
+
+private:
+    void accept_loop() {
+        allocation_tracking = false;
+        while (!stopping_) {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (stopping_) return;
+                continue;
+            }
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+            lock_guard<mutex> guard(mutex_);
+            open_fds_.insert(fd);
+            connections_.emplace_back(&MockServer::serve, this, fd);
+        }
+    }
+
+    void serve(int fd) {
+        allocation_tracking = false;
+        string buffer;
+        char chunk[16384];
+        while (!stopping_) {
+            size_t header_end;
+            while ((header_end = buffer.find("\r\n\r\n")) == string::npos) {
+                ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) return close_connection(fd);
+                buffer.append(chunk, n);
+            }
+
+            Request request;
+            istringstream head(buffer.substr(0, header_end));
+            string line;
+            getline(head, line);
+            istringstream request_line(line);
+            request_line >> request.method >> request.path;
+            while (getline(head, line)) {
+                size_t colon = line.find(':');
+                if (colon == string::npos) continue;
+                string name = line.substr(0, colon);
+                transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+                string value = line.substr(line.find_first_not_of(' ', colon + 1));
+                if (!value.empty() && value.back() == '\r') value.pop_back();
+                request.headers[name] = value;
+            }
+
+            size_t body_length = request.headers.count("content-length") ? stoul(request.headers["content-length"]) : 0;
+            while (buffer.size() < header_end + 4 + body_length) {
+                ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) return close_connection(fd);
+                buffer.append(chunk, n);
+            }
+            request.body = buffer.substr(header_end + 4, body_length);
+            buffer.erase(0, header_end + 4 + body_length);
+
+            const Handler* handler = nullptr;
+            size_t matched = 0;
+            for (const auto& entry : routes_) {
+                if (request.path.compare(0, entry.first.size(), entry.first) == 0 && entry.first.size() >= matched) {
+                    handler = &entry.second;
+                    matched = entry.first.size();
+                }
+            }
+            if (handler) {
+                (*handler)(request, fd);
+            } else {
+                send_response(fd, 404, "text/plain", "not found");
+            }
+            if (request.headers["connection"] == "close") return close_connection(fd);
+        }
+        close_connection(fd);
+    }
+
+    void close_connection(int fd) {
+        lock_guard<mutex> guard(mutex_);
+        open_fds_.erase(fd);
+        ::close(fd);
+    }
 
-    // Stop spinner after processing
-    spinner_running = false;
-    spinner_thread.join(); // Wait for spinner thread to finish
+    int listen_fd_ = -1;
+    int port_ = 0;
+    atomic<bool> stopping_{false};
+    thread acceptor_;
+    mutex mutex_;
+    vector<thread> connections_;
+    set<int> open_fds_;
+    map<string, Handler> routes_;
+};
+
+// Mock OpenAI-compatible /v1/chat/completions: waits `latency_ms` before the first token,
+// then produces `reply_tokens` (capped by max_tokens) at `tokens_per_second`, streamed or in one reply
+struct MockChatOptions {
+    int latency_ms = 20;
+    double tokens_per_second = 500;
+    int reply_tokens = 32;
+};
+
+// Like llama.cpp server, each slot remembers its last prompt (at four bytes a token) and
+// reports the shared prefix as cached in "timings"
+MockServer::Handler mock_chat_handler(const MockChatOptions& options) {
+    struct Slots {
+        mutex lock;
+        map<int, string> prompts;
+    };
+    auto slots = make_shared<Slots>();
+    return [options, slots](const MockServer::Request& request, int fd) {
+        bool stream = false;
+        int reply_tokens = options.reply_tokens;
+        int slot = 0;
+        string prompt;
+        bool cache_prompt = true;
+        try {
+            json body = json::parse(request.body);
+            stream = body.value("stream", false);
+            reply_tokens = min(reply_tokens, body.value("max_tokens", reply_tokens));
+            slot = body.value("id_slot", 0);
+            cache_prompt = body.value("cache_prompt", true);
+            prompt = body.value("messages", json::array()).dump();
+        } catch (const json::exception&) {
+            MockServer::send_response(fd, 400, "application/json", "{\"error\":\"invalid json\"}");
+            return;
+        }
+        size_t common = 0;
+        {
+            lock_guard<mutex> guard(slots->lock);
+            string& previous = slots->prompts[slot];
+            if (cache_prompt) {
+                while (common < previous.size() && common < prompt.size() && previous[common] == prompt[common]) common++;
+            }
+            previous = prompt;
+        }
+        size_t prompt_tokens = prompt.size() / 4;
+        auto token_delay = chrono::microseconds(static_cast<long>(1e6 / options.tokens_per_second));
+        json usage = {{"prompt_tokens", prompt_tokens}, {"completion_tokens", reply_tokens},
+                      {"total_tokens", prompt_tokens + reply_tokens}};
+        json timings = {{"cache_n", common / 4}, {"prompt_n", prompt_tokens - common / 4}, {"predicted_n", reply_tokens}};
+        this_thread::sleep_for(chrono::milliseconds(options.latency_ms));
+        if (!stream) {
+            this_thread::sleep_for(token_delay * reply_tokens);
+            string content;
+            for (int i = 0; i < reply_tokens; i++) content += "tok" + to_string(i) + " ";
+            json response = {{"choices", {{{"message", {{"role", "assistant"}, {"content", content}}}}}}, {"usage", usage},
+                             {"timings", timings}, {"id_slot", slot}};
+            MockServer::send_response(fd, 200, "application/json", response.dump());
+            return;
+        }
+        MockServer::send_chunked_header(fd, "text/event-stream");
+        for (int i = 0; i < reply_tokens; i++) {
+            if (i > 0) this_thread::sleep_for(token_delay);
+            json event = {{"choices", {{{"delta", {{"content", "tok" + to_string(i) + " "}}}}}}};
+            MockServer::send_chunk(fd, "data: " + event.dump() + "\n\n");
+        }
+        json last = {{"choices", {{{"delta", json::object()}, {"finish_reason", "stop"}}}}, {"usage", usage},
+                     {"timings", timings}, {"id_slot", slot}};
+        MockServer::send_chunk(fd, "data: " + last.dump() + "\n\ndata: [DONE]\n\n");
+        MockServer::send_chunk(fd, "");
+    };
 }
 
-// Help command logic
-void handle_help() {
-    cout << COLOR_GRADIENT_1 << "\nHelp Menu" << COLOR_RESET << endl;
-    cout << generate_border(30) << endl;
-    cout << COLOR_GRADIENT_2 << "1. search:<query>   " << COLOR_RESET << "Search the web for information.\n";
-    cout << COLOR_GRADIENT_2 << "2. chat:<question>   " << COLOR_RESET << "Engage in conversation with the AI.\n";
-    cout << COLOR_GRADIENT_2 << "3. nsfw:<on/off>    " << COLOR_RESET << "Toggle NSFW content filtering.\n";
-    cout << COLOR_GRADIENT_2 << "4. help             " << COLOR_RESET << "Display this help information.\n";
-    cout << COLOR_GRADIENT_2 << "5. clear            " << COLOR_RESET << "Clear the terminal screen.\n";
-    cout << COLOR_GRADIENT_2 << "6. settings         " << COLOR_RESET << "Configure AI and search settings.\n";
-    cout << COLOR_GRADIENT_2 << "7. exit             " << COLOR_RESET << "Terminate the program.\n";
-    cout << generate_border(30) << endl;
+void add_mock_chat_route(MockServer& server, const MockChatOptions& options) {
+    server.route("/v1/chat/completions", mock_chat_handler(options));
 }
 
-string web_search_with_selection(const string& query) {
-    CURL* curl = curl_easy_init();
-    string response;
+// Mock DuckDuckGo-style endpoint returning ten related topics, linking to the mock pages
+void add_mock_search_route(MockServer& server, int latency_ms) {
+    server.route("/search", [latency_ms](const MockServer::Request& request, int fd) {
+        this_thread::sleep_for(chrono::milliseconds(latency_ms));
+        auto host = request.headers.find("host");
+        string origin = "http://" + (host != request.headers.end() ? host->second : string("127.0.0.1"));
+        json topics = json::array();
+        for (int i = 0; i < 10; i++) {
+            topics.push_back({{"Text", "Result " + to_string(i) + " for " + request.path},
+                              {"FirstURL", origin + "/page" + to_string(i)}});
+        }
+        MockServer::send_response(fd, 200, "application/json", json{{"RelatedTopics", topics}}.dump());
+    });
+}
 
-    // Load configuration to check NSFW mode
-    Config config = load_config();
-    string safe_search = config.nsfw_mode ? "off" : "on"; // Set based on user preference
+// A result page: markup, a script, navigation and a footer around `paragraphs` paragraphs of
+// filler, the fourth of which is about the ghost in the shell and carries "needle-<index>"
+string mock_page_html(int index, size_t paragraphs) {
+    string html = "<!DOCTYPE html><html><head><title>Page " + to_string(index) + "</title><style>p { margin: 0 }</style>"
+                  "<script>if (a<b && c) document.write('</p>SCRIPT_SENTINEL');</script></head><body>"
+                  "<nav><a href=\"/\">Home</a> NAV_SENTINEL links repeated on every single page</nav>\n";
+    for (size_t i = 0; i < paragraphs; i++) {
+        if (i == 3) {
+            html += "<p>The ghost in the shell keeps its terminal sessions warm, needle-" + to_string(index) +
+                    ", with fish &amp; chips &#x2014; and a &lt;tag&gt;.</p>\n";
+        } else {
+            html += "<p>Filler paragraph " + to_string(i) + " of page " + to_string(index) +
+                    " with <b>ordinary</b> words about weather, gardens and trains, long enough to count as prose.</p>\n";
+        }
+    }
+    return html + "<!-- a comment > with markup --><footer>Copyright FOOTER_SENTINEL text</footer></body></html>";
+}
 
-    display_status("Starting Web Search: " + query, COLOR_HIGHLIGHT, "ℹ");
+// Mock result pages, streamed in four chunks over `latency_ms`: /page<n> (40 paragraphs),
+// /page-large (about 4 MB) and /page-binary
+void add_mock_pages_route(MockServer& server, int latency_ms) {
+    server.route("/page", [latency_ms](const MockServer::Request& request, int fd) {
+        if (request.path == "/page-binary") {
+            MockServer::send_response(fd, 200, "application/pdf", string("%PDF-1.7\0\0\0\x01" "binary", 18));
+            return;
+        }
+        string html = request.path == "/page-large" ? mock_page_html(99, 40000) : mock_page_html(atoi(request.path.c_str() + 5), 40);
+        MockServer::send_chunked_header(fd, "text/html; charset=utf-8");
+        size_t step = (html.size() + 3) / 4;
+        for (size_t offset = 0; offset < html.size(); offset += step) {
+            this_thread::sleep_for(chrono::milliseconds(latency_ms / 4));
+            MockServer::send_chunk(fd, string_view(html).substr(offset, step));
+        }
+        MockServer::send_chunk(fd, {});
+    });
+}
 
-    spinner_running = true;
-    thread spinner_thread(dynamic_spinner, "Searching web resources", COLOR_GRADIENT_1);
+// Mock /v1/embeddings: hashed bag-of-words vectors, so texts sharing words come out close
+void add_mock_embeddings_route(MockServer& server, size_t dim) {
+    server.route("/v1/embeddings", [dim](const MockServer::Request& request, int fd) {
+        json body = json::parse(request.body, nullptr, false);
+        if (!body.is_object() || !body.contains("input")) {
+            MockServer::send_response(fd, 400, "application/json", "{\"error\":{\"message\":\"missing input\"}}");
+            return;
+        }
+        json inputs = body["input"].is_array() ? body["input"] : json::array({body["input"]});
+        json data = json::array();
+        for (size_t i = 0; i < inputs.size(); i++) {
+            vector<float> embedding(dim, 0);
+            string text = inputs[i].is_string() ? inputs[i].get<string>() : "";
+            HistoryIndex::for_each_term(text, [&](string_view term) {
+                uint64_t hash = fnv1a64(term);
+                embedding[hash % dim] += (hash >> 32) & 1 ? 1.0f : -1.0f;
+            });
+            data.push_back({{"object", "embedding"}, {"index", i}, {"embedding", embedding}});
+        }
+        MockServer::send_response(fd, 200, "application/json", json{{"data", data}}.dump());
+    });
+}
 
-    if (curl) {
-        string encoded_query = url_encode(query);
-        string search_url = "https://api.duckduckgo.com/?q=" + encoded_query + 
-                          "&format=json&safesearch=" + safe_search; // Use user preference for safe search
+void emit_benchmark(ostream& out, const json& record) {
+    out << record.dump() << endl;
+}
 
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Accept: application/json");
+// Per-turn latency of a fresh handle per request versus the keep-alive pool
+void bench_connections(ostream& out, const string& url, int turns) {
+    string payload = json{
+        {"model", "llama"},
+        {"messages", {{{"role", "user"}, {"content", "ping"}}}},
+        {"max_tokens", 1},
+        {"stream", false}
+    }.dump();
 
-        curl_easy_setopt(curl, CURLOPT_URL, search_url.c_str());
+    auto run_turn = [&](CURL* curl) {
+        string response;
+        struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload.c_str());
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "Mozilla/5.0");
-
+        auto start = chrono::steady_clock::now();
         CURLcode res = curl_easy_perform(curl);
-        spinner_running = false;
-        spinner_thread.join();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        curl_slist_free_all(headers);
+        if (res != CURLE_OK) {
+            cerr << COLOR_RED << "Error: " << curl_easy_strerror(res) << COLOR_RESET << endl;
+            return -1.0;
+        }
+        return ms;
+    };
 
-        if (res == CURLE_OK) {
-            try {
-                json results = json::parse(response);
-                if (results.contains("RelatedTopics") && results["RelatedTopics"].is_array()) {
-                    if (results["RelatedTopics"].empty()) {
-                        cout << COLOR_RED << "No related topics found for your search." << COLOR_RESET << endl;
-                        return "No results."; // Return early if no results
-                    }
+    auto report = [&](const string& mode, const vector<double>& samples) {
+        if (samples.empty()) return;
+        emit_benchmark(out, {
+            {"benchmark", "connection"},
+            {"mode", mode},
+            {"turns", samples.size()},
+            {"mean_ms", accumulate(samples.begin(), samples.end(), 0.0) / samples.size()},
+            {"p50_ms", percentile(samples, 0.50)},
+            {"p95_ms", percentile(samples, 0.95)}
+        });
+    };
 
-                    cout << COLOR_SUCCESS << "\n📚 NSFW Search Results" << COLOR_RESET << endl;
-                    cout << generate_border(30) << endl;
+    vector<double> fresh, pooled;
+    for (int i = 0; i < turns; i++) {
+        CURL* curl = curl_easy_init();
+        if (!curl) break;
+        double ms = run_turn(curl);
+        curl_easy_cleanup(curl);
+        if (ms >= 0) fresh.push_back(ms);
+    }
+    for (int i = 0; i < turns; i++) {
+        PooledHandle handle(url);
+        if (!handle) break;
+        double ms = run_turn(handle.get());
+        if (ms >= 0) pooled.push_back(ms);
+    }
+    report("fresh_handle", fresh);
+    report("pooled", pooled);
+}
 
-                    vector<string> search_results;
-                    for (int i = 0; i < min(10, (int)results["RelatedTopics"].size()); i++) {
-                        if (results["RelatedTopics"][i].contains("Text")) {
-                            search_results.push_back(results["RelatedTopics"][i]["Text"]);
-                        } else {
-                            search_results.push_back("No text available for this result.");
-                        }
-                    }
+// History of `turns` alternating user/assistant messages after a system prompt
+void fill_history(MessageStore& store, int turns) {
+    const string turn_text = "Explain how the quick brown fox jumps over the lazy dog, "
+                             "and why \"quotes\" and\nnewlines need escaping in JSON payloads. ";
+    store.append("system", "You are a helpful assistant.");
+    for (int i = 0; i < turns; i++) store.append(i % 2 ? "assistant" : "user", turn_text + to_string(i));
+}
 
-                    display_results(search_results);
+// Request-build cost versus history length: the previous vector<json> payload rebuild
+// against MessageStore's cached serialization
+void bench_request_build(ostream& out, const Config& config) {
+    for (int history : {10, 100, 1000}) {
+        MessageStore store;
+        fill_history(store, history);
+        vector<json> messages = store.to_json();
 
-                    cout << COLOR_HIGHLIGHT << "Select result (1-10): " << COLOR_RESET;
+        const int iterations = max(20, 20000 / history);
+        size_t sink = 0;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            json payload = {
+                {"model", "llama"},
+                {"messages", messages},
+                {"max_tokens", config.max_tokens},
+                {"temperature", config.temperature},
+                {"stream", config.stream},
+                {"nsfw_mode", true}
+            };
+            sink += payload.dump().size();
+        }
+        double json_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iterations;
 
-                    int selection;
-                    while (!(cin >> selection) || selection < 1 || selection > 10) {
-                        cin.clear();
-                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                        cout << COLOR_ALERT << "Please enter a number between 1 and 10: " << COLOR_RESET;
-                    }
-                    cin.ignore();
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            string messages_json = "[";
+            store.append_serialized(messages_json, 0, store.size());
+            messages_json += ']';
+            sink += build_chat_request(config, messages_json, config.stream).body.size();
+        }
+        double store_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iterations;
 
-                    curl_slist_free_all(headers);
-                    curl_easy_cleanup(curl);
+        emit_benchmark(out, {
+            {"benchmark", "request_build"},
+            {"history", history},
+            {"json_rebuild_us", json_us},
+            {"message_store_us", store_us},
+            {"bytes", sink / (2 * iterations)}
+        });
+    }
+}
 
-                    display_status("NSFW Search completed successfully", COLOR_SUCCESS, "✓");
-                    return results["RelatedTopics"][selection - 1]["Text"];
-                } else {
-                    cout << COLOR_RED << "Unexpected JSON structure." << COLOR_RESET << endl;
-                }
-            } catch (const json::parse_error& e) {
-                cerr << COLOR_RED << "JSON parsing error: " << e.what() << COLOR_RESET << endl;
-            } catch (const json::type_error& e) {
-                cerr << COLOR_RED << "Type error: " << e.what() << COLOR_RESET << endl;
-            }
-        } else {
-            cerr << COLOR_RED << "CURL error: " << curl_easy_strerror(res) << COLOR_RESET << endl;
-        }
+// Time and heap allocations per document for the reply fields the client reads, through
+// an nlohmann DOM versus JsonView: a completion, one streamed chunk and a search answer
+void bench_response_parsing(ostream& out) {
+    string content;
+    for (int i = 0; content.size() < 4096; i++) {
+        content += "Line " + to_string(i) + ": \"quoted\" text, a tab\t and caf\u00e9 \u2014 done.\n";
+    }
+    string completion = json{
+        {"id", "chatcmpl-1"}, {"object", "chat.completion"}, {"model", "llama"},
+        {"choices", {{{"index", 0}, {"message", {{"role", "assistant"}, {"content", content}}}, {"finish_reason", "stop"}}}},
+        {"usage", {{"prompt_tokens", 812}, {"completion_tokens", 1024}, {"total_tokens", 1836}}},
+        {"timings", {{"cache_n", 790}, {"prompt_n", 22}, {"predicted_n", 1024}}}
+    }.dump();
+    string chunk = json{
+        {"id", "chatcmpl-1"}, {"object", "chat.completion.chunk"}, {"model", "llama"},
+        {"choices", {{{"index", 0}, {"delta", {{"content", " token"}}}, {"finish_reason", nullptr}}}}
+    }.dump();
+    json topics = json::array();
+    for (int i = 0; i < 30; i++) {
+        json topic = {{"Text", "Result " + to_string(i) + " about the query, with some \"snippet\" text"},
+                      {"FirstURL", "https://example.com/" + to_string(i)}, {"Icon", {{"URL", ""}, {"Height", ""}}}};
+        topics.push_back(i % 10 == 9 ? json{{"Name", "Group"}, {"Topics", {topic, topic}}} : topic);
+    }
+    string search = json{{"AbstractText", "Abstract"}, {"AbstractURL", "https://example.com"}, {"RelatedTopics", topics}}.dump();
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+    // Returns (microseconds, allocations) per call of `f`
+    auto measure = [](int iterations, const function<size_t()>& f) {
+        size_t sink = 0;
+        size_t before = allocation_count.load();
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) sink += f();
+        double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / iterations;
+        double allocations = static_cast<double>(allocation_count.load() - before) / iterations;
+        return make_pair(sink ? us : -1, allocations);
+    };
+    DuckDuckGoProvider provider("duckduckgo", "");
+    struct Case {
+        const char* name;
+        const string& body;
+        function<size_t()> dom;
+        function<size_t()> view;
+    };
+    string reply;
+    StreamState stream_state;
+    stream_state.echo = false;
+    string sse_line = "data: " + chunk;
+    vector<Case> cases = {
+        {"completion", completion,
+         [&] { return json::parse(completion)["choices"][0]["message"]["content"].get<string>().size(); },
+         [&] { return extract_reply(completion, reply) ? reply.size() : 0; }},
+        {"stream_chunk", chunk,
+         [&] { return json::parse(chunk)["choices"][0]["delta"]["content"].get<string>().size(); },
+         [&] {
+             stream_state.content.clear();
+             process_sse_line(stream_state, sse_line);
+             return stream_state.content.size();
+         }},
+        {"search", search,
+         [&] {
+             size_t results = 0;
+             json data = json::parse(search);
+             for (const auto& topic : data["RelatedTopics"]) {
+                 const json& entries = topic.contains("Topics") ? topic["Topics"] : json::array({topic});
+                 for (const auto& entry : entries) results += entry["Text"].get<string>().size() > 0;
+             }
+             return results;
+         },
+         [&] {
+             vector<SearchResult> results;
+             provider.parse(search, results);
+             return results.size();
+         }}
+    };
+    for (const Case& c : cases) {
+        int iterations = c.body.size() > 1000 ? 2000 : 20000;
+        auto [dom_us, dom_allocations] = measure(iterations, c.dom);
+        auto [view_us, view_allocations] = measure(iterations, c.view);
+        emit_benchmark(out, {
+            {"benchmark", "response_parsing"},
+            {"document", c.name},
+            {"bytes", c.body.size()},
+            {"nlohmann_us", dom_us},
+            {"json_view_us", view_us},
+            {"nlohmann_allocations", allocation_figure(dom_allocations)},
+            {"json_view_allocations", allocation_figure(view_allocations)}
+        });
     }
+}
 
-    return "Unable to complete search";
+// One chat turn through the query path without terminal output. Returns false on failure.
+bool bench_chat_turn(const Config& config, const string& messages_json, double& ttft_ms, double& total_ms) {
+    RequestSpec spec = build_chat_request(config, messages_json, config.stream);
+    StreamState stream_state;
+    stream_state.echo = false;
+    if (config.stream) {
+        spec.on_data = [&stream_state](const char* data, size_t length) {
+            stream_feed(stream_state, data, length);
+            return true;
+        };
+    }
+    auto start = chrono::steady_clock::now();
+    shared_ptr<PendingRequest> request = RequestEngine::instance().submit(move(spec));
+    request->wait();
+    auto end = chrono::steady_clock::now();
+    if (!request->result().ok()) return false;
+    total_ms = chrono::duration<double, milli>(end - start).count();
+    ttft_ms = config.stream && stream_state.started
+                  ? chrono::duration<double, milli>(stream_state.first_token_at - start).count()
+                  : total_ms;
+    return true;
 }
 
-// Main interactive agent function
-void interactive_agent_enhanced() {
-    Config config = load_config();
-    vector<json> messages = {
-        {{"role", "system"}, {"content", "You are a powerful AI assistant with advanced capabilities."}}
-    };
-    bool debug_mode = false;
-    show_welcome_screen();  // Show welcome screen only once
-    
-    while (true) {
-        show_command_prompt();
-        string input;
-        getline(cin, input);
-        
-        // Enhanced command processing
-        if (input == "clear") {
-            cout << "\033[2J\033[1;1H";
-            show_welcome_screen();  // Show welcome screen again after clearing
-            continue;
+// Time to first token and full-reply latency, streaming and non-streaming
+void bench_chat_latency(ostream& out, Config& config, const MockChatOptions& options, int turns) {
+    MessageStore store;
+    fill_history(store, 10);
+    string messages_json = "[";
+    store.append_serialized(messages_json, 0, store.size());
+    messages_json += ']';
+
+    for (bool stream : {true, false}) {
+        config.stream = stream;
+        vector<double> ttft, total;
+        for (int i = 0; i < turns; i++) {
+            double ttft_ms, total_ms;
+            if (!bench_chat_turn(config, messages_json, ttft_ms, total_ms)) continue;
+            ttft.push_back(ttft_ms);
+            total.push_back(total_ms);
         }
-        
-        if (input == "settings") {
-            handle_settings(config); // Call the settings handler
-            continue;
+        emit_benchmark(out, {
+            {"benchmark", "chat_latency"},
+            {"stream", stream},
+            {"turns", total.size()},
+            {"server_latency_ms", options.latency_ms},
+            {"server_tokens_per_second", options.tokens_per_second},
+            {"reply_tokens", options.reply_tokens},
+            {"ttft_p50_ms", percentile(ttft, 0.50)},
+            {"ttft_p95_ms", percentile(ttft, 0.95)},
+            {"total_p50_ms", percentile(total, 0.50)},
+            {"total_p95_ms", percentile(total, 0.95)}
+        });
+    }
+    config.stream = true;
+}
+
+// Client-side allocations for one streamed turn at a given history length:
+// context assembly, request build, SSE parsing and recording the exchange
+void bench_allocations(ostream& out, Config& config) {
+    config.stream = true;
+    for (int history : {10, 100}) {
+        MessageStore store;
+        fill_history(store, history);
+        ContextManager context;
+        const int turns = 20;
+        size_t allocations = 0;
+        for (int i = 0; i < turns; i++) {
+            size_t before = allocation_count.load();
+            string question = "question " + to_string(i);
+            string messages_json = context.build(config, store, serialize_message("user", question));
+            double ttft_ms, total_ms;
+            bench_chat_turn(config, messages_json, ttft_ms, total_ms);
+            store.append("user", question);
+            store.append("assistant", "reply");
+            allocations += allocation_count.load() - before;
         }
-        
-        if (input == "help") {
-            handle_help(); // Call the help handler
-            continue;
+        emit_benchmark(out, {
+            {"benchmark", "allocations_per_turn"},
+            {"history", history},
+            {"allocations", allocation_figure(static_cast<double>(allocations) / turns)}
+        });
+    }
+}
+
+// Sends `requests` non-streaming chat requests with `concurrency` kept in flight; returns
+// the latencies of the successful ones
+vector<double> run_concurrent_requests(const Config& config, int concurrency, int requests, int& failed) {
+    string messages_json = "[" + serialize_message("user", "ping") + "]";
+    vector<double> latencies;
+    list<shared_ptr<PendingRequest>> in_flight;
+    int submitted = 0;
+    failed = 0;
+    while (submitted < requests || !in_flight.empty()) {
+        while (submitted < requests && static_cast<int>(in_flight.size()) < concurrency) {
+            in_flight.push_back(RequestEngine::instance().submit(build_chat_request(config, messages_json, false)));
+            submitted++;
         }
-        
-        if (input.find("search:") == 0) {
-            string query = input.substr(7);
-            string result = web_search_with_selection(query);
-            messages.push_back({{"role", "system"}, {"content", "Search result: " + result}});
-            // Auto-analyze search results
-            messages.push_back({{"role", "user"}, {"content", "Please analyze this search result and provide insights."}});
-            string response = query_ai(config, messages);
-            // Ensure response is valid
-            if (!response.empty()) {
-                json response_json = json::parse(response);
-                string reply = response_json["choices"][0]["message"]["content"];
-                cout << COLOR_CYAN << "Analysis >>> " << reply << COLOR_RESET << endl;
+        in_flight.front()->wait();
+        for (auto it = in_flight.begin(); it != in_flight.end();) {
+            if (!(*it)->ready()) {
+                ++it;
+                continue;
             }
-            continue;
+            if ((*it)->result().ok()) {
+                latencies.push_back((*it)->result().timing.total_ms); // Set when it finished, not when we looked
+            } else {
+                failed++;
+            }
+            it = in_flight.erase(it);
         }
-        
-        if (input == "exit") {
-            save_session(messages); // Auto-save on exit
-            display_status("Session saved. Goodbye!", COLOR_GRADIENT_1, "👋");
-            break;
+    }
+    return latencies;
+}
+
+// Requests per second and latency with `concurrency` requests kept in flight
+void bench_throughput(ostream& out, Config& config, int concurrency, int requests) {
+    config.stream = false;
+    int failed;
+    auto start = chrono::steady_clock::now();
+    vector<double> latencies = run_concurrent_requests(config, concurrency, requests, failed);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    emit_benchmark(out, {
+        {"benchmark", "throughput"},
+        {"concurrency", concurrency},
+        {"requests", requests},
+        {"failed", failed},
+        {"requests_per_second", latencies.size() / seconds},
+        {"latency_p50_ms", percentile(latencies, 0.50)},
+        {"latency_p95_ms", percentile(latencies, 0.95)},
+        {"latency_p99_ms", percentile(latencies, 0.99)}
+    });
+    config.stream = true;
+}
+
+// Mock backend for routing benchmarks. Every `slow_every`-th request first stalls for
+// `stall_ms`, every `fail_every`-th is answered 503, and /health reports `healthy`.
+struct MockBackend {
+    MockServer server;
+    int stall_ms = 0;
+    int slow_every = 0;
+    int fail_every = 0;
+    bool healthy = true;
+
+    bool start(const MockChatOptions& options) {
+        auto counter = make_shared<atomic<int>>(0);
+        MockServer::Handler chat = mock_chat_handler(options);
+        server.route("/v1/chat/completions", [this, chat, counter](const MockServer::Request& request, int fd) {
+            int n = ++*counter;
+            if (fail_every > 0 && n % fail_every == 0) {
+                MockServer::send_response(fd, 503, "application/json", "{\"error\":\"overloaded\"}");
+                return;
+            }
+            if (slow_every > 0 && n % slow_every == 0) this_thread::sleep_for(chrono::milliseconds(stall_ms));
+            chat(request, fd);
+        });
+        server.route("/health", [this](const MockServer::Request&, int fd) {
+            MockServer::send_response(fd, healthy ? 200 : 503, "application/json", healthy ? "{\"status\":\"ok\"}" : "{\"status\":\"loading\"}");
+        });
+        return server.start();
+    }
+
+    string url() const { return server.url("/v1/chat/completions"); }
+};
+
+// Routing across several mock backends: how requests split between a fast and a slow
+// server per policy, failover past a backend that fails every other request, and hedging
+// against a backend with a slow tail. Reports each backend's share of the requests.
+void bench_routing(ostream& out, const MockChatOptions& options) {
+    struct Scenario {
+        string name;
+        string routing;
+        int hedge_after_ms;
+        vector<function<void(MockBackend&)>> backends;
+    };
+    int base = options.latency_ms;
+    // Hedge once a request has taken half again as long as a normal reply
+    int hedge_ms = static_cast<int>(1.5 * (base + 1000.0 * options.reply_tokens / options.tokens_per_second));
+    vector<Scenario> scenarios = {
+        {"fast_and_slow", "least_outstanding", 0, {[](MockBackend&) {}, [base](MockBackend& b) { b.stall_ms = 4 * base; b.slow_every = 1; }}},
+        {"fast_and_slow", "latency", 0, {[](MockBackend&) {}, [base](MockBackend& b) { b.stall_ms = 4 * base; b.slow_every = 1; }}},
+        {"failover", "least_outstanding", 0, {[](MockBackend&) {}, [](MockBackend& b) { b.fail_every = 2; }}},
+        {"slow_tail", "least_outstanding", 0, {[base](MockBackend& b) { b.stall_ms = 10 * base; b.slow_every = 10; }, [base](MockBackend& b) { b.stall_ms = 10 * base; b.slow_every = 10; }}},
+        {"slow_tail", "least_outstanding", hedge_ms, {[base](MockBackend& b) { b.stall_ms = 10 * base; b.slow_every = 10; }, [base](MockBackend& b) { b.stall_ms = 10 * base; b.slow_every = 10; }}},
+    };
+    for (const Scenario& scenario : scenarios) {
+        list<MockBackend> backends;
+        Config config;
+        config.backend_routing = scenario.routing;
+        config.hedge_after_ms = scenario.hedge_after_ms;
+        config.max_tokens = options.reply_tokens;
+        config.stream = false;
+        for (const auto& setup : scenario.backends) {
+            MockBackend& backend = backends.emplace_back();
+            setup(backend);
+            if (!backend.start(options)) return;
+            config.backends[backend.url()] = 1;
         }
-        
-        // Enhanced NSFW command processing
-        if (input.find("nsfw:") == 0) {
-            string mode = input.substr(5);
-            if (mode == "on") {
-                config.nsfw_mode = true;
-                cout << COLOR_SUCCESS << "NSFW Mode: Enabled" << COLOR_RESET << endl;
-            } else if (mode == "off") {
-                config.nsfw_mode = false;
-                cout << COLOR_SUCCESS << "NSFW Mode: Disabled" << COLOR_RESET << endl;
-            } else {
-                cout << COLOR_ALERT << "Invalid NSFW command. Use 'nsfw:on' or 'nsfw:off'." << COLOR_RESET << endl;
+        BackendPool::instance().configure(config);
+
+        int failed;
+        vector<double> latencies = run_concurrent_requests(config, 4, 100, failed);
+        json stats = BackendPool::instance().stats();
+        json shares = json::array();
+        for (const MockBackend& backend : backends) {
+            for (const auto& entry : stats) {
+                if (entry["url"] == backend.url()) shares.push_back({{"requests", entry["requests"]}, {"failures", entry["failures"]}});
             }
-            continue;
         }
-        
-        // Enhanced chat processing
-        if (!input.empty() && input != "help") {
-            messages.push_back({{"role", "user"}, {"content", input}});
-            string response = query_ai(config, messages);
-            json response_json = json::parse(response);
-            string reply = response_json["choices"][0]["message"]["content"];
-            
-            if (debug_mode) {
-                cout << COLOR_YELLOW << "Token count: " << response_json["usage"]["total_tokens"] << COLOR_RESET << endl;
-            }
-            
-            messages.push_back({{"role", "assistant"}, {"content", reply}});
-            cout << COLOR_CYAN << "AI >>> " << reply << COLOR_RESET << endl;
+        emit_benchmark(out, {
+            {"benchmark", "routing"},
+            {"scenario", scenario.name},
+            {"routing", scenario.routing},
+            {"hedge_after_ms", scenario.hedge_after_ms},
+            {"failed", failed},
+            {"latency_p50_ms", percentile(latencies, 0.50)},
+            {"latency_p95_ms", percentile(latencies, 0.95)},
+            {"latency_p99_ms", percentile(latencies, 0.99)},
+            {"backends", shares}
+        });
+    }
+    BackendPool::instance().configure(Config());
+}
+
+// Prompt tokens the mock server has to evaluate per conversation turn when another request
+// (a bg: job, say) runs between turns: with the conversation left to the server's default
+// slot versus pinned to its own. Pinned, prefill stays proportional to the new messages.
+void bench_prefix_reuse(ostream& out, Config& config, int turns) {
+    config.stream = false;
+    for (int slot : {-1, 1}) {
+        config.slot_id = slot;
+        SlotManager::instance().configure(config);
+        MessageStore store;
+        ContextManager context;
+        vector<double> evaluated, cached;
+        for (int i = 0; i < turns; i++) {
+            string question = "Question " + to_string(i) + ": what changed since the last answer?";
+            RequestSpec spec = build_chat_request(config, context.build(config, store, serialize_message("user", question)), false, 0,
+                                                  SlotManager::instance().slot());
+            SlotManager::instance().pin(spec);
+            shared_ptr<PendingRequest> request = RequestEngine::instance().submit(move(spec));
+            request->wait();
+            if (!request->result().ok()) continue;
+            SlotManager::instance().observe(request->result(), request->result().body);
+            JsonView response = JsonView::parse(request->result().body);
+            string reply;
+            if (!extract_reply(request->result().body, reply)) continue;
+            long cached_tokens = cached_prompt_tokens(response);
+            evaluated.push_back(response["usage"]["prompt_tokens"].integer_or(0) - cached_tokens);
+            cached.push_back(cached_tokens);
+            store.append("user", question);
+            store.append("assistant", reply);
+
+            string other = "[" + serialize_message("user", "background job " + to_string(i)) + "]";
+            RequestEngine::instance().submit(build_chat_request(config, other, false))->wait();
+        }
+        emit_benchmark(out, {
+            {"benchmark", "prefix_reuse"},
+            {"slot", slot >= 0 ? "pinned" : "server default"},
+            {"turns", evaluated.size()},
+            {"evaluated_tokens_p50", percentile(evaluated, 0.50)},
+            {"evaluated_tokens_max", evaluated.empty() ? 0 : *max_element(evaluated.begin(), evaluated.end())},
+            {"cached_tokens_p50", percentile(cached, 0.50)},
+            {"last_prompt_tokens", evaluated.empty() ? 0 : evaluated.back() + cached.back()}
+        });
+    }
+    config.slot_id = -1;
+    config.stream = true;
+}
+
+// A pasted-document stand-in: prose from a small vocabulary mixed with identifiers,
+// numbers and code punctuation that the tokenizer has not seen before
+string synthetic_paste(size_t bytes, uint64_t seed) {
+    static const char* words[] = {"the", "model", "request", "server", "token", "context", "and", "of", "to", "is",
+                                  "a", "in", "that", "for", "with", "cache", "prompt", "reply", "time", "data"};
+    string text;
+    text.reserve(bytes + 64);
+    uint64_t state = seed;
+    auto next = [&state]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state >> 33;
+    };
+    while (text.size() < bytes) {
+        uint64_t kind = next() % 10;
+        if (kind < 7) {
+            text += words[next() % 20];
+            text += next() % 12 == 0 ? ".\n" : " ";
+        } else if (kind < 9) {
+            text += "id_";
+            for (int i = 0, length = 3 + next() % 6; i < length; i++) text += static_cast<char>('a' + next() % 26);
+            text += "(" + to_string(next() % 100000) + "); ";
         } else {
-            cout << COLOR_ALERT << "Invalid command. Type 'help' for a list of available commands." << COLOR_RESET << endl;
+            text += "    if (x[" + to_string(next() % 64) + "] != y) {\n";
         }
     }
+    return text;
 }
 
-// Function to load prompts
-std::map<std::string, std::string> load_prompts() {
-    const std::string PROMPT_DIR = "prompts/";
+// Token counting of a 100 KB paste, cold (every piece merged) and warm (piece cache),
+// and of a growing history, which counts each message once as it is appended
+void bench_tokenizer(ostream& out, const string& tokenizer_path) {
+    Config config;
+    config.tokenizer_path = tokenizer_path;
+    Tokenizer& tokenizer = Tokenizer::instance();
+    tokenizer.configure(config);
+    tokenizer.wait_loaded();
 
-    if (!std::filesystem::exists(PROMPT_DIR)) {
-        std::cerr << "Error: Prompt directory not found." << std::endl;
-        return {};
+    string paste = synthetic_paste(100 * 1024, 1);
+    auto start = chrono::steady_clock::now();
+    int tokens = tokenizer.count(paste);
+    double cold_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    vector<double> warm;
+    for (int i = 0; i < 20; i++) {
+        start = chrono::steady_clock::now();
+        tokens = tokenizer.count(paste);
+        warm.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
     }
-    std::map<std::string, std::string> prompts;
-    
-    // Add default prompt regardless of directory
-    prompts["default"] = "You are a helpful AI assistant.";
-    
-    // Only try to load from directory if it exists
-    if (std::filesystem::exists(PROMPT_DIR)) {
-        for (const auto& entry : std::filesystem::directory_iterator(PROMPT_DIR)) {
-            if (entry.path().extension() == ".json") {
-                json prompt_data = load_json_file(entry.path().string());
-                std::string name = entry.path().stem().string();
-                prompts[name] = prompt_data.value("content", "");
-            }
+
+    MessageStore store;
+    start = chrono::steady_clock::now();
+    long history_tokens = 0;
+    for (int i = 0; i < 1000; i++) {
+        store.append(i % 2 ? "assistant" : "user", synthetic_paste(400, i + 2), false);
+        history_tokens += store.tokens(i);
+    }
+    double append_us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count() / 1000;
+
+    emit_benchmark(out, {
+        {"benchmark", "tokenizer"},
+        {"tokenizer", tokenizer.exact() ? tokenizer_path : "heuristic"},
+        {"paste_bytes", paste.size()},
+        {"paste_tokens", tokens},
+        {"bytes_per_token", tokens ? static_cast<double>(paste.size()) / tokens : 0},
+        {"cold_ms", cold_ms},
+        {"warm_p50_ms", percentile(warm, 0.50)},
+        {"history_tokens", history_tokens},
+        {"append_count_us", append_us}
+    });
+    config.tokenizer_path.clear();
+    tokenizer.configure(config);
+}
+
+// History search over a synthetic journal of `count` messages with a skewed vocabulary:
+// building the index, its size, ranked queries of one to three terms with and without a
+// role filter, and catching up with newly journaled messages
+void bench_history_index(ostream& out, size_t count) {
+    filesystem::path directory = filesystem::temp_directory_path() / ("ghost_history_bench_" + to_string(getpid()));
+    filesystem::create_directories(directory);
+    string journal_path = (directory / "journal.jsonl").string();
+    string index_path = (directory / "journal.idx").string();
+
+    uint64_t state = 7;
+    auto next = [&state]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state >> 33;
+    };
+    vector<string> vocabulary(20000);
+    for (string& word : vocabulary) {
+        for (size_t i = 0, length = 3 + next() % 7; i < length; i++) word += static_cast<char>('a' + next() % 26);
+    }
+    auto pick = [&]() -> const string& { // Low ranks are far more common, roughly like text
+        double u = (next() % 1000000) / 1e6;
+        return vocabulary[static_cast<size_t>(vocabulary.size() * u * u * u)];
+    };
+    auto write_messages = [&](size_t messages, int64_t first_ts) {
+        ofstream journal(journal_path, ios::app);
+        string record;
+        for (size_t i = 0; i < messages; i++) {
+            record = string("{\"role\":\"") + (i % 2 ? "assistant" : "user") + "\",\"content\":\"";
+            for (size_t w = 0, words = 8 + next() % 50; w < words; w++) record += pick() + (w % 13 == 12 ? ". " : " ");
+            record += "\",\"ts\":" + to_string(first_ts + static_cast<int64_t>(i)) + "}\n";
+            journal << record;
         }
+    };
+    write_messages(count, 1700000000);
+
+    HistoryIndex index;
+    auto start = chrono::steady_clock::now();
+    index.open(index_path, journal_path);
+    index.update();
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    vector<string> queries;
+    for (int i = 0; i < 200; i++) {
+        string query;
+        for (int t = 0, terms = 1 + i % 3; t < terms; t++) query += vocabulary[next() % 2000] + " ";
+        queries.push_back(query);
     }
-    return prompts;
+    vector<double> plain, filtered;
+    size_t hits = 0;
+    HistoryIndex::Filter user_only;
+    user_only.roles = HistoryIndex::ROLE_USER;
+    user_only.since = 1700000000 + static_cast<int64_t>(count / 2);
+    for (const string& query : queries) {
+        start = chrono::steady_clock::now();
+        hits += index.search(query, HistoryIndex::Filter(), 10).size();
+        auto middle = chrono::steady_clock::now();
+        index.search(query, user_only, 10);
+        auto end = chrono::steady_clock::now();
+        plain.push_back(chrono::duration<double, milli>(middle - start).count());
+        filtered.push_back(chrono::duration<double, milli>(end - middle).count());
+    }
+
+    write_messages(100, 1800000000);
+    start = chrono::steady_clock::now();
+    index.update();
+    index.search(queries[0], HistoryIndex::Filter(), 10);
+    double catch_up_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    emit_benchmark(out, {
+        {"benchmark", "history_index"},
+        {"messages", count},
+        {"journal_bytes", filesystem::file_size(journal_path)},
+        {"index_bytes", filesystem::file_size(index_path)},
+        {"build_ms", build_ms},
+        {"query_p50_ms", percentile(plain, 0.50)},
+        {"query_p95_ms", percentile(plain, 0.95)},
+        {"filtered_p50_ms", percentile(filtered, 0.50)},
+        {"filtered_p95_ms", percentile(filtered, 0.95)},
+        {"hits_per_query", static_cast<double>(hits) / queries.size()},
+        {"catch_up_100_ms", catch_up_ms}
+    });
+    filesystem::remove_all(directory);
 }
 
-void display_prompts(const map<string, string>& prompts) {
-    cout << COLOR_YELLOW << "Available Prompts:" << COLOR_RESET << endl;
-    for (const auto& prompt : prompts) {
-        cout << COLOR_GREEN << "  " << prompt.first << COLOR_RESET << endl;
+// Local retrieval: ingesting synthetic documents through the mock embeddings endpoint, then
+// vector search over `count` clustered unit vectors, scanning everything versus probing the
+// IVF lists, with the probed search's recall of the exact top 10
+void bench_rag(ostream& out, const Config& mock_config, size_t count, size_t dim) {
+    filesystem::path directory = filesystem::temp_directory_path() / ("ghost_rag_bench_" + to_string(getpid()));
+    filesystem::create_directories(directory / "docs");
+    for (int i = 0; i < 100; i++) {
+        ofstream(directory / "docs" / ("doc" + to_string(i) + ".txt")) << synthetic_paste(8 * 1024, i + 100);
     }
-    cout << COLOR_BLUE << "Use 'prompt:load:<name>' to switch prompts." << COLOR_RESET << endl;
+    Config config = mock_config.clone();
+    RagIndex documents;
+    documents.open((directory / "docs.bin").string());
+    RagIndex::AddResult added;
+    string error;
+    auto start = chrono::steady_clock::now();
+    documents.add(config, (directory / "docs").string(), added, error);
+    double ingest_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    mt19937_64 random(42);
+    normal_distribution<float> gaussian;
+    const size_t clusters = 1000;
+    vector<float> centers(clusters * dim);
+    for (float& value : centers) value = gaussian(random);
+    auto near_center = [&](float* vector) {
+        const float* center = &centers[(random() % clusters) * dim];
+        for (size_t d = 0; d < dim; d++) vector[d] = center[d] + 0.6f * gaussian(random);
+        normalize_vector(vector, dim);
+    };
+    vector<float> vectors(count * dim);
+    for (size_t i = 0; i < count; i++) near_center(&vectors[i * dim]);
+    RagIndex index;
+    index.open((directory / "vectors.bin").string());
+    start = chrono::steady_clock::now();
+    index.build(vectors, dim);
+    double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    vectors = vector<float>();
+
+    vector<double> exact_ms, probed_ms;
+    size_t found = 0, wanted = 0;
+    vector<float> query(dim);
+    for (int i = 0; i < 50; i++) {
+        near_center(query.data());
+        start = chrono::steady_clock::now();
+        vector<RagIndex::Hit> exact = index.search(query.data(), 10, 0);
+        auto middle = chrono::steady_clock::now();
+        vector<RagIndex::Hit> probed = index.search(query.data(), 10, config.rag_probe);
+        auto end = chrono::steady_clock::now();
+        exact_ms.push_back(chrono::duration<double, milli>(middle - start).count());
+        probed_ms.push_back(chrono::duration<double, milli>(end - middle).count());
+        for (const RagIndex::Hit& hit : exact) {
+            wanted++;
+            found += any_of(probed.begin(), probed.end(), [&](const RagIndex::Hit& other) { return other.score == hit.score; });
+        }
+    }
+
+    emit_benchmark(out, {
+        {"benchmark", "rag"},
+        {"ingest_files", added.files},
+        {"ingest_chunks", added.chunks},
+        {"ingest_ms", ingest_ms},
+        {"ingest_error", error},
+        {"vectors", count},
+        {"dimensions", dim},
+        {"ivf_lists", index.lists()},
+        {"build_ms", build_ms},
+        {"exact_p50_ms", percentile(exact_ms, 0.50)},
+        {"probe", config.rag_probe},
+        {"probed_p50_ms", percentile(probed_ms, 0.50)},
+        {"probed_p95_ms", percentile(probed_ms, 0.95)},
+        {"recall_at_10", wanted ? static_cast<double>(found) / wanted : 0}
+    });
+    filesystem::remove_all(directory);
 }
-string execute_command(const string& command) {
-    string output;
-    stringstream formatted_output;
-    
-    cout << "\n⚡ Executing Command ⚡" << endl;
-    cout << "╔════════════════════╗" << endl;
-    cout << "│ " << command << endl;
-    cout << "╟────────────────────╢" << endl;
-    
-    FILE* pipe = popen(command.c_str(), "r");
-    if (!pipe) {
-        cerr << "Error: Failed to execute command" << endl;
-        cout << "╚════════════════════╝" << endl;
-        return "Command execution failed";
+
+// Cold (fan-out) and warm (TTL cache) searches against the mock engine
+void bench_search(ostream& out, Config& config, int queries) {
+    vector<double> cold, warm;
+    for (int i = 0; i < queries; i++) {
+        string query = "benchmark query " + to_string(i);
+        auto start = chrono::steady_clock::now();
+        bool found = !SearchService::instance().search(config, query).empty();
+        auto middle = chrono::steady_clock::now();
+        found = found && !SearchService::instance().search(config, query).empty();
+        auto end = chrono::steady_clock::now();
+        if (!found) continue;
+        cold.push_back(chrono::duration<double, milli>(middle - start).count());
+        warm.push_back(chrono::duration<double, milli>(end - middle).count());
     }
-    
-    try {
-        char buffer[4096];
-        while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-            output += buffer;
-            formatted_output << "│ " << buffer;
+    emit_benchmark(out, {
+        {"benchmark", "search"},
+        {"queries", cold.size()},
+        {"cold_p50_ms", percentile(cold, 0.50)},
+        {"cold_p95_ms", percentile(cold, 0.95)},
+        {"cached_p50_ms", percentile(warm, 0.50)},
+        {"cached_p95_ms", percentile(warm, 0.95)}
+    });
+}
+
+// search: with its pages: fetching the top results' pages concurrently and choosing passages,
+// whether the extraction kept the right text, the size cap, and the extractor's throughput
+void bench_search_pages(ostream& out, Config& config, int queries) {
+    const int PAGES = 3;
+    config.search_fetch_pages = PAGES;
+    vector<double> fetch, select;
+    bool extraction_ok = true;
+    for (int i = 0; i < queries; i++) {
+        string query = "ghost shell terminal " + to_string(i);
+        vector<string> urls;
+        for (const SearchResult& result : SearchService::instance().search(config, query)) {
+            if (urls.size() < PAGES) urls.push_back(result.url);
         }
-        
-        int status = pclose(pipe);
-        if (status != 0) {
-            formatted_output << "│ Warning: Command exited with status " << status << endl;
+        auto start = chrono::steady_clock::now();
+        vector<FetchedPage> pages = fetch_pages(config, urls);
+        auto fetched = chrono::steady_clock::now();
+        string passages = select_passages(pages, query, config.search_context_tokens);
+        auto end = chrono::steady_clock::now();
+        fetch.push_back(chrono::duration<double, milli>(fetched - start).count());
+        select.push_back(chrono::duration<double, milli>(end - fetched).count());
+        extraction_ok = extraction_ok && !urls.empty() && passages.find("needle-0") != string::npos &&
+                        passages.find("fish & chips \u2014 and a <tag>.") != string::npos &&
+                        passages.find("SENTINEL") == string::npos;
+    }
+
+    string origin = url_origin(config.search_endpoints.begin()->second);
+    vector<FetchedPage> edge_cases = fetch_pages(config, {origin + "/page-large", origin + "/page-binary", origin + "/missing"});
+    extraction_ok = extraction_ok && edge_cases[0].truncated && edge_cases[1].error == "Not a text page" &&
+                    edge_cases[2].error == "HTTP status 404";
+
+    string html = mock_page_html(0, 40000);
+    auto start = chrono::steady_clock::now();
+    HtmlTextExtractor extractor;
+    for (size_t offset = 0; offset < html.size(); offset += 16384) {
+        extractor.feed(html.data() + offset, min<size_t>(16384, html.size() - offset));
+    }
+    extractor.finish();
+    double extract_s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    emit_benchmark(out, {
+        {"benchmark", "search_pages"},
+        {"queries", queries},
+        {"pages_per_query", PAGES},
+        {"fetch_p50_ms", percentile(fetch, 0.50)},
+        {"fetch_p95_ms", percentile(fetch, 0.95)},
+        {"select_p50_ms", percentile(select, 0.50)},
+        {"capped_page_kb", edge_cases[0].bytes >> 10},
+        {"extract_mb_per_s", html.size() / 1e6 / max(extract_s, 1e-9)},
+        {"extraction_ok", extraction_ok}
+    });
+}
+
+// What going through the daemon costs: connecting a client (socket and handshake), and a
+// streamed chat turn relayed over the socket versus sent straight to the server
+void bench_daemon(ostream& out, Config& config, int turns) {
+    string path = (filesystem::temp_directory_path() / ("ghostintheshell-bench-" + to_string(getpid()) + ".sock")).string();
+    DaemonServer server;
+    string error;
+    if (!server.start(path, error)) {
+        cerr << COLOR_RED << "Error: " << error << COLOR_RESET << endl;
+        return;
+    }
+    MessageStore store;
+    fill_history(store, 10);
+    string messages_json = "[";
+    store.append_serialized(messages_json, 0, store.size());
+    messages_json += ']';
+    config.stream = true;
+
+    DaemonClient& client = DaemonClient::instance();
+    vector<double> connect;
+    for (int i = 0; i < 50; i++) {
+        auto start = chrono::steady_clock::now();
+        if (!client.connect(path)) break;
+        connect.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    vector<double> relayed_ttft, relayed_total, direct_ttft, direct_total;
+    for (bool relayed : {true, false}) {
+        if (!relayed) client.close();
+        for (int i = 0; i < turns; i++) {
+            double ttft_ms, total_ms;
+            if (!bench_chat_turn(config, messages_json, ttft_ms, total_ms)) continue;
+            (relayed ? relayed_ttft : direct_ttft).push_back(ttft_ms);
+            (relayed ? relayed_total : direct_total).push_back(total_ms);
         }
-        
-        cout << formatted_output.str();
-        cout << "╚════════════════════╝" << endl;
-        
-        return output;
-    } catch (const exception& e) {
-        pclose(pipe);
-        cerr << "Error during command execution: " << e.what() << endl;
-        cout << "╚════════════════════╝" << endl;
-        return "Command execution error";
     }
+    server.stop();
+    emit_benchmark(out, {
+        {"benchmark", "daemon"},
+        {"turns", turns},
+        {"connect_p50_ms", percentile(connect, 0.50)},
+        {"connect_p95_ms", percentile(connect, 0.95)},
+        {"direct_ttft_p50_ms", percentile(direct_ttft, 0.50)},
+        {"relayed_ttft_p50_ms", percentile(relayed_ttft, 0.50)},
+        {"relayed_ttft_p95_ms", percentile(relayed_ttft, 0.95)},
+        {"direct_total_p50_ms", percentile(direct_total, 0.50)},
+        {"relayed_total_p50_ms", percentile(relayed_total, 0.50)},
+        {"relayed_failed", turns - static_cast<int>(relayed_total.size())}
+    });
 }
-// load prompt 
-void edit_prompt(map<string, string>& prompts) {
-    cout << COLOR_YELLOW << "Available Prompts:" << COLOR_RESET << endl;
-    for (const auto& prompt : prompts) {
-        cout << COLOR_GREEN << "  " << prompt.first << COLOR_RESET << endl;
+
+// Streamed chat turns recorded against the mock server, then replayed open-loop at 1x and
+// 4x: the recording's size, how closely the schedule was kept and the latency deltas
+void bench_replay(ostream& out, Config& config, int turns) {
+    string path = (filesystem::temp_directory_path() / ("ghostintheshell-bench-" + to_string(getpid()) + ".jsonl")).string();
+#ifdef GHOST_WITH_ZSTD
+    path += ".zst";
+#endif
+    filesystem::remove(path);
+    MessageStore store;
+    fill_history(store, 10);
+    string messages_json = "[";
+    store.append_serialized(messages_json, 0, store.size());
+    messages_json += ']';
+    config.stream = true;
+
+    Config recording = config.clone();
+    recording.record_file = path;
+    TrafficRecorder::instance().configure(recording);
+    for (int i = 0; i < turns; i++) {
+        double ttft_ms, total_ms;
+        bench_chat_turn(config, messages_json, ttft_ms, total_ms);
+        this_thread::sleep_for(chrono::milliseconds(10));
     }
-    cout << COLOR_BLUE << "Use 'prompt:load:<name>' to load a prompt." << COLOR_RESET << endl;
+    TrafficRecorder::instance().close();
 
-    cout << "Enter the name of the prompt you want to edit: ";
-    string name;
-    cin >> name;
+    size_t file_bytes = filesystem::exists(path) ? filesystem::file_size(path) : 0;
+    size_t raw_bytes = 0;
+    LineReader reader;
+    string error, line;
+    if (reader.open(path, error)) {
+        while (reader.next(line)) raw_bytes += line.size() + 1;
+    }
+    vector<ReplayRecord> records;
+    size_t skipped = 0;
+    load_recording(path, ReplayOptions(), records, skipped, error);
+    filesystem::remove(path);
 
-    if (prompts.find(name) != prompts.end()) {
-        cout << "Enter the new content for the prompt: ";
-        string new_content;
-        cin >> new_content;
-        prompts[name] = new_content;
-        cout << COLOR_GREEN << "Prompt updated successfully." << COLOR_RESET << endl;
-    } else {
-        cout << COLOR_RED << "Prompt not found." << COLOR_RESET << endl;
+    json record = {
+        {"benchmark", "replay"},
+        {"turns", turns},
+        {"recorded", records.size()},
+        {"file_kb", file_bytes >> 10},
+        {"compression_ratio", file_bytes ? static_cast<double>(raw_bytes) / file_bytes : 0.0}
+    };
+    for (double rate : {1.0, 4.0}) {
+        vector<json> report = replay_traffic(records, rate);
+        if (report.empty()) continue;
+        const json& all = report.back();
+        string prefix = "x" + to_string(static_cast<int>(rate)) + "_";
+        record[prefix + "lag_p95_ms"] = all["lag_p95_ms"];
+        record[prefix + "p50_ms"] = all["p50_ms"];
+        record[prefix + "p50_delta_ms"] = all.value("p50_delta_ms", json());
+        record[prefix + "completed_rps"] = all["completed_rps"];
+        record[prefix + "errors"] = all["errors"];
+        record[prefix + "replies_changed"] = all["replies_changed"];
     }
+    emit_benchmark(out, record);
 }
 
-void save_prompt(const string& name, const string& content) {
-    json prompt_data = {
-        {"role", "system"},
-        {"content", content}
-    };
-    save_json_file(PROMPT_DIR + "/" + name + ".json", prompt_data);
-    cout << COLOR_GREEN << "Prompt saved successfully." << COLOR_RESET << endl;
+// End-to-end benchmark suite against an in-process mock server; one JSON record per line,
+// e.g. `ghostintheshellgpt --bench [--out bench.jsonl] [--latency-ms 20] [--tokens-per-second 500]
+// [--tokenizer tokenizer.json]`
+int run_benchmark_suite(const string& output_path, const MockChatOptions& options, const string& tokenizer_path) {
+    MockServer server;
+    add_mock_chat_route(server, options);
+    add_mock_search_route(server, 5);
+    add_mock_embeddings_route(server, 256);
+    add_mock_pages_route(server, 20);
+    if (!server.start()) {
+        cerr << COLOR_RED << "Error: Unable to start the mock server" << COLOR_RESET << endl;
+        return 1;
+    }
+
+    ofstream output_file;
+    if (!output_path.empty()) output_file.open(output_path, ios::trunc);
+    ostream& out = output_file.is_open() ? output_file : cout;
+
+    Config config;
+    config.server_url = server.url("/v1/chat/completions");
+    config.search_engines = {"mock"};
+    config.search_endpoints = {{"mock", server.url("/search")}};
+    config.max_tokens = options.reply_tokens;
+    config.embeddings_url = server.url("/v1/embeddings");
+
+    bench_request_build(out, config);
+    bench_response_parsing(out);
+    bench_connections(out, config.server_url, 50);
+    bench_chat_latency(out, config, options, 20);
+    bench_allocations(out, config);
+    for (int concurrency : {1, 4, 16}) bench_throughput(out, config, concurrency, 64);
+    bench_search(out, config, 20);
+    bench_search_pages(out, config, 20);
+    bench_prefix_reuse(out, config, 30);
+    bench_routing(out, options);
+    bench_tokenizer(out, tokenizer_path);
+    bench_history_index(out, 200000);
+    bench_rag(out, config, 100000, 384);
+    bench_daemon(out, config, 30);
+    bench_replay(out, config, 40);
+
+    server.stop();
+    return 0;
+}
+
+// Value following `name` on the command line, or `fallback`
+string command_line_option(int argc, char* argv[], const string& name, const string& fallback = "") {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (argv[i] == name) return argv[i + 1];
+    }
+    return fallback;
+}
+
+// Reads the number following `name` into `value`, which keeps its default when the option is
+// absent. Prints an error and returns false when the argument is not a number of that type.
+template <typename T>
+bool command_line_number(int argc, char* argv[], const string& name, T& value) {
+    string text = command_line_option(argc, argv, name);
+    if (text.empty() || parse_number(text, value)) return true;
+    cerr << COLOR_RED << "Error: " << name << " expects a number, not \"" << text << "\"" << COLOR_RESET << endl;
+    return false;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     curl_global_init(CURL_GLOBAL_ALL);
-    interactive_agent_enhanced();
+    int status = 0;
+    if (argc >= 3 && string(argv[1]) == "--batch") {
+        // ghostintheshellgpt --batch <prompts.jsonl|-> [--out results.jsonl] [--concurrency N] [--retries N]
+        Config config = load_config();
+        if (!command_line_number(argc, argv, "--concurrency", config.batch_concurrency) ||
+            !command_line_number(argc, argv, "--retries", config.batch_retries)) {
+            status = 1;
+        } else {
+            status = run_batch(config, argv[2], command_line_option(argc, argv, "--out"));
+        }
+    } else if (argc >= 2 && string(argv[1]) == "--bench") {
+        MockChatOptions options;
+        if (!command_line_number(argc, argv, "--latency-ms", options.latency_ms) ||
+            !command_line_number(argc, argv, "--tokens-per-second", options.tokens_per_second) ||
+            !command_line_number(argc, argv, "--reply-tokens", options.reply_tokens)) {
+            status = 1;
+        } else if (!(options.tokens_per_second > 0)) {
+            cerr << COLOR_RED << "Error: --tokens-per-second must be positive" << COLOR_RESET << endl;
+            status = 1;
+        } else {
+            status = run_benchmark_suite(command_line_option(argc, argv, "--out"), options,
+                                         command_line_option(argc, argv, "--tokenizer"));
+        }
+    } else if (argc >= 3 && string(argv[1]) == "--bench-connections") {
+        // Connection reuse against a real server: --bench-connections <url> [turns]
+        int turns = 20;
+        if (argc >= 4 && !parse_number(argv[3], turns)) {
+            cerr << COLOR_RED << "Error: The number of turns must be a number, not \"" << argv[3] << "\"" << COLOR_RESET << endl;
+            status = 1;
+        } else {
+            bench_connections(cout, argv[2], turns);
+        }
+    } else if (argc >= 3 && string(argv[1]) == "--replay") {
+        ReplayOptions options;
+        options.target = command_line_option(argc, argv, "--target");
+        options.include_web = find(argv + 3, argv + argc, string("--include-web")) != argv + argc;
+        if (!command_line_number(argc, argv, "--rate", options.rate)) {
+            status = 1;
+        } else if (!(options.rate > 0)) {
+            cerr << COLOR_RED << "Error: --rate must be positive" << COLOR_RESET << endl;
+            status = 1;
+        } else {
+            status = run_replay(argv[2], options, command_line_option(argc, argv, "--out"));
+        }
+    } else if (argc >= 2 && string(argv[1]) == "--daemon") {
+        status = run_daemon(command_line_option(argc, argv, "--socket", DAEMON_SOCKET));
+    } else {
+        DaemonClient::instance().connect(command_line_option(argc, argv, "--socket", DAEMON_SOCKET));
+        interactive_agent_enhanced();
+    }
+    DaemonClient::instance().close();
+    ConfigStore::instance().stop_watching();
+    ProcessRunner::instance().shutdown();
+    RequestEngine::instance().shutdown();
+    TrafficRecorder::instance().close();
+    ConnectionPool::instance().shutdown();
+    Metrics::instance().flush();
+    Renderer::instance().shutdown();
     curl_global_cleanup();
-    return 0;
+    return status;
 }
 
 void display_history(const vector<json>& messages) {
@@ -613,40 +10031,28 @@ void display_history(const vector<json>& messages) {
     }
 }
 
-void save_session(const vector<json>& messages) {
-    save_json_file(SESSION_FILE, messages);
-}
-
-void load_session() {
-    if (filesystem::exists(SESSION_FILE)) {
-        vector<json> messages = load_json_file(SESSION_FILE);
-        for (const auto& message : messages) {
-            cout << COLOR_GREEN << "  " << message["role"] << ": " << message["content"] << COLOR_RESET << endl;
-        }
-    } else {
+// Prints the newest `count` messages of the session journal
+void load_session(size_t count) {
+    if (!filesystem::exists(SESSION_JOURNAL)) {
         cout << COLOR_RED << "No saved session found." << COLOR_RESET << endl;
+        return;
     }
-}
-
-// Function for dynamic spinner
-void dynamic_spinner(const string& message, const string& color) {
-    const vector<string> frames = {"⠋", "⠙", "⠹", "⠸", "⠼", "⠴", "⠦", "⠧", "⠇", "⠏"};
-    int frame = 0;
-    while (spinner_running) {
-        cout << "\r" << color << " " << frames[frame] << " " << message << "..." << COLOR_RESET << flush;
-        frame = (frame + 1) % frames.size();
-        this_thread::sleep_for(chrono::milliseconds(80));
+    for (const auto& message : SessionJournal::read_tail(SESSION_JOURNAL, count)) {
+        cout << COLOR_GREEN << "  " << message["role"] << ": " << message["content"] << COLOR_RESET << endl;
     }
-    cout << "\r" << string(message.length() + 10, ' ') << "\r";  // Clean up spinner line
 }
 
 // Function to show a command prompt
-void show_command_prompt() {
+void show_command_prompt(const string& status) {
     cout << COLOR_GRADIENT_1 << "\n┌─────[" << COLOR_RESET;
     cout << COLOR_GRADIENT_2 << "Ghostintheshell" << COLOR_RESET;
     cout << COLOR_GRADIENT_1 << "]─[" << COLOR_RESET;
     cout << COLOR_GRADIENT_2 << "Command" << COLOR_RESET;
     cout << COLOR_GRADIENT_1 << "]" << COLOR_RESET;
+    if (!status.empty()) {
+        cout << COLOR_GRADIENT_1 << "─[" << COLOR_RESET << COLOR_GRADIENT_2 << status << COLOR_RESET
+             << COLOR_GRADIENT_1 << "]" << COLOR_RESET;
+    }
     cout << COLOR_GRADIENT_3 << "───────" << COLOR_RESET;
     cout << COLOR_GRADIENT_1 << "\n└→ " << COLOR_HIGHLIGHT;
 }
\ No newline at end of file